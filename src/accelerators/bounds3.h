@@ -17,6 +17,9 @@ public:
 	// 2㣬xyzСΪpMinΪpMax
 	Bounds3(const Vector3<T>& p1, const Vector3<T>& p2) :pMin(Min(p1, p2)), pMax(Max(p1, p2)) {}
 
+	bool operator==(const Bounds3<T>& b) const { return pMin == b.pMin && pMax == b.pMax; }
+	bool operator!=(const Bounds3<T>& b) const { return pMin != b.pMin || pMax != b.pMax; }
+
 	// ĵ
 	Vector3<T> Center() const { return (pMax + pMin)*0.5; }
 	// ضԽߣpMin->pMax
@@ -1,18 +1,47 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include "bvh.h"
+#include "parallel.h"
 
 
 NAMESPACE_BEGIN(nagi)
 
+// ranges larger than this are built as two OpenMP tasks, smaller ones recurse serially
+static const int kParallelBuildThreshold = 4 * 1024;
+// ranges larger than this compute bounds and SAH buckets with chunked tasks
+static const int kParallelBinningThreshold = 64 * 1024;
+static const int kBinningChunkSize = 16 * 1024;
+
+// SBVH tries spatial splits only where the children of the best object split overlap more than
+// this fraction of the root surface area (alpha in Stich et al.)
+static const float kSBVHMinOverlap = 1e-5f;
+static const int kSBVHSpatialBins = 32;
+// no spatial splits below this depth, keeps the reference duplication of deep, tiny nodes in check
+static const int kSBVHMaxSplitDepth = 64;
+
 BVHAccel::BVHAccel(std::vector<bbox3f>& bounds, int maxPrimsInNode,
-					SplitMethod splitMethod, int nBuckets, float traversalCost)
+					SplitMethod splitMethod, int nBuckets, float traversalCost,
+					float splitBudget, ClipFunc clipPrimitive)
 	:maxPrimsInNode(std::min(255, maxPrimsInNode)),
 	splitMethod(splitMethod),
 	nBuckets(std::min(64, nBuckets)),
 	traversalCost(traversalCost),
-	nodeCounts(0)
+	nodeCounts(0),
+	buildTime(0.0),
+	buildSAHCost(0.0f),
+	sahAreaSum(0.0),
+	wideNodeCounts(0),
+	wideWidth(0),
+	splitBudget(std::max(0.0f, splitBudget)),
+	clipPrimitive(clipPrimitive),
+	sbvhRefsBudget(0),
+	sbvhMinOverlapArea(0.0f)
 {
 	// one bbox corresponds to one primitive(not actual geometry shape)
 	if (bounds.empty())	return;
+
+	auto buildStart = std::chrono::steady_clock::now();
 	
 	// For each primitive to be stored in the BVH, we store 
 	// the centroid of its bounding box, its complete bounding box, and its index in the primitives array 
@@ -23,15 +52,257 @@ BVHAccel::BVHAccel(std::vector<bbox3f>& bounds, int maxPrimsInNode,
 
 	// Ԥ
 	nodes.resize(2 * bounds.size() - 1);
-	orderedPrimsIndices.reserve(bounds.size());
-
-	if (SplitMethod::HLBVH)
+	if (splitMethod == SplitMethod::HLBVH)
 		HLBVHBuild(primitivesInfo);
-	else
-		recursiveBuild(primitivesInfo, 0, bounds.size());
+	else if (splitMethod == SplitMethod::SBVH)
+		SBVHBuild(primitivesInfo);
+	else {
+		// every subtree of n primitives owns the node range [offset, offset + 2n - 1),
+		// so tasks never contend for node allocation. Unused slots are removed by CompactNodes.
+		nodeUsed.assign(nodes.size(), 0);
+		ParallelTasks([&]() {
+			recursiveBuild(primitivesInfo, 0, (int)bounds.size(), 0);
+		});
+		CompactNodes();
+
+		// leaves reference contiguous ranges of the partitioned primitivesInfo in depth-first order
+		orderedPrimsIndices.resize(bounds.size());
+		for (size_t i = 0; i < bounds.size(); i++)
+			orderedPrimsIndices[i] = primitivesInfo[i].primitiveIdx;
+	}
 
 	// ʵnodeCountsͷŶпռ
 	nodes.resize(nodeCounts);
+
+	buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+	sahAreaSum = computeSAHAreaSum();
+	buildSAHCost = SAHCost();
+}
+
+BVHAccel::BVHAccel(const LinearBVHNode* nodes, uint32_t nodeCounts,
+					const uint32_t* orderedPrimsIndices, uint32_t primsIndicesNum,
+					int maxPrimsInNode, SplitMethod splitMethod, int nBuckets,
+					float traversalCost, float splitBudget)
+	:nodes(nodes, nodes + nodeCounts),
+	nodeCounts(nodeCounts),
+	orderedPrimsIndices(orderedPrimsIndices, orderedPrimsIndices + primsIndicesNum),
+	maxPrimsInNode(std::min(255, maxPrimsInNode)),
+	splitMethod(splitMethod),
+	nBuckets(std::min(64, nBuckets)),
+	traversalCost(traversalCost),
+	buildTime(0.0),
+	buildSAHCost(0.0f),
+	sahAreaSum(0.0),
+	wideNodeCounts(0),
+	wideWidth(0),
+	splitBudget(std::max(0.0f, splitBudget)),
+	clipPrimitive(nullptr),
+	sbvhRefsBudget(0),
+	sbvhMinOverlapArea(0.0f)
+{
+	// the reference cost of Refit is the one of the restored tree, which is the cost after its build
+	sahAreaSum = computeSAHAreaSum();
+	buildSAHCost = SAHCost();
+}
+
+bool BVHAccel::Refit(const std::vector<bbox3f>& bounds, float maxCostRatio)
+{
+	if (nodes.empty()) return true;
+
+	// leaves are independent of each other
+	ParallelFor((int)nodeCounts, 16 * 1024, [&](int i) {
+		LinearBVHNode& node = nodes[i];
+		if (!node.nPrimitives) return;
+		bbox3f box;
+		for (uint32_t j = 0; j < node.nPrimitives; j++)
+			box.grow(bounds[orderedPrimsIndices[node.primitivesOffset + j]]);
+		node.bounds = box;
+	});
+	// children are stored behind their parent, so a reverse sweep sees them updated
+	for (int64_t i = (int64_t)nodeCounts - 1; i >= 0; i--)
+	{
+		LinearBVHNode& node = nodes[i];
+		if (node.nPrimitives) continue;
+		bbox3f box = nodes[i + 1].bounds;
+		box.grow(nodes[node.secondChildOffset].bounds);
+		node.bounds = box;
+	}
+
+	if (!wideNodes.empty())
+	{
+		// collapseWideNode numbers the wide children behind their parent as well
+		const int groups = wideWidth / 4;
+		for (int64_t w = (int64_t)wideNodeCounts - 1; w >= 0; w--)
+			for (int slot = 0; slot < wideWidth; slot++)
+			{
+				WideBVHNode& group = wideNodes[w * groups + slot / 4];
+				int lane = slot & 3;
+				if (group.childCount[lane] == -1) continue;
+
+				bbox3f box;
+				if (group.childCount[lane] > 0)
+					for (int32_t j = 0; j < group.childCount[lane]; j++)
+						box.grow(bounds[orderedPrimsIndices[group.childOffset[lane] + j]]);
+				else
+					for (int childSlot = 0; childSlot < wideWidth; childSlot++)
+					{
+						const WideBVHNode& child = wideNodes[group.childOffset[lane] * groups + childSlot / 4];
+						int childLane = childSlot & 3;
+						if (child.childCount[childLane] == -1) continue;
+						box.grow(vec3f(child.boundsMin[0][childLane], child.boundsMin[1][childLane], child.boundsMin[2][childLane]));
+						box.grow(vec3f(child.boundsMax[0][childLane], child.boundsMax[1][childLane], child.boundsMax[2][childLane]));
+					}
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					group.boundsMin[axis][lane] = box.pMin[axis];
+					group.boundsMax[axis][lane] = box.pMax[axis];
+				}
+			}
+
+		// leaves of compressed nodes are already consecutive, so compressing again keeps orderedPrimsIndices
+		if (!compressedNodes.empty()) CompressWide();
+	}
+
+	sahAreaSum = computeSAHAreaSum();
+	return SAHCost() <= buildSAHCost * maxCostRatio;
+}
+
+void BVHAccel::buildRefitLookups(size_t primsNum)
+{
+	const uint32_t kNone = std::numeric_limits<uint32_t>::max();
+	parents.assign(nodeCounts, kNone);
+	primLeafOffsets.assign(primsNum + 1, 0);
+	// leaf starting at an orderedPrimsIndices offset, to match the wide leaves
+	std::vector<uint32_t> offsetLeaves(orderedPrimsIndices.size(), kNone);
+
+	for (uint32_t i = 0; i < nodeCounts; i++)
+	{
+		const LinearBVHNode& node = nodes[i];
+		if (node.nPrimitives)
+		{
+			offsetLeaves[node.primitivesOffset] = i;
+			for (uint32_t j = 0; j < node.nPrimitives; j++)
+				primLeafOffsets[orderedPrimsIndices[node.primitivesOffset + j] + 1]++;
+		}
+		else
+		{
+			parents[i + 1] = i;
+			parents[node.secondChildOffset] = i;
+		}
+	}
+	for (size_t p = 0; p < primsNum; p++)
+		primLeafOffsets[p + 1] += primLeafOffsets[p];
+
+	// SBVH may put a primitive into several leaves
+	primLeaves.resize(primLeafOffsets[primsNum]);
+	std::vector<uint32_t> fill(primLeafOffsets.begin(), primLeafOffsets.end() - 1);
+	for (uint32_t i = 0; i < nodeCounts; i++)
+		for (uint32_t j = 0; j < nodes[i].nPrimitives; j++)
+			primLeaves[fill[orderedPrimsIndices[nodes[i].primitivesOffset + j]]++] = i;
+
+	leafWideSlots.clear();
+	wideParentSlots.clear();
+	if (wideNodes.empty()) return;
+
+	// every binary leaf is a leaf slot of the wide tree
+	const int groups = wideWidth / 4;
+	leafWideSlots.assign(nodeCounts, kNone);
+	wideParentSlots.assign(wideNodeCounts, kNone);
+	for (uint32_t w = 0; w < wideNodeCounts; w++)
+		for (int slot = 0; slot < wideWidth; slot++)
+		{
+			const WideBVHNode& group = wideNodes[w * groups + slot / 4];
+			int lane = slot & 3;
+			if (group.childCount[lane] == 0)
+				wideParentSlots[group.childOffset[lane]] = w * wideWidth + slot;
+			else if (group.childCount[lane] > 0)
+				leafWideSlots[offsetLeaves[group.childOffset[lane]]] = w * wideWidth + slot;
+		}
+}
+
+bool BVHAccel::RefitPrimitives(const std::vector<uint32_t>& prims, const std::vector<bbox3f>& bounds, float maxCostRatio,
+	std::vector<uint32_t>& changedNodes, std::vector<uint32_t>& changedWideNodes)
+{
+	const uint32_t kNone = std::numeric_limits<uint32_t>::max();
+	changedNodes.clear();
+	changedWideNodes.clear();
+	if (nodes.empty()) return true;
+	if (parents.size() != nodeCounts) buildRefitLookups(bounds.size());
+
+	const int groups = wideWidth / 4;
+	for (uint32_t prim : prims)
+		for (uint32_t k = primLeafOffsets[prim]; k < primLeafOffsets[prim + 1]; k++)
+		{
+			uint32_t leaf = primLeaves[k];
+			bbox3f box;
+			for (uint32_t j = 0; j < nodes[leaf].nPrimitives; j++)
+				box.grow(bounds[orderedPrimsIndices[nodes[leaf].primitivesOffset + j]]);
+
+			// walk up until a bound does not change, the other changes walk their own path
+			uint32_t nodeIdx = leaf;
+			while (nodeIdx != kNone && box != nodes[nodeIdx].bounds)
+			{
+				LinearBVHNode& node = nodes[nodeIdx];
+				float cost = node.nPrimitives ? (float)node.nPrimitives : traversalCost;
+				sahAreaSum += (double)(box.SurfaceArea() - node.bounds.SurfaceArea()) * cost;
+				node.bounds = box;
+				changedNodes.push_back(nodeIdx);
+
+				nodeIdx = parents[nodeIdx];
+				if (nodeIdx == kNone) break;
+				box = nodes[nodeIdx + 1].bounds;
+				box.grow(nodes[nodes[nodeIdx].secondChildOffset].bounds);
+			}
+
+			if (wideNodes.empty()) continue;
+			box = nodes[leaf].bounds;
+			uint32_t wideSlot = leafWideSlots[leaf];
+			while (wideSlot != kNone)
+			{
+				uint32_t wideIdx = wideSlot / wideWidth;
+				int slot = wideSlot % wideWidth;
+				WideBVHNode& group = wideNodes[wideIdx * groups + slot / 4];
+				int lane = slot & 3;
+				bool same = true;
+				for (int axis = 0; axis < 3; axis++)
+					same = same && group.boundsMin[axis][lane] == box.pMin[axis] && group.boundsMax[axis][lane] == box.pMax[axis];
+				if (same) break;
+
+				for (int axis = 0; axis < 3; axis++)
+				{
+					group.boundsMin[axis][lane] = box.pMin[axis];
+					group.boundsMax[axis][lane] = box.pMax[axis];
+				}
+				changedWideNodes.push_back(wideIdx);
+
+				// the whole wide node is the bound of its slot in the parent
+				box = bbox3f();
+				for (int s = 0; s < wideWidth; s++)
+				{
+					const WideBVHNode& g = wideNodes[wideIdx * groups + s / 4];
+					if (g.childCount[s & 3] == -1) continue;
+					box.grow(vec3f(g.boundsMin[0][s & 3], g.boundsMin[1][s & 3], g.boundsMin[2][s & 3]));
+					box.grow(vec3f(g.boundsMax[0][s & 3], g.boundsMax[1][s & 3], g.boundsMax[2][s & 3]));
+				}
+				wideSlot = wideParentSlots[wideIdx];
+			}
+		}
+
+	std::sort(changedNodes.begin(), changedNodes.end());
+	changedNodes.erase(std::unique(changedNodes.begin(), changedNodes.end()), changedNodes.end());
+	std::sort(changedWideNodes.begin(), changedWideNodes.end());
+	changedWideNodes.erase(std::unique(changedWideNodes.begin(), changedWideNodes.end()), changedWideNodes.end());
+
+	if (!compressedNodes.empty())
+		for (uint32_t wideIdx : changedWideNodes)
+		{
+			if (wideWidth == 4) requantizeWideNode<4>(wideIdx);
+			else requantizeWideNode<8>(wideIdx);
+		}
+
+	float invRootArea = 1.0f / std::max(nodes[0].bounds.SurfaceArea(), std::numeric_limits<float>::min());
+	return (float)sahAreaSum * invRootArea <= buildSAHCost * maxCostRatio;
 }
 
 bbox3f BVHAccel::WorldBound()
@@ -39,33 +310,367 @@ bbox3f BVHAccel::WorldBound()
 	return nodes.empty() ? bbox3f() : nodes[0].bounds;
 }
 
-uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end)
+float BVHAccel::SAHCost() const
+{
+	if (nodes.empty()) return 0.0f;
+
+	float invRootArea = 1.0f / std::max(nodes[0].bounds.SurfaceArea(), std::numeric_limits<float>::min());
+	return (float)computeSAHAreaSum() * invRootArea;
+}
+
+double BVHAccel::computeSAHAreaSum() const
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		double area = nodes[i].bounds.SurfaceArea();
+		if (nodes[i].nPrimitives)
+			sum += area * nodes[i].nPrimitives;
+		else
+			sum += area * traversalCost;
+	}
+	return sum;
+}
+
+const char* BVHAccel::SplitMethodName(SplitMethod method)
+{
+	switch (method)
+	{
+	case SplitMethod::Middle:		return "Middle";
+	case SplitMethod::EuqalCounts:	return "EqualCounts";
+	case SplitMethod::SAH:			return "SAH";
+	case SplitMethod::HLBVH:		return "HLBVH";
+	case SplitMethod::SBVH:			return "SBVH";
+	default:						return "Unknown";
+	}
+}
+
+void BVHAccel::CollapseWide(int width)
+{
+	if (width != 4 && width != 8) Error("Wide BVH width must be 4 or 8.");
+
+	wideWidth = width;
+	wideNodeCounts = 0;
+	wideNodes.clear();
+	// the RefitPrimitives lookups know the old wide tree
+	parents.clear();
+	if (nodes.empty()) return;
+
+	// a binary tree of n nodes collapses into roughly n/(width-1) wide nodes
+	wideNodes.reserve((nodeCounts / (width - 1) + 1) * (width / 4));
+	collapseWideNode(0);
+}
+
+uint32_t BVHAccel::collapseWideNode(uint32_t nodeIdx)
+{
+	const int groups = wideWidth / 4;
+	uint32_t wideIdx = wideNodeCounts++;
+	wideNodes.resize(wideNodeCounts * groups);
+
+	// start with the two children, keep opening the interior child with the largest surface area.
+	// a leaf root becomes the single child of the wide root
+	uint32_t children[8];
+	int nChildren = 0;
+	if (nodes[nodeIdx].nPrimitives)
+		children[nChildren++] = nodeIdx;
+	else {
+		children[nChildren++] = nodeIdx + 1;
+		children[nChildren++] = nodes[nodeIdx].secondChildOffset;
+	}
+	while (nChildren < wideWidth)
+	{
+		int openIdx = -1;
+		float maxArea = -1.0f;
+		for (int i = 0; i < nChildren; i++)
+		{
+			const LinearBVHNode& child = nodes[children[i]];
+			if (!child.nPrimitives && child.bounds.SurfaceArea() > maxArea)
+			{
+				maxArea = child.bounds.SurfaceArea();
+				openIdx = i;
+			}
+		}
+		if (openIdx == -1) break;
+
+		uint32_t opened = children[openIdx];
+		children[openIdx] = opened + 1;
+		children[nChildren++] = nodes[opened].secondChildOffset;
+	}
+
+	for (int slot = 0; slot < wideWidth; slot++)
+	{
+		// recursion grows wideNodes, so the node is addressed by index every time
+		int lane = slot & 3;
+		uint32_t group = wideIdx * groups + slot / 4;
+
+		if (slot >= nChildren)
+		{
+			// empty slot, skipped by the traversal through childCount == -1
+			for (int axis = 0; axis < 3; axis++)
+			{
+				wideNodes[group].boundsMin[axis][lane] = std::numeric_limits<float>::max();
+				wideNodes[group].boundsMax[axis][lane] = std::numeric_limits<float>::lowest();
+			}
+			wideNodes[group].childOffset[lane] = 0;
+			wideNodes[group].childCount[lane] = -1;
+			wideNodes[group].childParam[lane] = 0;
+			continue;
+		}
+
+		const LinearBVHNode& child = nodes[children[slot]];
+		int32_t childOffset = child.nPrimitives ? (int32_t)child.primitivesOffset : (int32_t)collapseWideNode(children[slot]);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			wideNodes[group].boundsMin[axis][lane] = child.bounds.pMin[axis];
+			wideNodes[group].boundsMax[axis][lane] = child.bounds.pMax[axis];
+		}
+		wideNodes[group].childOffset[lane] = childOffset;
+		wideNodes[group].childCount[lane] = (int32_t)child.nPrimitives;
+		wideNodes[group].childParam[lane] = 0;
+	}
+
+	return wideIdx;
+}
+
+bool BVHAccel::CompressWide()
+{
+	compressedNodes.clear();
+	wideToCompressed.clear();
+	if (wideNodes.empty()) return true;
+	return wideWidth == 4 ? compressWideNodes<4>() : compressWideNodes<8>();
+}
+
+// quantize the child bounds of a wide node into node, the slot layout (meta, interiorMask) is not touched
+template <int Width>
+static void QuantizeWideNode(const WideBVHNode* wide, CompressedWideNode<Width>& node)
+{
+	bbox3f bound;
+	for (int slot = 0; slot < Width; slot++)
+	{
+		const WideBVHNode& group = wide[slot / 4];
+		if (group.childCount[slot & 3] == -1) continue;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			bound.pMin[axis] = std::min(bound.pMin[axis], group.boundsMin[axis][slot & 3]);
+			bound.pMax[axis] = std::max(bound.pMax[axis], group.boundsMax[axis][slot & 3]);
+		}
+	}
+
+	// smallest power of two scale that spans the node in 255 steps
+	float scale[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = bound.pMax[axis] - bound.pMin[axis];
+		int e = extent > 0.0f ? (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+		e = std::min(std::max(e, -126), 127);
+		while (e < 127 && std::ldexp(255.0f, e) < extent) e++;
+		node.origin[axis] = bound.pMin[axis];
+		node.exponent[axis] = (uint8_t)(e + 127);
+		scale[axis] = std::ldexp(1.0f, e);
+	}
+
+	for (int slot = 0; slot < Width; slot++)
+	{
+		const WideBVHNode& group = wide[slot / 4];
+		int lane = slot & 3;
+		if (group.childCount[lane] == -1) continue;
+
+		// conservative rounding, the decoded box always contains the child box
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float lo = std::floor((group.boundsMin[axis][lane] - node.origin[axis]) / scale[axis]);
+			float hi = std::ceil((group.boundsMax[axis][lane] - node.origin[axis]) / scale[axis]);
+			int qlo = std::min(std::max((int)lo, 0), 255);
+			int qhi = std::min(std::max((int)hi, 0), 255);
+			while (qlo > 0 && node.origin[axis] + qlo * scale[axis] > group.boundsMin[axis][lane]) qlo--;
+			while (qhi < 255 && node.origin[axis] + qhi * scale[axis] < group.boundsMax[axis][lane]) qhi++;
+			node.qlo[axis][slot] = (uint8_t)qlo;
+			node.qhi[axis][slot] = (uint8_t)qhi;
+		}
+	}
+}
+
+template <int Width>
+bool BVHAccel::compressWideNodes()
+{
+	static_assert(sizeof(CompressedWideNode<Width>) == (Width == 4 ? 64 : 80), "CompressedNodeWords is out of sync");
+	const int groups = Width / 4;
+	const uint32_t kNoOffset = std::numeric_limits<uint32_t>::max();
+
+	std::vector<CompressedWideNode<Width>> compressed(wideNodeCounts);
+	std::vector<uint32_t> newPrimsIndices;
+	newPrimsIndices.reserve(orderedPrimsIndices.size());
+	// old leaf primitivesOffset -> new one
+	std::vector<uint32_t> leafOffsets(orderedPrimsIndices.size(), kNoOffset);
+
+	// breadth-first, so the interior children of a node are appended consecutively
+	std::vector<uint32_t> order;
+	order.reserve(wideNodeCounts);
+	order.push_back(0);
+	for (size_t nodeIdx = 0; nodeIdx < order.size(); nodeIdx++)
+	{
+		const WideBVHNode* wide = &wideNodes[order[nodeIdx] * groups];
+		CompressedWideNode<Width>& node = compressed[nodeIdx];
+		memset(&node, 0, sizeof(node));
+		QuantizeWideNode<Width>(wide, node);
+
+		node.baseChild = (uint32_t)order.size();
+		node.basePrim = (uint32_t)newPrimsIndices.size();
+		int interiorRank = 0;
+		for (int slot = 0; slot < Width; slot++)
+		{
+			const WideBVHNode& group = wide[slot / 4];
+			int lane = slot & 3;
+			int32_t count = group.childCount[lane];
+			if (count == -1) continue;
+
+			if (count == 0)
+			{
+				node.interiorMask |= (uint8_t)(1 << slot);
+				node.meta[slot] = (uint8_t)interiorRank++;
+				order.push_back((uint32_t)group.childOffset[lane]);
+			}
+			else
+			{
+				if (count > 255) return false;
+				node.meta[slot] = (uint8_t)count;
+				leafOffsets[group.childOffset[lane]] = (uint32_t)newPrimsIndices.size();
+				newPrimsIndices.insert(newPrimsIndices.end(), orderedPrimsIndices.begin() + group.childOffset[lane],
+					orderedPrimsIndices.begin() + group.childOffset[lane] + count);
+			}
+		}
+	}
+
+	// move binary and wide leaves to the new primitive order
+	for (uint32_t i = 0; i < nodeCounts; i++)
+		if (nodes[i].nPrimitives) nodes[i].primitivesOffset = leafOffsets[nodes[i].primitivesOffset];
+	for (WideBVHNode& group : wideNodes)
+		for (int lane = 0; lane < 4; lane++)
+			if (group.childCount[lane] > 0) group.childOffset[lane] = (int32_t)leafOffsets[group.childOffset[lane]];
+	orderedPrimsIndices.swap(newPrimsIndices);
+
+	wideToCompressed.resize(wideNodeCounts);
+	for (size_t i = 0; i < order.size(); i++)
+		wideToCompressed[order[i]] = (uint32_t)i;
+
+	compressedNodes.resize(compressed.size() * CompressedNodeWords(Width));
+	memcpy(compressedNodes.data(), compressed.data(), compressed.size() * sizeof(CompressedWideNode<Width>));
+	return true;
+}
+
+template <int Width>
+void BVHAccel::requantizeWideNode(uint32_t wideIdx)
+{
+	CompressedWideNode<Width> node;
+	uint32_t* words = &compressedNodes[(size_t)wideToCompressed[wideIdx] * CompressedNodeWords(Width)];
+	memcpy(&node, words, sizeof(node));
+	QuantizeWideNode<Width>(&wideNodes[wideIdx * (Width / 4)], node);
+	memcpy(words, &node, sizeof(node));
+}
+
+// node bound and centroid bound of primitivesInfo[start, end)
+static void ComputeRangeBounds(const std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end,
+								bbox3f& bound, bbox3f& centroidBound)
+{
+	int nPrimitives = end - start;
+	if (nPrimitives <= kParallelBinningThreshold)
+	{
+		for (int i = start; i < end; i++)
+		{
+			bound.grow(primitivesInfo[i].bounds);
+			centroidBound.grow(primitivesInfo[i].centroid);
+		}
+		return;
+	}
+
+	int nChunks = (nPrimitives + kBinningChunkSize - 1) / kBinningChunkSize;
+	std::vector<bbox3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+	ParallelFor(nChunks, 1, [&](int c) {
+		int chunkEnd = std::min(start + (c + 1) * kBinningChunkSize, end);
+		for (int i = start + c * kBinningChunkSize; i < chunkEnd; i++)
+		{
+			chunkBounds[c].grow(primitivesInfo[i].bounds);
+			chunkCentroidBounds[c].grow(primitivesInfo[i].centroid);
+		}
+	});
+	for (int c = 0; c < nChunks; c++)
+	{
+		bound.grow(chunkBounds[c]);
+		centroidBound.grow(chunkCentroidBounds[c]);
+	}
+}
+
+// SAH bucket binning of primitivesInfo[start, end), every chunk fills private buckets which are merged afterwards
+static void ParallelBinning(const std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end,
+							const bbox3f& centroidBounds, int dim, std::vector<BucketInfo>& buckets)
+{
+	int nBuckets = (int)buckets.size();
+	int nChunks = (end - start + kBinningChunkSize - 1) / kBinningChunkSize;
+	std::vector<std::vector<BucketInfo>> chunkBuckets(nChunks, std::vector<BucketInfo>(nBuckets));
+	ParallelFor(nChunks, 1, [&](int c) {
+		int chunkEnd = std::min(start + (c + 1) * kBinningChunkSize, end);
+		for (int i = start + c * kBinningChunkSize; i < chunkEnd; i++)
+		{
+			int b = nBuckets * centroidBounds.LocalNormalizedCoord(primitivesInfo[i].centroid)[dim];
+			if (b < 0 || b > nBuckets) Error("Bucket Idx is out of range");
+			if (b == nBuckets) b -= 1;
+			chunkBuckets[c][b].count++;
+			chunkBuckets[c][b].bound.grow(primitivesInfo[i].bounds);
+		}
+	});
+	for (int c = 0; c < nChunks; c++)
+		for (int b = 0; b < nBuckets; b++)
+		{
+			buckets[b].count += chunkBuckets[c][b].count;
+			buckets[b].bound.grow(chunkBuckets[c][b].bound);
+		}
+}
+
+void BVHAccel::CompactNodes()
+{
+	// slots are visited in increasing order and a node never moves backwards past an unvisited slot,
+	// so the compaction can be done in place and keeps the depth-first order (left child = cur+1)
+	std::vector<uint32_t> remap(nodes.size());
+	nodeCounts = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+		if (nodeUsed[i])
+			remap[i] = nodeCounts++;
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		if (!nodeUsed[i]) continue;
+		LinearBVHNode node = nodes[i];
+		if (!node.nPrimitives)
+			node.secondChildOffset = remap[node.secondChildOffset];
+		nodes[remap[i]] = node;
+	}
+
+	nodeUsed.clear();
+	nodeUsed.shrink_to_fit();
+}
+
+uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end, uint32_t nodeOffset)
 {
 	if (start == end) Error("Start cannot equal to End in BVH building.");
 
 	// ¼nodenodesеidx
-	uint32_t curNodeOffset = nodeCounts;
-	LinearBVHNode& node = nodes[nodeCounts++];
+	uint32_t curNodeOffset = nodeOffset;
+	LinearBVHNode& node = nodes[curNodeOffset];
+	nodeUsed[curNodeOffset] = 1;
 
 	// [start, end)bbox
-	bbox3f bound;
-	for (int i = start; i < end; i++)
-		bound.grow(primitivesInfo[i].bounds);
+	bbox3f bound, centroidBounds;
+	ComputeRangeBounds(primitivesInfo, start, end, bound, centroidBounds);
 
 	uint32_t nPrimitives = end - start;
 	if (nPrimitives == 1) {
 		// Create leaf _LinearBVHNode_
-		uint32_t firstPrimOffset = (uint32_t)orderedPrimsIndices.size();
-		for (int i = start; i < end; i++)
-			orderedPrimsIndices.push_back(primitivesInfo[i].primitiveIdx);
-		node.InitLeaf(bound, firstPrimOffset, nPrimitives);
+		// orderedPrimsIndices is filled after the build, the leaf range equals its range in primitivesInfo
+		node.InitLeaf(bound, start, nPrimitives);
 		return curNodeOffset;
 	}
 	else {
 		// ͼԪΧĵbbox
-		bbox3f centroidBounds;
-		for (int i = start; i < end; i++)
-			centroidBounds.grow(primitivesInfo[i].centroid);
 		int dim = centroidBounds.MaximumExtent();
 
 		// PBRT-V3 261 page ΧΪ, ֻһ
@@ -75,10 +680,7 @@ uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo,
 		if (centroidBounds.pMin[dim] == centroidBounds.pMax[dim])
 		{
 			// Create leaf _LinearBVHNode_
-			uint32_t firstPrimOffset = (uint32_t)orderedPrimsIndices.size();
-			for (int i = start; i < end; i++)
-				orderedPrimsIndices.push_back(primitivesInfo[i].primitiveIdx);
-			node.InitLeaf(bound, firstPrimOffset, nPrimitives);
+			node.InitLeaf(bound, start, nPrimitives);
 			return curNodeOffset;
 		}
 		else {
@@ -128,14 +730,19 @@ uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo,
 					std::vector<BucketInfo> buckets(nBuckets);
 
 					// Initialize _BucketInfo_ for SAH partition buckets
-					for (int i = start; i < end; i++)
+					if (nPrimitives > kParallelBinningThreshold)
+						ParallelBinning(primitivesInfo, start, end, centroidBounds, dim, buckets);
+					else
 					{
-						/*˴rangeΪȾbucketȻͼԪbboxĵnodeBboxĹһֲжϣͼԪĵbucket*/
-						int b = nBuckets * centroidBounds.LocalNormalizedCoord(primitivesInfo[i].centroid)[dim];
-						if (b < 0 || b > nBuckets) Error("Bucket Idx is out of range");
-						if (b == nBuckets) b -= 1;
-						buckets[b].count++;
-						buckets[b].bound.grow(primitivesInfo[i].bounds);
+						for (int i = start; i < end; i++)
+						{
+							/*˴rangeΪȾbucketȻͼԪbboxĵnodeBboxĹһֲжϣͼԪĵbucket*/
+							int b = nBuckets * centroidBounds.LocalNormalizedCoord(primitivesInfo[i].centroid)[dim];
+							if (b < 0 || b > nBuckets) Error("Bucket Idx is out of range");
+							if (b == nBuckets) b -= 1;
+							buckets[b].count++;
+							buckets[b].bound.grow(primitivesInfo[i].bounds);
+						}
 					}
 
 					float minCost = std::numeric_limits<float>::max();
@@ -175,7 +782,7 @@ uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo,
 					// ɨ裬洢bucketIdxµrightBound
 					std::vector<bbox3f> rightBounds(nBuckets - 1);
 					bbox3f rightBbox;
-					for (int i = nBuckets - 1; i > 0; i++)
+					for (int i = nBuckets - 1; i > 0; i--)
 					{
 						rightBbox.grow(buckets[i].bound);
 						rightBounds[i - 1] = rightBbox;
@@ -220,10 +827,7 @@ uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo,
 					}
 					else {
 						// Create leaf _LinearBVHNode_
-						uint32_t firstPrimOffset = (uint32_t)orderedPrimsIndices.size();
-						for (int i = start; i < end; i++)
-							orderedPrimsIndices.push_back(primitivesInfo[i].primitiveIdx);
-						node.InitLeaf(bound, firstPrimOffset, nPrimitives);
+						node.InitLeaf(bound, start, nPrimitives);
 						return curNodeOffset;
 					}
 				}
@@ -233,19 +837,656 @@ uint32_t BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo,
 
 			// LinearBVHֻҪ洢
 			// ݹ鴴
-			recursiveBuild(primitivesInfo, start, mid);
+			uint32_t firstChildOffset = curNodeOffset + 1;
+			uint32_t secondChildOffset = curNodeOffset + 2 * (mid - start);
+			if (nPrimitives > kParallelBuildThreshold)
+			{
+				// fork the left subtree, the current task continues with the right one
+				std::vector<BVHPrimitiveInfo>* primsPtr = &primitivesInfo;
+#pragma omp task firstprivate(primsPtr, start, mid, firstChildOffset)
+				recursiveBuild(*primsPtr, start, mid, firstChildOffset);
+				recursiveBuild(primitivesInfo, mid, end, secondChildOffset);
+#pragma omp taskwait
+			}
+			else {
+				recursiveBuild(primitivesInfo, start, mid, firstChildOffset);
+				recursiveBuild(primitivesInfo, mid, end, secondChildOffset);
+			}
 			// õݹ鴴ʼǰnode
-			node.InitInterior(bound, recursiveBuild(primitivesInfo, mid, end), dim);
+			node.InitInterior(bound, secondChildOffset, dim);
 		}
 	}
 
 	return curNodeOffset;
 }
 
+// PBRT-V3 4.3.3. spread the lower 10 bits of x so that there are two zero bits between each of them
+static inline uint32_t LeftShift3(uint32_t x)
+{
+	if (x == (1 << 10)) --x;
+	x = (x | (x << 16)) & 0x30000ff;	// x = ---- --98 ---- ---- ---- ---- 7654 3210
+	x = (x | (x << 8)) & 0x300f00f;		// x = ---- --98 ---- ---- 7654 ---- ---- 3210
+	x = (x | (x << 4)) & 0x30c30c3;		// x = ---- --98 ---- 76-- --54 ---- 32-- --10
+	x = (x | (x << 2)) & 0x9249249;		// x = ---- 9--8 --7- -6-- 5--4 --3- -2-- 1--0
+	return x;
+}
+
+static inline uint32_t EncodeMorton3(const vec3f& v)
+{
+	return (LeftShift3((uint32_t)v.z) << 2) | (LeftShift3((uint32_t)v.y) << 1) | LeftShift3((uint32_t)v.x);
+}
+
+// LSD radix sort of 30-bit morton codes, 6 bits per pass
+static void RadixSort(std::vector<MortonPrimitive>* v)
+{
+	std::vector<MortonPrimitive> tempVector(v->size());
+	const int bitsPerPass = 6;
+	const int nBits = 30;
+	const int nPasses = nBits / bitsPerPass;
+	const int nBuckets = 1 << bitsPerPass;
+	const int bitMask = (1 << bitsPerPass) - 1;
+
+	for (int pass = 0; pass < nPasses; pass++)
+	{
+		int lowBit = pass * bitsPerPass;
+		// alternate between v and tempVector as input/output of every pass
+		std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+		std::vector<MortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+		int bucketCount[nBuckets] = { 0 };
+		for (const MortonPrimitive& mp : in)
+			bucketCount[(mp.mortonCode >> lowBit) & bitMask]++;
+
+		int outIndex[nBuckets];
+		outIndex[0] = 0;
+		for (int i = 1; i < nBuckets; i++)
+			outIndex[i] = outIndex[i - 1] + bucketCount[i - 1];
+
+		for (const MortonPrimitive& mp : in)
+			out[outIndex[(mp.mortonCode >> lowBit) & bitMask]++] = mp;
+	}
+	// nPasses is odd, the sorted result is in tempVector
+	if (nPasses & 1)
+		std::swap(*v, tempVector);
+}
+
 uint32_t BVHAccel::HLBVHBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo)
 {
-	// TODO: using SplitMethod::HLBVH to build BVH
-	return int();
+	const int nPrimitives = (int)primitivesInfo.size();
+
+	// Compute bounding box of all primitive centroids
+	bbox3f centroidBounds;
+	for (const BVHPrimitiveInfo& pi : primitivesInfo)
+		centroidBounds.grow(pi.centroid);
+
+	// Compute Morton indices of primitives
+	std::vector<MortonPrimitive> mortonPrims(nPrimitives);
+	const int mortonBits = 10;
+	const int mortonScale = 1 << mortonBits;
+	ParallelFor(nPrimitives, kBinningChunkSize, [&](int i) {
+		vec3f centroidOffset = centroidBounds.LocalNormalizedCoord(primitivesInfo[i].centroid);
+		mortonPrims[i].primitiveIdx = primitivesInfo[i].primitiveIdx;
+		mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
+	});
+
+	RadixSort(&mortonPrims);
+
+	// Create LBVH treelets at bottom of BVH
+	// Find intervals of primitives for each treelet, primitives of a treelet share the upper 12 bits
+	std::vector<LBVHTreelet> treeletsToBuild;
+	for (int start = 0, end = 1; end <= nPrimitives; end++)
+	{
+		uint32_t mask = 0x3ffc0000;
+		if (end == nPrimitives || ((mortonPrims[start].mortonCode & mask) != (mortonPrims[end].mortonCode & mask)))
+		{
+			treeletsToBuild.push_back(LBVHTreelet{ start, end - start, nullptr });
+			start = end;
+		}
+	}
+
+	// every treelet owns its build nodes, a treelet of n primitives needs at most 2n-1 nodes
+	std::vector<std::vector<BVHBuildNode>> treeletNodes(treeletsToBuild.size());
+	for (size_t i = 0; i < treeletsToBuild.size(); i++)
+	{
+		treeletNodes[i].resize(2 * treeletsToBuild[i].nPrimitives - 1);
+		treeletsToBuild[i].buildNodes = treeletNodes[i].data();
+	}
+
+	// Create LBVHs for treelets in parallel
+	// leaves write their primitives to orderedPrimsIndices through an atomic offset
+	orderedPrimsIndices.resize(nPrimitives);
+	std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
+	ParallelFor((int)treeletsToBuild.size(), 1, [&](int i) {
+		int nodesCreated = 0;
+		const int firstBitIndex = 29 - 12;
+		LBVHTreelet& tr = treeletsToBuild[i];
+		BVHBuildNode* buildNodes = tr.buildNodes;
+		tr.buildNodes = emitLBVH(buildNodes, primitivesInfo, &mortonPrims[tr.startIdx], tr.nPrimitives,
+								&nodesCreated, &orderedPrimsOffset, firstBitIndex);
+		atomicTotal += nodesCreated;
+	});
+	int totalNodes = atomicTotal;
+
+	// Create and return SAH BVH from LBVH treelets
+	std::vector<BVHBuildNode*> finishedTreelets;
+	finishedTreelets.reserve(treeletsToBuild.size());
+	for (LBVHTreelet& treelet : treeletsToBuild)
+		finishedTreelets.push_back(treelet.buildNodes);
+
+	std::deque<BVHBuildNode> upperNodes;
+	BVHBuildNode* root = buildUpperSAH(finishedTreelets, 0, (int)finishedTreelets.size(), upperNodes, &totalNodes);
+
+	// the pointer-based tree is flattened into the same depth-first layout as recursiveBuild
+	return flattenBVHTree(root);
+}
+
+BVHBuildNode* BVHAccel::emitLBVH(BVHBuildNode*& buildNodes, std::vector<BVHPrimitiveInfo>& primitivesInfo,
+								MortonPrimitive* mortonPrims, int nPrimitives, int* totalNodes,
+								std::atomic<int>* orderedPrimsOffset, int bitIndex)
+{
+	if (bitIndex == -1 || nPrimitives <= maxPrimsInNode)
+	{
+		// Create and return leaf node of LBVH treelet
+		(*totalNodes)++;
+		BVHBuildNode* node = buildNodes++;
+		bbox3f bounds;
+		int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
+		for (int i = 0; i < nPrimitives; i++)
+		{
+			int primitiveIdx = mortonPrims[i].primitiveIdx;
+			orderedPrimsIndices[firstPrimOffset + i] = primitiveIdx;
+			// primitivesInfo is still in the input order, so primitiveIdx indexes it directly
+			bounds.grow(primitivesInfo[primitiveIdx].bounds);
+		}
+		node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
+		return node;
+	}
+	else {
+		int mask = 1 << bitIndex;
+		// Advance to next subtree level if there's no LBVH split for this bit
+		if ((mortonPrims[0].mortonCode & mask) == (mortonPrims[nPrimitives - 1].mortonCode & mask))
+			return emitLBVH(buildNodes, primitivesInfo, mortonPrims, nPrimitives, totalNodes,
+							orderedPrimsOffset, bitIndex - 1);
+
+		// Find LBVH split point for this dimension
+		int searchStart = 0, searchEnd = nPrimitives - 1;
+		while (searchStart + 1 != searchEnd)
+		{
+			int mid = (searchStart + searchEnd) / 2;
+			if ((mortonPrims[searchStart].mortonCode & mask) == (mortonPrims[mid].mortonCode & mask))
+				searchStart = mid;
+			else
+				searchEnd = mid;
+		}
+		int splitOffset = searchEnd;
+
+		// Create and return interior LBVH node
+		(*totalNodes)++;
+		BVHBuildNode* node = buildNodes++;
+		BVHBuildNode* lbvh[2] = {
+			emitLBVH(buildNodes, primitivesInfo, mortonPrims, splitOffset, totalNodes,
+					orderedPrimsOffset, bitIndex - 1),
+			emitLBVH(buildNodes, primitivesInfo, &mortonPrims[splitOffset], nPrimitives - splitOffset,
+					totalNodes, orderedPrimsOffset, bitIndex - 1)
+		};
+		// morton bits are interleaved as ...zyxzyx, so the split axis cycles with bitIndex
+		int axis = bitIndex % 3;
+		node->InitInterior(axis, lbvh[0], lbvh[1]);
+		return node;
+	}
+}
+
+BVHBuildNode* BVHAccel::buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, int start, int end,
+									std::deque<BVHBuildNode>& upperNodes, int* totalNodes)
+{
+	if (start == end) Error("Start cannot equal to End in upper SAH building.");
+
+	int nNodes = end - start;
+	if (nNodes == 1) return treeletRoots[start];
+
+	(*totalNodes)++;
+	upperNodes.emplace_back();
+	BVHBuildNode* node = &upperNodes.back();
+
+	// Compute bounds of all nodes under this HLBVH node
+	bbox3f bounds;
+	for (int i = start; i < end; i++)
+		bounds.grow(treeletRoots[i]->bounds);
+
+	// Compute bound of HLBVH node centroids, choose split dimension dim
+	bbox3f centroidBounds;
+	for (int i = start; i < end; i++)
+		centroidBounds.grow(treeletRoots[i]->bounds.Center());
+	int dim = centroidBounds.MaximumExtent();
+
+	// all treelet centroids coincide, split in the middle of the list
+	if (centroidBounds.pMin[dim] == centroidBounds.pMax[dim])
+	{
+		int mid = (start + end) / 2;
+		node->InitInterior(dim,
+			buildUpperSAH(treeletRoots, start, mid, upperNodes, totalNodes),
+			buildUpperSAH(treeletRoots, mid, end, upperNodes, totalNodes));
+		return node;
+	}
+
+	// Initialize _BucketInfo_ for HLBVH SAH partition buckets
+	std::vector<BucketInfo> buckets(nBuckets);
+	for (int i = start; i < end; i++)
+	{
+		int b = nBuckets * centroidBounds.LocalNormalizedCoord(treeletRoots[i]->bounds.Center())[dim];
+		if (b == nBuckets) b = nBuckets - 1;
+		buckets[b].count++;
+		buckets[b].bound.grow(treeletRoots[i]->bounds);
+	}
+
+	// Compute costs for splitting after each bucket
+	float minCost = std::numeric_limits<float>::max();
+	int minCostSplitBucket = 0;
+	float invNodeBoundArea = 1.0f / bounds.SurfaceArea();
+	for (int i = 0; i < nBuckets - 1; i++)
+	{
+		bbox3f b0, b1;
+		int count0 = 0, count1 = 0;
+		for (int j = 0; j <= i; j++)
+		{
+			b0.grow(buckets[j].bound);
+			count0 += buckets[j].count;
+		}
+		for (int j = i + 1; j < nBuckets; j++)
+		{
+			b1.grow(buckets[j].bound);
+			count1 += buckets[j].count;
+		}
+		// empty side gives an infinite surface area, skip it
+		if (count0 == 0 || count1 == 0) continue;
+
+		float cost = traversalCost +
+					(count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) * invNodeBoundArea;
+		if (cost < minCost) {
+			minCost = cost;
+			minCostSplitBucket = i;
+		}
+	}
+
+	// Split nodes and create interior HLBVH SAH node
+	BVHBuildNode** pmid = std::partition(&treeletRoots[start], &treeletRoots[end - 1] + 1,
+		[=](const BVHBuildNode* node) {
+			int b = nBuckets * centroidBounds.LocalNormalizedCoord(node->bounds.Center())[dim];
+			if (b == nBuckets) b = nBuckets - 1;
+			return b <= minCostSplitBucket;
+		});
+	int mid = (int)(pmid - &treeletRoots[0]);
+	if (mid == start || mid == end)
+		mid = (start + end) / 2;
+
+	node->InitInterior(dim,
+		buildUpperSAH(treeletRoots, start, mid, upperNodes, totalNodes),
+		buildUpperSAH(treeletRoots, mid, end, upperNodes, totalNodes));
+	return node;
+}
+
+uint32_t BVHAccel::flattenBVHTree(BVHBuildNode* node)
+{
+	uint32_t curNodeOffset = nodeCounts;
+	LinearBVHNode& linearNode = nodes[nodeCounts++];
+
+	if (node->nPrimitives > 0)
+	{
+		linearNode.InitLeaf(node->bounds, node->firstPrimOffset, node->nPrimitives);
+	}
+	else {
+		// left child is always curNodeOffset+1, only the right child offset is stored
+		flattenBVHTree(node->children[0]);
+		uint32_t secondChildOffset = flattenBVHTree(node->children[1]);
+		linearNode.InitInterior(node->bounds, secondChildOffset, node->splitAxis);
+	}
+
+	return curNodeOffset;
+}
+
+static inline bool IsEmptyBound(const bbox3f& box)
+{
+	return box.pMin.x > box.pMax.x || box.pMin.y > box.pMax.y || box.pMin.z > box.pMax.z;
+}
+
+static inline float OverlapArea(const bbox3f& a, const bbox3f& b)
+{
+	bbox3f overlap;
+	overlap.pMin = Max(a.pMin, b.pMin);
+	overlap.pMax = Min(a.pMax, b.pMax);
+	return IsEmptyBound(overlap) ? 0.0f : overlap.SurfaceArea();
+}
+
+uint32_t BVHAccel::SBVHBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo)
+{
+	const int nPrimitives = (int)primitivesInfo.size();
+
+	bbox3f rootBound;
+	for (const BVHPrimitiveInfo& pi : primitivesInfo)
+		rootBound.grow(pi.bounds);
+	sbvhMinOverlapArea = kSBVHMinOverlap * rootBound.SurfaceArea();
+	sbvhRefsBudget = (int)(splitBudget * nPrimitives);
+
+	// leaves append their references while building, a primitive may be referenced by several leaves
+	orderedPrimsIndices.clear();
+	orderedPrimsIndices.reserve(nPrimitives + sbvhRefsBudget);
+
+	// spatial splits are serial, the reference budget is shared by the whole tree
+	std::deque<BVHBuildNode> buildNodes;
+	int totalNodes = 0;
+	BVHBuildNode* root = recursiveBuildSBVH(primitivesInfo, 0, buildNodes, &totalNodes);
+
+	// n references need up to 2n-1 nodes, more than the 2*nPrimitives-1 preallocated by the constructor
+	nodes.resize(totalNodes);
+	return flattenBVHTree(root);
+}
+
+BVHBuildNode* BVHAccel::recursiveBuildSBVH(std::vector<BVHPrimitiveInfo>& refs, int depth,
+										std::deque<BVHBuildNode>& buildNodes, int* totalNodes)
+{
+	if (refs.empty()) Error("SBVH node cannot be empty.");
+
+	(*totalNodes)++;
+	buildNodes.emplace_back();
+	BVHBuildNode* node = &buildNodes.back();
+
+	const int nRefs = (int)refs.size();
+	bbox3f bound, centroidBounds;
+	for (const BVHPrimitiveInfo& ref : refs)
+	{
+		bound.grow(ref.bounds);
+		centroidBounds.grow(ref.centroid);
+	}
+
+	auto createLeaf = [&]() {
+		node->InitLeaf((int)orderedPrimsIndices.size(), nRefs, bound);
+		for (const BVHPrimitiveInfo& ref : refs)
+			orderedPrimsIndices.push_back(ref.primitiveIdx);
+		return node;
+	};
+
+	if (nRefs == 1)
+		return createLeaf();
+
+	// costs below are not divided by the node area, they are only compared with each other
+	const float nodeArea = bound.SurfaceArea();
+
+	// Object split: binned SAH along the largest centroid extent, as SplitMethod::SAH
+	int objectDim = centroidBounds.MaximumExtent();
+	int objectSplitBucket = -1;
+	float objectCost = std::numeric_limits<float>::max();
+	float objectOverlap = 0.0f;
+	if (centroidBounds.pMin[objectDim] < centroidBounds.pMax[objectDim])
+	{
+		std::vector<BucketInfo> buckets(nBuckets);
+		for (const BVHPrimitiveInfo& ref : refs)
+		{
+			int b = nBuckets * centroidBounds.LocalNormalizedCoord(ref.centroid)[objectDim];
+			if (b == nBuckets) b = nBuckets - 1;
+			buckets[b].count++;
+			buckets[b].bound.grow(ref.bounds);
+		}
+
+		std::vector<bbox3f> rightBounds(nBuckets - 1);
+		bbox3f rightBbox;
+		for (int i = nBuckets - 1; i > 0; i--)
+		{
+			rightBbox.grow(buckets[i].bound);
+			rightBounds[i - 1] = rightBbox;
+		}
+
+		bbox3f leftBounds;
+		int leftCount = 0;
+		for (int i = 0; i < nBuckets - 1; i++)
+		{
+			leftBounds.grow(buckets[i].bound);
+			leftCount += buckets[i].count;
+			int rightCount = nRefs - leftCount;
+			if (leftCount == 0 || rightCount == 0) continue;
+
+			float cost = traversalCost * nodeArea +
+						leftCount * leftBounds.SurfaceArea() + rightCount * rightBounds[i].SurfaceArea();
+			if (cost < objectCost) {
+				objectCost = cost;
+				objectSplitBucket = i;
+				objectOverlap = OverlapArea(leftBounds, rightBounds[i]);
+			}
+		}
+	}
+
+	// Spatial split: only worth trying where the object split children overlap noticeably
+	int spatialDim = 0;
+	float spatialPos = 0.0f;
+	float spatialCost = std::numeric_limits<float>::max();
+	bool useSpatial = false;
+	if (depth < kSBVHMaxSplitDepth && sbvhRefsBudget > 0 &&
+		(objectSplitBucket < 0 || objectOverlap > sbvhMinOverlapArea))
+	{
+		useSpatial = findSpatialSplit(refs, bound, spatialDim, spatialPos, spatialCost) &&
+					spatialCost < objectCost;
+	}
+
+	float leafCost = nRefs * nodeArea;
+	float minCost = useSpatial ? spatialCost : objectCost;
+	if (nRefs <= maxPrimsInNode && leafCost <= minCost)
+		return createLeaf();
+
+	std::vector<BVHPrimitiveInfo> leftRefs, rightRefs;
+	int dim = useSpatial ? spatialDim : objectDim;
+
+	if (useSpatial)
+	{
+		// references entirely on one side of the plane stay whole, the straddling ones are split
+		std::vector<BVHPrimitiveInfo> straddling;
+		bbox3f leftBound, rightBound;
+		for (const BVHPrimitiveInfo& ref : refs)
+		{
+			if (ref.bounds.pMax[dim] <= spatialPos) {
+				leftRefs.push_back(ref);
+				leftBound.grow(ref.bounds);
+			}
+			else if (ref.bounds.pMin[dim] >= spatialPos) {
+				rightRefs.push_back(ref);
+				rightBound.grow(ref.bounds);
+			}
+			else
+				straddling.push_back(ref);
+		}
+
+		int leftCount = (int)(leftRefs.size() + straddling.size());
+		int rightCount = (int)(rightRefs.size() + straddling.size());
+		std::vector<BVHPrimitiveInfo> leftParts(straddling.size()), rightParts(straddling.size());
+		for (size_t i = 0; i < straddling.size(); i++)
+		{
+			splitReference(straddling[i], dim, spatialPos, leftParts[i], rightParts[i]);
+			leftBound.grow(leftParts[i].bounds);
+			rightBound.grow(rightParts[i].bounds);
+		}
+
+		// Reference unsplitting: keep a straddling reference whole on one side if that is cheaper,
+		// and always once the duplication budget is used up
+		for (size_t i = 0; i < straddling.size(); i++)
+		{
+			const BVHPrimitiveInfo& ref = straddling[i];
+			float leftArea = leftBound.SurfaceArea();
+			float rightArea = rightBound.SurfaceArea();
+			float unsplitLeftArea = Union(leftBound, ref.bounds).SurfaceArea();
+			float unsplitRightArea = Union(rightBound, ref.bounds).SurfaceArea();
+
+			float splitCost = leftArea * leftCount + rightArea * rightCount;
+			float unsplitLeftCost = unsplitLeftArea * leftCount + rightArea * (rightCount - 1);
+			float unsplitRightCost = leftArea * (leftCount - 1) + unsplitRightArea * rightCount;
+
+			if (sbvhRefsBudget > 0 && splitCost < unsplitLeftCost && splitCost < unsplitRightCost)
+			{
+				leftRefs.push_back(leftParts[i]);
+				rightRefs.push_back(rightParts[i]);
+				sbvhRefsBudget--;
+			}
+			else if (unsplitLeftCost <= unsplitRightCost)
+			{
+				leftRefs.push_back(ref);
+				leftBound.grow(ref.bounds);
+				rightCount--;
+			}
+			else {
+				rightRefs.push_back(ref);
+				rightBound.grow(ref.bounds);
+				leftCount--;
+			}
+		}
+
+		// unsplitting may move everything to one side, fall back to the object split then
+		if (leftRefs.empty() || rightRefs.empty())
+		{
+			sbvhRefsBudget += (int)(leftRefs.size() + rightRefs.size()) - nRefs;
+			leftRefs.clear();
+			rightRefs.clear();
+			useSpatial = false;
+			dim = objectDim;
+		}
+	}
+
+	if (!useSpatial)
+	{
+		if (objectSplitBucket >= 0)
+		{
+			for (const BVHPrimitiveInfo& ref : refs)
+			{
+				int b = nBuckets * centroidBounds.LocalNormalizedCoord(ref.centroid)[dim];
+				if (b == nBuckets) b = nBuckets - 1;
+				if (b <= objectSplitBucket)
+					leftRefs.push_back(ref);
+				else
+					rightRefs.push_back(ref);
+			}
+		}
+		else {
+			// PBRT-V3 261 page. all centroids coincide and no spatial split helps, keep them in one leaf
+			if (centroidBounds.pMin[dim] == centroidBounds.pMax[dim])
+				return createLeaf();
+
+			int mid = nRefs / 2;
+			std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+				[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+					return a.centroid[dim] < b.centroid[dim];
+				});
+			leftRefs.assign(refs.begin(), refs.begin() + mid);
+			rightRefs.assign(refs.begin() + mid, refs.end());
+		}
+	}
+
+	// references of this node are no longer needed, release them before going deeper
+	std::vector<BVHPrimitiveInfo>().swap(refs);
+
+	BVHBuildNode* left = recursiveBuildSBVH(leftRefs, depth + 1, buildNodes, totalNodes);
+	BVHBuildNode* right = recursiveBuildSBVH(rightRefs, depth + 1, buildNodes, totalNodes);
+	node->InitInterior(dim, left, right);
+	return node;
+}
+
+bool BVHAccel::findSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs, const bbox3f& bound,
+								int& splitDim, float& splitPos, float& splitCost) const
+{
+	struct SpatialBin
+	{
+		bbox3f bound;
+		int enter = 0;
+		int exit = 0;
+	};
+
+	const int nRefs = (int)refs.size();
+	const float nodeArea = bound.SurfaceArea();
+	vec3f extent = bound.Diagonal();
+	bool found = false;
+	splitCost = std::numeric_limits<float>::max();
+
+	for (int dim = 0; dim < 3; dim++)
+	{
+		if (extent[dim] <= 0.0f) continue;
+
+		float origin = bound.pMin[dim];
+		float binWidth = extent[dim] / kSBVHSpatialBins;
+		float invBinWidth = 1.0f / binWidth;
+		SpatialBin bins[kSBVHSpatialBins];
+
+		// chop every reference into the bins it overlaps, counting where it enters and exits
+		for (const BVHPrimitiveInfo& ref : refs)
+		{
+			int firstBin = std::min(std::max((int)((ref.bounds.pMin[dim] - origin) * invBinWidth), 0), kSBVHSpatialBins - 1);
+			int lastBin = std::min(std::max((int)((ref.bounds.pMax[dim] - origin) * invBinWidth), firstBin), kSBVHSpatialBins - 1);
+
+			if (firstBin == lastBin)
+				bins[firstBin].bound.grow(ref.bounds);
+			else {
+				for (int b = firstBin; b <= lastBin; b++)
+				{
+					bbox3f piece = ref.bounds;
+					if (b > firstBin) piece.pMin[dim] = origin + binWidth * b;
+					if (b < lastBin) piece.pMax[dim] = origin + binWidth * (b + 1);
+					bins[b].bound.grow(clipReference(ref, piece));
+				}
+			}
+			bins[firstBin].enter++;
+			bins[lastBin].exit++;
+		}
+
+		// sweep the planes between bins, same as the object split sweep
+		bbox3f rightBounds[kSBVHSpatialBins - 1];
+		bbox3f rightBbox;
+		for (int i = kSBVHSpatialBins - 1; i > 0; i--)
+		{
+			rightBbox.grow(bins[i].bound);
+			rightBounds[i - 1] = rightBbox;
+		}
+
+		bbox3f leftBounds;
+		int leftCount = 0, rightCount = nRefs;
+		for (int i = 0; i < kSBVHSpatialBins - 1; i++)
+		{
+			leftBounds.grow(bins[i].bound);
+			leftCount += bins[i].enter;
+			rightCount -= bins[i].exit;
+			if (leftCount == 0 || rightCount == 0) continue;
+
+			float cost = traversalCost * nodeArea +
+						leftCount * leftBounds.SurfaceArea() + rightCount * rightBounds[i].SurfaceArea();
+			if (cost < splitCost) {
+				splitCost = cost;
+				splitDim = dim;
+				splitPos = origin + binWidth * (i + 1);
+				found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+void BVHAccel::splitReference(const BVHPrimitiveInfo& ref, int dim, float pos,
+							BVHPrimitiveInfo& left, BVHPrimitiveInfo& right) const
+{
+	bbox3f leftBox = ref.bounds, rightBox = ref.bounds;
+	leftBox.pMax[dim] = std::min(pos, ref.bounds.pMax[dim]);
+	rightBox.pMin[dim] = std::max(pos, ref.bounds.pMin[dim]);
+
+	left = right = ref;
+	left.bounds = clipReference(ref, leftBox);
+	right.bounds = clipReference(ref, rightBox);
+	left.centroid = left.bounds.Center();
+	right.centroid = right.bounds.Center();
+}
+
+bbox3f BVHAccel::clipReference(const BVHPrimitiveInfo& ref, const bbox3f& box) const
+{
+	if (!clipPrimitive)
+		return box;
+
+	// the clipped primitive is never larger than the box, fall back to the box on numerical misses
+	bbox3f clipped = clipPrimitive(ref.primitiveIdx, box);
+	clipped.pMin = Max(clipped.pMin, box.pMin);
+	clipped.pMax = Min(clipped.pMax, box.pMax);
+	return IsEmptyBound(clipped) ? box : clipped;
 }
 
 
@@ -1,5 +1,8 @@
 #pragma once
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
 #include "bounds3.h"
 #include "scene.h"
 
@@ -57,28 +60,131 @@ struct BucketInfo
 	bbox3f bound;
 };
 
+// Pointer-based node used by builders that cannot emit the flattened layout directly (HLBVH),
+// it is flattened into LinearBVHNode by BVHAccel::flattenBVHTree
+struct BVHBuildNode
+{
+	void InitLeaf(int first, int n, const bbox3f& box)
+	{
+		firstPrimOffset = first;
+		nPrimitives = n;
+		bounds = box;
+		children[0] = children[1] = nullptr;
+	}
+	void InitInterior(int axis, BVHBuildNode* c0, BVHBuildNode* c1)
+	{
+		children[0] = c0;
+		children[1] = c1;
+		bounds = Union(c0->bounds, c1->bounds);
+		splitAxis = axis;
+		nPrimitives = 0;
+	}
+	bbox3f bounds;
+	BVHBuildNode* children[2];
+	int splitAxis, firstPrimOffset, nPrimitives;
+};
+
+// 4 children of a wide BVH node. Child bounds are SoA so the shader tests 4 boxes with one set of vec4 operations.
+// A BVH4 node is one WideBVHNode, a BVH8 node two consecutive ones. Uploaded as GL_RGBA32I, 9 texels each.
+struct WideBVHNode
+{
+	float boundsMin[3][4];		// [axis][child]
+	float boundsMax[3][4];
+	int32_t childOffset[4];		// interior: wide node idx, blasBVH leaf: primitivesOffset, tlasBVH leaf: blasBVHStartOffset
+	int32_t childCount[4];		// interior: 0, empty slot: -1, blasBVH leaf: nPrimitives, tlasBVH leaf: meshInstanceIdx+1
+	int32_t childParam[4];		// tlasBVH leaf: materialID
+};
+
+// Wide node with child bounds quantized to 8 bits relative to the node bounds (Ylitie et al. 2017).
+// Interior children are consecutive nodes from baseChild, leaf primitives are consecutive from basePrim in slot order.
+// BVH4 nodes are padded to 64 bytes and BVH8 nodes are 80 bytes, uploaded as GL_RGBA32I.
+template <int Width>
+struct alignas(16) CompressedWideNode
+{
+	float origin[3];			// node bounds pMin
+	uint8_t exponent[3];		// per axis child bounds scale 2^(exponent-127)
+	uint8_t interiorMask;		// bit i set: slot i is an interior child
+	uint32_t baseChild;			// idx of the first interior child
+	uint32_t basePrim;			// orderedPrimsIndices offset of the first leaf primitive
+	uint8_t meta[Width];		// interior: rank among the interior children, leaf: nPrimitives, empty slot: 0
+	uint8_t qlo[3][Width];		// [axis][slot]
+	uint8_t qhi[3][Width];
+};
+
+// PBRT-V3 4.3.3 Linear Bounding Volume Hierarchies
+struct MortonPrimitive
+{
+	int primitiveIdx;
+	uint32_t mortonCode;
+};
+
+// a cluster of primitives sharing the same high bits of morton code, built independently
+struct LBVHTreelet
+{
+	int startIdx, nPrimitives;
+	BVHBuildNode* buildNodes;
+};
+
 class BVHAccel
 {
 public:
 	enum SplitMethod {
-		Middle, EuqalCounts, SAH, HLBVH
+		Middle, EuqalCounts, SAH, HLBVH, SBVH
 	};
 
+	// returns the bound of the part of primitive primitiveIdx inside box, used by SBVH to split references.
+	// Without it the reference's bbox itself is clipped, which is looser for slanted primitives.
+	typedef std::function<bbox3f(uint32_t primitiveIdx, const bbox3f& box)> ClipFunc;
+
 	BVHAccel(std::vector<bbox3f>& bounds,
 			int maxPrimsInNode = 1,
 			SplitMethod splitMethod = SplitMethod::SAH,
 			int nBuckets = 12,
-			float traversalCost = 1.0f);
+			float traversalCost = 1.0f,
+			float splitBudget = 0.3f,
+			ClipFunc clipPrimitive = nullptr);
+	// restore a tree built earlier with the same parameters, e.g. read back from a mesh cache file
+	BVHAccel(const LinearBVHNode* nodes, uint32_t nodeCounts,
+			const uint32_t* orderedPrimsIndices, uint32_t primsIndicesNum,
+			int maxPrimsInNode, SplitMethod splitMethod, int nBuckets,
+			float traversalCost, float splitBudget);
 	~BVHAccel() {}
 
 	bbox3f WorldBound();
 
+	// SAH cost of the flattened tree relative to the root bound (intersection cost is 1),
+	// lower is better, comparable between different split methods on the same primitives.
+	float SAHCost() const;
+	// wall time of the last build in milliseconds
+	double BuildTime() const { return buildTime; }
+	static const char* SplitMethodName(SplitMethod method);
+
+	// collapse the binary nodes into wideNodes with width(4 or 8) children per node,
+	// the children of a node are the binary descendants with the largest surface area
+	// bottom-up refit of nodes, wideNodes and compressedNodes to new primitive bounds, the topology is kept.
+	// returns false once the SAH cost grew past maxCostRatio times the cost after building, the caller should rebuild then
+	bool Refit(const std::vector<bbox3f>& bounds, float maxCostRatio);
+	// refit only the ancestors of prims, whose entries in bounds changed, ancestors stop at the first unchanged bound.
+	// the binary and wide nodes whose bounds changed are returned, compressedNodes are updated through wideToCompressed.
+	// same return value as Refit, the SAH cost is tracked incrementally
+	bool RefitPrimitives(const std::vector<uint32_t>& prims, const std::vector<bbox3f>& bounds, float maxCostRatio,
+		std::vector<uint32_t>& changedNodes, std::vector<uint32_t>& changedWideNodes);
+	void CollapseWide(int width);
+	// quantize wideNodes into compressedNodes and reorder orderedPrimsIndices so that the leaves of
+	// every wide node are consecutive, nodes and wideNodes are updated to the new order.
+	// fails if a leaf holds more than 255 primitives, which only happens when their centroids coincide
+	bool CompressWide();
+	// 32-bit words of one compressed node of the given width
+	static int CompressedNodeWords(int width) { return width == 4 ? 16 : 20; }
+
 	// sceneдblastlas
 	// ⲿSceneԪprivateΪprivate¶ⲿغôBVHAccel޷ú
 	//friend void Scene::ProcessScene();
 	//friend void Scene::ProcessBLAS();
 	//friend void Scene::ProcessTLAS();
 	friend class Scene;
+	// Mesh writes nodes and orderedPrimsIndices to its cache file
+	friend class Mesh;
 
 protected:
 	// չƽBVHNodes
@@ -95,11 +201,66 @@ protected:
 	const int nBuckets;
 	// SAHбڵĳɱ
 	const float traversalCost;
+	// build time in milliseconds
+	double buildTime;
+	// SAHCost() right after building, the reference of Refit
+	float buildSAHCost;
+	// SAHCost() times the root surface area, kept up to date by Refit and RefitPrimitives
+	double sahAreaSum;
+	// nodes collapsed by CollapseWide, wideNodeCounts nodes of wideWidth/4 WideBVHNode each
+	std::vector<WideBVHNode> wideNodes;
+	uint32_t wideNodeCounts;
+	int wideWidth;
+	// CompressWide output, wideNodeCounts nodes in breadth-first order, CompressedNodeWords(wideWidth) words each
+	std::vector<uint32_t> compressedNodes;
+	// wide node idx -> compressed node idx
+	std::vector<uint32_t> wideToCompressed;
+	// RefitPrimitives lookups, built on first use and dropped when the tree changes.
+	// leaves of primitive p are primLeaves[primLeafOffsets[p], primLeafOffsets[p+1]),
+	// wide slots are stored as wideNodeIdx * wideWidth + slot
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> primLeafOffsets;
+	std::vector<uint32_t> primLeaves;
+	std::vector<uint32_t> leafWideSlots;
+	std::vector<uint32_t> wideParentSlots;
+	// marks the slots of nodes written by recursiveBuild, only alive during building
+	std::vector<uint8_t> nodeUsed;
+	// SBVH: extra references allowed by spatial splits, as a fraction of the primitive count.
+	// With SBVH orderedPrimsIndices may be longer than the primitive count.
+	const float splitBudget;
+	ClipFunc clipPrimitive;
+	// SBVH build state, only alive during building
+	int sbvhRefsBudget;
+	float sbvhMinOverlapArea;
 
 private:
 	// ָ봴BVH
-	uint32_t recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end);
+	uint32_t recursiveBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo, int start, int end, uint32_t nodeOffset);
+	// remove the unused slots left by recursiveBuild's per-subtree node ranges
+	void CompactNodes();
 	uint32_t HLBVHBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo);
+	BVHBuildNode* emitLBVH(BVHBuildNode*& buildNodes, std::vector<BVHPrimitiveInfo>& primitivesInfo,
+						MortonPrimitive* mortonPrims, int nPrimitives, int* totalNodes,
+						std::atomic<int>* orderedPrimsOffset, int bitIndex);
+	BVHBuildNode* buildUpperSAH(std::vector<BVHBuildNode*>& treeletRoots, int start, int end,
+						std::deque<BVHBuildNode>& upperNodes, int* totalNodes);
+	uint32_t flattenBVHTree(BVHBuildNode* node);
+	uint32_t collapseWideNode(uint32_t nodeIdx);
+	template <int Width>
+	bool compressWideNodes();
+	template <int Width>
+	void requantizeWideNode(uint32_t wideIdx);
+	void buildRefitLookups(size_t primsNum);
+	double computeSAHAreaSum() const;
+	// Stich et al. 2009, Spatial Splits in Bounding Volume Hierarchies
+	uint32_t SBVHBuild(std::vector<BVHPrimitiveInfo>& primitivesInfo);
+	BVHBuildNode* recursiveBuildSBVH(std::vector<BVHPrimitiveInfo>& refs, int depth,
+						std::deque<BVHBuildNode>& buildNodes, int* totalNodes);
+	bool findSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs, const bbox3f& bound,
+						int& splitDim, float& splitPos, float& splitCost) const;
+	void splitReference(const BVHPrimitiveInfo& ref, int dim, float pos,
+						BVHPrimitiveInfo& left, BVHPrimitiveInfo& right) const;
+	bbox3f clipReference(const BVHPrimitiveInfo& ref, const bbox3f& box) const;
 };
 
 NAMESPACE_END(nagi)
\ No newline at end of file
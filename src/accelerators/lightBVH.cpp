@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "lightBVH.h"
+#include "light.h"
+#include "environmentMap.h"
+
+NAMESPACE_BEGIN(nagi)
+
+static const int kLightBVHBuckets = 12;
+// LightBVHNode::bitTrail holds one bit per level
+static const int kLightBVHMaxDepth = 31;
+
+static inline float SafeACos(float x) { return std::acos(std::min(1.0f, std::max(-1.0f, x))); }
+static inline float SafeSqrt(float x) { return std::sqrt(std::max(0.0f, x)); }
+
+// rect lights emit on the side of cross(u, v) only, sphere lights in every direction.
+// both emit PI * L per unit area up to 90 degrees from their surface normals
+LightBounds::LightBounds(const Light& light)
+{
+	phi = PI * Luminance(light.emission.x, light.emission.y, light.emission.z) * light.area;
+	cosThetaE = 0.0f;
+	if (light.type == Light::RectLight)
+	{
+		bounds = Union(Union(bbox3f(light.position, light.position + light.u), light.position + light.v), light.position + light.u + light.v);
+		w = Normalize(Cross(light.u, light.v));
+		cosThetaO = 1.0f;
+	}
+	else
+	{
+		bounds = bbox3f(light.position - vec3f(light.radius), light.position + vec3f(light.radius));
+		w = vec3f(0.0f, 0.0f, 1.0f);
+		cosThetaO = -1.0f;
+	}
+}
+
+// PBRT-V4 3.8.4 DirectionCone Union: the smallest cone around both cones
+static void UnionCones(const vec3f& wa, float cosA, const vec3f& wb, float cosB, vec3f& w, float& cosTheta)
+{
+	float thetaA = SafeACos(cosA), thetaB = SafeACos(cosB), thetaD = SafeACos(Dot(wa, wb));
+	if (std::min(thetaD + thetaB, PI) <= thetaA)
+	{
+		w = wa;
+		cosTheta = cosA;
+		return;
+	}
+	if (std::min(thetaD + thetaA, PI) <= thetaB)
+	{
+		w = wb;
+		cosTheta = cosB;
+		return;
+	}
+
+	float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+	vec3f axis = Cross(wa, wb);
+	if (thetaO >= PI || axis.LengthSquared() == 0.0f)
+	{
+		w = wa;
+		cosTheta = -1.0f;
+		return;
+	}
+
+	// rotate wa towards wb by thetaO - thetaA around axis (Rodrigues)
+	float thetaR = thetaO - thetaA;
+	axis = Normalize(axis);
+	w = Normalize(wa * std::cos(thetaR) + Cross(axis, wa) * std::sin(thetaR) + axis * (Dot(axis, wa) * (1.0f - std::cos(thetaR))));
+	cosTheta = std::cos(thetaO);
+}
+
+// lights without power keep their bounds for intersection but do not widen the cones
+LightBounds Union(const LightBounds& a, const LightBounds& b)
+{
+	LightBounds u;
+	u.bounds = Union(a.bounds, b.bounds);
+	u.phi = a.phi + b.phi;
+	if (a.phi == 0.0f || b.phi == 0.0f)
+	{
+		const LightBounds& lit = a.phi == 0.0f ? b : a;
+		u.w = lit.w;
+		u.cosThetaO = lit.cosThetaO;
+		u.cosThetaE = lit.cosThetaE;
+		return u;
+	}
+	UnionCones(a.w, a.cosThetaO, b.w, b.cosThetaO, u.w, u.cosThetaO);
+	u.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+	return u;
+}
+
+// PBRT-V4 12.6.3 EvaluateCost: power times the solid angle measure of the cone times the surface area,
+// boxes thin along the split axis are penalized by Kr
+static float LightBoundsCost(const LightBounds& b, const bbox3f& bounds, int dim)
+{
+	if (b.phi == 0.0f)
+		return 0.0f;
+	float thetaO = SafeACos(b.cosThetaO), thetaE = SafeACos(b.cosThetaE);
+	float thetaW = std::min(thetaO + thetaE, PI);
+	float sinThetaO = SafeSqrt(1.0f - b.cosThetaO * b.cosThetaO);
+	float MOmega = 2.0f * PI * (1.0f - b.cosThetaO) +
+		PI / 2.0f * (2.0f * thetaW * sinThetaO - std::cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + b.cosThetaO);
+
+	vec3f d = bounds.Diagonal();
+	float maxExtent = std::max(d.x, std::max(d.y, d.z));
+	float Kr = d[dim] > 0.0f ? maxExtent / d[dim] : 1.0f;
+	return b.phi * MOmega * Kr * b.bounds.SurfaceArea();
+}
+
+struct LightBVHPrimitive
+{
+	int lightIdx;
+	LightBounds lb;
+};
+
+static int CeilLog2(int n)
+{
+	int levels = 0;
+	while ((1 << levels) < n)
+		levels++;
+	return levels;
+}
+
+static void SetNode(LightBVHNode& node, const LightBounds& lb, int childOrLight, int isLeaf, uint32_t bitTrail)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		node.boundsMin[i] = lb.bounds.pMin[i];
+		node.boundsMax[i] = lb.bounds.pMax[i];
+		node.w[i] = lb.w[i];
+	}
+	node.phi = lb.phi;
+	node.cosThetaO = lb.cosThetaO;
+	node.cosThetaE = lb.cosThetaE;
+	node.childOrLight = childOrLight;
+	node.isLeaf = isLeaf;
+	node.bitTrail = (int32_t)bitTrail;
+	node.padding = 0;
+}
+
+static LightBounds BuildRecursive(std::vector<LightBVHPrimitive>& prims, int start, int end, uint32_t bitTrail, int depth,
+	std::vector<LightBVHNode>& nodes)
+{
+	int nodeIdx = (int)nodes.size();
+	nodes.emplace_back();
+
+	if (end - start == 1)
+	{
+		SetNode(nodes[nodeIdx], prims[start].lb, prims[start].lightIdx, 1, bitTrail);
+		return prims[start].lb;
+	}
+
+	bbox3f bounds, centroidBounds;
+	for (int i = start; i < end; i++)
+	{
+		bounds = Union(bounds, prims[i].lb.bounds);
+		centroidBounds = Union(centroidBounds, prims[i].lb.bounds.Center());
+	}
+
+	int mid = -1;
+	// near the depth limit only halving the lights still fits into the bit trail
+	if (CeilLog2(end - start) < kLightBVHMaxDepth - depth)
+	{
+		float minCost = std::numeric_limits<float>::max();
+		int minCostSplitBucket = -1, minCostSplitDim = -1;
+		for (int dim = 0; dim < 3; dim++)
+		{
+			if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+				continue;
+
+			LightBounds buckets[kLightBVHBuckets];
+			for (int i = start; i < end; i++)
+			{
+				vec3f offset = centroidBounds.LocalNormalizedCoord(prims[i].lb.bounds.Center());
+				int b = std::min((int)(kLightBVHBuckets * offset[dim]), kLightBVHBuckets - 1);
+				buckets[b] = Union(buckets[b], prims[i].lb);
+			}
+
+			for (int i = 0; i < kLightBVHBuckets - 1; i++)
+			{
+				LightBounds below, above;
+				for (int j = 0; j <= i; j++)
+					below = Union(below, buckets[j]);
+				for (int j = i + 1; j < kLightBVHBuckets; j++)
+					above = Union(above, buckets[j]);
+				if (below.bounds.pMin.x > below.bounds.pMax.x || above.bounds.pMin.x > above.bounds.pMax.x)
+					continue;
+				float cost = LightBoundsCost(below, bounds, dim) + LightBoundsCost(above, bounds, dim);
+				if (cost < minCost)
+				{
+					minCost = cost;
+					minCostSplitBucket = i;
+					minCostSplitDim = dim;
+				}
+			}
+		}
+
+		if (minCostSplitDim != -1)
+		{
+			LightBVHPrimitive* pmid = std::partition(&prims[start], &prims[end - 1] + 1, [&](const LightBVHPrimitive& p) {
+				vec3f offset = centroidBounds.LocalNormalizedCoord(p.lb.bounds.Center());
+				int b = std::min((int)(kLightBVHBuckets * offset[minCostSplitDim]), kLightBVHBuckets - 1);
+				return b <= minCostSplitBucket;
+			});
+			mid = (int)(pmid - &prims[0]);
+		}
+	}
+	if (mid <= start || mid >= end)
+	{
+		mid = (start + end) / 2;
+		int dim = centroidBounds.MaximumExtent();
+		std::nth_element(&prims[start], &prims[mid], &prims[end - 1] + 1, [dim](const LightBVHPrimitive& a, const LightBVHPrimitive& b) {
+			return a.lb.bounds.Center()[dim] < b.lb.bounds.Center()[dim];
+		});
+	}
+
+	LightBounds lb0 = BuildRecursive(prims, start, mid, bitTrail, depth + 1, nodes);
+	int secondChild = (int)nodes.size();
+	LightBounds lb1 = BuildRecursive(prims, mid, end, bitTrail | (1u << depth), depth + 1, nodes);
+	LightBounds lb = Union(lb0, lb1);
+
+	SetNode(nodes[nodeIdx], lb, secondChild, 0, 0);
+	return lb;
+}
+
+void BuildLightBVH(const std::vector<Light>& lights, std::vector<LightBVHNode>& nodes, std::vector<int32_t>& distantLights)
+{
+	nodes.clear();
+	distantLights.clear();
+
+	std::vector<LightBVHPrimitive> prims;
+	for (size_t i = 0; i < lights.size(); i++)
+	{
+		if (lights[i].type == Light::DistantLight)
+			distantLights.push_back((int32_t)i);
+		else
+			prims.push_back({ (int)i, LightBounds(lights[i]) });
+	}
+
+	if (prims.empty())
+		return;
+	nodes.reserve(2 * prims.size() - 1);
+	BuildRecursive(prims, 0, (int)prims.size(), 0, 0, nodes);
+}
+
+NAMESPACE_END(nagi)
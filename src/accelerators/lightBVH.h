@@ -0,0 +1,47 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "bounds3.h"
+
+NAMESPACE_BEGIN(nagi)
+
+class Light;
+
+// spatial bounds, power and orientation cone of a set of lights (Conty & Kulla 2018, PBRT-V4 12.6.3).
+// every light emits around w within thetaO, and from there up to thetaE further away from w
+struct LightBounds
+{
+	LightBounds() :w(0.0f, 0.0f, 1.0f), phi(0.0f), cosThetaO(1.0f), cosThetaE(1.0f) {}
+	explicit LightBounds(const Light& light);
+
+	bbox3f bounds;
+	vec3f w;
+	float phi;
+	float cosThetaO;
+	float cosThetaE;
+};
+
+LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+// node of the light BVH as uploaded to lightBVHTex, 4 GL_RGBA32I texels, floats are read back with intBitsToFloat.
+// nodes are in depth first order, the first child of an interior node is the next node
+struct LightBVHNode
+{
+	float boundsMin[3];
+	float phi;
+	float boundsMax[3];
+	float cosThetaO;
+	float w[3];
+	float cosThetaE;
+	int32_t childOrLight;	// interior: idx of the second child, leaf: light idx
+	int32_t isLeaf;
+	int32_t bitTrail;		// leaf: bit i is the child taken at depth i on the way from the root, 1 is the second child
+	int32_t padding;
+};
+static_assert(sizeof(LightBVHNode) == 4 * 16, "LightBVHNode is 4 texels of lightBVHTex");
+
+// one leaf per rect or sphere light, split where the power and orientation weighted surface area is the lowest.
+// distant lights have no bounds, their indices go to distantLights and they are picked apart from the BVH
+void BuildLightBVH(const std::vector<Light>& lights, std::vector<LightBVHNode>& nodes, std::vector<int32_t>& distantLights);
+
+NAMESPACE_END(nagi)
@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include "vector.h"
+#include "scene.h"
 #include "glad.h"
 
 NAMESPACE_BEGIN(nagi)
@@ -30,6 +31,8 @@ private:
 	void InitGPUDataBuffers();
 	void InitFBOs();
 	void InitShaders();
+	// upload what the scene changed since the last frame (refits, rebuilds, transforms)
+	void UpdateGPUDataBuffers();
 
 protected:
 	Scene* scene;
@@ -38,18 +41,25 @@ protected:
 	// Input Data: Opengl buffer objects and textures for storing scene data on the GPU
 	GLuint BVHBuffer;
 	GLuint BVHTex;
+	GLuint wideBVHBuffer;
+	GLuint wideBVHTex;
 	GLuint vertexIndicesBuffer;
 	GLuint vertexIndicesTex;
 	GLuint verticesBuffer;
 	GLuint verticesTex;
 	GLuint normalsBuffer;
 	GLuint normalsTex;
+	GLuint transformsBuffer;
 	GLuint transformsTex;
 	GLuint lightsTex;
+	GLuint lightBVHBuffer;
+	GLuint lightBVHTex;
 	GLuint materialsTex;
-	GLuint textureMapsArrayTex;
+	// one texture array per texture class, see Scene::textureClassSizes
+	GLuint textureMapsArrayTex[kTextureClassesNum];
 	GLuint envMapTex;
-	GLuint envMapCDFTex;
+	GLuint envMapAliasBuffer;
+	GLuint envMapAliasTex;
 
 	// Calculate: Shader Program
 	std::string shadersDir;
@@ -57,6 +67,9 @@ protected:
 	Program* pathTraceShaderLowRes;
 	Program* tonemapShader;
 	Program* outputShader;
+	// Scene::WideBVHDepth and BVH compression the path trace shaders were compiled for
+	int bvhStackDepth;
+	bool bvhCompressed;
 
 	// Output: FBOs and Color Attachment
 	GLuint pathTraceFBO;
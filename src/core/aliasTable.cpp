@@ -0,0 +1,46 @@
+#include "aliasTable.h"
+#include <vector>
+
+NAMESPACE_BEGIN(nagi)
+
+// https://www.keithschwarz.com/darts-dice-coins/
+// every weight is scaled so that their mean is 1. a column under 1 (small) is filled up by a column over 1 (large),
+// which becomes its alias and gives away the missing part. columns left over at the end are 1 up to rounding
+double BuildAliasTable(const float* weights, size_t n, AliasEntry* table)
+{
+	double total = 0.0;
+	for (size_t i = 0; i < n; i++)
+		total += weights[i];
+
+	for (size_t i = 0; i < n; i++)
+		table[i] = { 1.0f, (uint32_t)i };
+	if (total <= 0.0)
+		return 0.0;
+
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	small.reserve(n);
+	large.reserve(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		scaled[i] = weights[i] * (double)n / total;
+		(scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		uint32_t s = small.back(), l = large.back();
+		small.pop_back();
+		table[s] = { (float)scaled[s], l };
+		// (a + b) - 1 loses less than a - (1 - b) when a is large
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		if (scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	return total;
+}
+
+NAMESPACE_END(nagi)
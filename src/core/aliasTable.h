@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "logger.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// one column of a Walker alias table, uploaded as an RG32UI texel (threshold as float bits, alias).
+// column i is picked uniformly, then i is kept if the fraction inside the column is below threshold,
+// otherwise alias is taken, so every sample costs one fetch
+struct AliasEntry
+{
+	float threshold;
+	uint32_t alias;
+};
+static_assert(sizeof(AliasEntry) == 8, "AliasEntry is one RG32UI texel");
+
+// Vose's O(n) construction of the alias table of n non-negative weights, returns the sum of the weights.
+// if they are all 0 every column keeps itself, i.e. the table samples uniformly
+double BuildAliasTable(const float* weights, size_t n, AliasEntry* table);
+
+NAMESPACE_END(nagi)
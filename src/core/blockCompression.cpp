@@ -0,0 +1,258 @@
+#include "blockCompression.h"
+#include "parallel.h"
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cfloat>
+
+NAMESPACE_BEGIN(nagi)
+
+// rows of blocks compressed by one task
+static const int kBlockRowsPerTask = 4;
+
+size_t TextureFormatBytes(TextureFormat format, int width, int height)
+{
+	size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+	switch (format)
+	{
+	case kTextureBC1: case kTextureBC4: return blocks * 8;
+	case kTextureBC3: case kTextureBC5: return blocks * 16;
+	default: return (size_t)width * height * 4;
+	}
+}
+
+int TextureMipLevels(int width, int height)
+{
+	int levels = 1;
+	while ((width >> levels) > 0 || (height >> levels) > 0)
+		levels++;
+	return levels;
+}
+
+size_t TextureMipChainBytes(TextureFormat format, int width, int height)
+{
+	size_t bytes = 0;
+	for (int level = 0; level < TextureMipLevels(width, height); level++)
+		bytes += TextureFormatBytes(format, TextureMipSize(width, level), TextureMipSize(height, level));
+	return bytes;
+}
+
+static inline uint16_t PackRGB565(const float c[3])
+{
+	int r = (int)(c[0] * 31.0f / 255.0f + 0.5f), g = (int)(c[1] * 63.0f / 255.0f + 0.5f), b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+	r = r < 0 ? 0 : (r > 31 ? 31 : r);
+	g = g < 0 ? 0 : (g > 63 ? 63 : g);
+	b = b < 0 ? 0 : (b > 31 ? 31 : b);
+	return (uint16_t)((r << 11) | (g << 5) | b);
+}
+
+static inline void UnpackRGB565(uint16_t c, int out[3])
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	out[0] = (r << 3) | (r >> 2);
+	out[1] = (g << 2) | (g >> 4);
+	out[2] = (b << 3) | (b >> 2);
+}
+
+// color indices of the 16 texels for the 4-color palette of c0 and c1, returns the squared error
+static int BC1Indices(const unsigned char texels[64], uint16_t c0, uint16_t c1, uint32_t& indices)
+{
+	int palette[4][3];
+	UnpackRGB565(c0, palette[0]);
+	UnpackRGB565(c1, palette[1]);
+	for (int k = 0; k < 3; k++)
+	{
+		palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+		palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+	}
+
+	int error = 0;
+	indices = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		int best = 0, bestDist = INT32_MAX;
+		for (int p = 0; p < 4; p++)
+		{
+			int dr = texels[i * 4 + 0] - palette[p][0], dg = texels[i * 4 + 1] - palette[p][1], db = texels[i * 4 + 2] - palette[p][2];
+			int dist = dr * dr + dg * dg + db * db;
+			if (dist < bestDist)
+			{
+				bestDist = dist;
+				best = p;
+			}
+		}
+		error += bestDist;
+		indices |= (uint32_t)best << (2 * i);
+	}
+	return error;
+}
+
+// endpoints minimizing the squared error for fixed indices, false if the system is singular (all indices equal)
+static bool RefineEndpoints(const unsigned char texels[64], uint32_t indices, float e0[3], float e1[3])
+{
+	static const float kWeights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++)
+	{
+		float a = kWeights[(indices >> (2 * i)) & 3], b = 1.0f - a;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int k = 0; k < 3; k++)
+		{
+			ax[k] += a * texels[i * 4 + k];
+			bx[k] += b * texels[i * 4 + k];
+		}
+	}
+
+	float det = aa * bb - ab * ab;
+	if (fabsf(det) < 1e-6f)
+		return false;
+	float invDet = 1.0f / det;
+	for (int k = 0; k < 3; k++)
+	{
+		e0[k] = (ax[k] * bb - bx[k] * ab) * invDet;
+		e1[k] = (bx[k] * aa - ax[k] * ab) * invDet;
+	}
+	return true;
+}
+
+// 4-color BC1 block (color0 > color1), also the color half of BC3 which always interpolates 4 colors.
+// the endpoints are the extremes along the principal axis of the colors, then refined once by least squares
+static void CompressBC1Block(const unsigned char texels[64], unsigned char out[8])
+{
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++)
+		for (int k = 0; k < 3; k++)
+			mean[k] += texels[i * 4 + k] / 16.0f;
+
+	float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; i++)
+	{
+		float d[3] = { texels[i * 4 + 0] - mean[0], texels[i * 4 + 1] - mean[1], texels[i * 4 + 2] - mean[2] };
+		cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+		cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+	}
+
+	// power iteration for the principal axis
+	float axis[3] = { 0.9f, 1.0f, 0.7f };
+	for (int iter = 0; iter < 4; iter++)
+	{
+		float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+		float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+		float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+		float len = fmaxf(fabsf(x), fmaxf(fabsf(y), fabsf(z)));
+		if (len < 1e-6f)
+			break;
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	int minIdx = 0, maxIdx = 0;
+	float minDot = FLT_MAX, maxDot = -FLT_MAX;
+	for (int i = 0; i < 16; i++)
+	{
+		float dot = texels[i * 4 + 0] * axis[0] + texels[i * 4 + 1] * axis[1] + texels[i * 4 + 2] * axis[2];
+		if (dot < minDot) { minDot = dot; minIdx = i; }
+		if (dot > maxDot) { maxDot = dot; maxIdx = i; }
+	}
+
+	float e0[3], e1[3];
+	for (int k = 0; k < 3; k++)
+	{
+		e0[k] = texels[maxIdx * 4 + k];
+		e1[k] = texels[minIdx * 4 + k];
+	}
+	uint16_t c0 = PackRGB565(e0), c1 = PackRGB565(e1);
+	uint32_t indices;
+	int error = BC1Indices(texels, c0, c1, indices);
+
+	if (error > 0 && RefineEndpoints(texels, indices, e0, e1))
+	{
+		uint16_t r0 = PackRGB565(e0), r1 = PackRGB565(e1);
+		uint32_t refinedIndices;
+		int refinedError = BC1Indices(texels, r0, r1, refinedIndices);
+		if (refinedError < error)
+		{
+			c0 = r0;
+			c1 = r1;
+			indices = refinedIndices;
+		}
+	}
+
+	// color0 > color1 selects the 4-color palette, swapping the endpoints swaps indices 0<->1 and 2<->3
+	if (c0 < c1)
+	{
+		uint16_t t = c0; c0 = c1; c1 = t;
+		indices ^= 0x55555555u;
+	}
+	else if (c0 == c1)
+		indices = 0;
+
+	out[0] = (unsigned char)(c0 & 0xff); out[1] = (unsigned char)(c0 >> 8);
+	out[2] = (unsigned char)(c1 & 0xff); out[3] = (unsigned char)(c1 >> 8);
+	for (int i = 0; i < 4; i++)
+		out[4 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// 8-value BC4 block of channel of the 16 RGBA texels, the endpoints are the extremes of the channel
+static void CompressBC4Block(const unsigned char texels[64], int channel, unsigned char out[8])
+{
+	int lo = 255, hi = 0;
+	for (int i = 0; i < 16; i++)
+	{
+		int v = texels[i * 4 + channel];
+		lo = v < lo ? v : lo;
+		hi = v > hi ? v : hi;
+	}
+
+	out[0] = (unsigned char)hi;
+	out[1] = (unsigned char)lo;
+	uint64_t indices = 0;
+	if (hi > lo)
+	{
+		// palette index 0 is hi, 1 is lo, 2..7 step from hi to lo in sevenths
+		static const int kOrder[8] = { 0, 2, 3, 4, 5, 6, 7, 1 };
+		for (int i = 0; i < 16; i++)
+		{
+			int v = texels[i * 4 + channel];
+			int step = ((hi - v) * 14 + (hi - lo)) / (2 * (hi - lo));
+			indices |= (uint64_t)kOrder[step] << (3 * i);
+		}
+	}
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+void CompressTexture(const unsigned char* rgba, int width, int height, TextureFormat format, unsigned char* blocks)
+{
+	const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	const size_t blockBytes = (format == kTextureBC3 || format == kTextureBC5) ? 16 : 8;
+
+	ParallelFor((blocksY + kBlockRowsPerTask - 1) / kBlockRowsPerTask, 1, [&](int task) {
+		int endY = task * kBlockRowsPerTask + kBlockRowsPerTask;
+		for (int by = task * kBlockRowsPerTask; by < endY && by < blocksY; by++)
+			for (int bx = 0; bx < blocksX; bx++)
+			{
+				unsigned char texels[64];
+				for (int y = 0; y < 4; y++)
+					for (int x = 0; x < 4; x++)
+					{
+						int sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+						int sy = by * 4 + y < height ? by * 4 + y : height - 1;
+						memcpy(&texels[(y * 4 + x) * 4], &rgba[((size_t)sy * width + sx) * 4], 4);
+					}
+
+				unsigned char* out = blocks + ((size_t)by * blocksX + bx) * blockBytes;
+				switch (format)
+				{
+				case kTextureBC1: CompressBC1Block(texels, out); break;
+				case kTextureBC3: CompressBC4Block(texels, 3, out); CompressBC1Block(texels, out + 8); break;
+				case kTextureBC4: CompressBC4Block(texels, 0, out); break;
+				case kTextureBC5: CompressBC4Block(texels, 0, out); CompressBC4Block(texels, 1, out + 8); break;
+				default: break;
+				}
+			}
+	});
+}
+
+NAMESPACE_END(nagi)
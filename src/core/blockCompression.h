@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include "logger.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// storage format of a texture class. the BC formats are the S3TC/RGTC 4x4 block formats:
+// BC1 RGB 4 bits per texel, BC3 RGBA 8 bits (BC4 alpha + BC1 color), BC4 R 4 bits, BC5 RG 8 bits
+enum TextureFormat
+{
+	kTextureRGBA8, kTextureBC1, kTextureBC3, kTextureBC4, kTextureBC5, kTextureFormatsNum
+};
+
+// bytes of a width x height image in format, partial blocks at the borders count as whole blocks
+size_t TextureFormatBytes(TextureFormat format, int width, int height);
+
+// levels of the full mip chain of a width x height image, every level halves the size down to 1 x 1
+int TextureMipLevels(int width, int height);
+// width and height of a mip level, at least 1
+inline int TextureMipSize(int size, int level) { return size >> level > 0 ? size >> level : 1; }
+// bytes of all levels of the mip chain
+size_t TextureMipChainBytes(TextureFormat format, int width, int height);
+
+// compress a width x height RGBA8 image into the blocks of format (not kTextureRGBA8), rows of blocks are
+// compressed in parallel. BC4 reads R and BC5 reads R and G. texels past the borders repeat the last row/column
+void CompressTexture(const unsigned char* rgba, int width, int height, TextureFormat format, unsigned char* blocks);
+
+NAMESPACE_END(nagi)
@@ -1,12 +1,15 @@
 #include "environmentMap.h"
+#include "parallel.h"
+#include "vector.h"
 #include "stb_image.h"
+#include <vector>
+#include <cmath>
 
 NAMESPACE_BEGIN(nagi)
 
 EnvironmentMap::~EnvironmentMap()
 {
 	stbi_image_free(img); 
-	delete[] cdf;
 }
 
 bool EnvironmentMap::LoadEnvMap(std::string & filename)
@@ -16,7 +19,7 @@ bool EnvironmentMap::LoadEnvMap(std::string & filename)
 	if (!img)
 		return false;
 
-	BuildCDF();
+	BuildAliasTable();
 
 	return true;
 }
@@ -28,25 +31,22 @@ float Luminance(float r, float g, float b)
 }
 
 // https://pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources#InfiniteAreaLights
-void EnvironmentMap::BuildCDF()
+// the weight of a pixel is its luminance times sin(theta) of its row, the solid angle the pixel covers.
+// instead of searching the marginal and conditional CDFs of PBRT, the pixels form one alias table sampled in O(1)
+void EnvironmentMap::BuildAliasTable()
 {
-	size_t pixels = width * height;
-	float* weights = new float[pixels];
-	for (int i = 0; i < height; i++)
-		for (int j = 0; j < width; j++)
+	std::vector<float> weights((size_t)width * height);
+	ParallelFor(height, 16, [&](int y) {
+		float sinTheta = sinf(PI * (y + 0.5f) / height);
+		for (int x = 0; x < width; x++)
 		{
-			size_t imgIdx = 3 * (i*width + j);
-			weights[i*width + j] = Luminance(img[imgIdx + 0], img[imgIdx + 1], img[imgIdx + 2]);
+			const float* pixel = img + 3 * ((size_t)y * width + x);
+			weights[(size_t)y * width + x] = Luminance(pixel[0], pixel[1], pixel[2]) * sinTheta;
 		}
+	});
 
-	cdf = new float[pixels];
-	cdf[0] = weights[0];
-	for (size_t i = 1; i < pixels; i++)
-		cdf[i] = cdf[i - 1] + weights[i];
-
-	totalSum = cdf[pixels - 1];
-	delete[] weights;
+	aliasTable.resize(weights.size());
+	totalSum = (float)nagi::BuildAliasTable(weights.data(), weights.size(), aliasTable.data());
 }
 
-
 NAMESPACE_END(nagi)
\ No newline at end of file
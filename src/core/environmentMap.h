@@ -1,22 +1,28 @@
 #pragma once
 #include <string>
-#include "logger.h"
+#include <vector>
+#include "aliasTable.h"
 
 NAMESPACE_BEGIN(nagi)
 
+// Y of the linear RGB color
+float Luminance(float r, float g, float b);
+
 class EnvironmentMap
 {
 public:
-	EnvironmentMap() :width(0), height(0), img(nullptr), cdf(nullptr) {}
+	EnvironmentMap() :width(0), height(0), totalSum(0.0f), img(nullptr) {}
 	~EnvironmentMap();
 
-	void BuildCDF();
+	void BuildAliasTable();
 	bool LoadEnvMap(std::string& filename);
 
 	int width, height;
+	// sum of the pixel weights, luminance times sin(theta) of the row
 	float totalSum;
 	float* img;
-	float* cdf;
+	// one column per pixel in row-major order, picks a pixel with probability weight / totalSum
+	std::vector<AliasEntry> aliasTable;
 };
 
 NAMESPACE_END(nagi)
\ No newline at end of file
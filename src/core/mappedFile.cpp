@@ -0,0 +1,102 @@
+#include "mappedFile.h"
+#include <cstring>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+NAMESPACE_BEGIN(nagi)
+
+#ifdef _WIN32
+MappedFile::MappedFile() :data(nullptr), size(0), fileHandle(INVALID_HANDLE_VALUE), mappingHandle(nullptr) {}
+#else
+MappedFile::MappedFile() :data(nullptr), size(0), fd(-1) {}
+#endif
+
+MappedFile::~MappedFile() { Close(); }
+
+bool MappedFile::Open(const std::string& filename)
+{
+	Close();
+#ifdef _WIN32
+	fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+							OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) { Close(); return false; }
+	size = (size_t)fileSize.QuadPart;
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mappingHandle) { Close(); return false; }
+	data = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!data) { Close(); return false; }
+#else
+	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	// empty files cannot be mapped
+	if (fstat(fd, &st) != 0 || st.st_size == 0) { Close(); return false; }
+	size = (size_t)st.st_size;
+	void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) { Close(); return false; }
+	data = (const uint8_t*)p;
+	// files are read front to back by the loaders
+	madvise(p, size, MADV_SEQUENTIAL);
+#endif
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (data) UnmapViewOfFile(data);
+	if (mappingHandle) CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (data) munmap((void*)data, size);
+	if (fd >= 0) close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+uint64_t HashBytes(const void* bytes, size_t size, uint64_t seed)
+{
+	const uint64_t kMul = 0x9E3779B97F4A7C15ull;
+	const uint8_t* p = (const uint8_t*)bytes;
+
+	// four independent lanes over 8-byte words, so the multiplies of consecutive words overlap
+	uint64_t lanes[4] = { seed ^ kMul, seed + kMul, seed ^ (kMul >> 1), seed - kMul };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+		for (int l = 0; l < 4; l++)
+		{
+			uint64_t w;
+			memcpy(&w, p + i + 8 * l, 8);
+			lanes[l] = (lanes[l] ^ w) * kMul;
+			lanes[l] ^= lanes[l] >> 32;
+		}
+
+	uint64_t h = (uint64_t)size * kMul;
+	for (int l = 0; l < 4; l++)
+	{
+		h = (h ^ lanes[l]) * kMul;
+		h ^= h >> 29;
+	}
+	// FNV-1a on the tail
+	for (; i < size; i++)
+		h = (h ^ p[i]) * 0x100000001B3ull;
+	h ^= h >> 32;
+	h *= kMul;
+	return h ^ (h >> 29);
+}
+
+NAMESPACE_END(nagi)
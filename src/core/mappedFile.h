@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include "logger.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// read-only memory mapping of a whole file, pages are read by the OS on first access
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::string& filename);
+	void Close();
+	bool IsOpen() const { return data != nullptr; }
+
+	const uint8_t* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	const uint8_t* data;
+	size_t size;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fd;
+#endif
+};
+
+// 64-bit hash of size bytes, used as content key of cache files, not suitable against malicious input
+uint64_t HashBytes(const void* bytes, size_t size, uint64_t seed = 0);
+
+NAMESPACE_END(nagi)
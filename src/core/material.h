@@ -14,7 +14,7 @@ public:
 		anisotropic = 0.0f;
 
 		emission = vec3f(0.0f, 0.0f, 0.0f);
-		// padding1
+		emissivePickScale = 0.0f;
 
 		metallic = 0.0f;
 		roughness = 0.5f;
@@ -49,7 +49,9 @@ public:
 	float anisotropic;
 
 	vec3f emission;
-	float padding1;
+	// set by Scene::CollectEmissiveTriangles: PI * L / total power of the emissive triangles, the probability
+	// per unit area that DirectLight samples a point on a triangle of this material
+	float emissivePickScale;
 
 	float metallic;
 	float roughness;
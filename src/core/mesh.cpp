@@ -1,98 +1,299 @@
-#define TINYOBJLOADER_IMPLEMENTATION
 #include "mesh.h"
-#include "tiny_obj_loader.h"
+#include "objLoader.h"
+#include "plyLoader.h"
 #include "bvh.h"
+#include "parallel.h"
+#include <cstring>
 
 NAMESPACE_BEGIN(nagi)
 
-Mesh::Mesh() :blasBVH(nullptr) {}
+// builder parameters of blasBVH other than splitMethod and splitBudget
+static const int kBLASMaxPrimsInNode = 1;
+static const int kBLASBuckets = 12;
+static const float kBLASTraversalCost = 1.0f;
+
+// the cache file is the mesh file name plus this suffix, laid out as
+// MeshCacheHeader, verticesUVX, normalsUVY, indices, blasBVH nodes, blasBVH orderedPrimsIndices
+static const char* kMeshCacheSuffix = ".nagicache";
+static const char kMeshCacheMagic[8] = "NAGIMSH";
+static const uint32_t kMeshCacheVersion = 2;
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;			// sizeof(LinearBVHNode) when written, guards against layout changes
+	uint64_t contentHash;
+	int32_t splitMethod;
+	int32_t maxPrimsInNode;
+	int32_t nBuckets;
+	float traversalCost;
+	float splitBudget;
+	uint32_t nodeCounts;
+	uint64_t verticesNum;
+	uint32_t primsIndicesNum;
+	uint32_t trianglesNum;
+};
+static_assert(sizeof(MeshCacheHeader) == 64, "keep the vertex arrays 16 byte aligned");
+static_assert(sizeof(vec4f) == 16 && sizeof(vec3i) == 12, "vertices and indices are stored raw");
+
+static size_t MeshCacheSize(const MeshCacheHeader& header)
+{
+	return sizeof(MeshCacheHeader) + 2 * header.verticesNum * sizeof(vec4f) + (size_t)header.trianglesNum * sizeof(vec3i)
+		+ (size_t)header.nodeCounts * sizeof(LinearBVHNode) + (size_t)header.primsIndicesNum * sizeof(uint32_t);
+}
+
+Mesh::Mesh() :blasBVH(nullptr), splitMethod(BVHAccel::SplitMethod::SAH), splitBudget(0.3f), contentHash(0), cacheable(false) {}
 Mesh::~Mesh() { if (blasBVH) delete blasBVH; }
 
 bool Mesh::LoadMesh(std::string& filename)
 {
 	name = filename;
-	tinyobj::attrib_t atrrib;
-	std::vector<tinyobj::shape_t> shapes;
+	MappedFile file;
+	if (!file.Open(filename))
+	{
+		printf("Cannot open mesh \"%s\" or it is empty\n", filename.c_str());
+		return false;
+	}
+	// the whole file is the key, so edits that keep its size and time stamp are detected too
+	contentHash = HashBytes(file.Data(), file.Size());
+	cacheable = true;
+	if (LoadCache())
+	{
+		printf("Mesh \"%s\" loaded from cache, %zu triangles\n", name.c_str(), indices.size());
+		return true;
+	}
+
 	std::string err;
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	if (ext == "ply" || ext == "PLY")
+	{
+		// PLY vertices are shared already, the faces index them directly
+		if (!ParsePLY((const char*)file.Data(), file.Size(), verticesUVX, normalsUVY, indices, err))
+		{
+			printf("ParsePLY Error: %s in \"%s\"\n", err.c_str(), filename.c_str());
+			return false;
+		}
+		printf("Mesh \"%s\": %zu triangles, %zu vertices\n", name.c_str(), indices.size(), verticesUVX.size());
+		return true;
+	}
 
-	// Ҫstd::vector<tinyobj::material_t> materials
-	if (!tinyobj::LoadObj(&atrrib, &shapes, NULL, &err, filename.c_str(), 0, true))
+	if (!ParseOBJ((const char*)file.Data(), file.Size(), verticesUVX, normalsUVY, err))
 	{
-		printf("tinyobj::LoadObj Error: %s\n", err.c_str());
+		printf("ParseOBJ Error: %s in \"%s\"\n", err.c_str(), filename.c_str());
 		return false;
 	}
 
-	// Loop over shapes
-	for (size_t s = 0; s < shapes.size(); s++)
+	WeldVertices();
+	return true;
+}
+
+void Mesh::WeldVertices()
+{
+	// open addressing over the welded vertices, keyed by the bits of position, normal and uv
+	const uint32_t cornersNum = (uint32_t)verticesUVX.size();
+	uint32_t capacity = 16;
+	while (capacity < cornersNum * 2) capacity <<= 1;
+	std::vector<uint32_t> table(capacity, UINT32_MAX);
+
+	// welded vertices are compacted in place, the first occurrence keeps its position in the file order
+	uint32_t uniqueNum = 0;
+	indices.resize(cornersNum / 3);
+	for (uint32_t i = 0; i < cornersNum; i++)
 	{
-		// Loop over faces(polygon)
-		size_t indexOffset = 0;
+		vec4f key[2] = { verticesUVX[i], normalsUVY[i] };
+		uint32_t slot = (uint32_t)HashBytes(key, sizeof(key)) & (capacity - 1);
+		while (table[slot] != UINT32_MAX &&
+			(memcmp(&verticesUVX[table[slot]], &key[0], sizeof(vec4f)) != 0 ||
+			 memcmp(&normalsUVY[table[slot]], &key[1], sizeof(vec4f)) != 0))
+			slot = (slot + 1) & (capacity - 1);
 
-		// ÿmeshface
-		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++)
+		if (table[slot] == UINT32_MAX)
 		{
-			std::vector<vec3f> facePoints;//洢ǰfaceж
-			for (size_t v = 0; v < 3; v++)
-			{
-				tinyobj::index_t idx = shapes[s].mesh.indices[indexOffset++];//indexOffset + v
-				tinyobj::real_t vx = atrrib.vertices[idx.vertex_index * 3 + 0];
-				tinyobj::real_t vy = atrrib.vertices[idx.vertex_index * 3 + 1];
-				tinyobj::real_t vz = atrrib.vertices[idx.vertex_index * 3 + 2];
-				facePoints.push_back(vec3f(vx, vy, vz));
-
-				// ȡ
-				tinyobj::real_t nx = 0, ny = 0, nz = 0;
-				if (!atrrib.normals.empty())	//objģûж㷨ߣshading normal
-				{
-					nx = atrrib.normals[idx.normal_index * 3 + 0];
-					ny = atrrib.normals[idx.normal_index * 3 + 1];
-					nz = atrrib.normals[idx.normal_index * 3 + 2];
-				}
+			table[slot] = uniqueNum;
+			verticesUVX[uniqueNum] = key[0];
+			normalsUVY[uniqueNum] = key[1];
+			uniqueNum++;
+		}
+		indices[i / 3][i % 3] = (int)table[slot];
+	}
 
-				// ȡuv
-				tinyobj::real_t tx, ty;
-				if (!atrrib.texcoords.empty())
-				{
-					tx = atrrib.texcoords[idx.texcoord_index * 2 + 0];
-					ty = 1.0f - atrrib.texcoords[idx.texcoord_index * 2 + 1];
-				}
-				else {	//objģûuv
-					if (v == 0) tx = ty = 0;
-					else if (v == 1) tx = 0, ty = 1;
-					else if (v == 2) tx = ty = 1;
-				}
+	printf("Mesh \"%s\": %zu triangles, %u unique of %u vertices\n", name.c_str(), indices.size(), uniqueNum, cornersNum);
+	verticesUVX.resize(uniqueNum);
+	normalsUVY.resize(uniqueNum);
+	verticesUVX.shrink_to_fit();
+	normalsUVY.shrink_to_fit();
+}
 
-				verticesUVX.push_back(vec4f(vx, vy, vz, tx));
-				normalsUVY.push_back(vec4f(nx, ny, nz, ty));
-			}
+bool Mesh::LoadCache()
+{
+	if (!cache.Open(name + kMeshCacheSuffix)) return false;
+	const MeshCacheHeader* header = (const MeshCacheHeader*)cache.Data();
+	// a stale or truncated cache is rebuilt and overwritten by BuildBVH
+	if (cache.Size() < sizeof(MeshCacheHeader) ||
+		memcmp(header->magic, kMeshCacheMagic, sizeof(kMeshCacheMagic)) != 0 ||
+		header->version != kMeshCacheVersion ||
+		header->nodeSize != sizeof(LinearBVHNode) ||
+		header->contentHash != contentHash ||
+		cache.Size() != MeshCacheSize(*header))
+	{
+		cache.Close();
+		return false;
+	}
 
-			if (atrrib.normals.empty())	//ûзߣֶ淨ߣgeometry normal
-			{
-				vec3f normal = Normalize(Cross(facePoints[2] - facePoints[0], facePoints[1] - facePoints[0]));
-				for (int v = indexOffset-3; v < indexOffset; v++)
-					normalsUVY[v] = vec4f(normal, normalsUVY[v].w);
-			}
+	const vec4f* vertices = (const vec4f*)(cache.Data() + sizeof(MeshCacheHeader));
+	verticesUVX.assign(vertices, vertices + header->verticesNum);
+	normalsUVY.assign(vertices + header->verticesNum, vertices + 2 * header->verticesNum);
+	const vec3i* triangles = (const vec3i*)(vertices + 2 * header->verticesNum);
+	indices.assign(triangles, triangles + header->trianglesNum);
+	return true;
+}
 
-			//indexOffset += 3;
-		}
+void Mesh::WriteCache()
+{
+	std::string cacheName = name + kMeshCacheSuffix;
+	FILE* fp = fopen(cacheName.c_str(), "wb");
+	if (!fp)
+	{
+		// e.g. a read-only asset directory, the mesh is parsed and built again next time
+		printf("Cannot write mesh cache \"%s\"\n", cacheName.c_str());
+		return;
 	}
 
-	return true;
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kMeshCacheMagic, sizeof(kMeshCacheMagic));
+	header.version = kMeshCacheVersion;
+	header.nodeSize = sizeof(LinearBVHNode);
+	header.contentHash = contentHash;
+	header.splitMethod = (int32_t)splitMethod;
+	header.maxPrimsInNode = kBLASMaxPrimsInNode;
+	header.nBuckets = kBLASBuckets;
+	header.traversalCost = kBLASTraversalCost;
+	header.splitBudget = splitBudget;
+	header.nodeCounts = blasBVH->nodeCounts;
+	header.verticesNum = verticesUVX.size();
+	header.primsIndicesNum = (uint32_t)blasBVH->orderedPrimsIndices.size();
+	header.trianglesNum = (uint32_t)indices.size();
+
+	bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(verticesUVX.data(), sizeof(vec4f), verticesUVX.size(), fp) == verticesUVX.size() &&
+		fwrite(normalsUVY.data(), sizeof(vec4f), normalsUVY.size(), fp) == normalsUVY.size() &&
+		fwrite(indices.data(), sizeof(vec3i), indices.size(), fp) == indices.size() &&
+		fwrite(blasBVH->nodes.data(), sizeof(LinearBVHNode), header.nodeCounts, fp) == header.nodeCounts &&
+		fwrite(blasBVH->orderedPrimsIndices.data(), sizeof(uint32_t), header.primsIndicesNum, fp) == header.primsIndicesNum;
+	fclose(fp);
+	if (!written)
+	{
+		printf("Cannot write mesh cache \"%s\"\n", cacheName.c_str());
+		remove(cacheName.c_str());
+	}
+}
+
+void Mesh::ComputeTriangleBounds(std::vector<bbox3f>& bounds)
+{
+	const uint32_t trianglesNum = (uint32_t)indices.size();
+	bounds.assign(trianglesNum, bbox3f());
+
+	ParallelFor((int)trianglesNum, 16 * 1024, [&](int i) {
+		bounds[i].grow(vec3f(verticesUVX[indices[i].x]));
+		bounds[i].grow(vec3f(verticesUVX[indices[i].y]));
+		bounds[i].grow(vec3f(verticesUVX[indices[i].z]));
+	});
 }
 
 void Mesh::BuildBVH()
 {
-	const uint32_t trianglesNum = verticesUVX.size() / 3;
-	std::vector<bbox3f> bounds(trianglesNum);
+	// BuildBVH also rebuilds a blasBVH whose refit degraded too much
+	if (blasBVH) delete blasBVH;
+	blasBVH = nullptr;
 
-#pragma omp parallel for
-	for (uint32_t i = 0; i < trianglesNum; i++)
+	if (cache.IsOpen())
 	{
-		bounds[i].grow(vec3f(verticesUVX[i * 3 + 0]));
-		bounds[i].grow(vec3f(verticesUVX[i * 3 + 1]));
-		bounds[i].grow(vec3f(verticesUVX[i * 3 + 2]));
+		// restore the cached tree if it was built with the same parameters
+		const MeshCacheHeader* header = (const MeshCacheHeader*)cache.Data();
+		if (header->splitMethod == (int32_t)splitMethod &&
+			header->maxPrimsInNode == kBLASMaxPrimsInNode &&
+			header->nBuckets == kBLASBuckets &&
+			header->traversalCost == kBLASTraversalCost &&
+			(splitMethod != BVHAccel::SplitMethod::SBVH || header->splitBudget == splitBudget))
+		{
+			const LinearBVHNode* nodes = (const LinearBVHNode*)(cache.Data() + sizeof(MeshCacheHeader)
+				+ 2 * header->verticesNum * sizeof(vec4f) + (size_t)header->trianglesNum * sizeof(vec3i));
+			const uint32_t* orderedPrimsIndices = (const uint32_t*)(nodes + header->nodeCounts);
+			blasBVH = new BVHAccel(nodes, header->nodeCounts, orderedPrimsIndices, header->primsIndicesNum,
+				kBLASMaxPrimsInNode, splitMethod, kBLASBuckets, kBLASTraversalCost, splitBudget);
+		}
+		// unmapped before WriteCache replaces the file below
+		cache.Close();
+		if (blasBVH) return;
 	}
-	blasBVH = new BVHAccel(bounds, 1, BVHAccel::SplitMethod::SAH, 12, 1.0f);
+
+	std::vector<bbox3f> bounds;
+	ComputeTriangleBounds(bounds);
+
+	// SBVH splits triangle references, clip the actual triangle instead of its bbox
+	BVHAccel::ClipFunc clipTriangle = nullptr;
+	if (splitMethod == BVHAccel::SplitMethod::SBVH)
+		clipTriangle = [this](uint32_t primitiveIdx, const bbox3f& box) {
+			const vec3i& tri = indices[primitiveIdx];
+			return ClipTriangleBounds(vec3f(verticesUVX[tri.x]), vec3f(verticesUVX[tri.y]), vec3f(verticesUVX[tri.z]), box);
+		};
+	blasBVH = new BVHAccel(bounds, kBLASMaxPrimsInNode, splitMethod, kBLASBuckets, kBLASTraversalCost, splitBudget, clipTriangle);
+	if (cacheable) WriteCache();
+}
+
+bool Mesh::RefitBVH(float maxCostRatio)
+{
+	cacheable = false;
+	std::vector<bbox3f> bounds;
+	ComputeTriangleBounds(bounds);
+	return blasBVH->Refit(bounds, maxCostRatio);
+}
+
+// bound of the part of triangle (v0, v1, v2) inside box,
+// Sutherland-Hodgman clipping of the triangle against the six planes of box
+bbox3f Mesh::ClipTriangleBounds(const vec3f& v0, const vec3f& v1, const vec3f& v2, const bbox3f& box)
+{
+	// every plane adds at most one vertex to a convex polygon (3 + 6), the rest is headroom for rounding
+	vec3f polygon[2][16];
+	polygon[0][0] = v0;
+	polygon[0][1] = v1;
+	polygon[0][2] = v2;
+	int n = 3, cur = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+		for (int side = 0; side < 2; side++)
+		{
+			float plane = side ? box.pMax[axis] : box.pMin[axis];
+			const vec3f* in = polygon[cur];
+			vec3f* out = polygon[cur ^ 1];
+			int m = 0;
+			for (int i = 0; i < n; i++)
+			{
+				const vec3f& a = in[i];
+				const vec3f& b = in[(i + 1) % n];
+				// >= 0 means inside the plane
+				float da = side ? plane - a[axis] : a[axis] - plane;
+				float db = side ? plane - b[axis] : b[axis] - plane;
+				if (da >= 0.0f)
+					out[m++] = a;
+				if (da * db < 0.0f)
+				{
+					vec3f p = a + (b - a) * (da / (da - db));
+					p[axis] = plane;
+					out[m++] = p;
+				}
+			}
+			n = m;
+			cur ^= 1;
+			if (n == 0) return bbox3f();
+		}
+
+	bbox3f bound;
+	for (int i = 0; i < n; i++)
+		bound.grow(polygon[cur][i]);
+	return bound;
 }
 
 
@@ -2,31 +2,58 @@
 #include <string>
 #include <vector>
 #include "matrix.h"
+#include "bvh.h"
+#include "mappedFile.h"
 
 NAMESPACE_BEGIN(nagi)
 
-class BVHAccel;
-
 class Mesh
 {
 public:
 	Mesh();
 	~Mesh();
 
+	// OBJ files are parsed by ParseOBJ and PLY files by ParsePLY, vertices and blasBVH are read back from
+	// the cache file next to the mesh instead when its content did not change
 	bool LoadMesh(std::string& filename);
 	void BuildBVH();
+	// refit blasBVH to the current verticesUVX, false if it should be rebuilt, see BVHAccel::Refit.
+	// the mesh no longer matches its file afterwards, so BuildBVH stops writing the cache
+	bool RefitBVH(float maxCostRatio);
+	static bbox3f ClipTriangleBounds(const vec3f& v0, const vec3f& v1, const vec3f& v2, const bbox3f& box);
+	// merge the three vertices emitted per triangle (by LoadMesh or an importer) by (position, normal, uv) and build indices
+	void WeldVertices();
 
 	BVHAccel* blasBVH;
+	// builder used for blasBVH, selected per mesh by "bvhSplitMethod" in the scene file
+	BVHAccel::SplitMethod splitMethod;
+	// extra references SBVH may create, as a fraction of the triangle count ("bvhSplitBudget")
+	float splitBudget;
 	std::string name;
 	std::vector<vec4f> verticesUVX;// Vertex + texture Coord (u/s)
 	std::vector<vec4f> normalsUVY;  // Normal + texture Coord (v/t)
+	// vertex indices of every triangle, verticesUVX and normalsUVY hold unique vertices only
+	std::vector<vec3i> indices;
+	// HashBytes of the mesh file, key of the cache file
+	uint64_t contentHash;
+
+private:
+	void ComputeTriangleBounds(std::vector<bbox3f>& bounds);
+	bool LoadCache();
+	void WriteCache();
+
+	// cache file mapped by LoadCache after LoadMesh hashed the mesh file,
+	// its blasBVH is used by BuildBVH if the builder parameters match
+	MappedFile cache;
+	// verticesUVX still match the file hashed into contentHash
+	bool cacheable;
 };
 
 
 class MeshInstance
 {
 public:
-	MeshInstance() :meshID(-1), materialID(0), name("none") {}
+	MeshInstance() :meshID(-1), materialID(0), name("none"), dirty(false) {}
 	~MeshInstance() {}
 
 	int meshID;
@@ -34,6 +61,8 @@ public:
 
 	mat4 transform;
 	std::string name;
+	// set after editing transform, Scene::UpdateInstances refits the tlasBVH for it and clears it
+	bool dirty;
 };
 
 NAMESPACE_END(nagi)
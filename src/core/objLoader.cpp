@@ -0,0 +1,340 @@
+#include "objLoader.h"
+#include "parallel.h"
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+NAMESPACE_BEGIN(nagi)
+
+// chunks are cut at the first line break behind every multiple of this size
+static const size_t kOBJChunkBytes = 4 << 20;
+
+// 0-based indices into the whole file, -1 if the corner has no uv/normal
+struct OBJCorner
+{
+	int v, vt, vn;
+};
+
+struct OBJChunk
+{
+	const char* begin;
+	const char* end;
+	// counted by the first pass, the bases are their prefix sums over the previous chunks
+	uint32_t positionsNum, texcoordsNum, normalsNum;
+	uint32_t positionsBase, texcoordsBase, normalsBase;
+	// three corners per triangle
+	std::vector<OBJCorner> triangles;
+	uint32_t trianglesBase;
+	const char* error;
+};
+
+enum OBJLineType { OBJ_OTHER, OBJ_POSITION, OBJ_TEXCOORD, OBJ_NORMAL, OBJ_FACE };
+
+static inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && IsSpace(*p)) p++;
+	return p;
+}
+
+static inline const char* NextLine(const char* p, const char* end)
+{
+	const char* n = (const char*)memchr(p, '\n', end - p);
+	return n ? n + 1 : end;
+}
+
+// p points to the first non-space character of a line, it is moved behind the keyword
+static inline OBJLineType LineType(const char*& p, const char* end)
+{
+	if (p + 1 >= end) return OBJ_OTHER;
+	if (p[0] == 'v')
+	{
+		if (IsSpace(p[1])) { p += 1; return OBJ_POSITION; }
+		if (p + 2 < end && IsSpace(p[2]))
+		{
+			if (p[1] == 't') { p += 2; return OBJ_TEXCOORD; }
+			if (p[1] == 'n') { p += 2; return OBJ_NORMAL; }
+		}
+	}
+	else if (p[0] == 'f' && IsSpace(p[1]))
+	{
+		p += 1;
+		return OBJ_FACE;
+	}
+	return OBJ_OTHER;
+}
+
+static inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// decimal float without locale or NUL terminator, rare spellings (inf, nan, hex) go through strtod
+static const char* ParseFloat(const char* p, const char* end, float& value)
+{
+	static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+									1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	p = SkipSpaces(p, end);
+	const char* start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	// up to 19 significant digits fit in the mantissa, the rest only moves the exponent
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	bool anyDigit = false;
+	for (; p < end && IsDigit(*p); p++)
+	{
+		anyDigit = true;
+		if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if (mantissa) digits++; }
+		else exponent++;
+	}
+	if (p < end && *p == '.')
+		for (p++; p < end && IsDigit(*p); p++)
+		{
+			anyDigit = true;
+			if (digits < 19) { mantissa = mantissa * 10 + (*p - '0'); if (mantissa) digits++; exponent--; }
+		}
+
+	if (!anyDigit)
+	{
+		char buffer[64];
+		size_t n = 0;
+		for (const char* q = start; q < end && !IsSpace(*q) && *q != '\n' && n < sizeof(buffer) - 1; q++)
+			buffer[n++] = *q;
+		buffer[n] = '\0';
+		char* parsedEnd;
+		value = (float)strtod(buffer, &parsedEnd);
+		return start + (parsedEnd - buffer);
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		const char* q = p + 1;
+		bool negativeExp = false;
+		if (q < end && (*q == '-' || *q == '+')) negativeExp = *q++ == '-';
+		if (q < end && IsDigit(*q))
+		{
+			int e = 0;
+			for (; q < end && IsDigit(*q); q++)
+				if (e < 10000) e = e * 10 + (*q - '0');
+			exponent += negativeExp ? -e : e;
+			p = q;
+		}
+	}
+
+	double v = (double)mantissa;
+	if (exponent < 0)
+		v = exponent >= -22 ? v / kPow10[-exponent] : v * std::pow(10.0, exponent);
+	else if (exponent > 0)
+		v = exponent <= 22 ? v * kPow10[exponent] : v * std::pow(10.0, exponent);
+	value = (float)(negative ? -v : v);
+	return p;
+}
+
+static inline const char* ParseInt(const char* p, const char* end, int& value, bool& valid)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	valid = p < end && IsDigit(*p);
+	int v = 0;
+	for (; p < end && IsDigit(*p); p++)
+		v = v * 10 + (*p - '0');
+	value = negative ? -v : v;
+	return p;
+}
+
+// OBJ indices are 1-based, negative ones count back from the current element, 0 is invalid
+static inline bool ResolveIndex(int idx, uint32_t seen, uint32_t total, int& resolved)
+{
+	int64_t i = idx > 0 ? (int64_t)idx - 1 : (int64_t)seen + idx;
+	if (idx == 0 || i < 0 || i >= (int64_t)total) return false;
+	resolved = (int)i;
+	return true;
+}
+
+static void CountChunk(OBJChunk& chunk)
+{
+	chunk.positionsNum = chunk.texcoordsNum = chunk.normalsNum = 0;
+	for (const char* line = chunk.begin; line < chunk.end; line = NextLine(line, chunk.end))
+	{
+		const char* p = SkipSpaces(line, chunk.end);
+		switch (LineType(p, chunk.end))
+		{
+		case OBJ_POSITION: chunk.positionsNum++; break;
+		case OBJ_TEXCOORD: chunk.texcoordsNum++; break;
+		case OBJ_NORMAL: chunk.normalsNum++; break;
+		default: break;
+		}
+	}
+}
+
+static void ParseChunk(OBJChunk& chunk, std::vector<vec3f>& positions, std::vector<vec2f>& texcoords,
+						std::vector<vec3f>& normals)
+{
+	uint32_t positionsSeen = chunk.positionsBase;
+	uint32_t texcoordsSeen = chunk.texcoordsBase;
+	uint32_t normalsSeen = chunk.normalsBase;
+	// corners of the current polygon, reused for every face
+	std::vector<OBJCorner> polygon;
+
+	for (const char* line = chunk.begin; line < chunk.end; line = NextLine(line, chunk.end))
+	{
+		const char* p = SkipSpaces(line, chunk.end);
+		const char* lineEnd = (const char*)memchr(p, '\n', chunk.end - p);
+		if (!lineEnd) lineEnd = chunk.end;
+
+		switch (LineType(p, lineEnd))
+		{
+		case OBJ_POSITION:
+		{
+			vec3f& v = positions[positionsSeen++];
+			p = ParseFloat(p, lineEnd, v.x);
+			p = ParseFloat(p, lineEnd, v.y);
+			ParseFloat(p, lineEnd, v.z);
+			break;
+		}
+		case OBJ_TEXCOORD:
+		{
+			vec2f& t = texcoords[texcoordsSeen++];
+			p = ParseFloat(p, lineEnd, t.x);
+			ParseFloat(p, lineEnd, t.y);
+			break;
+		}
+		case OBJ_NORMAL:
+		{
+			vec3f& n = normals[normalsSeen++];
+			p = ParseFloat(p, lineEnd, n.x);
+			p = ParseFloat(p, lineEnd, n.y);
+			ParseFloat(p, lineEnd, n.z);
+			break;
+		}
+		case OBJ_FACE:
+		{
+			// v, v/vt, v//vn or v/vt/vn
+			polygon.clear();
+			bool valid = true;
+			for (p = SkipSpaces(p, lineEnd); p < lineEnd && *p != '#'; p = SkipSpaces(p, lineEnd))
+			{
+				OBJCorner corner = { -1, -1, -1 };
+				int idx;
+				bool parsed;
+				p = ParseInt(p, lineEnd, idx, parsed);
+				valid &= parsed && ResolveIndex(idx, positionsSeen, (uint32_t)positions.size(), corner.v);
+				if (p < lineEnd && *p == '/')
+				{
+					p = ParseInt(p + 1, lineEnd, idx, parsed);
+					if (parsed) valid &= ResolveIndex(idx, texcoordsSeen, (uint32_t)texcoords.size(), corner.vt);
+					if (p < lineEnd && *p == '/')
+					{
+						p = ParseInt(p + 1, lineEnd, idx, parsed);
+						if (parsed) valid &= ResolveIndex(idx, normalsSeen, (uint32_t)normals.size(), corner.vn);
+					}
+				}
+				// skip whatever is left of a malformed corner
+				while (p < lineEnd && !IsSpace(*p)) p++;
+				polygon.push_back(corner);
+			}
+			if (!valid)
+			{
+				chunk.error = "face index out of range";
+				break;
+			}
+			// fan triangulation
+			for (size_t k = 2; k < polygon.size(); k++)
+			{
+				chunk.triangles.push_back(polygon[0]);
+				chunk.triangles.push_back(polygon[k - 1]);
+				chunk.triangles.push_back(polygon[k]);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+bool ParseOBJ(const char* data, size_t size, std::vector<vec4f>& verticesUVX, std::vector<vec4f>& normalsUVY, std::string& err)
+{
+	// cut line-aligned chunks
+	std::vector<OBJChunk> chunks;
+	for (const char* begin = data, *end = data + size; begin < end;)
+	{
+		const char* chunkEnd = (size_t)(end - begin) > kOBJChunkBytes ? NextLine(begin + kOBJChunkBytes, end) : end;
+		OBJChunk chunk;
+		chunk.begin = begin;
+		chunk.end = chunkEnd;
+		chunk.error = nullptr;
+		chunks.push_back(chunk);
+		begin = chunkEnd;
+	}
+	const int chunksNum = (int)chunks.size();
+
+	// first pass counts the elements of every chunk, so the second pass knows where to store them
+	// and can resolve the indices of faces referencing elements of earlier chunks
+	ParallelFor(chunksNum, 1, [&](int i) { CountChunk(chunks[i]); });
+	uint32_t positionsNum = 0, texcoordsNum = 0, normalsNum = 0;
+	for (OBJChunk& chunk : chunks)
+	{
+		chunk.positionsBase = positionsNum;
+		chunk.texcoordsBase = texcoordsNum;
+		chunk.normalsBase = normalsNum;
+		positionsNum += chunk.positionsNum;
+		texcoordsNum += chunk.texcoordsNum;
+		normalsNum += chunk.normalsNum;
+	}
+
+	std::vector<vec3f> positions(positionsNum), normals(normalsNum);
+	std::vector<vec2f> texcoords(texcoordsNum);
+	ParallelFor(chunksNum, 1, [&](int i) { ParseChunk(chunks[i], positions, texcoords, normals); });
+
+	uint32_t trianglesNum = 0;
+	for (OBJChunk& chunk : chunks)
+	{
+		if (chunk.error)
+		{
+			err = chunk.error;
+			return false;
+		}
+		chunk.trianglesBase = trianglesNum;
+		trianglesNum += (uint32_t)chunk.triangles.size() / 3;
+	}
+
+	// expand the triangles into three vertices each
+	verticesUVX.resize((size_t)trianglesNum * 3);
+	normalsUVY.resize((size_t)trianglesNum * 3);
+	ParallelFor(chunksNum, 1, [&](int c) {
+		const OBJChunk& chunk = chunks[c];
+		ParallelFor((int)chunk.triangles.size() / 3, 16 * 1024, [&](int t) {
+			const OBJCorner* corners = &chunk.triangles[(size_t)t * 3];
+			size_t first = ((size_t)chunk.trianglesBase + t) * 3;
+
+			// 没有法线，则手动计算面法线（geometry normal）
+			bool hasNormals = corners[0].vn >= 0 && corners[1].vn >= 0 && corners[2].vn >= 0;
+			vec3f faceNormal;
+			if (!hasNormals)
+			{
+				const vec3f& p0 = positions[corners[0].v];
+				faceNormal = Normalize(Cross(positions[corners[2].v] - p0, positions[corners[1].v] - p0));
+			}
+
+			for (int v = 0; v < 3; v++)
+			{
+				const OBJCorner& corner = corners[v];
+				// 部分obj模型没有uv
+				float tx = (v == 2) ? 1.0f : 0.0f, ty = (v == 0) ? 0.0f : 1.0f;
+				if (corner.vt >= 0)
+				{
+					tx = texcoords[corner.vt].x;
+					ty = 1.0f - texcoords[corner.vt].y;
+				}
+				vec3f normal = hasNormals ? normals[corner.vn] : faceNormal;
+				verticesUVX[first + v] = vec4f(positions[corner.v], tx);
+				normalsUVY[first + v] = vec4f(normal, ty);
+			}
+		});
+	});
+
+	return true;
+}
+
+NAMESPACE_END(nagi)
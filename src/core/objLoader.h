@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "vector.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// Wavefront OBJ parser over a file mapped into memory. The file is split into line-aligned chunks
+// that are parsed in parallel, only positions, uvs, normals and faces are read.
+// Polygons are fan-triangulated and every triangle gets three vertices of its own, like Mesh::LoadMesh expects:
+// uv v is flipped to 1-v, corners without uv get (0,0), (0,1), (1,1) and triangles without normals the face normal
+bool ParseOBJ(const char* data, size_t size, std::vector<vec4f>& verticesUVX, std::vector<vec4f>& normalsUVY, std::string& err);
+
+NAMESPACE_END(nagi)
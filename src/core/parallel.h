@@ -0,0 +1,46 @@
+#pragma once
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "logger.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// Run func on one thread of a parallel team so that it can fork OpenMP tasks.
+// Inside an existing parallel region (e.g. a task spawned by Scene::CreateBLAS) the enclosing team is reused,
+// so nested builds share the same threads instead of being serialized by a nested parallel region.
+template <typename Func>
+void ParallelTasks(const Func& func)
+{
+#ifdef _OPENMP
+	if (!omp_in_parallel())
+	{
+		const Func* f = &func;
+#pragma omp parallel firstprivate(f)
+#pragma omp single
+		(*f)();
+		return;
+	}
+#endif
+	func();
+}
+
+// Run func(i) for i in [0, count), every chunkSize iterations form one task, and wait for all of them
+template <typename Func>
+void ParallelFor(int count, int chunkSize, const Func& func)
+{
+	ParallelTasks([&]() {
+		const Func* f = &func;
+		for (int begin = 0; begin < count; begin += chunkSize)
+		{
+			int end = std::min(begin + chunkSize, count);
+#pragma omp task firstprivate(f, begin, end)
+			for (int i = begin; i < end; i++)
+				(*f)(i);
+		}
+#pragma omp taskwait
+	});
+}
+
+NAMESPACE_END(nagi)
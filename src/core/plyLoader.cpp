@@ -0,0 +1,527 @@
+#include "plyLoader.h"
+#include "parallel.h"
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+
+NAMESPACE_BEGIN(nagi)
+
+// binary face rows are parsed in parallel chunks of this many rows
+static const size_t kPLYFaceChunkRows = 64 * 1024;
+
+enum PLYFormat { PLY_ASCII, PLY_BINARY_LE, PLY_BINARY_BE };
+enum PLYType { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64 };
+
+// vertex properties read into the mesh
+enum PLYVertexSlot { PLY_X, PLY_Y, PLY_Z, PLY_NX, PLY_NY, PLY_NZ, PLY_U, PLY_V, PLY_SLOTS };
+
+struct PLYProperty
+{
+	std::string name;
+	PLYType type;		// item type for lists
+	PLYType countType;	// PLY_NONE for scalars
+	size_t offset;		// offset in a row of fixed size
+};
+
+struct PLYElement
+{
+	std::string name;
+	size_t count;
+	std::vector<PLYProperty> properties;
+	// bytes per binary row, 0 if the row contains a list
+	size_t stride;
+};
+
+// a run of binary face rows, found by a serial scan that only reads the list counts
+struct PLYFaceChunk
+{
+	const char* begin;
+	size_t rows;
+	size_t trianglesBase;
+};
+
+static const size_t kPLYTypeSize[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static PLYType ParseType(const std::string& s)
+{
+	if (s == "char" || s == "int8") return PLY_INT8;
+	if (s == "uchar" || s == "uint8") return PLY_UINT8;
+	if (s == "short" || s == "int16") return PLY_INT16;
+	if (s == "ushort" || s == "uint16") return PLY_UINT16;
+	if (s == "int" || s == "int32") return PLY_INT32;
+	if (s == "uint" || s == "uint32") return PLY_UINT32;
+	if (s == "float" || s == "float32") return PLY_FLOAT32;
+	if (s == "double" || s == "float64") return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+template <typename T>
+static inline T LoadBinary(const char* p, bool swap)
+{
+	T value;
+	if (!swap)
+		memcpy(&value, p, sizeof(T));
+	else {
+		char bytes[sizeof(T)];
+		for (size_t i = 0; i < sizeof(T); i++)
+			bytes[i] = p[sizeof(T) - 1 - i];
+		memcpy(&value, bytes, sizeof(T));
+	}
+	return value;
+}
+
+static inline double ReadBinary(const char* p, PLYType type, bool swap)
+{
+	switch (type)
+	{
+	case PLY_INT8: return (double)*(const int8_t*)p;
+	case PLY_UINT8: return (double)*(const uint8_t*)p;
+	case PLY_INT16: return (double)LoadBinary<int16_t>(p, swap);
+	case PLY_UINT16: return (double)LoadBinary<uint16_t>(p, swap);
+	case PLY_INT32: return (double)LoadBinary<int32_t>(p, swap);
+	case PLY_UINT32: return (double)LoadBinary<uint32_t>(p, swap);
+	case PLY_FLOAT32: return (double)LoadBinary<float>(p, swap);
+	case PLY_FLOAT64: return LoadBinary<double>(p, swap);
+	default: return 0.0;
+	}
+}
+
+// integer list items and counts, read without going through double
+static inline int64_t ReadBinaryInt(const char* p, PLYType type, bool swap)
+{
+	switch (type)
+	{
+	case PLY_INT8: return *(const int8_t*)p;
+	case PLY_UINT8: return *(const uint8_t*)p;
+	case PLY_INT16: return LoadBinary<int16_t>(p, swap);
+	case PLY_UINT16: return LoadBinary<uint16_t>(p, swap);
+	case PLY_INT32: return LoadBinary<int32_t>(p, swap);
+	case PLY_UINT32: return LoadBinary<uint32_t>(p, swap);
+	default: return (int64_t)ReadBinary(p, type, swap);
+	}
+}
+
+// size of the binary row at p, 0 if it runs past end
+static size_t BinaryRowSize(const char* p, const char* end, const PLYElement& element, bool swap)
+{
+	if (element.stride)
+		return (size_t)(end - p) >= element.stride ? element.stride : 0;
+
+	size_t size = 0;
+	for (const PLYProperty& prop : element.properties)
+	{
+		if (prop.countType == PLY_NONE)
+			size += kPLYTypeSize[prop.type];
+		else {
+			if ((size_t)(end - p) < size + kPLYTypeSize[prop.countType])
+				return 0;
+			int64_t n = ReadBinaryInt(p + size, prop.countType, swap);
+			if (n < 0)
+				return 0;
+			size += kPLYTypeSize[prop.countType] + (size_t)n * kPLYTypeSize[prop.type];
+		}
+		if ((size_t)(end - p) < size)
+			return 0;
+	}
+	return size;
+}
+
+// whitespace separated tokens of the ascii body
+struct PLYAsciiReader
+{
+	const char* p;
+	const char* end;
+
+	bool Next(double& value)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+		const char* start = p;
+		while (p < end && !(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+		// the mapping is not NUL terminated, strtod gets a copy
+		char token[64];
+		size_t len = (size_t)(p - start);
+		if (len == 0 || len >= sizeof(token))
+			return false;
+		memcpy(token, start, len);
+		token[len] = 0;
+		char* tokenEnd;
+		value = strtod(token, &tokenEnd);
+		return tokenEnd == token + len;
+	}
+};
+
+static bool ParseHeader(const char*& p, const char* end, PLYFormat& format, std::vector<PLYElement>& elements, std::string& err)
+{
+	if (end - p < 4 || memcmp(p, "ply", 3) != 0 || (p[3] != '\n' && p[3] != '\r'))
+	{
+		err = "missing \"ply\" magic";
+		return false;
+	}
+
+	bool hasFormat = false;
+	while (p < end)
+	{
+		const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+		if (!lineEnd)
+			break;
+		std::string line(p, lineEnd);
+		p = lineEnd + 1;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		char word[4][64] = {};
+		int n = sscanf(line.c_str(), "%63s %63s %63s %63s", word[0], word[1], word[2], word[3]);
+		if (n <= 0)
+			continue;
+		std::string keyword = word[0];
+
+		if (keyword == "end_header")
+		{
+			if (!hasFormat)
+			{
+				err = "missing format line";
+				return false;
+			}
+			return true;
+		}
+		else if (keyword == "format" && n >= 2)
+		{
+			std::string f = word[1];
+			if (f == "ascii") format = PLY_ASCII;
+			else if (f == "binary_little_endian") format = PLY_BINARY_LE;
+			else if (f == "binary_big_endian") format = PLY_BINARY_BE;
+			else {
+				err = "unknown format \"" + f + "\"";
+				return false;
+			}
+			hasFormat = true;
+		}
+		else if (keyword == "element" && n >= 3)
+		{
+			PLYElement element;
+			element.name = word[1];
+			element.count = (size_t)strtoull(word[2], nullptr, 10);
+			element.stride = 0;
+			elements.push_back(element);
+		}
+		else if (keyword == "property" && n >= 3)
+		{
+			if (elements.empty())
+			{
+				err = "property outside of an element";
+				return false;
+			}
+			PLYProperty prop;
+			if (std::string(word[1]) == "list" && n >= 4)
+			{
+				char itemName[64] = {};
+				sscanf(line.c_str(), "%*s %*s %*s %*s %63s", itemName);
+				prop.countType = ParseType(word[2]);
+				prop.type = ParseType(word[3]);
+				prop.name = itemName;
+				if (prop.countType == PLY_NONE || prop.type == PLY_NONE)
+				{
+					err = "unknown list type in \"" + line + "\"";
+					return false;
+				}
+			}
+			else {
+				prop.countType = PLY_NONE;
+				prop.type = ParseType(word[1]);
+				prop.name = word[2];
+				if (prop.type == PLY_NONE)
+				{
+					err = "unknown property type in \"" + line + "\"";
+					return false;
+				}
+			}
+			elements.back().properties.push_back(prop);
+		}
+		// comment, obj_info and unknown lines are ignored
+	}
+
+	err = "missing end_header";
+	return false;
+}
+
+static int VertexSlot(const std::string& name)
+{
+	if (name == "x") return PLY_X;
+	if (name == "y") return PLY_Y;
+	if (name == "z") return PLY_Z;
+	if (name == "nx") return PLY_NX;
+	if (name == "ny") return PLY_NY;
+	if (name == "nz") return PLY_NZ;
+	if (name == "u" || name == "s" || name == "texture_u" || name == "texture_s") return PLY_U;
+	if (name == "v" || name == "t" || name == "texture_v" || name == "texture_t") return PLY_V;
+	return -1;
+}
+
+static inline void StoreVertex(const double* values, bool hasUV, size_t i, std::vector<vec4f>& verticesUVX, std::vector<vec4f>& normalsUVY)
+{
+	verticesUVX[i] = vec4f((float)values[PLY_X], (float)values[PLY_Y], (float)values[PLY_Z], (float)values[PLY_U]);
+	normalsUVY[i] = vec4f((float)values[PLY_NX], (float)values[PLY_NY], (float)values[PLY_NZ], hasUV ? 1.0f - (float)values[PLY_V] : 0.0f);
+}
+
+bool ParsePLY(const char* data, size_t size, std::vector<vec4f>& verticesUVX, std::vector<vec4f>& normalsUVY,
+	std::vector<vec3i>& indices, std::string& err)
+{
+	const char* p = data;
+	const char* end = data + size;
+	PLYFormat format = PLY_ASCII;
+	std::vector<PLYElement> elements;
+	if (!ParseHeader(p, end, format, elements, err))
+		return false;
+	const bool swap = format == PLY_BINARY_BE;
+
+	// row layout of every element
+	int vertexElement = -1, faceElement = -1, faceList = -1;
+	int slots[PLY_SLOTS];
+	for (int s = 0; s < PLY_SLOTS; s++) slots[s] = -1;
+	for (size_t e = 0; e < elements.size(); e++)
+	{
+		PLYElement& element = elements[e];
+		size_t offset = 0;
+		bool fixed = true;
+		for (PLYProperty& prop : element.properties)
+		{
+			prop.offset = offset;
+			offset += kPLYTypeSize[prop.type];
+			fixed = fixed && prop.countType == PLY_NONE;
+		}
+		element.stride = fixed ? offset : 0;
+
+		if (element.name == "vertex" && vertexElement < 0)
+		{
+			vertexElement = (int)e;
+			for (size_t i = 0; i < element.properties.size(); i++)
+			{
+				int slot = VertexSlot(element.properties[i].name);
+				if (slot >= 0 && element.properties[i].countType == PLY_NONE)
+					slots[slot] = (int)i;
+			}
+		}
+		else if (element.name == "face" && faceElement < 0)
+		{
+			faceElement = (int)e;
+			for (size_t i = 0; i < element.properties.size(); i++)
+				if (element.properties[i].countType != PLY_NONE &&
+					(element.properties[i].name == "vertex_indices" || element.properties[i].name == "vertex_index"))
+					faceList = (int)i;
+		}
+	}
+	if (vertexElement < 0 || slots[PLY_X] < 0 || slots[PLY_Y] < 0 || slots[PLY_Z] < 0)
+	{
+		err = "no vertex element with x, y and z";
+		return false;
+	}
+	if (faceElement < 0 || faceList < 0)
+	{
+		err = "no face element with vertex_indices";
+		return false;
+	}
+	if (elements[vertexElement].count > (size_t)INT32_MAX)
+	{
+		err = "too many vertices";
+		return false;
+	}
+
+	const size_t verticesNum = elements[vertexElement].count;
+	const bool hasNormals = slots[PLY_NX] >= 0 && slots[PLY_NY] >= 0 && slots[PLY_NZ] >= 0;
+	const bool hasUV = slots[PLY_U] >= 0 && slots[PLY_V] >= 0;
+	verticesUVX.resize(verticesNum);
+	normalsUVY.resize(verticesNum);
+	indices.clear();
+
+	for (size_t e = 0; e < elements.size(); e++)
+	{
+		const PLYElement& element = elements[e];
+
+		if (format == PLY_ASCII)
+		{
+			PLYAsciiReader reader = { p, end };
+			std::vector<double> row(element.properties.size());
+			for (size_t r = 0; r < element.count; r++)
+			{
+				double values[PLY_SLOTS] = {};
+				for (size_t i = 0; i < element.properties.size(); i++)
+				{
+					const PLYProperty& prop = element.properties[i];
+					double n;
+					if (!reader.Next(n))
+					{
+						err = "bad ascii value in element \"" + element.name + "\"";
+						return false;
+					}
+					if (prop.countType == PLY_NONE)
+					{
+						row[i] = n;
+						continue;
+					}
+
+					// lists: only the vertex indices of faces are kept
+					std::vector<int> corners((size_t)std::max(n, 0.0));
+					for (size_t k = 0; k < corners.size(); k++)
+					{
+						double idx;
+						if (!reader.Next(idx))
+						{
+							err = "bad ascii list in element \"" + element.name + "\"";
+							return false;
+						}
+						corners[k] = (int)idx;
+					}
+					if ((int)e == faceElement && (int)i == faceList)
+						for (size_t k = 2; k < corners.size(); k++)
+							indices.push_back(vec3i(corners[0], corners[k - 1], corners[k]));
+				}
+				if ((int)e == vertexElement)
+				{
+					for (int s = 0; s < PLY_SLOTS; s++)
+						if (slots[s] >= 0) values[s] = row[slots[s]];
+					StoreVertex(values, hasUV, r, verticesUVX, normalsUVY);
+				}
+			}
+			p = reader.p;
+		}
+		else if ((int)e == vertexElement)
+		{
+			// the vertex rows have a fixed size, every row is read straight into the mesh arrays
+			if (!element.stride || (size_t)(end - p) / element.stride < element.count)
+			{
+				err = element.stride ? "vertex data is truncated" : "list properties in vertices are not supported";
+				return false;
+			}
+			const char* rows = p;
+			ParallelFor((int)verticesNum, 64 * 1024, [&](int r) {
+				const char* row = rows + (size_t)r * element.stride;
+				double values[PLY_SLOTS] = {};
+				for (int s = 0; s < PLY_SLOTS; s++)
+					if (slots[s] >= 0)
+					{
+						const PLYProperty& prop = element.properties[slots[s]];
+						values[s] = ReadBinary(row + prop.offset, prop.type, swap);
+					}
+				StoreVertex(values, hasUV, r, verticesUVX, normalsUVY);
+			});
+			p += element.count * element.stride;
+		}
+		else if ((int)e == faceElement)
+		{
+			// a serial scan reads only the list counts to find the chunk starts and their first triangle,
+			// then the chunks write their triangles in parallel
+			std::vector<PLYFaceChunk> chunks;
+			size_t trianglesNum = 0;
+			for (size_t r = 0; r < element.count; r++)
+			{
+				if (r % kPLYFaceChunkRows == 0)
+					chunks.push_back({ p, std::min(kPLYFaceChunkRows, element.count - r), trianglesNum });
+
+				size_t rowSize = BinaryRowSize(p, end, element, swap);
+				if (!rowSize)
+				{
+					err = "face data is truncated";
+					return false;
+				}
+				const PLYProperty& list = element.properties[faceList];
+				const char* listStart = p;
+				for (int i = 0; i < faceList; i++)
+				{
+					const PLYProperty& prop = element.properties[i];
+					listStart += prop.countType == PLY_NONE ? kPLYTypeSize[prop.type] :
+						kPLYTypeSize[prop.countType] + ReadBinaryInt(listStart, prop.countType, swap) * kPLYTypeSize[prop.type];
+				}
+				int64_t n = ReadBinaryInt(listStart, list.countType, swap);
+				trianglesNum += n > 2 ? (size_t)n - 2 : 0;
+				p += rowSize;
+			}
+			if (trianglesNum > (size_t)INT32_MAX)
+			{
+				err = "too many triangles";
+				return false;
+			}
+
+			indices.resize(trianglesNum);
+			ParallelFor((int)chunks.size(), 1, [&](int c) {
+				const PLYFaceChunk& chunk = chunks[c];
+				const PLYProperty& list = element.properties[faceList];
+				const size_t itemSize = kPLYTypeSize[list.type];
+				const char* row = chunk.begin;
+				vec3i* out = indices.data() + chunk.trianglesBase;
+				for (size_t r = 0; r < chunk.rows; r++)
+				{
+					const char* listStart = row;
+					for (int i = 0; i < faceList; i++)
+					{
+						const PLYProperty& prop = element.properties[i];
+						listStart += prop.countType == PLY_NONE ? kPLYTypeSize[prop.type] :
+							kPLYTypeSize[prop.countType] + ReadBinaryInt(listStart, prop.countType, swap) * kPLYTypeSize[prop.type];
+					}
+					int64_t n = ReadBinaryInt(listStart, list.countType, swap);
+					const char* items = listStart + kPLYTypeSize[list.countType];
+					int first = (int)ReadBinaryInt(items, list.type, swap);
+					for (int64_t k = 2; k < n; k++)
+						*out++ = vec3i(first, (int)ReadBinaryInt(items + (k - 1) * itemSize, list.type, swap),
+							(int)ReadBinaryInt(items + k * itemSize, list.type, swap));
+					row += BinaryRowSize(row, end, element, swap);
+				}
+			});
+		}
+		else {
+			// other elements are skipped
+			for (size_t r = 0; r < element.count; r++)
+			{
+				size_t rowSize = BinaryRowSize(p, end, element, swap);
+				if (!rowSize)
+				{
+					err = "element \"" + element.name + "\" is truncated";
+					return false;
+				}
+				p += rowSize;
+			}
+		}
+	}
+
+	// indices out of range would read outside verticesUVX during the BVH build and rendering
+	bool inRange = true;
+	for (const vec3i& t : indices)
+		inRange = inRange && (uint32_t)t.x < verticesNum && (uint32_t)t.y < verticesNum && (uint32_t)t.z < verticesNum;
+	if (!inRange)
+	{
+		err = "face references a vertex out of range";
+		return false;
+	}
+	if (indices.empty())
+	{
+		err = "no triangles";
+		return false;
+	}
+
+	if (!hasNormals)
+	{
+		// area weighted vertex normals, the triangles of a vertex are spread over the file so this is serial
+		for (const vec3i& t : indices)
+		{
+			vec3f p0(verticesUVX[t.x].x, verticesUVX[t.x].y, verticesUVX[t.x].z);
+			vec3f p1(verticesUVX[t.y].x, verticesUVX[t.y].y, verticesUVX[t.y].z);
+			vec3f p2(verticesUVX[t.z].x, verticesUVX[t.z].y, verticesUVX[t.z].z);
+			// same winding convention as the face normals of ParseOBJ
+			vec3f n = Cross(p2 - p0, p1 - p0);
+			for (int k = 0; k < 3; k++)
+			{
+				vec4f& dst = normalsUVY[t[k]];
+				dst.x += n.x; dst.y += n.y; dst.z += n.z;
+			}
+		}
+		ParallelFor((int)verticesNum, 64 * 1024, [&](int i) {
+			vec4f& dst = normalsUVY[i];
+			vec3f n(dst.x, dst.y, dst.z);
+			n = n.LengthSquared() > 0.0f ? Normalize(n) : vec3f(0.0f, 0.0f, 1.0f);
+			dst.x = n.x; dst.y = n.y; dst.z = n.z;
+		});
+	}
+
+	return true;
+}
+
+NAMESPACE_END(nagi)
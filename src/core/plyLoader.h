@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "vector.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// Stanford PLY parser (ascii, binary_little_endian and binary_big_endian) over a file mapped into memory.
+// The vertex and face elements are read straight into the mesh arrays, PLY vertices are already shared
+// so no welding is needed. x/y/z, nx/ny/nz and u/v (s/t, texture_u/texture_v) are read, other properties
+// and elements are skipped. Polygons are fan-triangulated, uv v is flipped to 1-v like ParseOBJ does,
+// vertices without normals get the area weighted normal of their triangles and vertices without uv (0,0)
+bool ParsePLY(const char* data, size_t size, std::vector<vec4f>& verticesUVX, std::vector<vec4f>& normalsUVY,
+	std::vector<vec3i>& indices, std::string& err);
+
+NAMESPACE_END(nagi)
@@ -10,6 +10,22 @@
 
 NAMESPACE_BEGIN(nagi)
 
+// texture units of the texture class arrays, the first one keeps the unit of the former single array
+static const int kTextureClassUnits[kTextureClassesNum] = { 8, 12, 13, 14 };
+
+// EXT_texture_compression_s3tc, not in the core profile glad was generated for but supported by desktop drivers
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// internal format of every TextureFormat
+static const GLenum kTextureInternalFormats[kTextureFormatsNum] = {
+	GL_RGBA8, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RED_RGTC1, GL_COMPRESSED_RG_RGTC2
+};
+
 Program* LoadShaders(ShaderSource vert, ShaderSource frag)
 {
 	std::vector<Shader> shaders;
@@ -21,12 +37,12 @@ Program* LoadShaders(ShaderSource vert, ShaderSource frag)
 Renderer::Renderer(Scene * scene, const std::string & shadersDir) 
 	: scene(scene), shadersDir(shadersDir), quad(new Quad),
 	// input
-	BVHBuffer(0), BVHTex(0), vertexIndicesBuffer(0), vertexIndicesTex(0), 
+	BVHBuffer(0), BVHTex(0), wideBVHBuffer(0), wideBVHTex(0), vertexIndicesBuffer(0), vertexIndicesTex(0), 
 	verticesBuffer(0), verticesTex(0), normalsBuffer(0), normalsTex(0), 
-	transformsTex(0), lightsTex(0), materialsTex(0), textureMapsArrayTex(0),
-	envMapTex(0), envMapCDFTex(0),
+	transformsBuffer(0), transformsTex(0), lightsTex(0), lightBVHBuffer(0), lightBVHTex(0), materialsTex(0), textureMapsArrayTex(),
+	envMapTex(0), envMapAliasBuffer(0), envMapAliasTex(0),
 	// calculate
-	pathTraceShader(nullptr), pathTraceShaderLowRes(nullptr),  tonemapShader(nullptr), outputShader(nullptr),
+	pathTraceShader(nullptr), pathTraceShaderLowRes(nullptr),  tonemapShader(nullptr), outputShader(nullptr), bvhStackDepth(0), bvhCompressed(false),
 	// output
 	pathTraceFBO(0), pathTraceTex(0), pathTraceFBOLowRes(0), pathTraceTexLowRes(0), 
 	accumFBO(0), accumTex(0), outputFBO(0), outputTex(), denoisedTex(0)
@@ -53,12 +69,16 @@ Renderer::~Renderer()
 
 	// delete inupt data
 	glDeleteBuffers(1,&BVHBuffer); glDeleteTextures(1, &BVHTex);
+	glDeleteBuffers(1,&wideBVHBuffer); glDeleteTextures(1, &wideBVHTex);
 	glDeleteBuffers(1,&vertexIndicesBuffer); glDeleteTextures(1, &vertexIndicesTex);
 	glDeleteBuffers(1,&verticesBuffer); glDeleteTextures(1, &verticesTex);
 	glDeleteBuffers(1,&normalsBuffer); glDeleteTextures(1, &normalsTex);
-	glDeleteTextures(1, &transformsTex); glDeleteTextures(1, &lightsTex);
-	glDeleteTextures(1, &materialsTex); glDeleteTextures(1, &textureMapsArrayTex);
-	glDeleteTextures(1, &envMapTex); glDeleteTextures(1, &envMapCDFTex);
+	glDeleteBuffers(1, &transformsBuffer); glDeleteTextures(1, &transformsTex);
+	glDeleteTextures(1, &lightsTex);
+	glDeleteBuffers(1, &lightBVHBuffer); glDeleteTextures(1, &lightBVHTex);
+	glDeleteTextures(1, &materialsTex); glDeleteTextures(kTextureClassesNum, textureMapsArrayTex);
+	glDeleteTextures(1, &envMapTex);
+	glDeleteBuffers(1, &envMapAliasBuffer); glDeleteTextures(1, &envMapAliasTex);
 
 	// delete calculate shader
 	delete pathTraceShader; delete pathTraceShaderLowRes;
@@ -79,18 +99,44 @@ void Renderer::InitGPUDataBuffers()
 {
 	glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
-	// Create buffer and texture for BVH
-	glGenBuffers(1, &BVHBuffer);
-	glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(LinearBVHNode)*scene->sceneNodes.size(), scene->sceneNodes.data(), GL_STATIC_DRAW);
-	glGenTextures(1, &BVHTex);
-	glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
-	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+	// the scene vectors, or the pages of a mapped .nagib file
+	SceneGPUArrays arrays = scene->GPUArrays();
+
+	if (arrays.wideNodes.empty())
+	{
+		// Create buffer and texture for BVH
+		glGenBuffers(1, &BVHBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(LinearBVHNode)*arrays.nodes.size, arrays.nodes.data, GL_STATIC_DRAW);
+		glGenTextures(1, &BVHTex);
+		glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+	}
+	else if (!arrays.compressedNodes.empty())
+	{
+		// Create buffer and texture for compressed wide BVH, the same texture unit as the uncompressed one
+		glGenBuffers(1, &wideBVHBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, wideBVHBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(uint32_t)*arrays.compressedNodes.size, arrays.compressedNodes.data, GL_STATIC_DRAW);
+		glGenTextures(1, &wideBVHTex);
+		glBindTexture(GL_TEXTURE_BUFFER, wideBVHTex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, wideBVHBuffer);
+	}
+	else
+	{
+		// Create buffer and texture for wide BVH, bounds are read back with intBitsToFloat
+		glGenBuffers(1, &wideBVHBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, wideBVHBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(WideBVHNode)*arrays.wideNodes.size, arrays.wideNodes.data, GL_STATIC_DRAW);
+		glGenTextures(1, &wideBVHTex);
+		glBindTexture(GL_TEXTURE_BUFFER, wideBVHTex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, wideBVHBuffer);
+	}
 
 	// Create buffer and texture for vertex indices
 	glGenBuffers(1, &vertexIndicesBuffer);
 	glBindBuffer(GL_TEXTURE_BUFFER, vertexIndicesBuffer);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec3i)*scene->scenePrimsVertexIndices.size(), scene->scenePrimsVertexIndices.data(), GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec3i)*arrays.primsVertexIndices.size, arrays.primsVertexIndices.data, GL_STATIC_DRAW);
 	glGenTextures(GL_TEXTURE_BUFFER, &vertexIndicesTex);
 	glBindTexture(GL_TEXTURE_BUFFER, vertexIndicesTex);
 	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32I, vertexIndicesBuffer);
@@ -98,7 +144,7 @@ void Renderer::InitGPUDataBuffers()
 	// Create buffer and texture for vertices
 	glGenBuffers(1, &verticesBuffer);
 	glBindBuffer(GL_TEXTURE_BUFFER, verticesBuffer);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4f)*scene->verticesUVX.size(), scene->verticesUVX.data(), GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4f)*arrays.verticesUVX.size, arrays.verticesUVX.data, GL_STATIC_DRAW);
 	glGenTextures(GL_TEXTURE_BUFFER, &verticesTex);
 	glBindTexture(GL_TEXTURE_BUFFER, verticesTex);
 	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, verticesBuffer);
@@ -106,18 +152,19 @@ void Renderer::InitGPUDataBuffers()
 	// Create buffer and texture for normals
 	glGenBuffers(1, &normalsBuffer);
 	glBindBuffer(GL_TEXTURE_BUFFER, normalsBuffer);
-	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4f)*scene->normalsUVY.size(), scene->normalsUVY.data(), GL_STATIC_DRAW);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(vec4f)*arrays.normalsUVY.size, arrays.normalsUVY.data, GL_STATIC_DRAW);
 	glGenTextures(GL_TEXTURE_BUFFER, &normalsTex);
 	glBindTexture(GL_TEXTURE_BUFFER, normalsTex);
 	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, normalsBuffer);
 
-	// Create texture for transforms
+	// Create buffer and texture for transforms, 7 texels per instance. a buffer texture is not limited to
+	// GL_MAX_TEXTURE_SIZE texels like a row of a 2D texture
+	glGenBuffers(1, &transformsBuffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, transformsBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(InstanceTransform)*scene->transforms.size(), scene->transforms.data(), GL_STATIC_DRAW);
 	glGenTextures(1, &transformsTex);
-	glBindTexture(GL_TEXTURE_2D, transformsTex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (sizeof(mat4) / sizeof(vec4f))*scene->transforms.size(), 1, 0, GL_RGBA, GL_FLOAT, scene->transforms.data());
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindTexture(GL_TEXTURE_BUFFER, transformsTex);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, transformsBuffer);
 
 	if (!scene->lights.empty())
 	{
@@ -130,6 +177,27 @@ void Renderer::InitGPUDataBuffers()
 		glBindTexture(GL_TEXTURE_2D, 0);
 	}
 
+	if (!scene->lights.empty() || !scene->emissiveTriangles.empty())
+	{
+		// Create buffer and texture for the light BVH followed by the distant light indices, one texel each,
+		// and the emissive triangles
+		std::vector<vec4i> distantLights(scene->distantLights.size(), vec4i(0));
+		for (size_t i = 0; i < distantLights.size(); i++)
+			distantLights[i].x = scene->distantLights[i];
+		size_t nodesBytes = sizeof(LightBVHNode) * scene->lightBVHNodes.size();
+		size_t distantBytes = sizeof(vec4i) * distantLights.size();
+		size_t trianglesBytes = sizeof(EmissiveTriangle) * scene->emissiveTriangles.size();
+		glGenBuffers(1, &lightBVHBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, lightBVHBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, nodesBytes + distantBytes + trianglesBytes, nullptr, GL_STATIC_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, nodesBytes, scene->lightBVHNodes.data());
+		glBufferSubData(GL_TEXTURE_BUFFER, nodesBytes, distantBytes, distantLights.data());
+		glBufferSubData(GL_TEXTURE_BUFFER, nodesBytes + distantBytes, trianglesBytes, scene->emissiveTriangles.data());
+		glGenTextures(1, &lightBVHTex);
+		glBindTexture(GL_TEXTURE_BUFFER, lightBVHTex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, lightBVHBuffer);
+	}
+
 	// Create texture for lights
 	glGenTextures(1, &materialsTex);
 	glBindTexture(GL_TEXTURE_2D, materialsTex);
@@ -138,14 +206,36 @@ void Renderer::InitGPUDataBuffers()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
-	// Create texture for scene textures
-	if (!scene->textures.empty())
+	// Create one texture array per texture class, the mip chains of the classes follow each other in textureMaps
+	size_t classOffset = 0;
+	for (int c = 0; c < kTextureClassesNum; c++)
 	{
-		glGenTextures(1, &textureMapsArrayTex);
-		glBindTexture(GL_TEXTURE_2D_ARRAY, textureMapsArrayTex);
-		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, scene->renderOptions->texArrayWidth, scene->renderOptions->texArrayHeight, scene->textures.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, &scene->textureMapsArray[0]);
+		int layers = arrays.textureClassEnds[c] - (c > 0 ? arrays.textureClassEnds[c - 1] : 0);
+		if (layers == 0)
+			continue;
+
+		const vec2i& size = arrays.textureClassSizes[c];
+		glGenTextures(1, &textureMapsArrayTex[c]);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureMapsArrayTex[c]);
+		TextureFormat format = arrays.textureClassFormats[c];
+		int levels = TextureMipLevels(size.x, size.y);
+		for (int level = 0; level < levels; level++)
+		{
+			int w = TextureMipSize(size.x, level), h = TextureMipSize(size.y, level);
+			size_t levelBytes = (size_t)layers * TextureFormatBytes(format, w, h);
+			if (format == kTextureRGBA8)
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, w, h, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, arrays.textureMaps.data + classOffset);
+			else
+				glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, kTextureInternalFormats[format], w, h, layers, 0,
+					(GLsizei)levelBytes, arrays.textureMaps.data + classOffset);
+			classOffset += levelBytes;
+		}
+		if (format != kTextureRGBA8 && glGetError() != GL_NO_ERROR)
+			printf("Compressed texture class %d x %d is not supported by the driver, use textureCompression 0\n", size.x, size.y);
+		// the shaders pick the level with textureLod from the ray cone, the filter only blends the two nearest levels
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
 		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 	}
 
@@ -158,12 +248,13 @@ void Renderer::InitGPUDataBuffers()
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 		glBindTexture(GL_TEXTURE_2D, 0);
 
-		glGenTextures(1, &envMapCDFTex);
-		glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, scene->envMap->width, scene->envMap->height, 0, GL_RED, GL_FLOAT, scene->envMap->cdf);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-		glBindTexture(GL_TEXTURE_2D, 0);
+		// Create buffer and texture for the alias table of the env map pixels
+		glGenBuffers(1, &envMapAliasBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, envMapAliasBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(AliasEntry)*scene->envMap->aliasTable.size(), scene->envMap->aliasTable.data(), GL_STATIC_DRAW);
+		glGenTextures(1, &envMapAliasTex);
+		glBindTexture(GL_TEXTURE_BUFFER, envMapAliasTex);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, envMapAliasBuffer);
 	}
 
 	// Bind textures to texture slots as they will not change slots during the lifespan of the renderer
@@ -178,15 +269,22 @@ void Renderer::InitGPUDataBuffers()
 	glActiveTexture(GL_TEXTURE5);
 	glBindTexture(GL_TEXTURE_2D, materialsTex);
 	glActiveTexture(GL_TEXTURE6);
-	glBindTexture(GL_TEXTURE_2D, transformsTex);
+	glBindTexture(GL_TEXTURE_BUFFER, transformsTex);
 	glActiveTexture(GL_TEXTURE7);
 	glBindTexture(GL_TEXTURE_2D, lightsTex);
-	glActiveTexture(GL_TEXTURE8);
-	glBindTexture(GL_TEXTURE_2D_ARRAY, textureMapsArrayTex);
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		glActiveTexture(GL_TEXTURE0 + kTextureClassUnits[c]);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, textureMapsArrayTex[c]);
+	}
 	glActiveTexture(GL_TEXTURE9);
 	glBindTexture(GL_TEXTURE_2D, envMapTex);
 	glActiveTexture(GL_TEXTURE10);
-	glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
+	glBindTexture(GL_TEXTURE_BUFFER, envMapAliasTex);
+	glActiveTexture(GL_TEXTURE11);
+	glBindTexture(GL_TEXTURE_BUFFER, wideBVHTex);
+	glActiveTexture(GL_TEXTURE15);
+	glBindTexture(GL_TEXTURE_BUFFER, lightBVHTex);
 }
 
 void Renderer::ResizeRenderer()
@@ -333,6 +431,9 @@ void Renderer::InitShaders()
 	if (!scene->lights.empty())
 		pathtraceDefines += "#define NAGI_LIGHTS\n";
 
+	if (!scene->emissiveTriangles.empty())
+		pathtraceDefines += "#define NAGI_EMISSIVE_TRIANGLES\n";
+
 	if (scene->renderOptions->enableRR)
 	{
 		pathtraceDefines += "#define NAGI_RR\n";
@@ -369,6 +470,18 @@ void Renderer::InitShaders()
 		}
 	}
 
+	SceneGPUArrays arrays = scene->GPUArrays();
+	if (!arrays.wideNodes.empty())
+	{
+		pathtraceDefines += "#define NAGI_WIDE_BVH\n";
+		pathtraceDefines += "#define NAGI_BVH_WIDTH " + std::to_string(scene->renderOptions->bvhWidth) + "\n";
+		bvhStackDepth = scene->WideBVHDepth();
+		pathtraceDefines += "#define NAGI_BVH_DEPTH " + std::to_string(bvhStackDepth) + "\n";
+		bvhCompressed = !arrays.compressedNodes.empty();
+		if (bvhCompressed)
+			pathtraceDefines += "#define NAGI_COMPRESSED_BVH\n";
+	}
+
 	if (scene->renderOptions->enableRoughnessMollification)
 		pathtraceDefines += "#define NAGI_ROUGHNESS_MOLLIFICATION\n";
 
@@ -426,7 +539,11 @@ void Renderer::InitShaders()
 	pathTraceShader->setVec2("resolution", (float)renderRes.x, (float)renderRes.y);
 	pathTraceShader->setVec2("invTilesNum", invTilesNum);
 	pathTraceShader->setInt("lightsNum", (int)scene->lights.size());
-	pathTraceShader->setInt("tlasBVHStartOffset", (int)scene->tlasBVHStartOffset);
+	pathTraceShader->setInt("lightBVHNodesNum", (int)scene->lightBVHNodes.size());
+	pathTraceShader->setInt("distantLightsNum", (int)scene->distantLights.size());
+	pathTraceShader->setInt("emissiveTrianglesNum", (int)scene->emissiveTriangles.size());
+	// the traversal only sees one of the layouts, so the TLAS start follows it
+	pathTraceShader->setInt("tlasBVHStartOffset", (int)(arrays.wideNodes.empty() ? scene->tlasBVHStartOffset : scene->tlasWideStartOffset));
 	pathTraceShader->setInt("accumTex", 0);
 	pathTraceShader->setInt("BVHTex", 1);
 	pathTraceShader->setInt("vertexIndicesTex", 2);
@@ -435,9 +552,15 @@ void Renderer::InitShaders()
 	pathTraceShader->setInt("materialsTex", 5);
 	pathTraceShader->setInt("transformsTex", 6);
 	pathTraceShader->setInt("lightsTex", 7);
-	pathTraceShader->setInt("textureMapsArrayTex", 8);
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		pathTraceShader->setInt("textureMapsArrayTex[" + std::to_string(c) + "]", kTextureClassUnits[c]);
+		pathTraceShader->setInt("textureClassEnds[" + std::to_string(c) + "]", arrays.textureClassEnds[c]);
+	}
 	pathTraceShader->setInt("envMapTex", 9);
-	pathTraceShader->setInt("envMapCDFTex", 10);
+	pathTraceShader->setInt("envMapAliasTex", 10);
+	pathTraceShader->setInt("wideBVHTex", 11);
+	pathTraceShader->setInt("lightBVHTex", 15);
 	pathTraceShader->stop();
 
 	// pathTraceShaderLowResuniform
@@ -448,7 +571,11 @@ void Renderer::InitShaders()
 	}
 	pathTraceShaderLowRes->setVec2("resolution", (float)renderRes.x, (float)renderRes.y);
 	pathTraceShaderLowRes->setInt("lightsNum", (int)scene->lights.size());
-	pathTraceShaderLowRes->setInt("tlasBVHStartOffset", (int)scene->tlasBVHStartOffset);
+	pathTraceShaderLowRes->setInt("lightBVHNodesNum", (int)scene->lightBVHNodes.size());
+	pathTraceShaderLowRes->setInt("distantLightsNum", (int)scene->distantLights.size());
+	pathTraceShaderLowRes->setInt("emissiveTrianglesNum", (int)scene->emissiveTriangles.size());
+	// the traversal only sees one of the layouts, so the TLAS start follows it
+	pathTraceShaderLowRes->setInt("tlasBVHStartOffset", (int)(arrays.wideNodes.empty() ? scene->tlasBVHStartOffset : scene->tlasWideStartOffset));
 	pathTraceShaderLowRes->setInt("accumTex", 0);
 	pathTraceShaderLowRes->setInt("BVHTex", 1);
 	pathTraceShaderLowRes->setInt("vertexIndicesTex", 2);
@@ -457,9 +584,15 @@ void Renderer::InitShaders()
 	pathTraceShaderLowRes->setInt("materialsTex", 5);
 	pathTraceShaderLowRes->setInt("transformsTex", 6);
 	pathTraceShaderLowRes->setInt("lightsTex", 7);
-	pathTraceShaderLowRes->setInt("textureMapsArrayTex", 8);
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		pathTraceShaderLowRes->setInt("textureMapsArrayTex[" + std::to_string(c) + "]", kTextureClassUnits[c]);
+		pathTraceShaderLowRes->setInt("textureClassEnds[" + std::to_string(c) + "]", arrays.textureClassEnds[c]);
+	}
 	pathTraceShaderLowRes->setInt("envMapTex", 9);
-	pathTraceShaderLowRes->setInt("envMapCDFTex", 10);
+	pathTraceShaderLowRes->setInt("envMapAliasTex", 10);
+	pathTraceShaderLowRes->setInt("wideBVHTex", 11);
+	pathTraceShaderLowRes->setInt("lightBVHTex", 15);
 	pathTraceShaderLowRes->stop();
 }
 
@@ -473,6 +606,115 @@ void Renderer::Present()
 
 void Renderer::Update(float secondsElapsed)
 {
+	UpdateGPUDataBuffers();
+}
+
+// upload data[begin, end) to buffer, or all of data when its size changed
+template <typename T>
+static void UpdateTextureBuffer(GLuint buffer, const std::vector<T>& data, size_t begin, size_t end)
+{
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	GLint bufferSize = 0;
+	glGetBufferParameteriv(GL_TEXTURE_BUFFER, GL_BUFFER_SIZE, &bufferSize);
+	if ((size_t)bufferSize != sizeof(T)*data.size())
+		glBufferData(GL_TEXTURE_BUFFER, sizeof(T)*data.size(), data.data(), GL_STATIC_DRAW);
+	else if (begin < end)
+		glBufferSubData(GL_TEXTURE_BUFFER, sizeof(T)*begin, sizeof(T)*(end - begin), data.data() + begin);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// upload the elements of data at idx * elementsPerIdx, one glBufferSubData per run of consecutive idx
+template <typename T>
+static void UpdateTextureBufferRuns(GLuint buffer, const std::vector<T>& data, std::vector<uint32_t>& idx, size_t elementsPerIdx)
+{
+	std::sort(idx.begin(), idx.end());
+	idx.erase(std::unique(idx.begin(), idx.end()), idx.end());
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	for (size_t i = 0; i < idx.size();)
+	{
+		size_t j = i + 1;
+		while (j < idx.size() && idx[j] == idx[j - 1] + 1) j++;
+		glBufferSubData(GL_TEXTURE_BUFFER, sizeof(T)*idx[i]*elementsPerIdx, sizeof(T)*(j - i)*elementsPerIdx, data.data() + idx[i]*elementsPerIdx);
+		i = j;
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void Renderer::UpdateGPUDataBuffers()
+{
+	// a rebuilt BVH may be deeper than the traversal stack of the shaders, or may have lost its compression
+	if (scene->bvhLayoutModified)
+	{
+		scene->bvhLayoutModified = false;
+		if (scene->WideBVHDepth() > bvhStackDepth || scene->sceneCompressedNodes.empty() == bvhCompressed)
+			ReloadShaders();
+	}
+
+	// refits only touch the node ranges of the refitted BVHs
+	if (scene->bvhDirtyBegin < scene->bvhDirtyEnd)
+	{
+		size_t begin = scene->bvhDirtyBegin, end = scene->bvhDirtyEnd;
+		if (!scene->sceneCompressedNodes.empty())
+		{
+			size_t words = BVHAccel::CompressedNodeWords(scene->renderOptions->bvhWidth);
+			UpdateTextureBuffer(wideBVHBuffer, scene->sceneCompressedNodes, begin * words, end * words);
+		}
+		else if (!scene->sceneWideNodes.empty())
+		{
+			size_t groups = scene->renderOptions->bvhWidth / 4;
+			UpdateTextureBuffer(wideBVHBuffer, scene->sceneWideNodes, begin * groups, end * groups);
+		}
+		else
+			UpdateTextureBuffer(BVHBuffer, scene->sceneNodes, begin, end);
+		scene->bvhDirtyBegin = scene->bvhDirtyEnd = 0;
+
+		// a rebuilt blasBVH moves the tlasBVH root
+		int tlasStart = (int)(scene->sceneWideNodes.empty() ? scene->tlasBVHStartOffset : scene->tlasWideStartOffset);
+		pathTraceShader->use();
+		pathTraceShader->setInt("tlasBVHStartOffset", tlasStart);
+		pathTraceShader->stop();
+		pathTraceShaderLowRes->use();
+		pathTraceShaderLowRes->setInt("tlasBVHStartOffset", tlasStart);
+		pathTraceShaderLowRes->stop();
+	}
+
+	// instance edits touch the nodes on a few root paths, after a reallocation above
+	if (!scene->bvhDirtyNodes.empty())
+	{
+		if (!scene->sceneCompressedNodes.empty())
+			UpdateTextureBufferRuns(wideBVHBuffer, scene->sceneCompressedNodes, scene->bvhDirtyNodes,
+				BVHAccel::CompressedNodeWords(scene->renderOptions->bvhWidth));
+		else if (!scene->sceneWideNodes.empty())
+			UpdateTextureBufferRuns(wideBVHBuffer, scene->sceneWideNodes, scene->bvhDirtyNodes, scene->renderOptions->bvhWidth / 4);
+		else
+			UpdateTextureBufferRuns(BVHBuffer, scene->sceneNodes, scene->bvhDirtyNodes, 1);
+		scene->bvhDirtyNodes.clear();
+	}
+
+	if (scene->verticesDirtyBegin < scene->verticesDirtyEnd)
+	{
+		UpdateTextureBuffer(verticesBuffer, scene->verticesUVX, scene->verticesDirtyBegin, scene->verticesDirtyEnd);
+		UpdateTextureBuffer(normalsBuffer, scene->normalsUVY, scene->verticesDirtyBegin, scene->verticesDirtyEnd);
+		scene->verticesDirtyBegin = scene->verticesDirtyEnd = 0;
+	}
+
+	if (scene->primsModified)
+	{
+		UpdateTextureBuffer(vertexIndicesBuffer, scene->scenePrimsVertexIndices, 0, scene->scenePrimsVertexIndices.size());
+		scene->primsModified = false;
+	}
+
+	if (scene->instancesModified)
+	{
+		UpdateTextureBuffer(transformsBuffer, scene->transforms, 0, scene->transforms.size());
+		scene->instancesModified = false;
+		scene->dirtyTransforms.clear();
+	}
+	else if (!scene->dirtyTransforms.empty())
+	{
+		UpdateTextureBufferRuns(transformsBuffer, scene->transforms, scene->dirtyTransforms, 1);
+		scene->dirtyTransforms.clear();
+	}
 }
 
 NAMESPACE_END(nagi)
\ No newline at end of file
@@ -6,14 +6,49 @@
 #include "material.h"
 #include "light.h"
 #include "bvh.h"
+#include "parallel.h"
+#include <map>
+#include <atomic>
+#include <cstring>
+#include <cmath>
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize.h"
 
 NAMESPACE_BEGIN(nagi)
 
+static_assert(sizeof(InstanceTransform) == 7 * sizeof(vec4f), "InstanceTransform is 7 texels of transformsTex");
+
+InstanceTransform::InstanceTransform(const mat4& m) :transform(m)
+{
+	// m.data[c] is column c of the GLSL matrix, the first three are the linear part A, the last the translation.
+	// the rows of A^-1 are the cross products of the other two columns divided by det(A)
+	vec3f a0(m.data[0][0], m.data[0][1], m.data[0][2]);
+	vec3f a1(m.data[1][0], m.data[1][1], m.data[1][2]);
+	vec3f a2(m.data[2][0], m.data[2][1], m.data[2][2]);
+	vec3f t(m.data[3][0], m.data[3][1], m.data[3][2]);
+
+	vec3f rows[3] = { Cross(a1, a2), Cross(a2, a0), Cross(a0, a1) };
+	float invDet = 1.0f / Dot(a0, rows[0]);
+	for (int i = 0; i < 3; i++)
+	{
+		rows[i] = rows[i] * invDet;
+		invRows[i] = vec4f(rows[i], -Dot(rows[i], t));
+	}
+}
+
 Scene::Scene() 
-	:tlasBVH(nullptr), camera(nullptr), envMap(nullptr), renderOptions(new RenderOptions),
-	initialized(false), dirty(true), instancesModified(true), envMapModified(true) {}
+	:tlasBVH(nullptr), tlasWideStartOffset(0), camera(nullptr), envMap(nullptr), renderOptions(new RenderOptions),
+	initialized(false), dirty(true), instancesModified(true), envMapModified(true),
+	bvhDirtyBegin(0), bvhDirtyEnd(0), verticesDirtyBegin(0), verticesDirtyEnd(0), primsModified(false),
+	bvhLayoutModified(false)
+{
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		textureClassSizes[c] = vec2i(0, 0);
+		textureClassFormats[c] = kTextureRGBA8;
+		textureClassEnds[c] = 0;
+	}
+}
 
 Scene::~Scene()
 {
@@ -60,36 +95,110 @@ void Scene::AddCamera(vec3f pos, vec3f lookat, float fov)
 void Scene::AddEnvMap(std::string& filename)
 {
 	if (envMap)
+	{
+		// the replaced env map may still be loading
+#pragma omp taskwait
 		delete envMap;
+	}
 
-	envMap = new EnvironmentMap;
-	if (envMap->LoadEnvMap(filename))
-		printf("HDR \"%s\" loaded\n", filename.c_str());
-	else {
-		printf("Unable to load \"%s\" HDR\n", filename.c_str());
-		delete envMap;
-		envMap = nullptr;
+	// img stays null if the load fails, WaitForLoads drops the env map then
+	EnvironmentMap* map = new EnvironmentMap;
+	envMap = map;
+	std::string name = filename;
+#pragma omp task firstprivate(map, name)
+	{
+		if (map->LoadEnvMap(name))
+			printf("HDR \"%s\" loaded\n", name.c_str());
+		else
+			printf("Unable to load \"%s\" HDR\n", name.c_str());
+	}
+}
+
+// lexically normalized path, the key of the registries: '\' becomes '/', "." segments, repeated separators
+// and "dir/.." pairs are removed, so "a/b.png", "a//./b.png" and "a\c\..\b.png" name the same file
+static std::string CanonicalPath(const std::string& path)
+{
+	std::vector<std::string> segments;
+	bool absolute = !path.empty() && (path[0] == '/' || path[0] == '\\');
+	size_t begin = 0;
+	while (begin <= path.size())
+	{
+		size_t end = path.find_first_of("/\\", begin);
+		if (end == std::string::npos)
+			end = path.size();
+
+		std::string segment = path.substr(begin, end - begin);
+		if (segment == "..")
+		{
+			// a leading ".." of a relative path cannot be resolved lexically and is kept
+			if (!segments.empty() && segments.back() != "..")
+				segments.pop_back();
+			else if (!absolute)
+				segments.push_back(segment);
+		}
+		else if (!segment.empty() && segment != ".")
+			segments.push_back(segment);
+		begin = end + 1;
+	}
+
+	std::string canonical = absolute ? "/" : "";
+	for (size_t i = 0; i < segments.size(); i++)
+	{
+		if (i > 0)
+			canonical += '/';
+		canonical += segments[i];
+	}
+	return canonical;
+}
+
+// move the ids of a registry to remap, names of removed ids (-1) are dropped
+static void RemapRegistry(std::unordered_map<std::string, int>& registry, const std::vector<int>& remap)
+{
+	for (auto it = registry.begin(); it != registry.end();)
+	{
+		it->second = remap[it->second];
+		if (it->second < 0)
+			it = registry.erase(it);
+		else
+			++it;
+	}
+}
+
+static void RemapMaterialTextures(std::vector<Material>& materials, const std::vector<int>& remap)
+{
+	for (Material& mat : materials)
+	{
+		float* texIDs[5] = { &mat.baseColorTexID, &mat.roughnessTexID, &mat.metallicTexID, &mat.normalMapTexID, &mat.emissionMapTexID };
+		for (int i = 0; i < 5; i++)
+			if (*texIDs[i] >= 0.0f)
+				*texIDs[i] = (float)remap[(int)*texIDs[i]];
 	}
 }
 
 int Scene::AddTexture(std::string & filename)
 {
 	// Check if texture was already loaded
-	for (size_t i = 0; i < textures.size(); i++)
-		if (textures[i]->name == filename)
-			return (int)i;
+	auto it = textureRegistry.emplace(CanonicalPath(filename), (int)textures.size());
+	if (!it.second)
+	{
+		textures[it.first->second]->duplicateRefs++;
+		return it.first->second;
+	}
 
+	// the placeholder is named and takes its id right away, so ids follow the order of the calls
+	// and the textures added while it loads are deduplicated against it
 	int id = (int)textures.size();
 	Texture* tex = new Texture;
+	tex->name = filename;
+	textures.push_back(tex);
+	pendingTextures.push_back(id);
 
 	printf("Loading texture \"%s\"\n", filename.c_str());
-	if (tex->LoadTexture(filename))
-		textures.push_back(tex);
-	else {
-		delete tex;
-		id = -1;
-		printf("Fail to load \"%s\" texture\n", filename.c_str());
-	}
+	// LoadTexture assigns name to itself, it is only read while the main thread compares names.
+	// texData stays empty if the load fails, WaitForLoads removes the texture then
+#pragma omp task firstprivate(tex)
+	if (!tex->LoadTexture(tex->name))
+		printf("Fail to load \"%s\" texture\n", tex->name.c_str());
 
 	return id;
 }
@@ -97,25 +206,127 @@ int Scene::AddTexture(std::string & filename)
 int Scene::AddMesh(std::string & filename)
 {
 	// Check if mesh was already loaded
-	for (size_t i = 0; i < meshes.size(); i++)
-		if (meshes[i]->name == filename)
-			return (int)i;
+	auto it = meshRegistry.emplace(CanonicalPath(filename), (int)meshes.size());
+	if (!it.second)
+		return it.first->second;
 
+	// placeholder like in AddTexture. the caller may set splitMethod and splitBudget while it loads,
+	// LoadMesh does not touch them
 	int id = (int)meshes.size();
 	Mesh* mesh = new Mesh;
+	mesh->name = filename;
+	meshes.push_back(mesh);
+	pendingMeshes.push_back(id);
 
 	printf("Loading mesh \"%s\"\n", filename.c_str());
-	if (mesh->LoadMesh(filename))
-		meshes.push_back(mesh);
-	else {
-		delete mesh;
-		id = -1;
-		printf("Fail to load \"%s\" mesh\n", filename.c_str());
+	// a mesh that failed or has no triangles is left without indices and removed by WaitForLoads
+#pragma omp task firstprivate(mesh)
+	if (!mesh->LoadMesh(mesh->name))
+	{
+		mesh->indices.clear();
+		printf("Fail to load \"%s\" mesh\n", mesh->name.c_str());
 	}
 
 	return id;
 }
 
+// delete the pending items that failed to load and move the later ones down.
+// remap[i] is the new index of items[i], -1 if it was removed. false if nothing was removed
+template <typename T, typename Loaded>
+static bool RemoveFailedLoads(std::vector<T*>& items, std::vector<int>& pending, std::vector<int>& remap, const Loaded& loaded)
+{
+	std::vector<char> failed(items.size(), 0);
+	bool anyFailed = false;
+	for (int id : pending)
+		if (!loaded(items[id]))
+		{
+			failed[id] = 1;
+			anyFailed = true;
+		}
+	pending.clear();
+	if (!anyFailed)
+		return false;
+
+	remap.resize(items.size());
+	size_t count = 0;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (failed[i])
+		{
+			delete items[i];
+			remap[i] = -1;
+		}
+		else
+		{
+			remap[i] = (int)count;
+			items[count++] = items[i];
+		}
+	}
+	items.resize(count);
+	return true;
+}
+
+void Scene::WaitForLoads()
+{
+#pragma omp taskwait
+
+	if (envMap && !envMap->img)
+	{
+		delete envMap;
+		envMap = nullptr;
+	}
+
+	// the names of failed loads leave the registries, adding them again retries the load
+	std::vector<int> remap;
+	if (RemoveFailedLoads(textures, pendingTextures, remap, [](const Texture* tex) { return !tex->texData.empty(); }))
+	{
+		RemapMaterialTextures(materials, remap);
+		RemapRegistry(textureRegistry, remap);
+	}
+
+	if (RemoveFailedLoads(meshes, pendingMeshes, remap, [](const Mesh* mesh) { return !mesh->indices.empty(); }))
+	{
+		RemapRegistry(meshRegistry, remap);
+		size_t count = 0;
+		for (size_t i = 0; i < meshInstances.size(); i++)
+		{
+			meshInstances[i]->meshID = remap[meshInstances[i]->meshID];
+			if (meshInstances[i]->meshID < 0)
+				delete meshInstances[i];
+			else
+				meshInstances[count++] = meshInstances[i];
+		}
+		meshInstances.resize(count);
+	}
+}
+
+int Scene::AddTexture(Texture * texture)
+{
+	auto it = textureRegistry.emplace(CanonicalPath(texture->name), (int)textures.size());
+	if (!it.second)
+	{
+		delete texture;
+		textures[it.first->second]->duplicateRefs++;
+		return it.first->second;
+	}
+
+	textures.push_back(texture);
+	return (int)textures.size() - 1;
+}
+
+int Scene::AddMesh(Mesh * mesh)
+{
+	auto it = meshRegistry.emplace(CanonicalPath(mesh->name), (int)meshes.size());
+	if (!it.second)
+	{
+		delete mesh;
+		return it.first->second;
+	}
+
+	meshes.push_back(mesh);
+	return (int)meshes.size() - 1;
+}
+
 int Scene::AddMeshInstance(MeshInstance * meshInstance)
 {
 	int id = (int)meshInstances.size();
@@ -141,91 +352,189 @@ int Scene::AddLight(const Light& light)
 // --------------------------------[BVH RELEVANT FUNCTION ]--------------------------------
 // --------------------------------[CREATE PROCESS REBUILD]--------------------------------
 
-void Scene::CreateTLAS()
+void Scene::ComputeInstanceBounds()
 {
-	// instanceTLAS-BVH
-	std::vector<bbox3f> bounds(meshInstances.size());
-	// pbrt-v3 exercise 2-1: ٱ仯AABBΧ
+	// every instance is up to date afterwards
+	tlasInstanceBounds.resize(meshInstances.size());
 	for (size_t i = 0; i < meshInstances.size(); i++)
 	{
-		mat4 matrix = meshInstances[i]->transform;
-		bbox3f bound = meshes[meshInstances[i]->meshID]->blasBVH->WorldBound();
-		vec3f pmin = bound.pMin;
-		vec3f pmax = bound.pMax;
+		tlasInstanceBounds[i] = InstanceBound(i);
+		meshInstances[i]->dirty = false;
+	}
+}
 
-		vec3f right = vec3f(matrix[0][0], matrix[0][1], matrix[0][2]);
-		vec3f up	= vec3f(matrix[1][0], matrix[1][1], matrix[1][2]);
-		vec3f forward = vec3f(matrix[2][0], matrix[2][1], matrix[2][2]);
-		vec3f translation = vec3f(matrix[3][0], matrix[3][1], matrix[3][2]);
+bbox3f Scene::InstanceBound(size_t i)
+{
+	// pbrt-v3 exercise 2-1: ٱ仯AABBΧ
+	mat4 matrix = meshInstances[i]->transform;
+	bbox3f bound = meshes[meshInstances[i]->meshID]->blasBVH->WorldBound();
+	vec3f pmin = bound.pMin;
+	vec3f pmax = bound.pMax;
 
-		vec3f xa = right * pmin.x;
-		vec3f xb = right * pmax.x;
-		vec3f ya = up * pmin.y;
-		vec3f yb = up * pmax.y;
-		vec3f za = forward * pmin.z;
-		vec3f zb = forward * pmax.z;
+	vec3f right = vec3f(matrix[0][0], matrix[0][1], matrix[0][2]);
+	vec3f up	= vec3f(matrix[1][0], matrix[1][1], matrix[1][2]);
+	vec3f forward = vec3f(matrix[2][0], matrix[2][1], matrix[2][2]);
+	vec3f translation = vec3f(matrix[3][0], matrix[3][1], matrix[3][2]);
 
-		pmin = Min(xa, xb) + Min(ya, yb) + Min(za, zb) + translation;
-		pmax = Max(xa, xb) + Max(ya, yb) + Max(za, zb) + translation;
+	vec3f xa = right * pmin.x;
+	vec3f xb = right * pmax.x;
+	vec3f ya = up * pmin.y;
+	vec3f yb = up * pmax.y;
+	vec3f za = forward * pmin.z;
+	vec3f zb = forward * pmax.z;
 
-		bounds[i] = bbox3f(pmin, pmax);
-	}
+	pmin = Min(xa, xb) + Min(ya, yb) + Min(za, zb) + translation;
+	pmax = Max(xa, xb) + Max(ya, yb) + Max(za, zb) + translation;
+
+	return bbox3f(pmin, pmax);
+}
+
+void Scene::CreateTLAS()
+{
+	// instanceTLAS-BVH
+	ComputeInstanceBounds();
 	printf("Building TLAS-BVH For Scene...\n");
-	tlasBVH = new BVHAccel(bounds, 1, BVHAccel::SplitMethod::SAH, 12, 1.0f);
+	tlasBVH = new BVHAccel(tlasInstanceBounds, 1, BVHAccel::SplitMethod::SAH, 12, 1.0f);
+	if (renderOptions->bvhWidth > 2)
+		tlasBVH->CollapseWide(renderOptions->bvhWidth);
+	if (renderOptions->enableCompressedBVH && !tlasBVH->CompressWide())
+	{
+		printf("TLAS-BVH has a leaf of more than 255 instances, using uncompressed BVH nodes\n");
+		UseUncompressedBVH();
+	}
 }
 
 void Scene::CreateBLAS()
 {
 	// ÿmeshΪÿmeshBLAS-BVH
-#pragma omp parallel for
-	for (size_t i = 0; i < meshes.size(); i++)
+	// every mesh is a task of one team, the builders fork their subtrees into the same team,
+	// so a single huge mesh still uses every core
+	std::atomic<bool> compressFailed(false);
+	ParallelFor((int)meshes.size(), 1, [&](int i) {
+		if (!CreateMeshBLAS(meshes[i]))
+			compressFailed = true;
+	});
+	if (compressFailed)
 	{
-		printf("Building BLAS-BVH For Mesh \"%s\"...\n", meshes[i]->name.c_str());
-		meshes[i]->BuildBVH();
+		printf("A BLAS-BVH has a leaf of more than 255 triangles, using uncompressed BVH nodes\n");
+		UseUncompressedBVH();
 	}
 }
 
+void Scene::UseUncompressedBVH()
+{
+	renderOptions->enableCompressedBVH = false;
+	if (sceneCompressedNodes.empty()) return;
+
+	// the shaders can not mix both formats. CompressWide keeps the wide nodes in the order of its compressed
+	// primitives, so sceneWideNodes and the blasBVH entries of scenePrimsVertexIndices are valid as they are
+	sceneCompressedNodes.clear();
+	scenePrimsVertexIndices.resize(blasPrimsOffsets.back());
+	MarkBVHDirty(0, tlasWideStartOffset);
+	primsModified = true;
+	bvhLayoutModified = true;
+}
+
+
+bool Scene::CreateMeshBLAS(Mesh* mesh)
+{
+	printf("Building BLAS-BVH For Mesh \"%s\"...\n", mesh->name.c_str());
+	mesh->BuildBVH();
+	BVHAccel* blas = mesh->blasBVH;
+	if (renderOptions->bvhWidth > 2)
+		blas->CollapseWide(renderOptions->bvhWidth);
+	bool compressed = !renderOptions->enableCompressedBVH || blas->CompressWide();
+	// SBVH leaves may reference a triangle more than once
+	printf("BLAS-BVH For Mesh \"%s\": %s, %u nodes, %zu refs of %zu triangles, %.2f ms, SAH cost %.2f\n",
+		mesh->name.c_str(), BVHAccel::SplitMethodName(blas->splitMethod), blas->nodeCounts,
+		blas->orderedPrimsIndices.size(), mesh->indices.size(), blas->BuildTime(), blas->SAHCost());
+	return compressed;
+}
 
 void Scene::ProcessBLAS()
 {
 	printf("Copying blasBVHNodes to the scene, Adding offset for these blasBVHNodes in sceneNodes...\n");
-	// meshblasBVHĽڵsceneNodesеĶƫ
-	uint32_t blasBVHRootOffset = 0;
+	const size_t meshesNum = meshes.size();
+	const bool wide = renderOptions->bvhWidth > 2;
+	const bool compressed = wide && renderOptions->enableCompressedBVH;
+	const int groups = renderOptions->bvhWidth / 4;
+	const int words = BVHAccel::CompressedNodeWords(renderOptions->bvhWidth);
 
-	// meshblasBVHҶӴ洢ͼԪscenePrimsVertexIndicesеĶƫ
-	uint32_t blasBVHPrimsOffset = 0;
-
-#pragma omp parallel for
-	for (size_t i = 0; i < meshes.size(); i++)
+	// meshsceneеʼλǰmeshСǰ׺ͣȫƫƣ֮mesh
+	blasBVHStartOffsets.resize(meshesNum);
+	blasWideStartOffsets.resize(meshesNum);
+	blasPrimsOffsets.resize(meshesNum + 1);
+	meshVerticesOffsets.resize(meshesNum + 1);
+	// meshblasBVHĽڵsceneNodessceneWideNodesеĶƫ
+	uint32_t blasBVHRootOffset = 0, blasWideRootOffset = 0;
+	blasPrimsOffsets[0] = meshVerticesOffsets[0] = 0;
+	for (size_t i = 0; i < meshesNum; i++)
 	{
-		std::vector<LinearBVHNode>& blasBVHNodes = meshes[i]->blasBVH->nodes;
+		BVHAccel* blas = meshes[i]->blasBVH;
+		blasBVHStartOffsets[i] = blasBVHRootOffset;
+		blasWideStartOffsets[i] = blasWideRootOffset;
+		blasBVHRootOffset += blas->nodeCounts;
+		if (wide) blasWideRootOffset += blas->wideNodeCounts;
+		blasPrimsOffsets[i + 1] = blasPrimsOffsets[i] + (uint32_t)blas->orderedPrimsIndices.size();
+		meshVerticesOffsets[i + 1] = meshVerticesOffsets[i] + (uint32_t)meshes[i]->verticesUVX.size();
+	}
 
-		// meshBVHNodesscene
-		sceneNodes.insert(sceneNodes.end(), blasBVHNodes.begin(), blasBVHNodes.end());
+	// sceneNodes.size() == blasBVHRootOffsetҲtlasBVHʼƫ
+	tlasBVHStartOffset = blasBVHRootOffset;
+	tlasWideStartOffset = blasWideRootOffset;
+	sceneNodes.resize(tlasBVHStartOffset);
+	// ǰ佫meshprimIdxչΪvertexIdx洢ͳһĿռ
+	scenePrimsVertexIndices.resize(blasPrimsOffsets[meshesNum]);
+	if (wide)
+		sceneWideNodes.resize((size_t)tlasWideStartOffset * groups);
+	if (compressed)
+		sceneCompressedNodes.resize((size_t)tlasWideStartOffset * words);
 
-		// nodeеĲֲӦsceneNodesĴ洢ʽ
-#pragma omp parallel for
-		for (size_t j = 0; j < meshes[i]->blasBVH->nodeCounts; j++)
-		{
+	// every mesh fills its own slices, large meshes are split further into chunks of nodes
+	const int chunkSize = 16 * 1024;
+	ParallelFor((int)meshesNum, 1, [&](int i) {
+		BVHAccel* blas = meshes[i]->blasBVH;
+		const uint32_t nodesOffset = blasBVHStartOffsets[i];
+		const uint32_t primsOffset = blasPrimsOffsets[i];
+
+		// meshBVHNodessceneУnodeеĲֲӦsceneNodesĴ洢ʽ
+		ParallelFor((int)blas->nodeCounts, chunkSize, [&](int j) {
+			LinearBVHNode node = blas->nodes[j];
 			// nPrimitivesжleafinterior
-			if (blasBVHNodes[j].nPrimitives)
+			if (node.nPrimitives)
 				// Ҷӽڵ洢ĵһͼԪƫ
-				sceneNodes[blasBVHRootOffset + j].primitivesOffset += blasBVHPrimsOffset;
+				node.primitivesOffset += primsOffset;
 			else
 				// мڵ洢ƫ
-				sceneNodes[blasBVHRootOffset + j].secondChildOffset += blasBVHRootOffset;
-		}
+				node.secondChildOffset += nodesOffset;
+			sceneNodes[nodesOffset + j] = node;
+		});
 
-		// ²
-		blasBVHStartOffsets.push_back(blasBVHRootOffset);
-		blasBVHRootOffset += (uint32_t)meshes[i]->blasBVH->nodes.size();	// nodeCounts == nodes.size()
-		blasBVHPrimsOffset += (uint32_t)meshes[i]->blasBVH->orderedPrimsIndices.size();
-	}
+		if (!wide) return;
+		// same fix-ups on the collapsed nodes, interior offsets count wide nodes here
+		const uint32_t wideOffset = blasWideStartOffsets[i];
+		ParallelFor((int)blas->wideNodes.size(), chunkSize, [&](int j) {
+			WideBVHNode node = blas->wideNodes[j];
+			for (int c = 0; c < 4; c++)
+			{
+				if (node.childCount[c] > 0)
+					node.childOffset[c] += primsOffset;
+				else if (node.childCount[c] == 0)
+					node.childOffset[c] += wideOffset;
+			}
+			sceneWideNodes[(size_t)wideOffset * groups + j] = node;
+		});
 
-	// node: sceneNodes.size() == blasBVHRootOffsetҲtlasBVHʼƫ
-	tlasBVHStartOffset = blasBVHRootOffset;
-	// ǰ佫meshprimIdxչΪvertexIdx洢ͳһĿռ
-	scenePrimsVertexIndices.resize(blasBVHPrimsOffset);
+		if (!compressed) return;
+		// compressed nodes share the wide node idx, only baseChild(word 4) and basePrim(word 5) move
+		ParallelFor((int)blas->wideNodeCounts, chunkSize, [&](int j) {
+			const uint32_t* src = &blas->compressedNodes[(size_t)j * words];
+			uint32_t* dst = &sceneCompressedNodes[((size_t)wideOffset + j) * words];
+			std::copy(src, src + words, dst);
+			dst[4] += wideOffset;
+			dst[5] += primsOffset;
+		});
+	});
 }
 
 void Scene::ProcessTLAS()
@@ -258,6 +567,52 @@ void Scene::ProcessTLAS()
 			// мڵ洢ƫ
 			sceneNodes[tlasBVHStartOffset + i].secondChildOffset += tlasBVHStartOffset;
 	}
+
+	if (renderOptions->bvhWidth > 2)
+	{
+		// wide tlasBVH leaves get the same information as the binary ones, split over the three child arrays
+		const int groups = renderOptions->bvhWidth / 4;
+		sceneWideNodes.resize((size_t)tlasWideStartOffset * groups);
+		sceneWideNodes.insert(sceneWideNodes.end(), tlasBVH->wideNodes.begin(), tlasBVH->wideNodes.end());
+#pragma omp parallel for
+		for (size_t j = (size_t)tlasWideStartOffset * groups; j < sceneWideNodes.size(); j++)
+			for (int c = 0; c < 4; c++)
+			{
+				WideBVHNode& node = sceneWideNodes[j];
+				if (node.childCount[c] > 0)
+				{
+					uint32_t instanceIdx = tlasBVH->orderedPrimsIndices[node.childOffset[c]];
+					uint32_t meshID = meshInstances[instanceIdx]->meshID;
+					node.childOffset[c] = blasWideStartOffsets[meshID];
+					node.childCount[c] = instanceIdx + 1;
+					node.childParam[c] = meshInstances[instanceIdx]->materialID;
+				}
+				else if (node.childCount[c] == 0)
+					node.childOffset[c] += tlasWideStartOffset;
+			}
+
+		if (renderOptions->enableCompressedBVH)
+		{
+			// compressed tlasBVH leaves read their information from entries behind the blasBVH primitives
+			const int words = BVHAccel::CompressedNodeWords(renderOptions->bvhWidth);
+			size_t tlasPrimsOffset = blasPrimsOffsets.back();
+			scenePrimsVertexIndices.resize(tlasPrimsOffset);
+			for (uint32_t instanceIdx : tlasBVH->orderedPrimsIndices)
+			{
+				int meshID = meshInstances[instanceIdx]->meshID;
+				scenePrimsVertexIndices.push_back(vec3i{ (int)blasWideStartOffsets[meshID], (int)instanceIdx + 1, meshInstances[instanceIdx]->materialID });
+			}
+
+			sceneCompressedNodes.resize((size_t)tlasWideStartOffset * words);
+			size_t firstWord = sceneCompressedNodes.size();
+			sceneCompressedNodes.insert(sceneCompressedNodes.end(), tlasBVH->compressedNodes.begin(), tlasBVH->compressedNodes.end());
+			for (size_t j = firstWord; j < sceneCompressedNodes.size(); j += words)
+			{
+				sceneCompressedNodes[j + 4] += tlasWideStartOffset;
+				sceneCompressedNodes[j + 5] += (uint32_t)tlasPrimsOffset;
+			}
+		}
+	}
 }
 
 void Scene::RebuildTLAS()
@@ -272,88 +627,741 @@ void Scene::RebuildTLAS()
 	// reprocess tlas
 	ProcessTLAS();
 
+	// the tlas node count may change, the renderer reallocates the buffer then
+	bvhDirtyNodes.clear();
+	if (renderOptions->bvhWidth > 2)
+		MarkBVHDirty(tlasWideStartOffset, tlasWideStartOffset + tlasBVH->wideNodeCounts);
+	else
+		MarkBVHDirty(tlasBVHStartOffset, (uint32_t)sceneNodes.size());
+	// compressed tlasBVH leaves live in scenePrimsVertexIndices
+	if (renderOptions->enableCompressedBVH)
+		primsModified = true;
+
+	bvhLayoutModified = true;
+
 	// Copy transforms
 	transforms.resize(0);
 	transforms.resize(meshInstances.size());
 	for (size_t i = 0; i < meshInstances.size(); i++)
-		transforms[i] = meshInstances[i]->transform;
+		transforms[i] = InstanceTransform(meshInstances[i]->transform);
 
 	instancesModified = true;
 	dirty = true;
 }
 
+void Scene::RefitTLAS()
+{
+	ComputeInstanceBounds();
+	if (!tlasBVH->Refit(tlasInstanceBounds, renderOptions->bvhRefitThreshold))
+	{
+		printf("TLAS-BVH degraded by refitting (SAH cost %.2f), rebuilding it...\n", tlasBVH->SAHCost());
+		RebuildTLAS();
+		return;
+	}
+	RefitSceneNodes(tlasBVH, tlasBVHStartOffset, tlasWideStartOffset);
 
-void Scene::ProcessScene()
+	for (size_t i = 0; i < meshInstances.size(); i++)
+		transforms[i] = InstanceTransform(meshInstances[i]->transform);
+
+	instancesModified = true;
+	dirty = true;
+}
+
+void Scene::UpdateInstances()
 {
-	printf("----------[BUILDING BLAS-BVH FOR EVERY MESH]---------\n");
-	CreateBLAS();
+	std::vector<uint32_t> dirtyInstances;
+	for (size_t i = 0; i < meshInstances.size(); i++)
+	{
+		if (!meshInstances[i]->dirty) continue;
+		meshInstances[i]->dirty = false;
+		dirtyInstances.push_back((uint32_t)i);
+		tlasInstanceBounds[i] = InstanceBound(i);
+		transforms[i] = InstanceTransform(meshInstances[i]->transform);
+	}
+	if (dirtyInstances.empty()) return;
 
-	printf("----------[BUILDING TLAS-BVH FOR WHOLE SCENE]--------\n");
-	CreateTLAS();
+	std::vector<uint32_t> changedNodes, changedWideNodes;
+	if (!tlasBVH->RefitPrimitives(dirtyInstances, tlasInstanceBounds, renderOptions->bvhRefitThreshold,
+		changedNodes, changedWideNodes))
+	{
+		printf("TLAS-BVH degraded by moving instances (SAH cost %.2f), rebuilding it...\n", tlasBVH->SAHCost());
+		RebuildTLAS();
+		return;
+	}
 
-	printf("----------[INTEGRATE BLAS-BVH AND TLAS-BVH]----------\n");
+	// only the nodes on the paths to the moved instances are copied and uploaded
+	for (uint32_t n : changedNodes)
+		sceneNodes[tlasBVHStartOffset + n].bounds = tlasBVH->nodes[n].bounds;
+	if (renderOptions->bvhWidth > 2)
+	{
+		const int groups = renderOptions->bvhWidth / 4;
+		const int words = BVHAccel::CompressedNodeWords(renderOptions->bvhWidth);
+		for (uint32_t w : changedWideNodes)
+		{
+			for (int g = 0; g < groups; g++)
+			{
+				WideBVHNode& node = sceneWideNodes[(size_t)(tlasWideStartOffset + w) * groups + g];
+				const WideBVHNode& refitted = tlasBVH->wideNodes[(size_t)w * groups + g];
+				std::copy(&refitted.boundsMin[0][0], &refitted.boundsMin[0][0] + 12, &node.boundsMin[0][0]);
+				std::copy(&refitted.boundsMax[0][0], &refitted.boundsMax[0][0] + 12, &node.boundsMax[0][0]);
+			}
+
+			if (renderOptions->enableCompressedBVH)
+			{
+				// everything but baseChild(word 4) and basePrim(word 5) is relative to the node
+				uint32_t c = tlasBVH->wideToCompressed[w];
+				for (int j = 0; j < words; j++)
+					if (j != 4 && j != 5)
+						sceneCompressedNodes[(size_t)(tlasWideStartOffset + c) * words + j] = tlasBVH->compressedNodes[(size_t)c * words + j];
+				bvhDirtyNodes.push_back(tlasWideStartOffset + c);
+			}
+			else
+				bvhDirtyNodes.push_back(tlasWideStartOffset + w);
+		}
+	}
+	else
+		for (uint32_t n : changedNodes)
+			bvhDirtyNodes.push_back(tlasBVHStartOffset + n);
+
+	dirtyTransforms.insert(dirtyTransforms.end(), dirtyInstances.begin(), dirtyInstances.end());
+	dirty = true;
+}
+
+void Scene::RefitMesh(int meshID)
+{
+	Mesh* mesh = meshes[meshID];
+
+	// the deformed vertices replace the copy of the mesh in the scene
+	uint32_t verticesOffset = meshVerticesOffsets[meshID];
+	uint32_t verticesEnd = meshVerticesOffsets[meshID + 1];
+	std::copy(mesh->verticesUVX.begin(), mesh->verticesUVX.end(), verticesUVX.begin() + verticesOffset);
+	std::copy(mesh->normalsUVY.begin(), mesh->normalsUVY.end(), normalsUVY.begin() + verticesOffset);
+	if (verticesDirtyBegin >= verticesDirtyEnd)
+	{
+		verticesDirtyBegin = verticesOffset;
+		verticesDirtyEnd = verticesEnd;
+	}
+	else
+	{
+		verticesDirtyBegin = std::min(verticesDirtyBegin, verticesOffset);
+		verticesDirtyEnd = std::max(verticesDirtyEnd, verticesEnd);
+	}
+
+	if (mesh->RefitBVH(renderOptions->bvhRefitThreshold))
+		RefitSceneNodes(mesh->blasBVH, blasBVHStartOffsets[meshID],
+			renderOptions->bvhWidth > 2 ? blasWideStartOffsets[meshID] : 0);
+	else
+	{
+		printf("BLAS-BVH For Mesh \"%s\" degraded by refitting (SAH cost %.2f), rebuilding it...\n",
+			mesh->name.c_str(), mesh->blasBVH->SAHCost());
+		if (!CreateMeshBLAS(mesh))
+		{
+			printf("Rebuilt BLAS-BVH has a leaf of more than 255 triangles, using uncompressed BVH nodes\n");
+			UseUncompressedBVH();
+		}
+		// node counts changed, every offset in the scene moves
+		ReprocessBVH();
+	}
+
+	// instance bounds follow the mesh
+	RefitTLAS();
+}
+
+void Scene::RefitSceneNodes(BVHAccel* bvh, uint32_t nodesOffset, uint32_t wideNodesOffset)
+{
+	// only bounds changed, the offsets written by ProcessBLAS and ProcessTLAS stay
+	for (size_t i = 0; i < bvh->nodeCounts; i++)
+		sceneNodes[nodesOffset + i].bounds = bvh->nodes[i].bounds;
+
+	if (renderOptions->bvhWidth > 2)
+	{
+		const int groups = renderOptions->bvhWidth / 4;
+		for (size_t j = 0; j < bvh->wideNodes.size(); j++)
+		{
+			WideBVHNode& node = sceneWideNodes[(size_t)wideNodesOffset * groups + j];
+			const WideBVHNode& refitted = bvh->wideNodes[j];
+			std::copy(&refitted.boundsMin[0][0], &refitted.boundsMin[0][0] + 12, &node.boundsMin[0][0]);
+			std::copy(&refitted.boundsMax[0][0], &refitted.boundsMax[0][0] + 12, &node.boundsMax[0][0]);
+		}
+
+		if (renderOptions->enableCompressedBVH)
+		{
+			// everything but baseChild(word 4) and basePrim(word 5) is relative to the node
+			const int words = BVHAccel::CompressedNodeWords(renderOptions->bvhWidth);
+			for (size_t j = 0; j < bvh->compressedNodes.size(); j++)
+				if (j % words != 4 && j % words != 5)
+					sceneCompressedNodes[(size_t)wideNodesOffset * words + j] = bvh->compressedNodes[j];
+		}
+		MarkBVHDirty(wideNodesOffset, wideNodesOffset + bvh->wideNodeCounts);
+	}
+	else
+		MarkBVHDirty(nodesOffset, nodesOffset + bvh->nodeCounts);
+}
+
+void Scene::MarkBVHDirty(uint32_t begin, uint32_t end)
+{
+	if (bvhDirtyBegin >= bvhDirtyEnd)
+	{
+		bvhDirtyBegin = begin;
+		bvhDirtyEnd = end;
+	}
+	else
+	{
+		bvhDirtyBegin = std::min(bvhDirtyBegin, begin);
+		bvhDirtyEnd = std::max(bvhDirtyEnd, end);
+	}
+}
+
+void Scene::ReprocessBVH()
+{
 	ProcessBLAS();
 	ProcessTLAS();
+	ExpandPrimsVertexIndices();
 
-	printf("----------[COPYING MESH DATA TO THE SCENE]-----------\n");
-	printf("Copying mesh data to the scene, Expand the primIndex to vertexIndex...\n");
-	// meshblasBVHҶӴ洢ͼԪӦscene.verticesUVXscene.normalsUVYеĶƫ
-	uint32_t blasBVHVerticesOffset = 0;
-	size_t counter = 0;	// 
-	for (size_t i = 0; i < meshes.size(); i++)
+	bvhDirtyNodes.clear();
+	if (renderOptions->bvhWidth > 2)
+		MarkBVHDirty(0, tlasWideStartOffset + tlasBVH->wideNodeCounts);
+	else
+		MarkBVHDirty(0, (uint32_t)sceneNodes.size());
+	primsModified = true;
+	bvhLayoutModified = true;
+}
+
+int Scene::WideBVHDepth() const
+{
+	const ArrayView<WideBVHNode> nodes = GPUArrays().wideNodes;
+	if (nodes.empty()) return 0;
+
+	// height of every wide node. children are numbered behind their parent inside a BVH, so a reverse sweep
+	// sees them done. tlasBVH leaves continue into the blasBVH roots, the blasBVH nodes are swept first
+	const int width = renderOptions->bvhWidth;
+	const int groups = width / 4;
+	const uint32_t nodesNum = (uint32_t)(nodes.size / groups);
+	std::vector<int> height(nodesNum, 1);
+	auto sweep = [&](uint32_t begin, uint32_t end, bool tlas) {
+		for (int64_t w = (int64_t)end - 1; w >= (int64_t)begin; w--)
+			for (int slot = 0; slot < width; slot++)
+			{
+				const WideBVHNode& group = nodes.data[w * groups + slot / 4];
+				int lane = slot & 3;
+				if (group.childCount[lane] == 0 || (tlas && group.childCount[lane] > 0))
+					height[w] = std::max(height[w], 1 + height[group.childOffset[lane]]);
+			}
+	};
+	sweep(0, tlasWideStartOffset, false);
+	sweep(tlasWideStartOffset, nodesNum, true);
+	return height[tlasWideStartOffset];
+}
+
+void Scene::ExpandPrimsVertexIndices()
+{
+	printf("Expand the primIndex to vertexIndex...\n");
+	// ΪsceneBVHҶӽڵд洢ͼԪverticesUVXnormalsUVY֮
+	// meshͼԪsceneеƫProcessBLASmesh֮以
+	ParallelFor((int)meshes.size(), 1, [&](int i) {
+		const std::vector<uint32_t>& blasBVHPrimsIndices = meshes[i]->blasBVH->orderedPrimsIndices;
+		const std::vector<vec3i>& meshIndices = meshes[i]->indices;
+		// meshblasBVHҶӴ洢ͼԪӦscene.verticesUVXscene.normalsUVYеĶƫ
+		const int verticesOffset = (int)meshVerticesOffsets[i];
+		vec3i* dst = scenePrimsVertexIndices.data() + blasPrimsOffsets[i];
+
+		// meshorderedPrimsIndicesչΪΪprimΣһorderedIdxӦmeshе
+		ParallelFor((int)blasBVHPrimsIndices.size(), 64 * 1024, [&](int j) {
+			const vec3i& tri = meshIndices[blasBVHPrimsIndices[j]];
+			dst[j] = vec3i{ tri.x + verticesOffset, tri.y + verticesOffset, tri.z + verticesOffset };
+		});
+	});
+}
+
+
+int Scene::DeduplicateTextures()
+{
+	// the first texture of a hash is kept, the later ones with the same size and pixels are merged into it.
+	// textures are compacted in place, remap[j] < i is already the final slot of texture j
+	std::unordered_map<uint64_t, int> firstOfHash;
+	std::vector<int> remap(textures.size());
+	int merged = 0;
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		int first = firstOfHash.emplace(textures[i]->contentHash, (int)i).first->second;
+		const Texture* kept = textures[remap[first]];
+		if (first != (int)i && kept->width == textures[i]->width && kept->height == textures[i]->height &&
+			kept->texData == textures[i]->texData)
+		{
+			remap[i] = remap[first];
+			textures[remap[first]]->duplicateRefs += 1 + textures[i]->duplicateRefs;
+			delete textures[i];
+			merged++;
+		}
+		else
+		{
+			remap[i] = (int)i - merged;
+			textures[remap[i]] = textures[i];
+		}
+	}
+
+	if (merged > 0)
 	{
-		std::vector<uint32_t>& blasBVHPrimsIndices = meshes[i]->blasBVH->orderedPrimsIndices;
-		size_t blasBVHPrimsIndicesNum = blasBVHPrimsIndices.size();
+		textures.resize(textures.size() - merged);
+		RemapMaterialTextures(materials, remap);
+		RemapRegistry(textureRegistry, remap);
+	}
+	return merged;
+}
+
+// smallest power of two not below size
+static int PowerOfTwoCeil(int size)
+{
+	int side = 1;
+	while (side < size)
+		side <<= 1;
+	return side;
+}
+
+// kTextureFormatsNum stands for a texture no material slot uses, it is stored in whatever class it lands in
+static const char* kTextureFormatNames[kTextureFormatsNum] = { "RGBA8", "BC1", "BC3", "BC4", "BC5" };
+
+// least compressed format that serves both a and b: BC4 (R) < BC1 (RGB) < BC3 (RGBA), BC4 < BC5 (RG)
+static TextureFormat JoinTextureFormats(TextureFormat a, TextureFormat b)
+{
+	if (a == b || b == kTextureFormatsNum) return a;
+	if (a == kTextureFormatsNum) return b;
+	if (a == kTextureBC4) return b;
+	if (b == kTextureBC4) return a;
+	if ((a == kTextureBC1 && b == kTextureBC3) || (a == kTextureBC3 && b == kTextureBC1)) return kTextureBC3;
+	// BC5 has no blue channel and the BC1 colors are too coarse for normals
+	return kTextureRGBA8;
+}
+
+void Scene::ProcessTextures()
+{
+	const int maxWidth = renderOptions->texArrayWidth, maxHeight = renderOptions->texArrayHeight;
+	const bool compress = renderOptions->enableTextureCompression;
+	const int maxSideX = PowerOfTwoCeil(maxWidth), maxSideY = PowerOfTwoCeil(maxHeight);
 
-		// ΪsceneBVHҶӽڵд洢ͼԪverticesUVXnormalsUVY֮
-		for (size_t j = 0; j < blasBVHPrimsIndicesNum; j++)
+	// the format every texture needs for the material slots it is used in. roughness and metallic read R,
+	// normal maps RG (z is reconstructed in the shader), base color RGB and A if any texel is not opaque
+	// base color and emission maps are sRGB, their mip levels are averaged in linear space
+	std::vector<TextureFormat> formats(textures.size(), compress ? kTextureFormatsNum : kTextureRGBA8);
+	std::vector<char> baseColors(textures.size(), 0), srgb(textures.size(), 0);
+	for (const Material& mat : materials)
+	{
+		const float texIDs[5] = { mat.baseColorTexID, mat.roughnessTexID, mat.metallicTexID, mat.normalMapTexID, mat.emissionMapTexID };
+		const TextureFormat slotFormats[5] = { kTextureBC1, kTextureBC4, kTextureBC4, kTextureBC5, kTextureBC1 };
+		for (int s = 0; s < 5; s++)
+			if (texIDs[s] >= 0.0f && compress)
+				formats[(int)texIDs[s]] = JoinTextureFormats(formats[(int)texIDs[s]], slotFormats[s]);
+		if (mat.baseColorTexID >= 0.0f)
+			baseColors[(int)mat.baseColorTexID] = srgb[(int)mat.baseColorTexID] = 1;
+		if (mat.emissionMapTexID >= 0.0f)
+			srgb[(int)mat.emissionMapTexID] = 1;
+	}
+	if (compress)
+	{
+		ParallelFor((int)textures.size(), 1, [&](int i) {
+			const std::vector<unsigned char>& texels = textures[i]->texData;
+			if (baseColors[i])
+				for (size_t p = 3; p < texels.size(); p += 4)
+					if (texels[p] != 255)
+					{
+						formats[i] = JoinTextureFormats(formats[i], kTextureBC3);
+						break;
+					}
+		});
+	}
+
+	// a texture class is the power of two layer width and height, the format and the textures stored in it.
+	// layers need not be square, a texture is stretched to its layer so its uvs stay as they are
+	struct TextureClass
+	{
+		vec2i side;
+		TextureFormat format;
+		std::vector<int> members;
+	};
+	auto classBytes = [&](vec2i side, TextureFormat format, size_t layers) {
+		return layers * TextureFormatBytes(format == kTextureFormatsNum ? kTextureBC4 : format, std::min(side.x, maxWidth), std::min(side.y, maxHeight));
+	};
+	auto maxSide = [](vec2i a, vec2i b) { return vec2i(std::max(a.x, b.x), std::max(a.y, b.y)); };
+
+	// one class per width, height and format at first, blocks are 4 x 4 so compressed layers are at least that large
+	std::map<std::pair<std::pair<int, int>, int>, std::vector<int>> groups;
+	for (size_t i = 0; i < textures.size(); i++)
+	{
+		int sideX = std::min(PowerOfTwoCeil(textures[i]->width), maxSideX);
+		int sideY = std::min(PowerOfTwoCeil(textures[i]->height), maxSideY);
+		if (formats[i] != kTextureRGBA8)
 		{
-			// scenePrimsVertexIndices.size() = sum{meshes[x].blasBVH.orderedPrimsIndices.size() | x:[0,n)}
-			// meshorderedPrimsIndicesչΪΪprimΣһorderedIdxӦ
-			int v1 = (blasBVHPrimsIndices[j] * 3 + 0) + blasBVHVerticesOffset;
-			int v2 = (blasBVHPrimsIndices[j] * 3 + 1) + blasBVHVerticesOffset;
-			int v3 = (blasBVHPrimsIndices[j] * 3 + 2) + blasBVHVerticesOffset;
-			scenePrimsVertexIndices[counter++] = vec3i{v1, v2, v2};
+			sideX = std::min(std::max(sideX, 4), maxSideX);
+			sideY = std::min(std::max(sideY, 4), maxSideY);
 		}
+		groups[std::make_pair(std::make_pair(sideX, sideY), (int)formats[i])].push_back((int)i);
+	}
+	std::vector<TextureClass> classes;
+	for (auto& group : groups)
+		classes.push_back(TextureClass{ vec2i(group.first.first.first, group.first.first.second), (TextureFormat)group.first.second, std::move(group.second) });
 
-		// ²
-		// meshes[i]->verticesUVX.size() == 3 * meshes[i]->blasBVH->orderedPrimsIndices.size()
-		blasBVHVerticesOffset += meshes[i]->verticesUVX.size();
+	// too many classes: merge the two whose union, with the larger width and height and the joined format, grows textureMapsArray least
+	while (classes.size() > kTextureClassesNum)
+	{
+		size_t bestA = 0, bestB = 1;
+		int64_t bestGrowth = INT64_MAX;
+		for (size_t a = 0; a < classes.size(); a++)
+			for (size_t b = a + 1; b < classes.size(); b++)
+			{
+				vec2i side = maxSide(classes[a].side, classes[b].side);
+				TextureFormat format = JoinTextureFormats(classes[a].format, classes[b].format);
+				int64_t growth = (int64_t)classBytes(side, format, classes[a].members.size() + classes[b].members.size()) -
+					(int64_t)classBytes(classes[a].side, classes[a].format, classes[a].members.size()) -
+					(int64_t)classBytes(classes[b].side, classes[b].format, classes[b].members.size());
+				if (growth < bestGrowth)
+				{
+					bestGrowth = growth;
+					bestA = a;
+					bestB = b;
+				}
+			}
+		TextureClass& merged = classes[bestA];
+		merged.side = maxSide(merged.side, classes[bestB].side);
+		merged.format = JoinTextureFormats(merged.format, classes[bestB].format);
+		merged.members.insert(merged.members.end(), classes[bestB].members.begin(), classes[bestB].members.end());
+		classes.erase(classes.begin() + bestB);
+	}
+	std::sort(classes.begin(), classes.end(), [](const TextureClass& a, const TextureClass& b) {
+		int64_t areaA = (int64_t)a.side.x * a.side.y, areaB = (int64_t)b.side.x * b.side.y;
+		if (areaA != areaB) return areaA < areaB;
+		return a.side.x != b.side.x ? a.side.x < b.side.x : a.format < b.format;
+	});
 
-		// meshĶ㡢ߡuvݵscene
-		verticesUVX.insert(verticesUVX.end(), meshes[i]->verticesUVX.begin(), meshes[i]->verticesUVX.end());
-		normalsUVY.insert(normalsUVY.end(), meshes[i]->normalsUVY.begin(), meshes[i]->normalsUVY.end());
+	std::vector<int> classOf(textures.size());
+	int end = 0;
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		if (c < (int)classes.size())
+		{
+			textureClassSizes[c] = vec2i(std::min(classes[c].side.x, maxWidth), std::min(classes[c].side.y, maxHeight));
+			// a class of textures no slot uses is never sampled, store it as small as possible
+			textureClassFormats[c] = classes[c].format == kTextureFormatsNum ? kTextureBC4 : classes[c].format;
+			end += (int)classes[c].members.size();
+			for (int i : classes[c].members)
+				classOf[i] = c;
+		}
+		else
+		{
+			textureClassSizes[c] = vec2i(0, 0);
+			textureClassFormats[c] = kTextureRGBA8;
+		}
+		textureClassEnds[c] = end;
 	}
 
-	printf("----------[COPYING TRANSFORM TO THE SCENE]-----------\n");
-	printf("Copying meshInstance transform to the scene...\n");
-	transforms.resize(meshInstances.size());
-	for (size_t i = 0; i < meshInstances.size(); i++)
-		transforms[i] = meshInstances[i]->transform;
+	// sort the textures by class, the order within a class stays the order they were added in
+	std::vector<int> order(textures.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = (int)i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return classOf[a] < classOf[b]; });
 
-	if (!textures.empty())
+	std::vector<Texture*> sorted(textures.size());
+	std::vector<int> remap(textures.size());
+	for (size_t i = 0; i < order.size(); i++)
 	{
-		printf("----------[COPYING TEXTURES TO THE SCENE]------------\n");
-		printf("Copying and resizing textures...\n");
-		int reqWidth = renderOptions->texArrayWidth;
-		int reqHeight = renderOptions->texArrayHeight;
-		size_t texBytes = reqWidth * reqHeight * 4;
-		textureMapsArray.resize(texBytes * textures.size());
+		sorted[i] = textures[order[i]];
+		remap[order[i]] = (int)i;
+	}
+	textures.swap(sorted);
+	RemapMaterialTextures(materials, remap);
+	RemapRegistry(textureRegistry, remap);
 
-#pragma omp parallel for
-		for (size_t i = 0; i < textures.size(); i++)
+	// class by class, level by level, layer by layer: every level of a class is one glTexImage3D
+	std::vector<size_t> classOffsets(kTextureClassesNum + 1, 0);
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		int layers = textureClassEnds[c] - (c > 0 ? textureClassEnds[c - 1] : 0);
+		classOffsets[c + 1] = classOffsets[c] + layers * TextureMipChainBytes(textureClassFormats[c], textureClassSizes[c].x, textureClassSizes[c].y);
+	}
+	const size_t bytes = classOffsets[kTextureClassesNum];
+	textureMapsArray.resize(bytes);
+	// start of level of texture i in textureMapsArray
+	auto levelOffset = [&](int i, int c, int level) {
+		int layers = textureClassEnds[c] - (c > 0 ? textureClassEnds[c - 1] : 0), layer = i - (c > 0 ? textureClassEnds[c - 1] : 0);
+		size_t offset = classOffsets[c];
+		for (int l = 0; l < level; l++)
+			offset += layers * TextureFormatBytes(textureClassFormats[c], TextureMipSize(textureClassSizes[c].x, l), TextureMipSize(textureClassSizes[c].y, l));
+		return offset + layer * TextureFormatBytes(textureClassFormats[c], TextureMipSize(textureClassSizes[c].x, level), TextureMipSize(textureClassSizes[c].y, level));
+	};
+
+	// the levels are box filtered from the level above. compressed chains come from the cache file of their texture,
+	// or are built, compressed and cached
+	std::atomic<int> cachedLayers(0);
+	ParallelFor((int)textures.size(), 1, [&](int i) {
+		const Texture* tex = textures[i];
+		const int c = classOf[order[i]];
+		const vec2i& size = textureClassSizes[c];
+		const TextureFormat format = textureClassFormats[c];
+		const bool isSrgb = srgb[order[i]] != 0;
+		const int levels = TextureMipLevels(size.x, size.y);
+
+		std::vector<unsigned char> chain;
+		if (format != kTextureRGBA8)
 		{
-			if (textures[i]->width != reqWidth || textures[i]->height != reqHeight)
+			chain.resize(TextureMipChainBytes(format, size.x, size.y));
+			if (tex->LoadCompressedCache(format, size.x, size.y, isSrgb, chain.data()))
 			{
-				unsigned char * resizedTex = new unsigned char[texBytes];
-				stbir_resize_uint8(&textures[i]->texData[0], textures[i]->width, textures[i]->height, 0,
-									resizedTex, reqWidth, reqHeight, 0, 4);
-				std::copy(resizedTex, resizedTex + texBytes, &textureMapsArray[i * texBytes]);
-				delete[] resizedTex;
+				cachedLayers++;
+				size_t chainOffset = 0;
+				for (int level = 0; level < levels; level++)
+				{
+					size_t levelBytes = TextureFormatBytes(format, TextureMipSize(size.x, level), TextureMipSize(size.y, level));
+					memcpy(&textureMapsArray[levelOffset(i, c, level)], &chain[chainOffset], levelBytes);
+					chainOffset += levelBytes;
+				}
+				return;
 			}
+		}
+
+		// RGBA8 levels are written to textureMapsArray directly, the others go through texels and are compressed
+		std::vector<unsigned char> texels[2];
+		const unsigned char* above = nullptr;
+		size_t chainOffset = 0;
+		for (int level = 0; level < levels; level++)
+		{
+			const int w = TextureMipSize(size.x, level), h = TextureMipSize(size.y, level);
+			unsigned char* dst = &textureMapsArray[levelOffset(i, c, level)];
+			unsigned char* rgba = dst;
+			if (format != kTextureRGBA8)
+			{
+				texels[level & 1].resize((size_t)w * h * 4);
+				rgba = texels[level & 1].data();
+			}
+
+			if (level == 0 && tex->width == w && tex->height == h)
+				std::copy(tex->texData.begin(), tex->texData.end(), rgba);
+			else if (level == 0)
+				stbir_resize_uint8(tex->texData.data(), tex->width, tex->height, 0, rgba, w, h, 0, 4);
 			else
-				std::copy(textures[i]->texData.begin(), textures[i]->texData.end(), &textureMapsArray[i * texBytes]);
+				stbir_resize_uint8_generic(above, TextureMipSize(size.x, level - 1), TextureMipSize(size.y, level - 1), 0, rgba, w, h, 0,
+					4, 3, 0, STBIR_EDGE_WRAP, STBIR_FILTER_BOX, isSrgb ? STBIR_COLORSPACE_SRGB : STBIR_COLORSPACE_LINEAR, nullptr);
+			above = rgba;
+
+			if (format != kTextureRGBA8)
+			{
+				size_t levelBytes = TextureFormatBytes(format, w, h);
+				CompressTexture(rgba, w, h, format, &chain[chainOffset]);
+				memcpy(dst, &chain[chainOffset], levelBytes);
+				chainOffset += levelBytes;
+			}
 		}
+		if (format != kTextureRGBA8)
+			tex->WriteCompressedCache(format, size.x, size.y, isSrgb, chain.data());
+	});
+
+	size_t uncompressedBytes = 0;
+	for (size_t c = 0; c < classes.size(); c++)
+	{
+		int layers = textureClassEnds[c] - (c > 0 ? textureClassEnds[c - 1] : 0);
+		uncompressedBytes += layers * TextureMipChainBytes(kTextureRGBA8, textureClassSizes[c].x, textureClassSizes[c].y);
+		printf("Texture class %d x %d %s: %d layers of %d levels, %.1f MB\n", textureClassSizes[c].x, textureClassSizes[c].y,
+			kTextureFormatNames[textureClassFormats[c]], layers, TextureMipLevels(textureClassSizes[c].x, textureClassSizes[c].y),
+			(classOffsets[c + 1] - classOffsets[c]) / (1024.0 * 1024.0));
+	}
+	if (compress)
+		printf("Textures take %.1f MB instead of %.1f MB as RGBA8, %d compressed layers read from cache\n",
+			bytes / (1024.0 * 1024.0), uncompressedBytes / (1024.0 * 1024.0), cachedLayers.load());
+}
+
+void Scene::ReportDedupe(int mergedTextures)
+{
+	// without deduplication every name hit of AddTexture and every texture merged by content would be
+	// another layer of the class of the texture it reuses, and every meshInstance would have its own vertices and indices
+	size_t textureRefs = 0, textureSaved = 0;
+	for (const Material& mat : materials)
+	{
+		const float texIDs[5] = { mat.baseColorTexID, mat.roughnessTexID, mat.metallicTexID, mat.normalMapTexID, mat.emissionMapTexID };
+		for (int i = 0; i < 5; i++)
+			textureRefs += texIDs[i] >= 0.0f;
+	}
+	for (int i = 0, c = 0; i < (int)textures.size(); i++)
+	{
+		while (textureClassEnds[c] <= i)
+			c++;
+		textureSaved += textures[i]->duplicateRefs * TextureMipChainBytes(textureClassFormats[c], textureClassSizes[c].x, textureClassSizes[c].y);
+	}
+
+	std::vector<size_t> meshRefs(meshes.size(), 0);
+	for (size_t i = 0; i < meshInstances.size(); i++)
+		meshRefs[meshInstances[i]->meshID]++;
+	size_t meshSaved = 0;
+	for (size_t i = 0; i < meshes.size(); i++)
+		if (meshRefs[i] > 1)
+			meshSaved += (meshRefs[i] - 1) * (meshes[i]->verticesUVX.size() * 2 * sizeof(vec4f) + meshes[i]->indices.size() * sizeof(vec3i));
+
+	printf("%zu texture references share %zu textures (%d merged by content), %zu meshInstances share %zu meshes\n",
+		textureRefs, textures.size(), mergedTextures, meshInstances.size(), meshes.size());
+	printf("Deduplication saved %.1f MB of texture layers and %.1f MB of mesh data\n",
+		textureSaved / (1024.0 * 1024.0), meshSaved / (1024.0 * 1024.0));
+}
+
+void Scene::CollectEmissiveTriangles()
+{
+	emissiveTriangles.clear();
+	for (Material& mat : materials)
+		mat.emissivePickScale = 0.0f;
+
+	// luminance of the emission of every material. emission maps replace the emission color in GetMaterial,
+	// the average of their texels in linear space stands in for it
+	float srgbToLinear[256];
+	for (int i = 0; i < 256; i++)
+		srgbToLinear[i] = powf(i / 255.0f, 2.2f);
+	std::vector<float> emissionLum(materials.size(), 0.0f);
+	ParallelFor((int)materials.size(), 1, [&](int m) {
+		const Material& mat = materials[m];
+		if (mat.emissionMapTexID < 0.0f)
+		{
+			emissionLum[m] = Luminance(mat.emission.x, mat.emission.y, mat.emission.z);
+			return;
+		}
+		const std::vector<unsigned char>& texels = textures[(int)mat.emissionMapTexID]->texData;
+		double sum = 0.0;
+		for (size_t p = 0; p + 4 <= texels.size(); p += 4)
+			sum += Luminance(srgbToLinear[texels[p]], srgbToLinear[texels[p + 1]], srgbToLinear[texels[p + 2]]);
+		emissionLum[m] = texels.size() >= 4 ? (float)(sum / (texels.size() / 4)) : 0.0f;
+	});
+
+	std::vector<char> emissiveMesh(meshes.size(), 0);
+	for (const MeshInstance* instance : meshInstances)
+		if (emissionLum[instance->materialID] > 0.0f)
+			emissiveMesh[instance->meshID] = 1;
+
+	// sbvh may reference a triangle from several leaves, so orderedPrimsIndices can hold it more than once.
+	// uniquePrims[i] keeps the first entry of every triangle of mesh i, relative to blasPrimsOffsets[i]
+	std::vector<std::vector<uint32_t>> uniquePrims(meshes.size());
+	ParallelFor((int)meshes.size(), 1, [&](int i) {
+		if (!emissiveMesh[i])
+			return;
+		const std::vector<uint32_t>& blasBVHPrimsIndices = meshes[i]->blasBVH->orderedPrimsIndices;
+		std::vector<char> seen(meshes[i]->indices.size(), 0);
+		uniquePrims[i].reserve(meshes[i]->indices.size());
+		for (size_t j = 0; j < blasBVHPrimsIndices.size(); j++)
+		{
+			if (seen[blasBVHPrimsIndices[j]])
+				continue;
+			seen[blasBVHPrimsIndices[j]] = 1;
+			uniquePrims[i].push_back((uint32_t)j);
+		}
+	});
+
+	// every triangle of an emissive meshInstance is a light, the ones of the k-th instance start at firstTriangle[k]
+	std::vector<int> emissiveInstances;
+	std::vector<size_t> firstTriangle;
+	size_t trianglesNum = 0;
+	for (size_t i = 0; i < meshInstances.size(); i++)
+	{
+		if (emissionLum[meshInstances[i]->materialID] <= 0.0f)
+			continue;
+		emissiveInstances.push_back((int)i);
+		firstTriangle.push_back(trianglesNum);
+		trianglesNum += uniquePrims[meshInstances[i]->meshID].size();
+	}
+	if (trianglesNum == 0)
+		return;
+
+	emissiveTriangles.resize(trianglesNum);
+	std::vector<float> power(trianglesNum);
+	ParallelFor((int)emissiveInstances.size(), 1, [&](int k) {
+		const MeshInstance* instance = meshInstances[emissiveInstances[k]];
+		// the world area only depends on the linear part of the transform, m.data[c] is column c of the GLSL matrix
+		const mat4& m = instance->transform;
+		vec3f a0(m.data[0][0], m.data[0][1], m.data[0][2]);
+		vec3f a1(m.data[1][0], m.data[1][1], m.data[1][2]);
+		vec3f a2(m.data[2][0], m.data[2][1], m.data[2][2]);
+		auto toWorld = [&](const vec4f& v) { return a0 * v.x + a1 * v.y + a2 * v.z; };
+
+		const uint32_t primsBegin = blasPrimsOffsets[instance->meshID];
+		const std::vector<uint32_t>& prims = uniquePrims[instance->meshID];
+		const float exitance = PI * emissionLum[instance->materialID];
+		EmissiveTriangle* dst = emissiveTriangles.data() + firstTriangle[k];
+		float* dstPower = power.data() + firstTriangle[k];
+		ParallelFor((int)prims.size(), 64 * 1024, [&](int j) {
+			const uint32_t primIdx = primsBegin + prims[j];
+			const vec3i& tri = scenePrimsVertexIndices[primIdx];
+			vec3f v0 = toWorld(verticesUVX[tri.x]);
+			float area = 0.5f * Cross(toWorld(verticesUVX[tri.y]) - v0, toWorld(verticesUVX[tri.z]) - v0).Length();
+
+			dst[j].primIdx = (int32_t)primIdx;
+			dst[j].instanceIdx = emissiveInstances[k];
+			dst[j].matID = instance->materialID;
+			dst[j].padding[0] = dst[j].padding[1] = 0;
+			dstPower[j] = exitance * area;
+		});
+	});
+
+	std::vector<AliasEntry> aliasTable(trianglesNum);
+	double totalPower = BuildAliasTable(power.data(), trianglesNum, aliasTable.data());
+	// only degenerate triangles, nothing to sample
+	if (totalPower <= 0.0)
+	{
+		emissiveTriangles.clear();
+		return;
+	}
+	for (size_t i = 0; i < trianglesNum; i++)
+	{
+		emissiveTriangles[i].pickPdf = (float)(power[i] / totalPower);
+		emissiveTriangles[i].alias = aliasTable[i];
+	}
+	// a point of a triangle of material m is sampled with probability PI * L_m * area / totalPower * (1 / area)
+	for (size_t m = 0; m < materials.size(); m++)
+		materials[m].emissivePickScale = (float)(PI * emissionLum[m] / totalPower);
+
+	printf("%zu emissive triangles in %zu meshInstances, total power %.3g\n", trianglesNum, emissiveInstances.size(), totalPower);
+}
+
+void Scene::ProcessScene()
+{
+	printf("----------[BUILDING BLAS-BVH FOR EVERY MESH]---------\n");
+	CreateBLAS();
+
+	printf("----------[BUILDING TLAS-BVH FOR WHOLE SCENE]--------\n");
+	CreateTLAS();
+
+	printf("----------[INTEGRATE BLAS-BVH AND TLAS-BVH]----------\n");
+	ProcessBLAS();
+	ProcessTLAS();
+
+	printf("----------[COPYING MESH DATA TO THE SCENE]-----------\n");
+	printf("Copying mesh data to the scene...\n");
+	ExpandPrimsVertexIndices();
+	// meshĶ㡢ߡuvݵsceneУmeshλProcessBLASеmeshVerticesOffsetsȷ
+	verticesUVX.resize(meshVerticesOffsets.back());
+	normalsUVY.resize(meshVerticesOffsets.back());
+	ParallelFor((int)meshes.size(), 1, [&](int i) {
+		std::copy(meshes[i]->verticesUVX.begin(), meshes[i]->verticesUVX.end(), verticesUVX.begin() + meshVerticesOffsets[i]);
+		std::copy(meshes[i]->normalsUVY.begin(), meshes[i]->normalsUVY.end(), normalsUVY.begin() + meshVerticesOffsets[i]);
+	});
+
+	printf("----------[COPYING TRANSFORM TO THE SCENE]-----------\n");
+	printf("Copying meshInstance transform to the scene...\n");
+	transforms.resize(meshInstances.size());
+	for (size_t i = 0; i < meshInstances.size(); i++)
+		transforms[i] = InstanceTransform(meshInstances[i]->transform);
+
+	if (renderOptions->enableTextureDedupe || renderOptions->enableTextureCompression)
+	{
+		ParallelFor((int)textures.size(), 1, [&](int i) {
+			Texture* tex = textures[i];
+			tex->contentHash = HashBytes(tex->texData.data(), tex->texData.size(), ((uint64_t)tex->width << 32) | (uint32_t)tex->height);
+		});
+	}
+
+	int mergedTextures = 0;
+	if (renderOptions->enableTextureDedupe && textures.size() > 1)
+	{
+		printf("Merging identical textures...\n");
+		mergedTextures = DeduplicateTextures();
+	}
+
+	if (!textures.empty())
+	{
+		printf("----------[COPYING TEXTURES TO THE SCENE]------------\n");
+		printf("Copying, resizing and compressing textures...\n");
+		ProcessTextures();
 	}
 
 	if (!camera)
@@ -364,6 +1372,17 @@ void Scene::ProcessScene()
 		AddCamera(vec3f(center.x, center.y, center.z + diagonal.Length()), center, 45.0f);
 	}
 
+	if (!lights.empty())
+	{
+		printf("----------[BUILDING LIGHT BVH]-----------------------\n");
+		BuildLightBVH(lights, lightBVHNodes, distantLights);
+		printf("%zu lights in the light BVH, %zu distant lights\n", lights.size() - distantLights.size(), distantLights.size());
+	}
+
+	printf("----------[COLLECTING EMISSIVE TRIANGLES]------------\n");
+	CollectEmissiveTriangles();
+
+	ReportDedupe(mergedTextures);
 	initialized = true;
 }
 
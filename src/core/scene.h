@@ -1,7 +1,13 @@
 #pragma once
 
 #include <vector>
+#include <unordered_map>
 #include "matrix.h"
+#include "bounds3.h"
+#include "mappedFile.h"
+#include "blockCompression.h"
+#include "lightBVH.h"
+#include "aliasTable.h"
 
 NAMESPACE_BEGIN(nagi)
 
@@ -14,6 +20,76 @@ class Material;
 class Light;
 class BVHAccel;
 struct LinearBVHNode;
+struct WideBVHNode;
+
+// instance transform as uploaded to transformsTex, 7 RGBA32F texels: the rows of transform (GLSL columns),
+// then the rows of its affine inverse, so the shaders move rays into instance space without inverting per visit
+struct InstanceTransform
+{
+	InstanceTransform() {}
+	explicit InstanceTransform(const mat4& m);
+
+	mat4 transform;
+	vec4f invRows[3];
+};
+
+// triangle of an emissive meshInstance as uploaded to lightBVHTex after the distant light indices, 2 GL_RGBA32I
+// texels: the triangle, its instance and material and the probability to pick it, then its alias table column.
+// triangles are picked by power (PI * L * world area), see Scene::CollectEmissiveTriangles
+struct EmissiveTriangle
+{
+	int32_t primIdx;		// into scenePrimsVertexIndices, the first entry of the triangle when sbvh duplicated it
+	int32_t instanceIdx;
+	int32_t matID;
+	float pickPdf;
+	AliasEntry alias;
+	int32_t padding[2];
+};
+static_assert(sizeof(EmissiveTriangle) == 2 * 16, "EmissiveTriangle is 2 texels of lightBVHTex");
+
+// most texture size classes, every class is one GL_TEXTURE_2D_ARRAY of its own layer size
+static const int kTextureClassesNum = 4;
+
+// read-only view of a contiguous array
+template <typename T>
+struct ArrayView
+{
+	ArrayView() :data(nullptr), size(0) {}
+	ArrayView(const T* data, size_t size) :data(data), size(size) {}
+	explicit ArrayView(const std::vector<T>& v) :data(v.data()), size(v.size()) {}
+	bool empty() const { return size == 0; }
+
+	const T* data;
+	size_t size;
+};
+
+// the large arrays Renderer::InitGPUDataBuffers uploads. they view the vectors of Scene after ProcessScene,
+// or the pages of the .nagib file mapped by Scene::LoadBinary
+struct SceneGPUArrays
+{
+	SceneGPUArrays() :texturesNum(0)
+	{
+		for (int c = 0; c < kTextureClassesNum; c++)
+		{
+			textureClassSizes[c] = vec2i(0, 0);
+			textureClassFormats[c] = kTextureRGBA8;
+			textureClassEnds[c] = 0;
+		}
+	}
+
+	ArrayView<LinearBVHNode> nodes;
+	ArrayView<WideBVHNode> wideNodes;
+	ArrayView<uint32_t> compressedNodes;
+	ArrayView<vec3i> primsVertexIndices;
+	ArrayView<vec4f> verticesUVX;
+	ArrayView<vec4f> normalsUVY;
+	// mip chains of the texture classes one after the other, see Scene::textureMapsArray
+	ArrayView<unsigned char> textureMaps;
+	int texturesNum;
+	vec2i textureClassSizes[kTextureClassesNum];
+	TextureFormat textureClassFormats[kTextureClassesNum];
+	int textureClassEnds[kTextureClassesNum];
+};
 
 struct RenderOptions
 {
@@ -24,8 +100,13 @@ struct RenderOptions
 		maxSpp = 512;
 		maxDepth = 3;
 		RRDepth = 2;
-		texArrayWidth = 2048;
-		texArrayHeight = 2048;
+		texArrayWidth = 4096;
+		texArrayHeight = 4096;
+		enableTextureDedupe = true;
+		enableTextureCompression = true;
+		bvhWidth = 2;
+		enableCompressedBVH = false;
+		bvhRefitThreshold = 1.5f;
 		denoiserFrameCnt = 20;
 		enableRR = true;
 		enableDenoiser = false;
@@ -50,8 +131,19 @@ struct RenderOptions
 	int maxSpp;
 	int maxDepth;
 	int RRDepth;
+	// largest texture layer, larger textures are downsampled to it
 	int texArrayWidth;
 	int texArrayHeight;
+	// textures with the same pixels are stored once in textureMapsArray, whatever their names
+	bool enableTextureDedupe;
+	// store textures as BC1/BC3/BC4/BC5 blocks chosen by the material slots using them, cached next to the texture files
+	bool enableTextureCompression;
+	// 2: binary LinearBVHNode traversal, 4 or 8: collapsed WideBVHNode traversal
+	int bvhWidth;
+	// quantize the wide nodes to 8-bit child bounds (CompressedWideNode), needs bvhWidth 4 or 8
+	bool enableCompressedBVH;
+	// a refitted BVH is rebuilt once its SAH cost exceeds this multiple of the cost after building
+	float bvhRefitThreshold;
 	int denoiserFrameCnt;
 	bool enableRR;
 	bool enableDenoiser;
@@ -78,21 +170,72 @@ public:
 	~Scene();
 
 	void AddCamera(vec3f pos, vec3f lookat, float fov);
+	// the env map, textures and meshes of files are loaded by OpenMP tasks. the returned id is that of a placeholder
+	// and final unless the load fails, call WaitForLoads before using them. inside a parallel region (see
+	// ParallelTasks) the loads run on the other threads of the team, otherwise they run before returning
 	void AddEnvMap(std::string& filename);
 	int AddTexture(std::string& filename);
 	int AddMesh(std::string& filename);
+	// join the loads started by the calling task. textures and meshes that failed are removed, the later ones move
+	// down keeping their order, and the texture ids of materials and the meshID of meshInstances are remapped.
+	// meshInstances of a failed mesh are removed
+	void WaitForLoads();
+	// add a texture/mesh created by an importer, the scene takes ownership.
+	// an already added one with the same name is kept and the new one deleted
+	int AddTexture(Texture* texture);
+	int AddMesh(Mesh* mesh);
 	int AddMeshInstance(MeshInstance* meshInstance);
 	int AddMaterial(const Material& mat);
 	int AddLight(const Light& light);
 
 	void RebuildTLAS();
+	// refit tlasBVH to the current meshInstances transforms, rebuilds it if the refit degraded it too much
+	void RefitTLAS();
+	// refit only the tlasBVH paths of the meshInstances marked dirty, for interactive edits of a few instances.
+	// rebuilds tlasBVH if the refit degraded it too much
+	void UpdateInstances();
+	// refit the blasBVH of a mesh after its verticesUVX/normalsUVY were deformed (same triangle count),
+	// rebuilds it if the refit degraded it too much. tlasBVH is refitted as well
+	void RefitMesh(int meshID);
 	void ProcessScene();
 
+	// write the arrays assembled by ProcessScene to a .nagib container
+	bool SaveBinary(const std::string& filename);
+	// map a .nagib container written by SaveBinary instead of loading and processing a scene. the large arrays
+	// stay in the mapping and are uploaded from there, meshes and meshInstances stay empty so nothing can be edited
+	bool LoadBinary(const std::string& filename);
+	SceneGPUArrays GPUArrays() const;
+	// wide nodes on the deepest path from the tlasBVH root into a blasBVH, 0 without wide nodes.
+	// the shaders size their traversal stack with it
+	int WideBVHDepth() const;
+
 private:
+	// fills tlasInstanceBounds and clears the dirty flag of every instance
+	void ComputeInstanceBounds();
+	bbox3f InstanceBound(size_t i);
 	void CreateTLAS();
 	void CreateBLAS();
+	// fall back to the uncompressed wide nodes when a BVH can not be compressed, also after ProcessScene
+	void UseUncompressedBVH();
+	// build, collapse and compress the blasBVH of one mesh, false if compression failed
+	bool CreateMeshBLAS(Mesh* mesh);
 	void ProcessBLAS();
 	void ProcessTLAS();
+	void ExpandPrimsVertexIndices();
+	// copy the refitted bounds of bvh to its nodes in the scene
+	void RefitSceneNodes(BVHAccel* bvh, uint32_t nodesOffset, uint32_t wideNodesOffset);
+	// redo ProcessBLAS and ProcessTLAS after a blasBVH was rebuilt
+	void ReprocessBVH();
+	void MarkBVHDirty(uint32_t begin, uint32_t end);
+	// merge the textures whose pixels are identical into the first of them, returns how many were merged
+	int DeduplicateTextures();
+	// choose the texture classes, sort textures by class and copy or compress them into textureMapsArray
+	void ProcessTextures();
+	// print how many references share the textures and meshes and the memory that saved
+	void ReportDedupe(int mergedTextures);
+	// collect the triangles of the meshInstances whose material emits into emissiveTriangles and set the
+	// emissivePickScale of the materials
+	void CollectEmissiveTriangles();
 
 public:
 	// TLAS, leaf is BLAS
@@ -103,6 +246,21 @@ public:
 	uint32_t tlasBVHStartOffset;
 	// meshblasBVHnodesеĿʼ
 	std::vector<uint32_t> blasBVHStartOffsets;
+	// sceneNodes collapsed to renderOptions->bvhWidth children, empty for binary traversal.
+	// offsets below count wide nodes, each is bvhWidth/4 WideBVHNode
+	std::vector<WideBVHNode> sceneWideNodes;
+	uint32_t tlasWideStartOffset;
+	std::vector<uint32_t> blasWideStartOffsets;
+	// exclusive prefix sums over meshes, the totals are the last element: start of every mesh's
+	// blasBVH primitives in scenePrimsVertexIndices and of its vertices in verticesUVX/normalsUVY
+	std::vector<uint32_t> blasPrimsOffsets;
+	std::vector<uint32_t> meshVerticesOffsets;
+	// world bound of every meshInstance, the primitives of tlasBVH
+	std::vector<bbox3f> tlasInstanceBounds;
+	// sceneWideNodes quantized by BVHAccel::CompressWide, empty unless renderOptions->enableCompressedBVH.
+	// node idx and offsets are the same as sceneWideNodes, tlasBVH leaves reference
+	// (blasBVH root, meshInstanceIdx+1, materialID) entries appended to scenePrimsVertexIndices
+	std::vector<uint32_t> sceneCompressedNodes;
 
 	// RenderOptions is responsible for indicate render options.
 	RenderOptions* renderOptions;
@@ -127,16 +285,30 @@ public:
 	std::vector<Material> materials;
 	// store all light
 	std::vector<Light> lights;
+	// light BVH over the rect and sphere lights, for picking a light by its importance to a point and for
+	// intersecting emitters. uploaded to lightBVHTex, followed by one texel per distantLights entry and the emissiveTriangles
+	std::vector<LightBVHNode> lightBVHNodes;
+	std::vector<int32_t> distantLights;
+	// triangles of the emissive meshInstances with an alias table over their power, sampled by DirectLight
+	std::vector<EmissiveTriangle> emissiveTriangles;
 
 	// Texture Data
 	std::vector<Texture*> textures;
+	// textures are grouped into size classes of power of two width x height layers (clamped to texArrayWidth x texArrayHeight),
+	// a texture is stored in the smallest class that holds it without downsampling. textures are sorted by class,
+	// textures [textureClassEnds[c-1], textureClassEnds[c]) are the layers of class c. unused classes are 0 x 0.
+	// the format of a class is the least compressed one its textures need for the material slots they are used in
+	vec2i textureClassSizes[kTextureClassesNum];
+	TextureFormat textureClassFormats[kTextureClassesNum];
+	int textureClassEnds[kTextureClassesNum];
+	// class by class, the mip levels of a class from the largest, every level holds all layers of the class
 	std::vector<unsigned char> textureMapsArray;
 
 	// scene data for all obj
 	std::vector<vec3i> scenePrimsVertexIndices;
 	std::vector<vec4f> verticesUVX;// Vertex + texture Coord (u/s)
 	std::vector<vec4f> normalsUVY;  // Normal + texture Coord (v/t)
-	std::vector<mat4> transforms;
+	std::vector<InstanceTransform> transforms;
 
 	// there are four varible control render state.
 	// Is scene has been initialized?
@@ -147,6 +319,31 @@ public:
 	bool instancesModified;
 	// Is envMap has been modified?
 	bool envMapModified;
+
+	// changes since the last upload, the renderer uploads them and resets the ranges to empty.
+	// node range of the uploaded layout (sceneNodes, or wide nodes with bvhWidth > 2)
+	uint32_t bvhDirtyBegin, bvhDirtyEnd;
+	// single nodes of the uploaded layout, from UpdateInstances
+	std::vector<uint32_t> bvhDirtyNodes;
+	// vertex range of verticesUVX and normalsUVY
+	uint32_t verticesDirtyBegin, verticesDirtyEnd;
+	// meshInstances whose transforms changed, from UpdateInstances
+	std::vector<uint32_t> dirtyTransforms;
+	// Is scenePrimsVertexIndices have been modified?
+	bool primsModified;
+	// Is the BVH the shaders were compiled for rebuilt? its depth or compression may have changed
+	bool bvhLayoutModified;
+
+private:
+	// .nagib file mapped by LoadBinary and the arrays in it
+	MappedFile binary;
+	SceneGPUArrays binaryArrays;
+	// ids of the textures and meshes whose loads WaitForLoads has not joined yet
+	std::vector<int> pendingTextures;
+	std::vector<int> pendingMeshes;
+	// id of every added texture and mesh by CanonicalPath of its name, several names may share an id
+	std::unordered_map<std::string, int> textureRegistry;
+	std::unordered_map<std::string, int> meshRegistry;
 };
 
 NAMESPACE_END(nagi)
@@ -0,0 +1,281 @@
+#include "scene.h"
+#include "camera.h"
+#include "material.h"
+#include "light.h"
+#include "bvh.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+NAMESPACE_BEGIN(nagi)
+
+// .nagib container: SceneBinaryHeader, then one section per array. every section starts on a page
+// boundary, so the mapped arrays are handed to glBufferData/glTexImage without copying or misaligned reads
+static const char kSceneBinaryMagic[8] = "NAGIBIN";
+static const uint32_t kSceneBinaryVersion = 6;
+static const uint64_t kSceneBinaryAlignment = 4096;
+
+enum SceneBinarySection
+{
+	kSectionNodes, kSectionWideNodes, kSectionCompressedNodes, kSectionPrimsVertexIndices,
+	kSectionVerticesUVX, kSectionNormalsUVY, kSectionTransforms, kSectionMaterials, kSectionLights,
+	kSectionEmissiveTriangles, kSectionTextureMaps, kSectionsNum
+};
+
+struct SceneBinaryRange
+{
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+struct SceneBinaryHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t sectionsNum;
+	// element sizes when written, guard against layout changes of the GPU structs
+	uint32_t nodeSize, wideNodeSize, transformSize, materialSize, lightSize, emissiveTriangleSize;
+	// renderOptions the arrays were built with
+	int32_t bvhWidth;
+	int32_t texArrayWidth, texArrayHeight, texturesNum;
+	int32_t textureClassSizes[kTextureClassesNum][2];
+	int32_t textureClassFormats[kTextureClassesNum];
+	int32_t textureClassEnds[kTextureClassesNum];
+	uint32_t tlasBVHStartOffset, tlasWideStartOffset;
+	int32_t hasCamera;
+	float cameraPosition[3], cameraForward[3];
+	float cameraFov, cameraFocalDistance, cameraLensRadius;
+	SceneBinaryRange sections[kSectionsNum];
+};
+static_assert(sizeof(SceneBinaryHeader) % 8 == 0 && offsetof(SceneBinaryHeader, sections) % 8 == 0, "no implicit padding");
+
+static void FillSizes(SceneBinaryHeader& header)
+{
+	memcpy(header.magic, kSceneBinaryMagic, sizeof(header.magic));
+	header.version = kSceneBinaryVersion;
+	header.sectionsNum = kSectionsNum;
+	header.nodeSize = sizeof(LinearBVHNode);
+	header.wideNodeSize = sizeof(WideBVHNode);
+	header.transformSize = sizeof(InstanceTransform);
+	header.materialSize = sizeof(Material);
+	header.lightSize = sizeof(Light);
+	header.emissiveTriangleSize = sizeof(EmissiveTriangle);
+}
+
+bool Scene::SaveBinary(const std::string& filename)
+{
+	if (!initialized)
+	{
+		printf("Scene has to be processed before it is saved to \"%s\"\n", filename.c_str());
+		return false;
+	}
+
+	SceneGPUArrays arrays = GPUArrays();
+	const void* data[kSectionsNum] = {
+		arrays.nodes.data, arrays.wideNodes.data, arrays.compressedNodes.data, arrays.primsVertexIndices.data,
+		arrays.verticesUVX.data, arrays.normalsUVY.data, transforms.data(), materials.data(), lights.data(),
+		emissiveTriangles.data(), arrays.textureMaps.data };
+	const uint64_t bytes[kSectionsNum] = {
+		arrays.nodes.size * sizeof(LinearBVHNode), arrays.wideNodes.size * sizeof(WideBVHNode),
+		arrays.compressedNodes.size * sizeof(uint32_t), arrays.primsVertexIndices.size * sizeof(vec3i),
+		arrays.verticesUVX.size * sizeof(vec4f), arrays.normalsUVY.size * sizeof(vec4f),
+		transforms.size() * sizeof(InstanceTransform), materials.size() * sizeof(Material), lights.size() * sizeof(Light),
+		emissiveTriangles.size() * sizeof(EmissiveTriangle), arrays.textureMaps.size };
+
+	SceneBinaryHeader header;
+	memset(&header, 0, sizeof(header));
+	FillSizes(header);
+	header.bvhWidth = renderOptions->bvhWidth;
+	header.texArrayWidth = renderOptions->texArrayWidth;
+	header.texArrayHeight = renderOptions->texArrayHeight;
+	header.texturesNum = arrays.texturesNum;
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		header.textureClassSizes[c][0] = arrays.textureClassSizes[c].x;
+		header.textureClassSizes[c][1] = arrays.textureClassSizes[c].y;
+		header.textureClassFormats[c] = (int32_t)arrays.textureClassFormats[c];
+		header.textureClassEnds[c] = arrays.textureClassEnds[c];
+	}
+	header.tlasBVHStartOffset = tlasBVHStartOffset;
+	header.tlasWideStartOffset = tlasWideStartOffset;
+	if (camera)
+	{
+		header.hasCamera = 1;
+		for (int i = 0; i < 3; i++)
+		{
+			header.cameraPosition[i] = camera->position[i];
+			header.cameraForward[i] = camera->forward[i];
+		}
+		header.cameraFov = Degrees(camera->fov);
+		header.cameraFocalDistance = camera->focalDistance;
+		header.cameraLensRadius = camera->lensRadius;
+	}
+
+	uint64_t offset = sizeof(SceneBinaryHeader);
+	for (int i = 0; i < kSectionsNum; i++)
+	{
+		offset = (offset + kSceneBinaryAlignment - 1) / kSceneBinaryAlignment * kSceneBinaryAlignment;
+		header.sections[i].offset = offset;
+		header.sections[i].bytes = bytes[i];
+		offset += bytes[i];
+	}
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		printf("Fail to create \"%s\" file\n", filename.c_str());
+		return false;
+	}
+
+	static const char zeros[kSceneBinaryAlignment] = {};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint64_t written = sizeof(header);
+	for (int i = 0; i < kSectionsNum && ok; i++)
+	{
+		ok = fwrite(zeros, 1, (size_t)(header.sections[i].offset - written), file) == header.sections[i].offset - written;
+		ok = ok && (bytes[i] == 0 || fwrite(data[i], 1, (size_t)bytes[i], file) == bytes[i]);
+		written = header.sections[i].offset + bytes[i];
+	}
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		printf("Fail to write \"%s\" file\n", filename.c_str());
+		remove(filename.c_str());
+		return false;
+	}
+
+	printf("Scene saved to \"%s\", %.1f MB\n", filename.c_str(), written / (1024.0 * 1024.0));
+	return true;
+}
+
+bool Scene::LoadBinary(const std::string& filename)
+{
+	printf("Load Scene From \"%s\" file.\n", filename.c_str());
+	if (!binary.Open(filename) || binary.Size() < sizeof(SceneBinaryHeader))
+	{
+		printf("Cannot open \"%s\" or it is too small\n", filename.c_str());
+		binary.Close();
+		return false;
+	}
+
+	SceneBinaryHeader header, expected;
+	memcpy(&header, binary.Data(), sizeof(header));
+	memset(&expected, 0, sizeof(expected));
+	FillSizes(expected);
+	// the first fields up to the sizes have to match exactly
+	if (memcmp(&header, &expected, offsetof(SceneBinaryHeader, bvhWidth)) != 0)
+	{
+		printf("\"%s\" is not a .nagib file of this version\n", filename.c_str());
+		binary.Close();
+		return false;
+	}
+	for (int i = 0; i < kSectionsNum; i++)
+	{
+		const SceneBinaryRange& range = header.sections[i];
+		if (range.offset % kSceneBinaryAlignment != 0 || range.offset > binary.Size() || range.bytes > binary.Size() - range.offset)
+		{
+			printf("\"%s\" is truncated\n", filename.c_str());
+			binary.Close();
+			return false;
+		}
+	}
+
+	uint64_t texelBytes = 0;
+	bool classesValid = header.texturesNum >= 0;
+	for (int c = 0; c < kTextureClassesNum && classesValid; c++)
+	{
+		int layers = header.textureClassEnds[c] - (c > 0 ? header.textureClassEnds[c - 1] : 0);
+		classesValid = layers >= 0 && header.textureClassSizes[c][0] >= 0 && header.textureClassSizes[c][1] >= 0 &&
+			header.textureClassFormats[c] >= 0 && header.textureClassFormats[c] < kTextureFormatsNum;
+		if (classesValid)
+			texelBytes += (uint64_t)layers * TextureMipChainBytes((TextureFormat)header.textureClassFormats[c],
+				header.textureClassSizes[c][0], header.textureClassSizes[c][1]);
+	}
+	if (!classesValid || header.textureClassEnds[kTextureClassesNum - 1] != header.texturesNum ||
+		header.sections[kSectionTextureMaps].bytes < texelBytes)
+	{
+		printf("\"%s\" has fewer texels than its %d textures need\n", filename.c_str(), header.texturesNum);
+		binary.Close();
+		return false;
+	}
+
+	auto section = [&](int i) { return binary.Data() + header.sections[i].offset; };
+	auto count = [&](int i, size_t elementSize) { return (size_t)(header.sections[i].bytes / elementSize); };
+
+	binaryArrays.nodes = ArrayView<LinearBVHNode>((const LinearBVHNode*)section(kSectionNodes), count(kSectionNodes, sizeof(LinearBVHNode)));
+	binaryArrays.wideNodes = ArrayView<WideBVHNode>((const WideBVHNode*)section(kSectionWideNodes), count(kSectionWideNodes, sizeof(WideBVHNode)));
+	binaryArrays.compressedNodes = ArrayView<uint32_t>((const uint32_t*)section(kSectionCompressedNodes), count(kSectionCompressedNodes, sizeof(uint32_t)));
+	binaryArrays.primsVertexIndices = ArrayView<vec3i>((const vec3i*)section(kSectionPrimsVertexIndices), count(kSectionPrimsVertexIndices, sizeof(vec3i)));
+	binaryArrays.verticesUVX = ArrayView<vec4f>((const vec4f*)section(kSectionVerticesUVX), count(kSectionVerticesUVX, sizeof(vec4f)));
+	binaryArrays.normalsUVY = ArrayView<vec4f>((const vec4f*)section(kSectionNormalsUVY), count(kSectionNormalsUVY, sizeof(vec4f)));
+	binaryArrays.textureMaps = ArrayView<unsigned char>(section(kSectionTextureMaps), count(kSectionTextureMaps, 1));
+	binaryArrays.texturesNum = header.texturesNum;
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		binaryArrays.textureClassSizes[c] = vec2i(header.textureClassSizes[c][0], header.textureClassSizes[c][1]);
+		binaryArrays.textureClassFormats[c] = (TextureFormat)header.textureClassFormats[c];
+		binaryArrays.textureClassEnds[c] = header.textureClassEnds[c];
+	}
+
+	// transforms, materials, lights and emissive triangles are small and edited or re-uploaded from their vectors.
+	// the emissivePickScale of the materials was saved with them
+	const InstanceTransform* t = (const InstanceTransform*)section(kSectionTransforms);
+	transforms.assign(t, t + count(kSectionTransforms, sizeof(InstanceTransform)));
+	const Material* m = (const Material*)section(kSectionMaterials);
+	materials.assign(m, m + count(kSectionMaterials, sizeof(Material)));
+	const Light* l = (const Light*)section(kSectionLights);
+	lights.assign(l, l + count(kSectionLights, sizeof(Light)));
+	if (!lights.empty())
+		BuildLightBVH(lights, lightBVHNodes, distantLights);
+	const EmissiveTriangle* e = (const EmissiveTriangle*)section(kSectionEmissiveTriangles);
+	emissiveTriangles.assign(e, e + count(kSectionEmissiveTriangles, sizeof(EmissiveTriangle)));
+
+	renderOptions->bvhWidth = header.bvhWidth;
+	renderOptions->texArrayWidth = header.texArrayWidth;
+	renderOptions->texArrayHeight = header.texArrayHeight;
+	tlasBVHStartOffset = header.tlasBVHStartOffset;
+	tlasWideStartOffset = header.tlasWideStartOffset;
+
+	if (header.hasCamera)
+	{
+		vec3f pos(header.cameraPosition[0], header.cameraPosition[1], header.cameraPosition[2]);
+		vec3f forward(header.cameraForward[0], header.cameraForward[1], header.cameraForward[2]);
+		AddCamera(pos, pos + forward, header.cameraFov);
+		camera->focalDistance = header.cameraFocalDistance;
+		camera->lensRadius = header.cameraLensRadius;
+	}
+	else
+		AddCamera(vec3f(0.0f, 0.0f, 1.0f), vec3f(0.0f), 45.0f);
+
+	printf("%zu nodes, %zu triangles, %zu vertices, %d textures\n", binaryArrays.nodes.size + binaryArrays.wideNodes.size,
+		binaryArrays.primsVertexIndices.size, binaryArrays.verticesUVX.size, binaryArrays.texturesNum);
+
+	// nothing left for ProcessScene to do
+	initialized = true;
+	return true;
+}
+
+SceneGPUArrays Scene::GPUArrays() const
+{
+	if (binary.IsOpen())
+		return binaryArrays;
+
+	SceneGPUArrays arrays;
+	arrays.nodes = ArrayView<LinearBVHNode>(sceneNodes);
+	arrays.wideNodes = ArrayView<WideBVHNode>(sceneWideNodes);
+	arrays.compressedNodes = ArrayView<uint32_t>(sceneCompressedNodes);
+	arrays.primsVertexIndices = ArrayView<vec3i>(scenePrimsVertexIndices);
+	arrays.verticesUVX = ArrayView<vec4f>(verticesUVX);
+	arrays.normalsUVY = ArrayView<vec4f>(normalsUVY);
+	arrays.textureMaps = ArrayView<unsigned char>(textureMapsArray);
+	arrays.texturesNum = (int)textures.size();
+	for (int c = 0; c < kTextureClassesNum; c++)
+	{
+		arrays.textureClassSizes[c] = textureClassSizes[c];
+		arrays.textureClassFormats[c] = textureClassFormats[c];
+		arrays.textureClassEnds[c] = textureClassEnds[c];
+	}
+	return arrays;
+}
+
+NAMESPACE_END(nagi)
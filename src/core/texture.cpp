@@ -1,10 +1,41 @@
 #include "texture.h"
+#include "mappedFile.h"
 #include "stb_image.h"
+#include <cstdio>
+#include <cstring>
 
 NAMESPACE_BEGIN(nagi)
 
+// the cache file is the texture file name plus this suffix, laid out as TextureCacheHeader, blocks of level 0, 1, ...
+static const char* kTextureCacheSuffix = ".nagicache";
+static const char kTextureCacheMagic[8] = "NAGITEX";
+static const uint32_t kTextureCacheVersion = 2;
+
+struct TextureCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	int32_t format;
+	uint64_t contentHash;
+	int32_t width, height;
+	int32_t levels, srgb;
+	uint64_t bytes;
+};
+
+// images embedded in a glTF file are named "file.gltf#image3/roughness", their cache sits next to the glTF file
+static std::string TextureCacheName(const std::string& name)
+{
+	std::string cacheName = name;
+	size_t embedded = cacheName.find('#');
+	if (embedded != std::string::npos)
+		for (size_t i = embedded; i < cacheName.size(); i++)
+			if (cacheName[i] == '#' || cacheName[i] == '/' || cacheName[i] == '\\')
+				cacheName[i] = '.';
+	return cacheName + kTextureCacheSuffix;
+}
+
 Texture::Texture(std::string & filename, unsigned char * data, int w, int h, int c):
-	name(filename),width(w),height(h),components(c)
+	name(filename),width(w),height(h),components(c),contentHash(0),duplicateRefs(0)
 {
 	texData.resize(width*height*components);
 	std::copy(data, data + width * height * components, texData.begin());
@@ -25,6 +56,75 @@ bool Texture::LoadTexture(std::string & filename)
 	return true;
 }
 
+bool Texture::LoadTexture(std::string & name, const unsigned char * encoded, int size)
+{
+	this->name = name;
+	components = 4;
+	unsigned char* data = stbi_load_from_memory(encoded, size, &width, &height, NULL, 4);
+	if (!data)
+		return false;
+
+	texData.resize(width*height*components);
+	std::copy(data, data + width * height * components, texData.begin());
+	stbi_image_free(data);
 
+	return true;
+}
+
+bool Texture::LoadCompressedCache(TextureFormat format, int layerWidth, int layerHeight, bool srgb, unsigned char * chain) const
+{
+	if (name.empty()) return false;
+	MappedFile cache;
+	if (!cache.Open(TextureCacheName(name))) return false;
+	const TextureCacheHeader* header = (const TextureCacheHeader*)cache.Data();
+	// a stale or truncated cache is compressed again and overwritten by WriteCompressedCache
+	size_t bytes = TextureMipChainBytes(format, layerWidth, layerHeight);
+	if (cache.Size() != sizeof(TextureCacheHeader) + bytes ||
+		memcmp(header->magic, kTextureCacheMagic, sizeof(kTextureCacheMagic)) != 0 ||
+		header->version != kTextureCacheVersion ||
+		header->format != (int32_t)format ||
+		header->contentHash != contentHash ||
+		header->width != layerWidth || header->height != layerHeight ||
+		header->levels != TextureMipLevels(layerWidth, layerHeight) || header->srgb != (int32_t)srgb ||
+		header->bytes != bytes)
+		return false;
+
+	memcpy(chain, cache.Data() + sizeof(TextureCacheHeader), bytes);
+	return true;
+}
+
+void Texture::WriteCompressedCache(TextureFormat format, int layerWidth, int layerHeight, bool srgb, const unsigned char * chain) const
+{
+	if (name.empty()) return;
+	std::string cacheName = TextureCacheName(name);
+	FILE* fp = fopen(cacheName.c_str(), "wb");
+	if (!fp)
+	{
+		// e.g. a read-only asset directory, the texture is compressed again next time
+		printf("Cannot write texture cache \"%s\"\n", cacheName.c_str());
+		return;
+	}
+
+	TextureCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kTextureCacheMagic, sizeof(kTextureCacheMagic));
+	header.version = kTextureCacheVersion;
+	header.format = (int32_t)format;
+	header.contentHash = contentHash;
+	header.width = layerWidth;
+	header.height = layerHeight;
+	header.levels = TextureMipLevels(layerWidth, layerHeight);
+	header.srgb = (int32_t)srgb;
+	header.bytes = TextureMipChainBytes(format, layerWidth, layerHeight);
+
+	bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(chain, 1, (size_t)header.bytes, fp) == header.bytes;
+	fclose(fp);
+	if (!written)
+	{
+		printf("Cannot write texture cache \"%s\"\n", cacheName.c_str());
+		remove(cacheName.c_str());
+	}
+}
 
 NAMESPACE_END(nagi)
\ No newline at end of file
@@ -1,7 +1,9 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <cstdint>
 #include "logger.h"
+#include "blockCompression.h"
 
 NAMESPACE_BEGIN(nagi)
 
@@ -9,14 +11,26 @@ NAMESPACE_BEGIN(nagi)
 class Texture
 {
 public:
-	Texture() :width(0), height(0), components(0) {}
+	Texture() :width(0), height(0), components(0), contentHash(0), duplicateRefs(0) {}
 	Texture(std::string& name, unsigned char* data, int w, int h, int c);
 
 	bool LoadTexture(std::string& filename);
+	// decode an image file that is already in memory, e.g. embedded in a glTF/GLB file
+	bool LoadTexture(std::string& name, const unsigned char* encoded, int size);
+
+	// read the mip chain of texData resized to layerWidth x layerHeight and compressed to format from the cache file of name,
+	// false if there is none or it was written for other pixels, format, size or mip filter (srgb: averaged in linear space)
+	bool LoadCompressedCache(TextureFormat format, int layerWidth, int layerHeight, bool srgb, unsigned char* chain) const;
+	void WriteCompressedCache(TextureFormat format, int layerWidth, int layerHeight, bool srgb, const unsigned char* chain) const;
 
 	int width, height, components;
 	std::vector<unsigned char> texData;
 	std::string name;
+	// HashBytes of texData seeded with the size, set by Scene::ProcessScene. key of merging and of the cache file
+	uint64_t contentHash;
+	// AddTexture calls of the same name and textures merged by content that reuse this texture,
+	// each of them would have been a layer of its own
+	int duplicateRefs;
 };
 
 NAMESPACE_END(nagi)
\ No newline at end of file
@@ -47,7 +47,8 @@ void GetSceneFiles()
 		tinydir_file file;
 		tinydir_readfile_n(&dir, &file, i);
 
-		if (strcmp(file.extension, "scene") == 0)
+		if (strcmp(file.extension, "scene") == 0 || strcmp(file.extension, "gltf") == 0 || strcmp(file.extension, "glb") == 0 ||
+			strcmp(file.extension, "nagib") == 0)
 		{
 			sceneFiles.push_back(assetsDir + file.name);
 		}
@@ -84,6 +85,10 @@ void CreateScene(std::string filename)
 	bool success = false;
 	if (ext == "scene")
 		success = ParseFromSceneFile(filename, scene);
+	else if (ext == "gltf" || ext == "glb")
+		success = ParseFromGLTFFile(filename, scene);
+	else if (ext == "nagib")
+		success = scene->LoadBinary(filename);
 
 	if (!success)
 		Error("Fail to load scene from \"%s\" file", filename.c_str());
@@ -91,6 +96,7 @@ void CreateScene(std::string filename)
 	if (!scene->envMap && !envMaps.empty())
 	{
 		scene->AddEnvMap(envMaps[selectedEnvMapIdx]);
+		scene->WaitForLoads();
 		scene->renderOptions->enableEnvMap = scene->lights.empty() ? true : false;
 		scene->renderOptions->envMapIntensity = 1.5f;
 	}
@@ -116,6 +122,8 @@ int main(int argc, char** argv) {
 	srand((uint32_t)time(nullptr));
 
 	std::string sceneFilename;
+	// process the scene, write it as a .nagib container and exit
+	std::string exportFilename;
 
 	for (size_t i = 1; i < argc; i++)
 	{
@@ -124,6 +132,10 @@ int main(int argc, char** argv) {
 		{
 			sceneFilename = argv[++i];
 		}
+		else if (arg == "-e" || arg == "--export")
+		{
+			exportFilename = argv[++i];
+		}
 		else if (arg[0] == '-')
 		{
 			Error("Unknown Option \"%s\"", arg.c_str());
@@ -143,6 +155,15 @@ int main(int argc, char** argv) {
 		CreateScene(sceneFilename);
 	}
 
+	if (!exportFilename.empty())
+	{
+		if (!scene->initialized)
+			scene->ProcessScene();
+		bool saved = scene->SaveBinary(exportFilename);
+		delete scene;
+		return saved ? 0 : 1;
+	}
+
 	// init glfw and glad
 	if (!glfwInit())
 		Error("Fail to init glfw!");
@@ -0,0 +1,553 @@
+#define TINYGLTF_IMPLEMENTATION
+#define TINYGLTF_NO_STB_IMAGE
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#define TINYGLTF_NO_INCLUDE_STB_IMAGE
+#define TINYGLTF_NO_INCLUDE_STB_IMAGE_WRITE
+#include <map>
+#include "tiny_gltf.h"
+#include "parser.h"
+#include "scene.h"
+#include "material.h"
+#include "camera.h"
+#include "mesh.h"
+#include "texture.h"
+#include "mappedFile.h"
+#include "parallel.h"
+
+NAMESPACE_BEGIN(nagi)
+
+// how a glTF image is turned into a Nagi texture. the shaders read roughness and metallic from .r,
+// so the G (roughness) and B (metallic) channels of a metallicRoughnessTexture become textures of their own
+enum GLTFTextureUsage { kGLTFColor, kGLTFRoughness, kGLTFMetallic };
+
+struct GLTFParseState
+{
+	const tinygltf::Model* model;
+	Scene* scene;
+	std::string filename;
+	// Nagi mesh id of every primitive of every glTF mesh, -1 if it was skipped
+	std::vector<std::vector<int>> meshIDs;
+	std::vector<int> materialIDs;
+	bool hasCamera;
+};
+
+// tinygltf would decode every image serially while parsing the json, keep the encoded bytes instead,
+// they are decoded in parallel once the materials show which images are used
+static bool KeepEncodedImage(tinygltf::Image* image, const int, std::string*, std::string*,
+	int, int, const unsigned char* bytes, int size, void*)
+{
+	image->image.assign(bytes, bytes + size);
+	image->as_is = true;
+	return true;
+}
+
+// component i of an accessor element as float, normalized integers are mapped to [0, 1]
+static float AccessorFloat(const unsigned char* element, int componentType, int i)
+{
+	switch (componentType)
+	{
+	case TINYGLTF_COMPONENT_TYPE_FLOAT:
+	{
+		float f;
+		memcpy(&f, element + i * sizeof(float), sizeof(float));
+		return f;
+	}
+	case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+		return element[i] / 255.0f;
+	case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+	{
+		uint16_t u;
+		memcpy(&u, element + i * sizeof(uint16_t), sizeof(uint16_t));
+		return u / 65535.0f;
+	}
+	}
+	return 0.0f;
+}
+
+// accessors are read in place from the buffer, the element pointer is data + idx * stride
+struct GLTFAccessorView
+{
+	const unsigned char* data;
+	size_t stride;
+	size_t count;
+	int componentType;
+
+	GLTFAccessorView() :data(nullptr), stride(0), count(0), componentType(0) {}
+	const unsigned char* operator[](size_t idx) const { return data + idx * stride; }
+};
+
+static bool ViewAccessor(const tinygltf::Model& model, int accessorIdx, GLTFAccessorView& view)
+{
+	if (accessorIdx < 0 || accessorIdx >= (int)model.accessors.size())
+		return false;
+
+	const tinygltf::Accessor& accessor = model.accessors[accessorIdx];
+	if (accessor.sparse.isSparse || accessor.bufferView < 0)
+	{
+		printf("glTF accessor %d is sparse or has no bufferView, not supported\n", accessorIdx);
+		return false;
+	}
+
+	const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+	const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+	int stride = accessor.ByteStride(bufferView);
+	if (stride <= 0)
+		return false;
+
+	view.data = buffer.data.data() + bufferView.byteOffset + accessor.byteOffset;
+	view.stride = (size_t)stride;
+	view.count = accessor.count;
+	view.componentType = accessor.componentType;
+
+	if (accessor.count > 0 && bufferView.byteOffset + accessor.byteOffset + (accessor.count - 1) * view.stride +
+		tinygltf::GetComponentSizeInBytes(accessor.componentType) * tinygltf::GetNumComponentsInType(accessor.type) > buffer.data.size())
+	{
+		printf("glTF accessor %d is out of its buffer range\n", accessorIdx);
+		return false;
+	}
+
+	return true;
+}
+
+static uint32_t AccessorIndex(const GLTFAccessorView& view, size_t idx)
+{
+	const unsigned char* element = view[idx];
+	switch (view.componentType)
+	{
+	case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+		return element[0];
+	case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+	{
+		uint16_t u;
+		memcpy(&u, element, sizeof(uint16_t));
+		return u;
+	}
+	case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+	{
+		uint32_t u;
+		memcpy(&u, element, sizeof(uint32_t));
+		return u;
+	}
+	}
+	return 0;
+}
+
+static int PrimitiveAttribute(const tinygltf::Primitive& prim, const char* name)
+{
+	auto it = prim.attributes.find(name);
+	return it == prim.attributes.end() ? -1 : it->second;
+}
+
+// fill verticesUVX/normalsUVY/indices of mesh from a TRIANGLES primitive.
+// uv is kept as glTF stores it (origin at the top left, like the textures are uploaded)
+static bool LoadPrimitive(const tinygltf::Model& model, const tinygltf::Primitive& prim, Mesh* mesh)
+{
+	if (prim.mode != TINYGLTF_MODE_TRIANGLES && prim.mode != -1)
+	{
+		printf("Skip \"%s\": primitive mode %d is not triangles\n", mesh->name.c_str(), prim.mode);
+		return false;
+	}
+
+	GLTFAccessorView positions, normals, uvs, indexView;
+	if (!ViewAccessor(model, PrimitiveAttribute(prim, "POSITION"), positions) ||
+		positions.componentType != TINYGLTF_COMPONENT_TYPE_FLOAT)
+	{
+		printf("Skip \"%s\": no float POSITION attribute\n", mesh->name.c_str());
+		return false;
+	}
+	bool hasNormals = ViewAccessor(model, PrimitiveAttribute(prim, "NORMAL"), normals) && normals.count == positions.count;
+	bool hasUVs = ViewAccessor(model, PrimitiveAttribute(prim, "TEXCOORD_0"), uvs) && uvs.count == positions.count;
+	bool hasIndices = prim.indices >= 0;
+	if (hasIndices && !ViewAccessor(model, prim.indices, indexView))
+		return false;
+
+	const size_t vertexCount = positions.count;
+	const size_t trianglesNum = (hasIndices ? indexView.count : vertexCount) / 3;
+	auto corner = [&](size_t i) -> uint32_t {
+		uint32_t idx = hasIndices ? AccessorIndex(indexView, i) : (uint32_t)i;
+		return idx < vertexCount ? idx : 0;
+	};
+	auto position = [&](uint32_t idx) {
+		const unsigned char* e = positions[idx];
+		return vec3f(AccessorFloat(e, positions.componentType, 0), AccessorFloat(e, positions.componentType, 1),
+			AccessorFloat(e, positions.componentType, 2));
+	};
+
+	if (hasNormals && hasUVs)
+	{
+		// the primitive is already indexed with unique vertices, copy it as it is
+		mesh->verticesUVX.resize(vertexCount);
+		mesh->normalsUVY.resize(vertexCount);
+		for (size_t i = 0; i < vertexCount; i++)
+		{
+			const unsigned char* n = normals[i];
+			const unsigned char* t = uvs[i];
+			vec3f p = position((uint32_t)i);
+			mesh->verticesUVX[i] = vec4f(p.x, p.y, p.z, AccessorFloat(t, uvs.componentType, 0));
+			mesh->normalsUVY[i] = vec4f(AccessorFloat(n, normals.componentType, 0), AccessorFloat(n, normals.componentType, 1),
+				AccessorFloat(n, normals.componentType, 2), AccessorFloat(t, uvs.componentType, 1));
+		}
+
+		mesh->indices.resize(trianglesNum);
+		for (size_t i = 0; i < trianglesNum; i++)
+			mesh->indices[i] = vec3i(corner(3 * i), corner(3 * i + 1), corner(3 * i + 2));
+	}
+	else {
+		// missing normals/uvs are generated per triangle like ParseOBJ does, which needs three vertices
+		// per triangle first, WeldVertices merges them again
+		static const float kPlaceholderUV[3][2] = { { 0.0f, 0.0f }, { 0.0f, 1.0f }, { 1.0f, 1.0f } };
+		mesh->verticesUVX.resize(trianglesNum * 3);
+		mesh->normalsUVY.resize(trianglesNum * 3);
+		for (size_t i = 0; i < trianglesNum; i++)
+		{
+			uint32_t idx[3] = { corner(3 * i), corner(3 * i + 1), corner(3 * i + 2) };
+			vec3f p[3] = { position(idx[0]), position(idx[1]), position(idx[2]) };
+			// same winding convention as the face normals of ParseOBJ
+			vec3f faceNormal = Normalize(Cross(p[2] - p[0], p[1] - p[0]));
+
+			for (int k = 0; k < 3; k++)
+			{
+				vec3f n = faceNormal;
+				if (hasNormals)
+				{
+					const unsigned char* e = normals[idx[k]];
+					n = vec3f(AccessorFloat(e, normals.componentType, 0), AccessorFloat(e, normals.componentType, 1),
+						AccessorFloat(e, normals.componentType, 2));
+				}
+				float u = kPlaceholderUV[k][0], v = kPlaceholderUV[k][1];
+				if (hasUVs)
+				{
+					u = AccessorFloat(uvs[idx[k]], uvs.componentType, 0);
+					v = AccessorFloat(uvs[idx[k]], uvs.componentType, 1);
+				}
+				mesh->verticesUVX[3 * i + k] = vec4f(p[k].x, p[k].y, p[k].z, u);
+				mesh->normalsUVY[3 * i + k] = vec4f(n.x, n.y, n.z, v);
+			}
+		}
+		mesh->WeldVertices();
+	}
+
+	return !mesh->indices.empty();
+}
+
+static void LoadMeshes(GLTFParseState& state)
+{
+	const tinygltf::Model& model = *state.model;
+
+	// every (mesh, primitive) pair becomes one Nagi mesh, they are independent so they are read in parallel
+	std::vector<std::pair<int, int>> prims;
+	state.meshIDs.resize(model.meshes.size());
+	for (size_t i = 0; i < model.meshes.size(); i++)
+	{
+		state.meshIDs[i].assign(model.meshes[i].primitives.size(), -1);
+		for (size_t j = 0; j < model.meshes[i].primitives.size(); j++)
+			prims.push_back(std::make_pair((int)i, (int)j));
+	}
+
+	std::vector<Mesh*> meshes(prims.size(), nullptr);
+	ParallelFor((int)prims.size(), 1, [&](int i) {
+		Mesh* mesh = new Mesh;
+		mesh->name = state.filename + "#mesh" + std::to_string(prims[i].first) + "/" + std::to_string(prims[i].second);
+		if (LoadPrimitive(model, model.meshes[prims[i].first].primitives[prims[i].second], mesh))
+			meshes[i] = mesh;
+		else
+			delete mesh;
+	});
+
+	for (size_t i = 0; i < prims.size(); i++)
+		if (meshes[i])
+		{
+			printf("Loading mesh \"%s\"\n", meshes[i]->name.c_str());
+			state.meshIDs[prims[i].first][prims[i].second] = state.scene->AddMesh(meshes[i]);
+		}
+}
+
+static float ExtensionNumber(const tinygltf::ExtensionMap& extensions, const char* extension, const char* key, float defaultValue)
+{
+	auto it = extensions.find(extension);
+	if (it == extensions.end() || !it->second.Has(key))
+		return defaultValue;
+	const tinygltf::Value& value = it->second.Get(key);
+	return value.IsNumber() ? (float)value.GetNumberAsDouble() : defaultValue;
+}
+
+static void LoadMaterials(GLTFParseState& state)
+{
+	const tinygltf::Model& model = *state.model;
+
+	// textures used by the materials, keyed by (image, usage)
+	std::map<std::pair<int, int>, int> textureIDs;
+	auto imageOf = [&](int textureIdx) {
+		if (textureIdx < 0 || textureIdx >= (int)model.textures.size())
+			return -1;
+		int source = model.textures[textureIdx].source;
+		return source >= 0 && source < (int)model.images.size() ? source : -1;
+	};
+	auto useTexture = [&](int textureIdx, GLTFTextureUsage usage) {
+		int image = imageOf(textureIdx);
+		if (image >= 0)
+			textureIDs[std::make_pair(image, (int)usage)] = -1;
+	};
+	for (const tinygltf::Material& gltfMat : model.materials)
+	{
+		useTexture(gltfMat.pbrMetallicRoughness.baseColorTexture.index, kGLTFColor);
+		useTexture(gltfMat.pbrMetallicRoughness.metallicRoughnessTexture.index, kGLTFRoughness);
+		useTexture(gltfMat.pbrMetallicRoughness.metallicRoughnessTexture.index, kGLTFMetallic);
+		useTexture(gltfMat.normalTexture.index, kGLTFColor);
+		useTexture(gltfMat.emissiveTexture.index, kGLTFColor);
+	}
+
+	// decode every used image once, in parallel
+	std::vector<int> usedImages;
+	for (auto& it : textureIDs)
+		if (usedImages.empty() || usedImages.back() != it.first.first)
+			usedImages.push_back(it.first.first);
+	std::vector<Texture*> decoded(model.images.size(), nullptr);
+	ParallelFor((int)usedImages.size(), 1, [&](int i) {
+		const tinygltf::Image& image = model.images[usedImages[i]];
+		std::string name = state.filename + "#image" + std::to_string(usedImages[i]);
+		Texture* tex = new Texture;
+		if (!image.image.empty() && tex->LoadTexture(name, image.image.data(), (int)image.image.size()))
+			decoded[usedImages[i]] = tex;
+		else {
+			printf("Fail to decode glTF image %d \"%s\"\n", usedImages[i], image.uri.c_str());
+			delete tex;
+		}
+	});
+
+	for (auto& it : textureIDs)
+	{
+		Texture* src = decoded[it.first.first];
+		if (!src)
+			continue;
+
+		Texture* tex = new Texture(*src);
+		if (it.first.second != kGLTFColor)
+		{
+			// copy the used channel to RGB
+			int channel = it.first.second == kGLTFRoughness ? 1 : 2;
+			tex->name += it.first.second == kGLTFRoughness ? "/roughness" : "/metallic";
+			for (size_t p = 0; p < tex->texData.size(); p += 4)
+				tex->texData[p] = tex->texData[p + 1] = tex->texData[p + 2] = src->texData[p + channel];
+		}
+		printf("Loading texture \"%s\"\n", tex->name.c_str());
+		it.second = state.scene->AddTexture(tex);
+	}
+	for (Texture* tex : decoded)
+		delete tex;
+
+	auto textureID = [&](int textureIdx, GLTFTextureUsage usage) {
+		auto it = textureIDs.find(std::make_pair(imageOf(textureIdx), (int)usage));
+		return it == textureIDs.end() ? -1.0f : (float)it->second;
+	};
+
+	state.materialIDs.resize(model.materials.size());
+	for (size_t i = 0; i < model.materials.size(); i++)
+	{
+		const tinygltf::Material& gltfMat = model.materials[i];
+		const tinygltf::PbrMetallicRoughness& pbr = gltfMat.pbrMetallicRoughness;
+		Material mat;
+
+		if (pbr.baseColorFactor.size() == 4)
+		{
+			mat.baseColor = vec3f((float)pbr.baseColorFactor[0], (float)pbr.baseColorFactor[1], (float)pbr.baseColorFactor[2]);
+			mat.opacity = (float)pbr.baseColorFactor[3];
+		}
+		mat.metallic = (float)pbr.metallicFactor;
+		mat.roughness = (float)pbr.roughnessFactor;
+		mat.baseColorTexID = textureID(pbr.baseColorTexture.index, kGLTFColor);
+		mat.roughnessTexID = textureID(pbr.metallicRoughnessTexture.index, kGLTFRoughness);
+		mat.metallicTexID = textureID(pbr.metallicRoughnessTexture.index, kGLTFMetallic);
+		mat.normalMapTexID = textureID(gltfMat.normalTexture.index, kGLTFColor);
+		mat.emissionMapTexID = textureID(gltfMat.emissiveTexture.index, kGLTFColor);
+
+		if (gltfMat.emissiveFactor.size() == 3)
+		{
+			float strength = ExtensionNumber(gltfMat.extensions, "KHR_materials_emissive_strength", "emissiveStrength", 1.0f);
+			mat.emission = vec3f((float)gltfMat.emissiveFactor[0], (float)gltfMat.emissiveFactor[1],
+				(float)gltfMat.emissiveFactor[2]) * strength;
+		}
+
+		if (gltfMat.alphaMode == "BLEND")
+			mat.alphaMode = Material::AlphaMode::Blend;
+		else if (gltfMat.alphaMode == "MASK")
+			mat.alphaMode = Material::AlphaMode::Mask;
+		else
+			mat.alphaMode = Material::AlphaMode::Opaque;
+		mat.alphaCutoff = (float)gltfMat.alphaCutoff;
+
+		mat.specTrans = ExtensionNumber(gltfMat.extensions, "KHR_materials_transmission", "transmissionFactor", mat.specTrans);
+		mat.ior = ExtensionNumber(gltfMat.extensions, "KHR_materials_ior", "ior", mat.ior);
+
+		state.materialIDs[i] = state.scene->AddMaterial(mat);
+	}
+}
+
+// node local transform in the row vector convention of mat4 (data[3] is the translation)
+static mat4 NodeTransform(const tinygltf::Node& node)
+{
+	mat4 local;
+	if (node.matrix.size() == 16)
+	{
+		// glTF matrices are column major, the columns are the rows of mat4
+		for (int c = 0; c < 4; c++)
+			for (int r = 0; r < 4; r++)
+				local[c][r] = (float)node.matrix[c * 4 + r];
+		return local;
+	}
+
+	mat4 translate, scale, rotate;
+	if (node.translation.size() == 3)
+		translate = mat4::Translate(vec3f((float)node.translation[0], (float)node.translation[1], (float)node.translation[2]));
+	if (node.scale.size() == 3)
+		scale = mat4::Scale(vec3f((float)node.scale[0], (float)node.scale[1], (float)node.scale[2]));
+	if (node.rotation.size() == 4)
+		rotate = mat4::QuatToMatrix((float)node.rotation[0], (float)node.rotation[1], (float)node.rotation[2], (float)node.rotation[3]);
+
+	return scale * rotate * translate;
+}
+
+static void LoadNode(GLTFParseState& state, int nodeIdx, const mat4& parent, int depth)
+{
+	const tinygltf::Model& model = *state.model;
+	if (nodeIdx < 0 || nodeIdx >= (int)model.nodes.size() || depth > 256)
+		return;
+
+	const tinygltf::Node& node = model.nodes[nodeIdx];
+	mat4 world = NodeTransform(node) * parent;
+
+	if (node.mesh >= 0 && node.mesh < (int)model.meshes.size())
+	{
+		const tinygltf::Mesh& gltfMesh = model.meshes[node.mesh];
+		for (size_t j = 0; j < gltfMesh.primitives.size(); j++)
+		{
+			int meshID = state.meshIDs[node.mesh][j];
+			if (meshID < 0)
+				continue;
+
+			int material = gltfMesh.primitives[j].material;
+			MeshInstance* meshInstance = new MeshInstance;
+			meshInstance->meshID = meshID;
+			meshInstance->materialID = material >= 0 && material < (int)state.materialIDs.size() ? state.materialIDs[material] : 0;
+			meshInstance->transform = world;
+			meshInstance->name = !node.name.empty() ? node.name : !gltfMesh.name.empty() ? gltfMesh.name : "none";
+			state.scene->AddMeshInstance(meshInstance);
+		}
+	}
+
+	if (!state.hasCamera && node.camera >= 0 && node.camera < (int)model.cameras.size() &&
+		model.cameras[node.camera].type == "perspective")
+	{
+		// glTF cameras look down -Z
+		vec3f pos = vec3f(world[3][0], world[3][1], world[3][2]);
+		vec3f forward = Normalize(vec3f(-world[2][0], -world[2][1], -world[2][2]));
+		state.scene->AddCamera(pos, pos + forward, Degrees((float)model.cameras[node.camera].perspective.yfov));
+		state.hasCamera = true;
+	}
+
+	for (int child : node.children)
+		LoadNode(state, child, world, depth + 1);
+}
+
+// frame the instances when the file has no camera
+static void AddDefaultCamera(Scene* scene)
+{
+	bbox3f bound;
+	for (MeshInstance* meshInstance : scene->meshInstances)
+	{
+		const Mesh* mesh = scene->meshes[meshInstance->meshID];
+		bbox3f local;
+		for (const vec4f& v : mesh->verticesUVX)
+			local = Union(local, vec3f(v.x, v.y, v.z));
+
+		mat4& m = meshInstance->transform;
+		for (int c = 0; c < 8; c++)
+		{
+			vec3f p = vec3f((c & 1) ? local.pMax.x : local.pMin.x, (c & 2) ? local.pMax.y : local.pMin.y,
+				(c & 4) ? local.pMax.z : local.pMin.z);
+			bound = Union(bound, vec3f(
+				p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0],
+				p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1],
+				p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2]));
+		}
+	}
+
+	vec3f center = scene->meshInstances.empty() ? vec3f(0.0f) : bound.Center();
+	float radius = scene->meshInstances.empty() ? 1.0f : bound.Diagonal().Length() * 0.5f;
+	// fov 45 degrees: the bounding sphere fits at radius / sin(22.5)
+	scene->AddCamera(center + vec3f(0.0f, 0.0f, radius * 2.7f), center, 45.0f);
+}
+
+bool ParseFromGLTFFile(std::string filename, Scene* scene)
+{
+	printf("Parse Scene From \"%s\" file.\n", filename.c_str());
+
+	tinygltf::TinyGLTF loader;
+	loader.SetImageLoader(KeepEncodedImage, nullptr);
+
+	tinygltf::Model model;
+	std::string err, warn;
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	bool loaded = false;
+	if (ext == "glb")
+	{
+		// parse the GLB container straight from the mapping instead of reading it into a copy first
+		MappedFile file;
+		std::string baseDir = filename.substr(0, filename.find_last_of("/\\") + 1);
+		if (file.Open(filename))
+			loaded = loader.LoadBinaryFromMemory(&model, &err, &warn, (const unsigned char*)file.Data(), (unsigned int)file.Size(), baseDir);
+		else
+			err = "fail to open file";
+	}
+	else
+		loaded = loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+
+	if (!warn.empty())
+		printf("glTF warning: %s\n", warn.c_str());
+	if (!loaded)
+	{
+		printf("glTF error: %s\n", err.c_str());
+		return false;
+	}
+
+	GLTFParseState state;
+	state.model = &model;
+	state.scene = scene;
+	state.filename = filename;
+	state.hasCamera = false;
+
+	Material defaultMat;
+	scene->AddMaterial(defaultMat);
+
+	LoadMeshes(state);
+	LoadMaterials(state);
+
+	// the default scene, or every root node when the file does not name one
+	mat4 identity;
+	int sceneIdx = model.defaultScene >= 0 ? model.defaultScene : 0;
+	if (sceneIdx < (int)model.scenes.size())
+	{
+		for (int node : model.scenes[sceneIdx].nodes)
+			LoadNode(state, node, identity, 0);
+	}
+	else {
+		std::vector<bool> isChild(model.nodes.size(), false);
+		for (const tinygltf::Node& node : model.nodes)
+			for (int child : node.children)
+				if (child >= 0 && child < (int)isChild.size())
+					isChild[child] = true;
+		for (size_t i = 0; i < model.nodes.size(); i++)
+			if (!isChild[i])
+				LoadNode(state, (int)i, identity, 0);
+	}
+
+	if (!state.hasCamera)
+		AddDefaultCamera(scene);
+
+	if (!model.lights.empty())
+		printf("glTF punctual lights are not imported, %d skipped\n", (int)model.lights.size());
+
+	return !scene->meshInstances.empty();
+}
+
+NAMESPACE_END(nagi)
@@ -1,158 +1,503 @@
-#include <map>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
 #include "parser.h"
 #include "scene.h"
 #include "material.h"
 #include "light.h"
 #include "camera.h"
 #include "mesh.h"
+#include "mappedFile.h"
+#include "parallel.h"
 
 NAMESPACE_BEGIN(nagi)
 
-static const int kMaxLineLength = 2048;
+// longest number token, longer ones are rejected
+static const size_t kMaxNumberLength = 63;
+
+// whitespace separated token of a line, '{' and '}' are tokens of their own
+struct SceneToken
+{
+	const char* p;
+	size_t len;
+
+	bool operator==(const char* s) const { return strlen(s) == len && memcmp(p, s, len) == 0; }
+	bool operator!=(const char* s) const { return !(*this == s); }
+	std::string str() const { return std::string(p, len); }
+};
+
+// splits the mapped scene file into lines of tokens, blank lines and '#' comments are skipped
+class SceneLexer
+{
+public:
+	SceneLexer(const char* data, size_t size) :cur(data), end(data + size), lineNumber(0) {}
+
+	// false at the end of the file
+	bool NextLine()
+	{
+		while (cur < end)
+		{
+			const char* lineEnd = (const char*)memchr(cur, '\n', end - cur);
+			if (!lineEnd) lineEnd = end;
+			const char* p = cur;
+			cur = lineEnd < end ? lineEnd + 1 : end;
+			lineNumber++;
+
+			tokens.clear();
+			while (p < lineEnd)
+			{
+				while (p < lineEnd && IsSpace(*p)) p++;
+				if (p == lineEnd || *p == '#')
+					break;
+				const char* start = p;
+				if (*p == '{' || *p == '}')
+					p++;
+				else
+					while (p < lineEnd && !IsSpace(*p) && *p != '{' && *p != '}') p++;
+				tokens.push_back({ start, (size_t)(p - start) });
+			}
+			if (!tokens.empty())
+				return true;
+		}
+		return false;
+	}
+
+	std::vector<SceneToken> tokens;
+	const char* cur;
+	const char* end;
+	size_t lineNumber;
+
+private:
+	static bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+};
+
+enum SceneKeyword
+{
+	kKeywordUnknown,
+	// blocks
+	kBlockMaterial, kBlockRenderer, kBlockCamera, kBlockLight, kBlockMesh,
+	// material
+	kColor, kAnisotropic, kEmission, kRoughness, kMetallic, kSubsurface, kSpecularTint, kSheen, kSheenTint,
+	kClearcoat, kClearcoatGloss, kSpecTrans, kIor, kMediumType, kMediumDensity, kMediumColor, kMediumAnisotropy,
+	kBaseColorTex, kRoughnessTex, kMetallicTex, kNormalMapTex, kEmissionTex, kOpacity, kAlphaMode, kAlphaCutoff,
+	// renderer
+	kEnvmapFile, kEnvMapRotation, kEnvmapIntensity, kRenderRes, kWindowRes, kTileRes, kMaxSpp, kMaxDepth, kRRDepth,
+	kTexArrayWidth, kTexArrayHeight, kTextureDedupe, kTextureCompression, kBvhWidth, kCompressedBVH, kBvhRefitThreshold, kDenoiserFrameCnt, kEnableRR,
+	kEnableDenoiser, kEnableTonemap, kEnableAces, kSimpleAcesFit, kOpenglNormalMap, kHideEmitters, kEnableBackground,
+	kTransparentBackground, kIndependentRenderSize, kEnableRoughnessMollification, kEnableVolumeMIS,
+	// camera, light and mesh
+	kPosition, kLookat, kFov, kFocalDistance, kLensRadius, kMatrix, kV1, kV2, kRadius, kType,
+	kMeshName, kMatName, kBvhSplitMethod, kBvhSplitBudget, kScale, kRotation
+};
+
+// every keyword maps to one id, the blocks decide which ids they accept
+static SceneKeyword LookupKeyword(const SceneToken& token)
+{
+	static const std::unordered_map<std::string, SceneKeyword> keywords = {
+		{ "material", kBlockMaterial }, { "renderer", kBlockRenderer }, { "camera", kBlockCamera },
+		{ "light", kBlockLight }, { "mesh", kBlockMesh },
+		{ "color", kColor }, { "anisotropic", kAnisotropic }, { "emission", kEmission }, { "roughness", kRoughness },
+		{ "metallic", kMetallic }, { "subsurface", kSubsurface }, { "specularTint", kSpecularTint }, { "sheen", kSheen },
+		{ "sheenTint", kSheenTint }, { "clearcoat", kClearcoat }, { "clearcoatGloss", kClearcoatGloss },
+		{ "specTrans", kSpecTrans }, { "ior", kIor }, { "mediumType", kMediumType }, { "mediumDensity", kMediumDensity },
+		{ "mediumColor", kMediumColor }, { "mediumAnisotropy", kMediumAnisotropy }, { "baseColorTex", kBaseColorTex },
+		{ "roughnessTex", kRoughnessTex }, { "metallicTex", kMetallicTex }, { "normalMapTex", kNormalMapTex },
+		{ "emissionTex", kEmissionTex }, { "opacity", kOpacity }, { "alphaMode", kAlphaMode }, { "alphaCutoff", kAlphaCutoff },
+		{ "envmapFile", kEnvmapFile }, { "envMapRotation", kEnvMapRotation }, { "envmapIntensity", kEnvmapIntensity },
+		{ "renderRes", kRenderRes }, { "windowRes", kWindowRes }, { "tileRes", kTileRes }, { "maxSpp", kMaxSpp },
+		{ "maxDepth", kMaxDepth }, { "RRDepth", kRRDepth }, { "texArrayWidth", kTexArrayWidth },
+		{ "texArrayHeight", kTexArrayHeight }, { "textureDedupe", kTextureDedupe }, { "textureCompression", kTextureCompression },
+		{ "bvhWidth", kBvhWidth }, { "compressedBVH", kCompressedBVH },
+		{ "bvhRefitThreshold", kBvhRefitThreshold }, { "denoiserFrameCnt", kDenoiserFrameCnt }, { "enableRR", kEnableRR },
+		{ "enableDenoiser", kEnableDenoiser }, { "enableTonemap", kEnableTonemap }, { "enableAces", kEnableAces },
+		{ "simpleAcesFit", kSimpleAcesFit }, { "openglNormalMap", kOpenglNormalMap }, { "hideEmitters", kHideEmitters },
+		{ "enableBackground", kEnableBackground }, { "transparentBackground", kTransparentBackground },
+		{ "independentRenderSize", kIndependentRenderSize },
+		{ "enableRoughnessMollification", kEnableRoughnessMollification }, { "enableVolumeMIS", kEnableVolumeMIS },
+		{ "position", kPosition }, { "lookat", kLookat }, { "fov", kFov }, { "focalDistance", kFocalDistance },
+		{ "lensRadius", kLensRadius }, { "matrix", kMatrix }, { "v1", kV1 }, { "v2", kV2 }, { "radius", kRadius },
+		{ "type", kType }, { "meshName", kMeshName }, { "matName", kMatName }, { "bvhSplitMethod", kBvhSplitMethod },
+		{ "bvhSplitBudget", kBvhSplitBudget }, { "scale", kScale }, { "rotation", kRotation }
+	};
+
+	auto it = keywords.find(token.str());
+	return it == keywords.end() ? kKeywordUnknown : it->second;
+}
+
+// reads the values of the current keyword line and reports errors with the file name and line number
+class SceneLineReader
+{
+public:
+	SceneLineReader(const std::string& filename, const SceneLexer& lexer) :filename(filename), lexer(lexer), failed(false) {}
+
+	void Fail(const char* message)
+	{
+		printf("%s:%zu: %s\n", filename.c_str(), lexer.lineNumber, message);
+		failed = true;
+	}
+
+	// exactly n numbers behind the keyword
+	bool Floats(float* out, size_t n)
+	{
+		if (!Count(n))
+			return false;
+		for (size_t i = 0; i < n; i++)
+			if (!Number(lexer.tokens[i + 1], out[i]))
+				return false;
+		return true;
+	}
+	bool Float(float& out) { return Floats(&out, 1); }
+	bool Int(int& out)
+	{
+		float f;
+		if (!Floats(&f, 1))
+			return false;
+		out = (int)f;
+		if ((float)out != f)
+		{
+			Fail(("\"" + lexer.tokens[0].str() + "\" expects an integer").c_str());
+			return false;
+		}
+		return true;
+	}
+	bool Ints(vec2i& out) { return Int2(out.x, out.y); }
+	bool Bool(bool& out)
+	{
+		int i;
+		if (!Int(i))
+			return false;
+		out = i != 0;
+		return true;
+	}
+	bool String(std::string& out)
+	{
+		if (!Count(1))
+			return false;
+		out = lexer.tokens[1].str();
+		return true;
+	}
+	// mat4 written row by row as 16 numbers, mat4 stores the columns
+	bool Matrix(mat4& out)
+	{
+		float m[16];
+		if (!Floats(m, 16))
+			return false;
+		for (int r = 0; r < 4; r++)
+			for (int c = 0; c < 4; c++)
+				out[c][r] = m[r * 4 + c];
+		return true;
+	}
+	// a name of one of the values of an enum, or its number
+	bool Enum(float& out, const char* const* names, int count)
+	{
+		if (!Count(1))
+			return false;
+		for (int i = 0; i < count; i++)
+			if (lexer.tokens[1] == names[i])
+			{
+				out = (float)i;
+				return true;
+			}
+		float f;
+		if (NumberSilent(lexer.tokens[1], f) && f >= 0.0f && f < (float)count && f == (float)(int)f)
+		{
+			out = f;
+			return true;
+		}
+		std::string message = "unknown " + lexer.tokens[0].str() + " \"" + lexer.tokens[1].str() + "\", expected";
+		for (int i = 0; i < count; i++)
+			message += std::string(" ") + names[i];
+		Fail(message.c_str());
+		return false;
+	}
+
+	const std::string& filename;
+	const SceneLexer& lexer;
+	bool failed;
+
+private:
+	bool Count(size_t n)
+	{
+		if (lexer.tokens.size() == n + 1)
+			return true;
+		Fail(("\"" + lexer.tokens[0].str() + "\" expects " + std::to_string(n) + " value(s), got " +
+			std::to_string(lexer.tokens.size() - 1)).c_str());
+		return false;
+	}
+	bool Int2(int& x, int& y)
+	{
+		float f[2];
+		if (!Floats(f, 2))
+			return false;
+		x = (int)f[0];
+		y = (int)f[1];
+		return true;
+	}
+	static bool NumberSilent(const SceneToken& token, float& out)
+	{
+		// the mapping is not NUL terminated, strtof gets a copy
+		char buffer[kMaxNumberLength + 1];
+		if (token.len == 0 || token.len > kMaxNumberLength)
+			return false;
+		memcpy(buffer, token.p, token.len);
+		buffer[token.len] = 0;
+		char* numberEnd;
+		out = strtof(buffer, &numberEnd);
+		return numberEnd == buffer + token.len;
+	}
+	bool Number(const SceneToken& token, float& out)
+	{
+		if (NumberSilent(token, out))
+			return true;
+		Fail(("\"" + token.str() + "\" is not a number").c_str());
+		return false;
+	}
+};
+
+static const char* const kAlphaModeNames[] = { "opaque", "blend", "mask" };
+static const char* const kMediumTypeNames[] = { "none", "absorb", "scatter", "emissive" };
+// in the order of BVHAccel::SplitMethod, so numeric values keep selecting the same method
+static const char* const kSplitMethodNames[] = { "middle", "equalcounts", "sah", "hlbvh", "sbvh" };
 
 //TODO: mat.alphaModemat.mediumTypelight.typeԸraytoolsежöֵķ
 
-bool ParseFromSceneFile(std::string filename, Scene* scene)
+static bool ParseSceneBlocks(const std::string& filename, Scene* scene)
 {
-	FILE* file = fopen(filename.c_str(), "r");
-	if (!file)
+	MappedFile file;
+	if (!file.Open(filename))
 		Error("Fail to open \"%s\" file", filename.c_str());
 
 	printf("Parse Scene From \"%s\" file.\n", filename.c_str());
 
-	std::map<std::string, uint16_t> materialMap;
+	std::unordered_map<std::string, int> materialMap;
+	// meshes whose split method/budget an instance already set
+	std::vector<char> meshSplitSet;
 	std::string path = filename.substr(0, filename.find_last_of("/\\") + 1);
 
-	char line[kMaxLineLength];
-
 	Material defaultMat;
 	scene->AddMaterial(defaultMat);
 
-	while(fgets(line, kMaxLineLength, file))
-	{
-		// skip comments
-		if (line[0] == '#')
-			continue;
+	SceneLexer lexer((const char*)file.Data(), file.Size());
+	SceneLineReader reader(filename, lexer);
+	const std::vector<SceneToken>& tokens = lexer.tokens;
 
-		// name used for materials and meshes
-		char name[kMaxLineLength] = { 0 };
+	while (lexer.NextLine())
+	{
+		// block header: the block type, the name of materials, then '{' on the same or the next line
+		SceneKeyword block = LookupKeyword(tokens[0]);
+		size_t headerLine = lexer.lineNumber;
+		size_t braceIdx = block == kBlockMaterial ? 2 : 1;
+		if (block < kBlockMaterial || block > kBlockMesh)
+		{
+			reader.Fail(("unknown block \"" + tokens[0].str() + "\"").c_str());
+			return false;
+		}
+		if (block == kBlockMaterial && (tokens.size() < 2 || tokens[1] == "{"))
+		{
+			reader.Fail("material without a name");
+			return false;
+		}
+		std::string blockName = tokens[0].str();
+		std::string name = block == kBlockMaterial ? tokens[1].str() : "";
+		bool opened = tokens.size() == braceIdx + 1 && tokens[braceIdx] == "{";
+		if (!opened && tokens.size() != braceIdx)
+		{
+			reader.Fail(("unexpected \"" + tokens[braceIdx].str() + "\" after the block header").c_str());
+			return false;
+		}
+		if (!opened && (!lexer.NextLine() || tokens.size() != 1 || tokens[0] != "{"))
+		{
+			reader.Fail(("expected '{' after \"" + blockName + "\"").c_str());
+			return false;
+		}
 
-		// Material
-		if (sscanf(line, " material %s", name) == 1)
+		Material mat;
+		std::string texNames[5];
+		RenderOptions& options = *(scene->renderOptions);
+		std::string envMapName;
+		mat4 xform, translate, scale, rotate;
+		bool matrixProvided = false;
+		vec3f pos, lookat, v1, v2;
+		float fov = 45.0f, focalDistance = 1.0f, lensRadius = 0.0f;
+		Light light;
+		std::string lightType, meshName, matName;
+		float splitMethod = -1.0f, bvhSplitBudget = -1.0f;
+
+		bool closed = false;
+		while (lexer.NextLine())
 		{
-			Material mat;
-			char baseColorTexName[100] = "none";
-			char roughnessTexName[100] = "none";
-			char metallicTexName[100] = "none";
-			char normalMapTexName[100] = "none";
-			char emissionMapTexName[100] = "none";
-			char alphaMode[100] = "none";
-			char mediumType[100] = "none";
-
-			while(fgets(line, kMaxLineLength, file))
+			if (tokens[0] == "}")
 			{
-				if (strchr(line, '}'))
-					break;
-
-				sscanf(line, " color %f %f %f", 		&mat.baseColor.x, &mat.baseColor.y, &mat.baseColor.z);
-				sscanf(line, " anisotropic %f", 		&mat.anisotropic);
-				sscanf(line, " emission %f %f %f", 		&mat.emission.x, &mat.emission.y, &mat.emission.z);
-				sscanf(line, " roughness %f", 			&mat.roughness);
-				sscanf(line, " metallic %f", 			&mat.metallic);
-				sscanf(line, " subsurface %f", 			&mat.subsurface);
-				sscanf(line, " specularTint %f", 		&mat.specularTint);
-				sscanf(line, " sheen %f", 				&mat.sheen);
-				sscanf(line, " sheenTint %f", 			&mat.sheenTint);
-				sscanf(line, " clearcoat %f", 			&mat.clearcoat);
-				sscanf(line, " clearcoatGloss %f", 		&mat.clearcoatGloss);
-				sscanf(line, " specTrans %f", 			&mat.specTrans);
-				sscanf(line, " ior %f", 				&mat.ior);
-				sscanf(line, " mediumType %f", 			&mat.mediumType);
-				sscanf(line, " mediumDensity %f", 		&mat.mediumDensity);
-				sscanf(line, " mediumColor %f %f %f", 	&mat.mediumColor.x, &mat.mediumColor.y, &mat.mediumColor.z);
-				sscanf(line, " mediumAnisotropy %f", 	&mat.mediumAnisotropy);
-				sscanf(line, " baseColorTex %s", 		baseColorTexName);
-				sscanf(line, " roughnessTex %s", 		roughnessTexName);
-				sscanf(line, " metallicTex %s", 		metallicTexName);
-				sscanf(line, " normalMapTex %s", 		normalMapTexName);
-				sscanf(line, " emissionTex %s", 		emissionMapTexName);
-				sscanf(line, " opacity %f", 			&mat.opacity);
-				sscanf(line, " alphaMode %f", 			&mat.alphaMode);
-				sscanf(line, " alphaCutoff %f", 		&mat.alphaCutoff);
+				if (tokens.size() != 1)
+				{
+					reader.Fail("unexpected tokens after '}'");
+					return false;
+				}
+				closed = true;
+				break;
 			}
 
-			if (strcmp(baseColorTexName, "none") != 0)
-				mat.baseColorTexID = scene->AddTexture(path + baseColorTexName);
-
-			if (strcmp(roughnessTexName, "none") != 0)
-				mat.roughnessTexID = scene->AddTexture(path + roughnessTexName);
+			SceneKeyword keyword = LookupKeyword(tokens[0]);
+			bool known = true;
+			switch (block)
+			{
+			case kBlockMaterial:
+				switch (keyword)
+				{
+				case kColor:			reader.Floats(&mat.baseColor.x, 3); break;
+				case kAnisotropic:		reader.Float(mat.anisotropic); break;
+				case kEmission:			reader.Floats(&mat.emission.x, 3); break;
+				case kRoughness:		reader.Float(mat.roughness); break;
+				case kMetallic:			reader.Float(mat.metallic); break;
+				case kSubsurface:		reader.Float(mat.subsurface); break;
+				case kSpecularTint:		reader.Float(mat.specularTint); break;
+				case kSheen:			reader.Float(mat.sheen); break;
+				case kSheenTint:		reader.Float(mat.sheenTint); break;
+				case kClearcoat:		reader.Float(mat.clearcoat); break;
+				case kClearcoatGloss:	reader.Float(mat.clearcoatGloss); break;
+				case kSpecTrans:		reader.Float(mat.specTrans); break;
+				case kIor:				reader.Float(mat.ior); break;
+				case kMediumType:		reader.Enum(mat.mediumType, kMediumTypeNames, 4); break;
+				case kMediumDensity:	reader.Float(mat.mediumDensity); break;
+				case kMediumColor:		reader.Floats(&mat.mediumColor.x, 3); break;
+				case kMediumAnisotropy:	reader.Float(mat.mediumAnisotropy); break;
+				case kBaseColorTex:		reader.String(texNames[0]); break;
+				case kRoughnessTex:		reader.String(texNames[1]); break;
+				case kMetallicTex:		reader.String(texNames[2]); break;
+				case kNormalMapTex:		reader.String(texNames[3]); break;
+				case kEmissionTex:		reader.String(texNames[4]); break;
+				case kOpacity:			reader.Float(mat.opacity); break;
+				case kAlphaMode:		reader.Enum(mat.alphaMode, kAlphaModeNames, 3); break;
+				case kAlphaCutoff:		reader.Float(mat.alphaCutoff); break;
+				default: known = false;
+				}
+				break;
 
-			if (strcmp(metallicTexName, "none") != 0)
-				mat.metallicTexID = scene->AddTexture(path + metallicTexName);
+			case kBlockRenderer:
+				switch (keyword)
+				{
+				case kEnvmapFile:					reader.String(envMapName); break;
+				case kEnvMapRotation:				reader.Float(options.envMapRot); break;
+				case kEnvmapIntensity:				reader.Float(options.envMapIntensity); break;
+				case kRenderRes:					reader.Ints(options.renderResolution); break;
+				case kWindowRes:					reader.Ints(options.windowResolution); break;
+				case kTileRes:						reader.Ints(options.tileResolution); break;
+				case kMaxSpp:						reader.Int(options.maxSpp); break;
+				case kMaxDepth:						reader.Int(options.maxDepth); break;
+				case kRRDepth:						reader.Int(options.RRDepth); break;
+				case kTexArrayWidth:				reader.Int(options.texArrayWidth); break;
+				case kTexArrayHeight:				reader.Int(options.texArrayHeight); break;
+				case kTextureDedupe:				reader.Bool(options.enableTextureDedupe); break;
+				case kTextureCompression:			reader.Bool(options.enableTextureCompression); break;
+				case kBvhWidth:						reader.Int(options.bvhWidth); break;
+				case kCompressedBVH:				reader.Bool(options.enableCompressedBVH); break;
+				case kBvhRefitThreshold:			reader.Float(options.bvhRefitThreshold); break;
+				case kDenoiserFrameCnt:				reader.Int(options.denoiserFrameCnt); break;
+				case kEnableRR:						reader.Bool(options.enableRR); break;
+				case kEnableDenoiser:				reader.Bool(options.enableDenoiser); break;
+				case kEnableTonemap:				reader.Bool(options.enableTonemap); break;
+				case kEnableAces:					reader.Bool(options.enableAces); break;
+				case kSimpleAcesFit:				reader.Bool(options.enableSimpleAcesFit); break;
+				case kOpenglNormalMap:				reader.Bool(options.enableOpenglNormalMap); break;
+				case kHideEmitters:					reader.Bool(options.enableHideEmitters); break;
+				case kEnableBackground:				reader.Bool(options.enableBackground); break;
+				case kTransparentBackground:		reader.Bool(options.enableTransparentBackground); break;
+				case kIndependentRenderSize:		reader.Bool(options.enableIndependentRenderSize); break;
+				case kEnableRoughnessMollification:	reader.Bool(options.enableRoughnessMollification); break;
+				case kEnableVolumeMIS:				reader.Bool(options.enableVolumeMIS); break;
+				default: known = false;
+				}
+				break;
 
-			if (strcmp(normalMapTexName, "none") != 0)
-				mat.normalMapTexID = scene->AddTexture(path + normalMapTexName);
+			case kBlockCamera:
+				switch (keyword)
+				{
+				case kPosition:			reader.Floats(&pos.x, 3); break;
+				case kLookat:			reader.Floats(&lookat.x, 3); break;
+				case kFov:				reader.Float(fov); break;
+				case kFocalDistance:	reader.Float(focalDistance); break;
+				case kLensRadius:		reader.Float(lensRadius); break;
+				case kMatrix:			matrixProvided = reader.Matrix(xform); break;
+				default: known = false;
+				}
+				break;
 
-			if (strcmp(emissionMapTexName, "none") != 0)
-				mat.emissionMapTexID = scene->AddTexture(path + emissionMapTexName);
+			case kBlockLight:
+				switch (keyword)
+				{
+				case kPosition:	reader.Floats(&light.position.x, 3); break;
+				case kEmission:	reader.Floats(&light.emission.x, 3); break;
+				case kV1:		reader.Floats(&v1.x, 3); break;
+				case kV2:		reader.Floats(&v2.x, 3); break;
+				case kRadius:	reader.Float(light.radius); break;
+				case kType:		reader.String(lightType); break;
+				default: known = false;
+				}
+				break;
 
-			if (strcmp(alphaMode, "opaque") == 0)
-				mat.alphaMode = Material::AlphaMode::Opaque;
-			else if (strcmp(alphaMode, "blend") == 0)
-				mat.alphaMode = Material::AlphaMode::Blend;
-			else if (strcmp(alphaMode, "mask") == 0)
-				mat.alphaMode = Material::AlphaMode::Mask;
+			case kBlockMesh:
+				switch (keyword)
+				{
+				case kMeshName:			reader.String(meshName); break;
+				case kMatName:			reader.String(matName); break;
+				case kBvhSplitMethod:	reader.Enum(splitMethod, kSplitMethodNames, 5); break;
+				case kBvhSplitBudget:	reader.Float(bvhSplitBudget); break;
+				case kPosition:			reader.Floats(&translate.data[3][0], 3); break;
+				case kScale:
+				{
+					vec3f s;
+					if (reader.Floats(&s.x, 3))
+						scale = mat4::Scale(s);
+					break;
+				}
+				case kRotation:
+				{
+					vec4f q;
+					if (reader.Floats(&q.x, 4))
+						rotate = mat4::QuatToMatrix(q.x, q.y, q.z, q.w);
+					break;
+				}
+				case kMatrix:			matrixProvided = reader.Matrix(xform); break;
+				default: known = false;
+				}
+				break;
 
-			if (strcmp(mediumType, "absorb") == 0)
-				mat.mediumType = Material::MediumType::Absorb;
-			else if (strcmp(mediumType, "scatter") == 0)
-				mat.mediumType = Material::MediumType::Scatter;
-			else if (strcmp(mediumType, "emissive") == 0)
-				mat.mediumType = Material::MediumType::Emissive;
+			default:
+				break;
+			}
 
-			if (materialMap.find(name) == materialMap.end())
-				materialMap[name] = scene->AddMaterial(mat);
+			// unknown keywords are skipped so files written for newer versions still load
+			if (!known)
+				printf("%s:%zu: unknown keyword \"%s\" in %s block, skipped\n", filename.c_str(), lexer.lineNumber,
+					tokens[0].str().c_str(), blockName.c_str());
+			if (reader.failed)
+				return false;
 		}
 
-		if (strstr(line, "renderer"))
+		if (!closed)
 		{
-			RenderOptions& options = *(scene->renderOptions);
-			char envMapName[200] = "none";
+			printf("%s:%zu: block is not closed by '}'\n", filename.c_str(), headerLine);
+			return false;
+		}
 
-			while (fgets(line, kMaxLineLength, file))
-			{
-				if (strchr(line,'}'))
-					break;
+		switch (block)
+		{
+		case kBlockMaterial:
+		{
+			float* texIDs[5] = { &mat.baseColorTexID, &mat.roughnessTexID, &mat.metallicTexID, &mat.normalMapTexID, &mat.emissionMapTexID };
+			for (int i = 0; i < 5; i++)
+				if (!texNames[i].empty() && texNames[i] != "none")
+					*texIDs[i] = (float)scene->AddTexture(path + texNames[i]);
 
-				sscanf(line, " envmapFile %s", 						envMapName);
-				sscanf(line, " envMapRotation %f", 					&options.envMapRot);
-				sscanf(line, " envmapIntensity %f", 				&options.envMapIntensity);
-				sscanf(line, " renderRes %d %d", 					&options.renderResolution.x, &options.renderResolution.y);
-				sscanf(line, " windowRes %d %d", 					&options.windowResolution.x, &options.windowResolution.y);
-				sscanf(line, " tileRes %d %d", 						&options.tileResolution.x,   &options.tileResolution.y);
-				sscanf(line, " maxSpp %d", 							&options.maxSpp);
-				sscanf(line, " maxDepth %d", 						&options.maxDepth);
-				sscanf(line, " RRDepth %d", 						&options.RRDepth);
-				sscanf(line, " texArrayWidth %d", 					&options.texArrayWidth);
-				sscanf(line, " texArrayHeight %d", 					&options.texArrayHeight);
-				sscanf(line, " denoiserFrameCnt %d", 				&options.denoiserFrameCnt);
-				sscanf(line, " enableRR %d", 						&options.enableRR);
-				sscanf(line, " enableDenoiser %d", 					&options.enableDenoiser);
-				sscanf(line, " enableTonemap %d", 					&options.enableTonemap);
-				sscanf(line, " enableAces %d", 						&options.enableAces);
-				sscanf(line, " simpleAcesFit %d", 					&options.enableSimpleAcesFit);
-				sscanf(line, " openglNormalMap %d", 				&options.enableOpenglNormalMap);
-				sscanf(line, " hideEmitters %d", 					&options.enableHideEmitters);
-				sscanf(line, " enableBackground %d", 				&options.enableBackground);
-				sscanf(line, " transparentBackground %d",			&options.enableTransparentBackground);
-				sscanf(line, " independentRenderSize %d", 			&options.enableIndependentRenderSize);
-				sscanf(line, " enableRoughnessMollification %d", 	&options.enableRoughnessMollification);
-				sscanf(line, " enableVolumeMIS %d", 				&options.enableVolumeMIS);
-			}
+			if (materialMap.find(name) == materialMap.end())
+				materialMap[name] = scene->AddMaterial(mat);
+			break;
+		}
 
-			if (strcmp(envMapName, "none") == 0)
+		case kBlockRenderer:
+			if (envMapName.empty() || envMapName == "none")
 				options.enableEnvMap = false;
-			else if (strcmp(envMapName, "none") != 0)
+			else
 			{
 				scene->AddEnvMap(path + envMapName);
 				options.enableEnvMap = true;
@@ -160,35 +505,20 @@ bool ParseFromSceneFile(std::string filename, Scene* scene)
 
 			if (!options.enableIndependentRenderSize)
 				options.windowResolution = options.renderResolution;
-		}
 
-		if (strstr(line, "camera"))
-		{
-			mat4 xform;
-			bool matrixProvided = false;
-			vec3f pos, lookat;
-			float fov, focalDistance = 1.0f, lensRadius = 0.0f;
-
-			while (fgets(line, kMaxLineLength, file))
+			if (options.bvhWidth != 2 && options.bvhWidth != 4 && options.bvhWidth != 8)
 			{
-				if (strchr(line, '}'))
-					break;
-
-				sscanf(line, " position %f %f %f", 	&pos.x, &pos.y, &pos.z);
-				sscanf(line, " lookat %f %f %f", 	&lookat.x, &lookat.y, &lookat.z);
-				sscanf(line, " fov %f", 			&fov);
-				sscanf(line, " focalDistance %f", 	&focalDistance);
-				sscanf(line, " lensRadius %f", 		&lensRadius);
-
-				if (sscanf(line, " matrix %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
-					&xform[0][0], &xform[1][0], &xform[2][0], &xform[3][0],
-					&xform[0][1], &xform[1][1], &xform[2][1], &xform[3][1],
-					&xform[0][2], &xform[1][2], &xform[2][2], &xform[3][2],
-					&xform[0][3], &xform[1][3], &xform[2][3], &xform[3][3]
-				) != 0)
-					matrixProvided = true;
+				printf("Unsupported bvhWidth %d, using binary BVH\n", options.bvhWidth);
+				options.bvhWidth = 2;
+			}
+			if (options.enableCompressedBVH && options.bvhWidth == 2)
+			{
+				printf("compressedBVH needs bvhWidth 4 or 8, using uncompressed nodes\n");
+				options.enableCompressedBVH = false;
 			}
+			break;
 
+		case kBlockCamera:
 			if (matrixProvided)
 			{
 				vec3f forward = vec3f(xform[2][0], xform[2][1], xform[2][2]);
@@ -199,104 +529,92 @@ bool ParseFromSceneFile(std::string filename, Scene* scene)
 			scene->AddCamera(pos, lookat, fov);
 			scene->camera->focalDistance = focalDistance;
 			scene->camera->lensRadius = lensRadius;
-		}
+			break;
 
-		if (strstr(line, "light"))
-		{
-			Light light;
-			vec3f v1, v2;
-			char lightType[100] = "none";
-
-			while (fgets(line,kMaxLineLength,file))
-			{
-				if (strchr(line, '}'))
-					break;
-
-				sscanf(line, " position %f %f %f", 	&light.position.x, &light.position.y, &light.position.z);
-				sscanf(line, " emission %f %f %f", 	&light.emission.x, &light.emission.y, &light.emission.z);
-				sscanf(line, " v1 %f %f %f", 		&v1.x, &v1.y, &v1.z);
-				sscanf(line, " v2 %f %f %f", 		&v2.x, &v2.y, &v2.z);
-				sscanf(line, " radius %f", 			&light.radius);
-				sscanf(line, " type %s", 			lightType);
-			}
-
-			if (strcmp(lightType, "quad") == 0)
+		case kBlockLight:
+			if (lightType == "quad")
 			{
 				light.type = Light::LightType::RectLight;
 				light.u = v1 - light.position;
 				light.v = v2 - light.position;
 				light.area = Cross(light.u, light.v).Length();
 			}
-			else if (strcmp(lightType, "sphere") == 0)
+			else if (lightType == "sphere")
 			{
 				light.type = Light::LightType::SphereLight;
 				light.area = 4.0f * PI * light.radius * light.radius;
 			}
-			else if (strcmp(lightType, "distant") == 0)
+			else if (lightType == "distant")
 			{
 				light.type = Light::LightType::DistantLight;
 				light.area = 0.0f;
 			}
+			else if (!lightType.empty())
+			{
+				printf("%s:%zu: light type \"%s\" is not quad, sphere or distant\n", filename.c_str(), headerLine, lightType.c_str());
+				return false;
+			}
 
 			scene->AddLight(light);
-		}
+			break;
 
-		if (strstr(line, "mesh"))
+		case kBlockMesh:
 		{
-			char meshName[100] = "none";
-			char matName[100] = "none";
-			mat4 xform, translate, scale, rotate;
-			vec4f rotQuat;
-			bool matrixProvided = false;
+			if (meshName.empty() || meshName == "none")
+				break;
 
-			while (fgets(line, kMaxLineLength, file))
-			{
-				if (strchr(line, '}'))
-					break;
+			int meshID = scene->AddMesh(path + meshName);
 
-				sscanf(line, " meshName %s", 			  meshName);
-				sscanf(line, " matName %s", 			  matName);
-				sscanf(line, " position %f %f %f", 		  &translate.data[3][0], &translate.data[3][1], &translate.data[3][2]);
-				sscanf(line, " scale %f %f %f", 		  &scale.data[0][0], &scale.data[1][1], &scale.data[2][2]);
-				if (sscanf(line, " rotation %f %f %f %f", &rotQuat.x, &rotQuat.y, &rotQuat.z, &rotQuat.w) != 0)
-					rotate = mat4::QuatToMatrix(rotQuat.x, rotQuat.y, rotQuat.z, rotQuat.w);
-				if (sscanf(line, " matrix %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
-					&xform[0][0], &xform[1][0], &xform[2][0], &xform[3][0],
-					&xform[0][1], &xform[1][1], &xform[2][1], &xform[3][1],
-					&xform[0][2], &xform[1][2], &xform[2][2], &xform[3][2],
-					&xform[0][3], &xform[1][3], &xform[2][3], &xform[3][3]
-				) != 0)
-					matrixProvided = true;
+			// bvh split method is a property of the mesh, the first instance specifying it wins
+			Mesh* mesh = scene->meshes[meshID];
+			if (meshSplitSet.size() <= (size_t)meshID)
+				meshSplitSet.resize(meshID + 1, 0);
+			if (!meshSplitSet[meshID] && (splitMethod >= 0.0f || bvhSplitBudget >= 0.0f))
+			{
+				meshSplitSet[meshID] = 1;
+				if (splitMethod >= 0.0f)
+					mesh->splitMethod = (BVHAccel::SplitMethod)(int)splitMethod;
+				if (bvhSplitBudget >= 0.0f)
+					mesh->splitBudget = bvhSplitBudget;
 			}
 
-			if (strcmp(meshName, "none") != 0)
-			{
-				int meshID = scene->AddMesh(path + meshName);
-				if (meshID != -1)
-				{
-					MeshInstance* meshInstance = new MeshInstance;
+			MeshInstance* meshInstance = new MeshInstance;
+			meshInstance->meshID = meshID;
+			meshInstance->name = meshName;
 
-					meshInstance->meshID = meshID;
-					meshInstance->name = meshName;
+			auto it = materialMap.find(matName);
+			if (it != materialMap.end())
+				meshInstance->materialID = it->second;
+			else
+				printf("%s:%zu: could not find material \"%s\". Using default material\n", filename.c_str(), headerLine, matName.c_str());
 
-					if (materialMap.find(matName) != materialMap.end())
-						meshInstance->materialID = materialMap[matName];
-					else
-						printf("Could not find material \"%s\". Using default material\n", matName);
+			if (matrixProvided)
+				meshInstance->transform = xform;
+			else
+				meshInstance->transform = scale * rotate * translate;
 
-					if (matrixProvided)
-						meshInstance->transform = xform;
-					else
-						meshInstance->transform = scale * rotate * translate;
+			scene->AddMeshInstance(meshInstance);
+			break;
+		}
 
-					scene->AddMeshInstance(meshInstance);
-				}
-			}
+		default:
+			break;
 		}
 	}
 
-
 	return true;
 }
 
-NAMESPACE_END(nagi)
\ No newline at end of file
+bool ParseFromSceneFile(std::string filename, Scene* scene)
+{
+	// the env map, textures and meshes are loaded by tasks of the team started here while the blocks are
+	// parsed on one of its threads, they are joined before returning
+	bool success = false;
+	ParallelTasks([&]() {
+		success = ParseSceneBlocks(filename, scene);
+		scene->WaitForLoads();
+	});
+	return success;
+}
+
+NAMESPACE_END(nagi)
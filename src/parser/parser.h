@@ -5,5 +5,7 @@ NAMESPACE_BEGIN(nagi)
 class Scene;
 
 bool ParseFromSceneFile(std::string sceneFile, Scene* scene);
+// glTF 2.0 (.gltf/.glb): triangle meshes, node hierarchy, metallic-roughness materials and the first perspective camera
+bool ParseFromGLTFFile(std::string gltfFile, Scene* scene);
 
 NAMESPACE_END(nagi)
\ No newline at end of file
@@ -15,42 +15,18 @@ bool AnyHit(Ray r, float maxDist)
 {
 #ifdef NAGI_LIGHTS
     // Intersect Emitters
-    for(int i = 0; i < lightsNum; i++)
-    {
-        // 根据light.h中Light的成员变量顺序获取数据，以vec3f为刻度，Light等同5个vec3f
-        vec3 position   = texelFetch(lightsTex, ivec2(i * 5 + 0, 0), 0).xyz;
-        vec3 emission   = texelFetch(lightsTex, ivec2(i * 5 + 1, 0), 0).xyz;
-        vec3 u          = texelFetch(lightsTex, ivec2(i * 5 + 2, 0), 0).xyz;
-        vec3 v          = texelFetch(lightsTex, ivec2(i * 5 + 3, 0), 0).xyz;
-        vec3 params     = texelFetch(lightsTex, ivec2(i * 5 + 4, 0), 0).xyz;
-        float radius    = params.x;
-        float area      = params.y;
-        float type      = params.z;
-
-        // Intersect area light according to light.type
-        if (type == QUAD_LIGHT)
-        {
-            vec3 normal = normalize(cross(u, v));
-            vec4 plane = vec4(normal, dot(normal, position));
-            u *= 1.0f / dot(u, u);  // normalization
-            v *= 1.0f / dot(v, v);  // normalization
-
-            float d = RectangleIntersect(position, u, v, plane, r);
-            if (d > 0.0 && d < maxDist)
-                return true;
-        }
-        else if (type == SPHERE_LIGHT)
-        {
-            float d = SphereIntersect(position, radius, r);
-            if (d > 0.0 && d < maxDist)
-                return true;
-        }
-    }
+    float lightDist = maxDist;
+    if (LightBVHIntersect(r, true, lightDist) >= 0)
+        return true;
 #endif
 
     /* BVH Traversal */
 
+#ifdef NAGI_WIDE_BVH
+    int nodesToVisit[NAGI_BVH_STACK_SIZE];
+#else
     int nodesToVisit[64];
+#endif
     int toVisitOffset = 0;
     nodesToVisit[toVisitOffset++] = -1;
 
@@ -65,6 +41,106 @@ bool AnyHit(Ray r, float maxDist)
     rTrans.ori = r.ori;
     rTrans.dir = r.dir;
 
+#ifdef NAGI_WIDE_BVH
+    // curNodeIdx >= 0 is a wide node, < -1 is a leaf slot pushed by WideNodeIntersect
+    while(curNodeIdx != -1)
+    {
+        // wide中间节点
+        if (curNodeIdx >= 0)
+        {
+            int hitEntry[NAGI_BVH_WIDTH];
+            int hitNum = WideNodeIntersect(curNodeIdx, rTrans, maxDist, hitEntry);
+            for (int i = 0; i < hitNum; i++)
+                nodesToVisit[toVisitOffset++] = hitEntry[i];
+        }
+        else
+        {
+            // 解析叶子所在的wide节点及slot
+            int nodeIdx, childOffset, childCount, childParam;
+            WideLeafDecode(curNodeIdx, nodeIdx, childOffset, childCount, childParam);
+
+            // blasBVH叶子节点
+            if (nodeIdx < tlasBVHStartOffset)
+            {
+                int primitivesOffset = childOffset;
+                int nPrimitives = childCount;
+                for(int i = 0; i < nPrimitives; i++)
+                {
+                    ivec3 primVertexIdx = ivec3(texelFetch(vertexIndicesTex, primitivesOffset + i).xyz);
+
+                    vec4 v0_u = texelFetch(verticesTex, primVertexIdx.x);
+                    vec4 v1_u = texelFetch(verticesTex, primVertexIdx.y);
+                    vec4 v2_u = texelFetch(verticesTex, primVertexIdx.z);
+
+                    vec3 e0 = v1_u.xyz - v0_u.xyz;
+                    vec3 e1 = v2_u.xyz - v0_u.xyz;
+                    vec3 pv = cross(rTrans.dir, e1);
+                    float det = dot(e0, pv);
+
+                    vec3 tv = rTrans.ori - v0_u.xyz;
+                    vec3 qv = cross(tv, e0);
+
+                    vec4 uvt;
+                    uvt.x = dot(tv, pv);
+                    uvt.y = dot(rTrans.dir, qv);
+                    uvt.z = dot(e1, qv);
+                    uvt.xyz = uvt.xyz / det;
+                    uvt.w = 1.0 - uvt.x - uvt.y;
+
+                    if(all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < maxDist)
+                    {
+#if defined(NAGI_ALPHA_TEST) && !defined(NAGI_MEDIUM)
+                        vec2 uv0 = vec2(v0_u.w, texelFetch(normalsTex, primVertexIdx.x).w);
+                        vec2 uv1 = vec2(v1_u.w, texelFetch(normalsTex, primVertexIdx.y).w);
+                        vec2 uv2 = vec2(v2_u.w, texelFetch(normalsTex, primVertexIdx.z).w);
+                        vec2 texCoord = uv0 * uvt.w + uv1 * uvt.x + uv2 * uvt.y;
+
+                        int baseColorTexID  = int(texelFetch(materialsTex, ivec2(curMatID * 8 + 6, 0), 0).x);
+                        float opacity       = texelFetch(materialsTex, ivec2(curMatID * 8 + 7, 0), 0).y;
+                        float alphaMode     = texelFetch(materialsTex, ivec2(curMatID * 8 + 7, 0), 0).z;
+                        float alphaCutoff   = texelFetch(materialsTex, ivec2(curMatID * 8 + 7, 0), 0).w;
+
+                        opacity *= SampleTexture(baseColorTexID, texCoord, TEXTURE_LOD_FULL).a;
+
+                        // alphaTest, 测试hitPoint是否应视作透明点而被忽略
+                        if (!((alphaMode == ALPHA_MODE_MASK && opacity < alphaCutoff) ||
+                              (alphaMode == ALPHA_MODE_BLEND && rand() > opacity)))
+                            return true;
+#else
+                        return true;
+#endif
+                    }
+                }
+            }
+            // tlasBVH叶子节点
+            else
+            {
+                int meshInstanceIdx = childCount - 1;   // 对应scene.cpp中ProcessTLAS()
+#if defined(NAGI_ALPHA_TEST) && !defined(NAGI_MEDIUM)
+                curMatID = childParam;
+#endif
+                rTrans = InstanceLocalRay(r, meshInstanceIdx);
+
+                // tlas的叶子存储blas，childOffset是blas根节点的wide索引
+                nodesToVisit[toVisitOffset++] = -1;
+                curNodeIdx = childOffset;
+                BLAS = true;
+                continue;
+            }
+        }
+
+        curNodeIdx = nodesToVisit[--toVisitOffset];
+
+        // 遍历完BLAS后，返回TLAS中，ray要重置回应用transform前
+        if (BLAS && curNodeIdx == -1)
+        {
+            BLAS = false;
+            curNodeIdx = nodesToVisit[--toVisitOffset];
+            rTrans.ori = r.ori;
+            rTrans.dir = r.dir;
+        }
+    }
+#else
     // curNodeIdx == -1，退出遍历
     while(curNodeIdx != -1)
     {
@@ -120,7 +196,7 @@ bool AnyHit(Ray r, float maxDist)
 
                     // opacity *= alpha
                     // textureMapsArrayTex是一个三维数组，xy代表一张纹理的坐标，z代表第几张纹理
-                    opacity *= texture(textureMapsArrayTex, vec3(texCoord, baseColorTexID)).a;
+                    opacity *= SampleTexture(baseColorTexID, texCoord, TEXTURE_LOD_FULL).a;
 
                     // alphaTest, 测试hitPoint是否应视作透明点而被忽略
                     if (!((alphaMode == ALPHA_MODE_MASK && opacity < alphaCutoff) || 
@@ -145,16 +221,8 @@ bool AnyHit(Ray r, float maxDist)
             curNodeIdx = blasBVHStartOffset;
             BLAS = true;
 
-            // TODO:需要查阅GLSL中mat4的构建规则与parser.cpp中transform的构建方式
-            // 从transforms数组中获取instance的变换矩阵，transforms数组以vec4f为刻度，matrix等同4个vec4f
-            vec4 r1 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 0, 0), 0);
-            vec4 r2 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 1, 0), 0);
-            vec4 r3 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 2, 0), 0);
-            vec4 r4 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 3, 0), 0);
-            mat4 transform = mat4(r1, r2, r3, r4);
-            // TODO:查阅为什么这里用inverse(transform)
-            rTrans.ori = vec3(inverse(transform) * vec4(r.ori, 1.0));
-            rTrans.dir = vec3(inverse(transform) * vec4(r.dir, 0.0));
+            // BLAS顶点在局部空间，将ray用instance的逆变换（Scene中预先计算）变换到局部空间
+            rTrans = InstanceLocalRay(r, meshInstanceIdx);
 
             // Add a marker. We'll return to this spot after we've traversed the entire BLAS
             nodesToVisit[toVisitOffset++] = -1;
@@ -209,6 +277,7 @@ bool AnyHit(Ray r, float maxDist)
             rTrans.dir = r.dir;
         }
     }
+#endif
 
     return false;
 }
@@ -13,64 +13,39 @@ bool ClosestHit(Ray r, inout State state, inout LightSample lightSample)
 // depth为0时，ray从相机出发，此时忽视光源
 if(state.depth > 0)
 #endif
-    for(int i = 0; i < lightsNum; i++)
     {
-        // 根据light.h中Light的成员变量顺序获取数据，以vec3f为刻度，Light等同5个vec3f
-        vec3 position   = texelFetch(lightsTex, ivec2(i * 5 + 0, 0), 0).xyz;
-        vec3 emission   = texelFetch(lightsTex, ivec2(i * 5 + 1, 0), 0).xyz;
-        vec3 u          = texelFetch(lightsTex, ivec2(i * 5 + 2, 0), 0).xyz;
-        vec3 v          = texelFetch(lightsTex, ivec2(i * 5 + 3, 0), 0).xyz;
-        vec3 params     = texelFetch(lightsTex, ivec2(i * 5 + 4, 0), 0).xyz;
-        float radius    = params.x;
-        float area      = params.y;
-        float type      = params.z;
-
-        // Intersect area light according to light.type
-        if (type == QUAD_LIGHT)
+        // light BVH剔除不相交的光源，叶子中的光源与原先逐个求交时相同
+        int lightNode = LightBVHIntersect(r, false, t);
+        if (lightNode >= 0)
         {
-            vec3 normal = normalize(cross(u, v));
-            if (dot(normal, r.dir) > 0.0)
-                continue;
-            vec4 plane = vec4(normal, dot(normal, position));
-            u *= 1.0f / dot(u, u);  // normalization
-            v *= 1.0f / dot(v, v);  // normalization
-
-            d = RectangleIntersect(position, u, v, plane, r);
-            if (d < 0.0)
-                d = INF;
-            
-            if (d < t)
+            Light light = FetchLight(texelFetch(lightBVHTex, lightNode * NAGI_LIGHT_NODE_TEXELS + 3).x);
+            // 光源的pdf包含DirectLight在上一个着色点选中它的概率，着色点由PathTrace记录
+            float lightPickPdf = LightBVHPmf(lightNode, state.lightPickPos, state.lightPickNormal);
+            if (int(light.type) == QUAD_LIGHT)
             {
-                t = d;
-                float cosTheta  = dot(-r.dir, normal);
-                lightSample.pdf      = (t * t) / (area * cosTheta);
-                lightSample.emission = emission;
-                state.isEmitter = true;
+                float cosTheta  = dot(-r.dir, normalize(cross(light.u, light.v)));
+                lightSample.pdf      = (t * t) / (light.area * cosTheta) * lightPickPdf;
             }
-        }
-        else if (type == SPHERE_LIGHT)
-        {
-            float d = SphereIntersect(position, radius, r);
-            if (d < 0.0)
-                d = INF;
-            
-            if (d < t)
+            else
             {
-                t = d;
                 vec3 hitPoint = r.ori + t * r.dir;
-                float cosTheta  = dot(-r.dir, normalize(hitPoint - position));
+                float cosTheta  = dot(-r.dir, normalize(hitPoint - light.position));
                 // TODO: Fix this. Currently assumes the light will be hit only from the outside
-                lightSample.pdf      = (t * t) / (area * 0.5 * cosTheta);
-                lightSample.emission = emission;
-                state.isEmitter = true;
+                lightSample.pdf      = (t * t) / (light.area * 0.5 * cosTheta) * lightPickPdf;
             }
+            lightSample.emission = light.emission;
+            state.isEmitter = true;
         }
     }
 #endif
 
     /* BVH Traversal */
 
+#ifdef NAGI_WIDE_BVH
+    int nodesToVisit[NAGI_BVH_STACK_SIZE];
+#else
     int nodesToVisit[64];
+#endif
     int toVisitOffset = 0;
     nodesToVisit[toVisitOffset++] = -1;
 
@@ -79,7 +54,7 @@ if(state.depth > 0)
     bool BLAS = false;
 
     ivec3 triangleIdx = ivec3(-1);
-    mat4 triangleTransMat, instanceTransMat;
+    int triangleInstanceIdx = -1, curInstanceIdx = -1;
     vec3 barycentric;
     vec4 vert0, vert1, vert2;
 
@@ -87,6 +62,95 @@ if(state.depth > 0)
     rTrans.ori = r.ori;
     rTrans.dir = r.dir;
 
+#ifdef NAGI_WIDE_BVH
+    // curNodeIdx >= 0 is a wide node, < -1 is a leaf slot pushed by WideNodeIntersect
+    while(curNodeIdx != -1)
+    {
+        // wide中间节点
+        if (curNodeIdx >= 0)
+        {
+            int hitEntry[NAGI_BVH_WIDTH];
+            int hitNum = WideNodeIntersect(curNodeIdx, rTrans, t, hitEntry);
+            // 由远到近入栈，最近的子节点最先出栈
+            for (int i = 0; i < hitNum; i++)
+                nodesToVisit[toVisitOffset++] = hitEntry[i];
+        }
+        else
+        {
+            // 解析叶子所在的wide节点及slot
+            int nodeIdx, childOffset, childCount, childParam;
+            WideLeafDecode(curNodeIdx, nodeIdx, childOffset, childCount, childParam);
+
+            // blasBVH叶子节点
+            if (nodeIdx < tlasBVHStartOffset)
+            {
+                int primitivesOffset = childOffset;
+                int nPrimitives = childCount;
+                for(int i = 0; i < nPrimitives; i++)
+                {
+                    // 获取vertexIndices数组的数据，以vec3i为刻度
+                    ivec3 primVertexIdx = ivec3(texelFetch(vertexIndicesTex, primitivesOffset + i).xyz);
+
+                    // 获取verticesUVX数组的数据，包括顶点和u，以vec4f为刻度
+                    vec4 v0_u = texelFetch(verticesTex, primVertexIdx.x);
+                    vec4 v1_u = texelFetch(verticesTex, primVertexIdx.y);
+                    vec4 v2_u = texelFetch(verticesTex, primVertexIdx.z);
+
+                    vec3 e0 = v1_u.xyz - v0_u.xyz;
+                    vec3 e1 = v2_u.xyz - v0_u.xyz;
+                    vec3 pv = cross(rTrans.dir, e1);
+                    float det = dot(e0, pv);
+
+                    vec3 tv = rTrans.ori - v0_u.xyz;
+                    vec3 qv = cross(tv, e0);
+
+                    vec4 uvt;
+                    uvt.x = dot(tv, pv);
+                    uvt.y = dot(rTrans.dir, qv);
+                    uvt.z = dot(e1, qv);
+                    uvt.xyz = uvt.xyz / det;
+                    uvt.w = 1.0 - uvt.x - uvt.y;
+
+                    if(all(greaterThanEqual(uvt, vec4(0.0))) && uvt.z < t)
+                    {
+                        t = uvt.z;
+                        triangleIdx = primVertexIdx;
+                        state.matID = curMatID;
+                        barycentric = uvt.wxy;
+                        vert0 = v0_u, vert1 = v1_u, vert2 = v2_u;
+                        triangleInstanceIdx = curInstanceIdx;
+                    }
+                }
+            }
+            // tlasBVH叶子节点
+            else
+            {
+                int meshInstanceIdx = childCount - 1;   // 对应scene.cpp中ProcessTLAS()
+                curMatID            = childParam;
+
+                curInstanceIdx = meshInstanceIdx;
+                rTrans = InstanceLocalRay(r, meshInstanceIdx);
+
+                // tlas的叶子存储blas，childOffset是blas根节点的wide索引
+                nodesToVisit[toVisitOffset++] = -1;
+                curNodeIdx = childOffset;
+                BLAS = true;
+                continue;
+            }
+        }
+
+        curNodeIdx = nodesToVisit[--toVisitOffset];
+
+        // 遍历完BLAS后，返回TLAS中，ray要重置回应用transform前
+        if (BLAS && curNodeIdx == -1)
+        {
+            BLAS = false;
+            curNodeIdx = nodesToVisit[--toVisitOffset];
+            rTrans.ori = r.ori;
+            rTrans.dir = r.dir;
+        }
+    }
+#else
     // curNodeIdx == -1，退出遍历
     while(curNodeIdx != -1)
     {
@@ -132,7 +196,7 @@ if(state.depth > 0)
                     state.matID = curMatID;
                     barycentric = uvt.wxy;
                     vert0 = v0_u, vert1 = v1_u, vert2 = v2_u;
-                    triangleTransMat = instanceTransMat;
+                    triangleInstanceIdx = curInstanceIdx;
                 }
             }
         }
@@ -148,16 +212,9 @@ if(state.depth > 0)
             curNodeIdx = blasBVHStartOffset;
             BLAS = true;
 
-            // TODO:需要查阅GLSL中mat4的构建规则与parser.cpp中transform的构建方式
-            // 从transforms数组中获取instance的变换矩阵，transforms数组以vec4f为刻度，matrix等同4个vec4f
-            vec4 r1 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 0, 0), 0);
-            vec4 r2 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 1, 0), 0);
-            vec4 r3 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 2, 0), 0);
-            vec4 r4 = texelFetch(transformsTex, ivec2(meshInstanceIdx * 4 + 3, 0), 0);
-            instanceTransMat = mat4(r1, r2, r3, r4);
-            // TODO:查阅为什么这里用inverse(instanceTransMat)
-            rTrans.ori = vec3(inverse(instanceTransMat) * vec4(r.ori, 1.0));
-            rTrans.dir = vec3(inverse(instanceTransMat) * vec4(r.dir, 0.0));
+            // BLAS顶点在局部空间，将ray用instance的逆变换（Scene中预先计算）变换到局部空间
+            curInstanceIdx = meshInstanceIdx;
+            rTrans = InstanceLocalRay(r, meshInstanceIdx);
 
             // Add a marker. We'll return to this spot after we've traversed the entire BLAS
             nodesToVisit[toVisitOffset++] = -1;
@@ -213,6 +270,7 @@ if(state.depth > 0)
             rTrans.dir = r.dir;
         }
     }
+#endif
 
     /* Processing State after BVH Traversal */
 
@@ -242,7 +300,9 @@ if(state.depth > 0)
         vec3 normal = normalize(n0.xyz * barycentric.x + n1.xyz * barycentric.y + n2.xyz * barycentric.z);
 
         // 将局部法线变换回世界法线
-        state.normal = normalize(transpose(inverse(mat3(triangleTransMat))) * normal);
+        mat3 linear, normalMat;
+        InstanceLinearMatrices(triangleInstanceIdx, linear, normalMat);
+        state.normal = normalize(normalMat * normal);
         state.ffnormal = dot(state.normal, r.dir) <= 0.0 ? state.normal : -state.normal;    // face forward normal
 
         // 计算切线和副法线
@@ -257,8 +317,19 @@ if(state.depth > 0)
         state.tangent   = (deltaUV2.y * deltaPos1 - deltaUV1.y * deltaPos2) * invdet;
         state.bitangent = (deltaUV1.x * deltaPos2 - deltaUV2.x * deltaPos1) * invdet;
 
-        state.tangent = normalize(mat3(triangleTransMat) * state.tangent);
-        state.bitangent = normalize(mat3(triangleTransMat) * state.bitangent);
+        state.tangent = normalize(linear * state.tangent);
+        state.bitangent = normalize(linear * state.bitangent);
+
+        // ray cone texture LOD (Akenine-Moller et al. 2019): uv area per world area of the triangle
+        float uvArea = abs(deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
+        vec3 faceNormal = cross(linear * deltaPos1, linear * deltaPos2);
+        float worldArea = length(faceNormal);
+        state.texLodBase = 0.5 * log2(max(uvArea, 1e-20) / max(worldArea, 1e-20));
+
+    #ifdef NAGI_EMISSIVE_TRIANGLES
+        // DirectLight也采样发光三角形，PathTrace用该pdf计算击中点emission的MIS权重
+        lightSample.pdf = EmissiveTrianglePdf(state.matID, faceNormal, r.dir, t);
+    #endif
     }
 
     return true;
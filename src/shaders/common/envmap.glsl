@@ -5,39 +5,26 @@
 #ifdef NAGI_ENVMAP
 #ifndef NAGI_UNIFORM_LIGHT
 
-// 坐标系第一象限的二维二分查找，查找value的(x, y)坐标
-vec2 BinarySearch(float value)
+// 按像素权重(luminance * sin(theta))采样envMap的uv坐标：alias table一次选出像素，再在像素内均匀偏移
+vec2 SampleEnvMapUV(vec3 rnd)
 {
     ivec2 envMapResInt = ivec2(envMapRes);
+    int pixel = SampleAliasTable(envMapAliasTex, envMapResInt.x * envMapResInt.y, rnd.x);
+    vec2 xy = vec2(pixel % envMapResInt.x, pixel / envMapResInt.x);
+    return (xy + rnd.yz) / envMapRes;
+}
 
-    // 先确定在哪一行
-    int lower = 0;
-    int upper = envMapResInt.y - 1;
-    while(lower < upper)
-    {
-        int mid = (lower + upper) >> 1;
-        if (value < texelFetch(envMapCDFTex, ivec2(envMapResInt.x - 1, mid), 0).r)
-            upper = mid;
-        else
-            lower = mid + 1;
-    }
-    int y = clamp(lower, 0, envMapResInt.y - 1);
-
-    // 再确定在哪一列
-    lower = 0;
-    upper = envMapResInt.x - 1;
-    while(lower < upper)
-    {
-        int mid = (lower + upper) >> 1;
-        if (value < texelFetch(envMapCDFTex, ivec2(mid, y), 0).r)
-            upper = mid;
-        else
-            lower = mid + 1;
-    }
-    int x = clamp(lower, 0, envMapResInt.x - 1);
-
-    // 实际坐标转换为百分比坐标
-    return vec2(x, y) / envMapRes;
+// 方向的立体角pdf：像素概率 luminance * sin(rowTheta) / envMapTotalSum，除以像素所占立体角 (TWO_PI / w) * (PI / h) * sin(theta)
+float EnvMapPdf(vec2 uv, float theta)
+{
+    ivec2 pixel = clamp(ivec2(uv * envMapRes), ivec2(0), ivec2(envMapRes) - 1);
+    float sinTheta = sin(theta);
+    if (sinTheta <= 0.0)
+        return 0.0;
+
+    float rowSinTheta = sin(PI * (float(pixel.y) + 0.5) / envMapRes.y);
+    float weight = Luminance(texelFetch(envMapTex, pixel, 0).rgb) * rowSinTheta;
+    return (weight / envMapTotalSum) * envMapRes.x * envMapRes.y / (TWO_PI * PI * sinTheta);
 }
 
 // 根据已知的ray计算击中envMap的颜色值
@@ -54,33 +41,21 @@ vec4 EvalEnvMap(Ray r)
     vec2 uv = vec2((PI + atan(r.dir.z, r.dir.x)) * INV_TWO_PI, theta * INV_PI) + vec2(envMapRot, 0.0);
     
     vec3 color = texture(envMapTex, uv).rgb;
-    float pdf = Luminance(color) / envMapTotalSum;
-
-    // TODO: w项????
-    return vec4(color, (pdf * envMapRes.x * envMapRes.y) / (TWO_PI * PI * sin(theta)));
+    return vec4(color, EnvMapPdf(vec2(fract(uv.x), uv.y), theta));
 }
 
-// 从envMap中均匀采样一条光线
+// 按luminance * sin(theta)重要性采样envMap的一个方向
 vec4 SampleEnvMap(inout vec3 color)
 {
-    // 哪个像素的luminance大，哪个像素就更可能被采样
-    // envMapTotalSum是所有像素的LuminanceTotalSum
-    vec2 uv = BinarySearch(rand() * envMapTotalSum);
-
+    vec2 uv = SampleEnvMapUV(vec3(rand(), rand(), rand()));
     color = texture(envMapTex, uv).rgb;
-    // pdf = singlePixelLuminance / LuminanceTotalSum
-    float pdf = Luminance(color) / envMapTotalSum;
 
     // (u, v)->(phi, theta)
-    uv.x -= envMapRot;
-    float phi = uv.x * TWO_PI;
     float theta = uv.y * PI;
+    float pdf = EnvMapPdf(uv, theta);
+    float phi = (uv.x - envMapRot) * TWO_PI;
 
-    if (sin(theta) == 0.0)
-        pdf = 0.0;
-    
-    // TODO: w项????
-    return vec4(-sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi), (pdf * envMapRes.x * envMapRes.y) / (TWO_PI * PI * sin(theta)));
+    return vec4(-sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi), pdf);
 }
 
 #endif
@@ -148,10 +148,15 @@ struct State
 	vec3 ffnormal;  // face forward normal
 	vec3 tangent;
 	vec3 bitangent;
+	// point and normal DirectLight last picked a light BVH light for, the normal is 0 for a medium scatter.
+	// ClosestHit evaluates LightBVHPmf with them, the transparent hits in between do not move them
+	vec3 lightPickPos;
+	vec3 lightPickNormal;
 
 	bool isEmitter;
 
 	vec2 texCoord;
+	float texLodBase;   // 0.5 * log2(uv area / world area) of the hit triangle, for the ray cone texture LOD
 	int matID;
 	Material mat;
 	Medium medium;
@@ -228,6 +233,18 @@ vec4 rand4()
     pcg4d(seed); return vec4(seed)/float(0xffffffffu);
 }
 
+// uniform integer in [0, n) from the full 32 bits of the state. rand() keeps 24 bits, so int(rand() * n)
+// never reaches some of more than 2^24 choices. the 2^32 mod n smallest states are rejected against the modulo bias
+int RandInt(int n)
+{
+    uint count = uint(n);
+    uint threshold = (0u - count) % count;
+    pcg4d(seed);
+    while (seed.x < threshold)
+        pcg4d(seed);
+    return int(seed.x % count);
+}
+
 
 
 
@@ -86,4 +86,324 @@ float AABBIntersect(vec3 pMin, vec3 pMax, Ray r)
     // 如果tExit > 0.0，有交点，此时tEnter < 0.0 < tExit，t值就是tExit
     // 如果tExit < 0.0，没交点，此时tEnter < tExit < 0.0，返回的t值无用
 	return tExit >= tEnter ? (tEnter > 0.0 ? tEnter : tExit) : -1.0;
-}
\ No newline at end of file
+}
+
+// transformsTex holds NAGI_TRANSFORM_TEXELS texels per instance, see InstanceTransform in scene.h:
+// the 4 columns of the instance transform, then the 3 rows of its affine inverse
+#define NAGI_TRANSFORM_TEXELS 7
+
+// world space ray into the local space of the instance, without inverting its transform per visit
+Ray InstanceLocalRay(Ray r, int meshInstanceIdx)
+{
+    int base = meshInstanceIdx * NAGI_TRANSFORM_TEXELS + 4;
+    vec4 i0 = texelFetch(transformsTex, base + 0);
+    vec4 i1 = texelFetch(transformsTex, base + 1);
+    vec4 i2 = texelFetch(transformsTex, base + 2);
+
+    Ray rTrans;
+    vec4 ori = vec4(r.ori, 1.0);
+    rTrans.ori = vec3(dot(i0, ori), dot(i1, ori), dot(i2, ori));
+    rTrans.dir = vec3(dot(i0.xyz, r.dir), dot(i1.xyz, r.dir), dot(i2.xyz, r.dir));
+    return rTrans;
+}
+
+// linear part of the instance transform, and its normal matrix transpose(inverse(linear))
+// whose columns are the stored inverse rows
+void InstanceLinearMatrices(int meshInstanceIdx, out mat3 linear, out mat3 normalMat)
+{
+    int base = meshInstanceIdx * NAGI_TRANSFORM_TEXELS;
+    linear = mat3(texelFetch(transformsTex, base + 0).xyz,
+                  texelFetch(transformsTex, base + 1).xyz,
+                  texelFetch(transformsTex, base + 2).xyz);
+    normalMat = mat3(texelFetch(transformsTex, base + 4).xyz,
+                     texelFetch(transformsTex, base + 5).xyz,
+                     texelFetch(transformsTex, base + 6).xyz);
+}
+
+#ifdef NAGI_WIDE_BVH
+// traversal stack of ClosestHit/AnyHit, TLAS and BLAS share it. NAGI_BVH_DEPTH is the number of wide nodes on the
+// deepest path from the tlasBVH root into a blasBVH (Scene::WideBVHDepth). every node on it leaves at most NAGI_BVH_WIDTH-1
+// children behind, the last one pushes all of its children before popping, plus the -1 markers of the root and the BLAS
+#define NAGI_BVH_STACK_SIZE ((NAGI_BVH_WIDTH - 1) * NAGI_BVH_DEPTH + 3)
+
+// slab test of 4 boxes stored as SoA (WideBVHNode), only hits inside [0, tMax] pass
+bvec4 AABBIntersect4(vec4 minX, vec4 minY, vec4 minZ, vec4 maxX, vec4 maxY, vec4 maxZ, Ray r, float tMax, out vec4 tEnter)
+{
+    vec3 invDir = 1.0 / r.dir;
+
+    vec4 t0x = (minX - r.ori.x) * invDir.x;
+    vec4 t1x = (maxX - r.ori.x) * invDir.x;
+    vec4 t0y = (minY - r.ori.y) * invDir.y;
+    vec4 t1y = (maxY - r.ori.y) * invDir.y;
+    vec4 t0z = (minZ - r.ori.z) * invDir.z;
+    vec4 t1z = (maxZ - r.ori.z) * invDir.z;
+
+    tEnter = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), vec4(0.0)));
+    vec4 tExit = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), vec4(tMax)));
+    return lessThanEqual(tEnter, tExit);
+}
+
+#ifdef NAGI_COMPRESSED_BVH
+// CompressedWideNode in bvh.h as 32-bit words: origin[3], exponent[3] and interiorMask, baseChild, basePrim,
+// then the byte arrays meta, qlo[3], qhi[3] with 4 slots per word. BVH4 nodes are 4 texels, BVH8 nodes 5 texels
+#if NAGI_BVH_WIDTH == 4
+#define NAGI_COMPRESSED_TEXELS 4
+#else
+#define NAGI_COMPRESSED_TEXELS 5
+#endif
+#define NAGI_COMPRESSED_GROUPS (NAGI_BVH_WIDTH / 4)
+
+void FetchCompressedNode(int nodeIdx, out ivec4 node[NAGI_COMPRESSED_TEXELS])
+{
+    for (int i = 0; i < NAGI_COMPRESSED_TEXELS; i++)
+        node[i] = texelFetch(wideBVHTex, nodeIdx * NAGI_COMPRESSED_TEXELS + i);
+}
+
+// byte of slot in the byte array starting at word first
+int CompressedNodeByte(ivec4 node[NAGI_COMPRESSED_TEXELS], int first, int slot)
+{
+    int word = first + slot / 4;
+    return (node[word / 4][word % 4] >> (8 * (slot % 4))) & 0xff;
+}
+
+// Same as the uncompressed version below, the child boxes are decoded as origin + q * 2^(exponent-127).
+// Interior children are baseChild + meta, leaves are written as -(nodeIdx * NAGI_BVH_WIDTH + slot) - 2.
+int WideNodeIntersect(int nodeIdx, Ray r, float tMax, out int hitEntry[NAGI_BVH_WIDTH])
+{
+    ivec4 node[NAGI_COMPRESSED_TEXELS];
+    FetchCompressedNode(nodeIdx, node);
+
+    vec3 origin = intBitsToFloat(node[0].xyz);
+    // the biased exponent shifted into place is the float 2^(exponent-127)
+    vec3 scale = intBitsToFloat(((ivec3(node[0].w) >> ivec3(0, 8, 16)) & 0xff) << 23);
+    int interiorMask = (node[0].w >> 24) & 0xff;
+    int baseChild = node[1].x;
+
+    float hitT[NAGI_BVH_WIDTH];
+    int hitNum = 0;
+
+    for (int g = 0; g < NAGI_COMPRESSED_GROUPS; g++)
+    {
+        vec4 qlo[3], qhi[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            int lo = 6 + NAGI_COMPRESSED_GROUPS * (1 + axis) + g;
+            int hi = 6 + NAGI_COMPRESSED_GROUPS * (4 + axis) + g;
+            qlo[axis] = vec4((ivec4(node[lo / 4][lo % 4]) >> ivec4(0, 8, 16, 24)) & 0xff);
+            qhi[axis] = vec4((ivec4(node[hi / 4][hi % 4]) >> ivec4(0, 8, 16, 24)) & 0xff);
+        }
+
+        vec4 tEnter;
+        bvec4 hit = AABBIntersect4(
+            origin.x + qlo[0] * scale.x, origin.y + qlo[1] * scale.y, origin.z + qlo[2] * scale.z,
+            origin.x + qhi[0] * scale.x, origin.y + qhi[1] * scale.y, origin.z + qhi[2] * scale.z,
+            r, tMax, tEnter);
+
+        for (int c = 0; c < 4; c++)
+        {
+            int slot = g * 4 + c;
+            int meta = CompressedNodeByte(node, 6, slot);
+            bool interior = ((interiorMask >> slot) & 1) != 0;
+            // a leaf without primitives is an empty slot
+            if (!hit[c] || (!interior && meta == 0))
+                continue;
+
+            int entry = interior ? baseChild + meta : -(nodeIdx * NAGI_BVH_WIDTH + slot) - 2;
+
+            // insertion sort by distance, farthest first
+            int k = hitNum++;
+            while (k > 0 && hitT[k - 1] < tEnter[c])
+            {
+                hitT[k] = hitT[k - 1];
+                hitEntry[k] = hitEntry[k - 1];
+                k--;
+            }
+            hitT[k] = tEnter[c];
+            hitEntry[k] = entry;
+        }
+    }
+
+    return hitNum;
+}
+
+// Resolves a leaf entry pushed by WideNodeIntersect. blasBVH leaf: offset and count of its primitives,
+// tlasBVH leaf: offset is the blasBVH root, count is meshInstanceIdx+1 and param the materialID
+void WideLeafDecode(int entry, out int nodeIdx, out int offset, out int count, out int param)
+{
+    int slot = -entry - 2;
+    nodeIdx = slot / NAGI_BVH_WIDTH;
+    int lane = slot % NAGI_BVH_WIDTH;
+
+    ivec4 node[NAGI_COMPRESSED_TEXELS];
+    FetchCompressedNode(nodeIdx, node);
+
+    // the leaves of a node store their primitives consecutively from basePrim in slot order
+    int interiorMask = (node[0].w >> 24) & 0xff;
+    offset = node[1].y;
+    for (int s = 0; s < lane; s++)
+        if (((interiorMask >> s) & 1) == 0)
+            offset += CompressedNodeByte(node, 6, s);
+    count = CompressedNodeByte(node, 6, lane);
+    param = 0;
+
+    // tlasBVH leaves point at an entry behind the blasBVH primitives, see scene.cpp ProcessTLAS()
+    if (nodeIdx >= tlasBVHStartOffset)
+    {
+        ivec3 leaf = texelFetch(vertexIndicesTex, offset).xyz;
+        offset = leaf.x;
+        count  = leaf.y;
+        param  = leaf.z;
+    }
+}
+#else
+// Tests all children of wide node nodeIdx and writes the hit ones to hitEntry, farthest first.
+// Interior children are written as their wide node idx, leaves as -(nodeIdx * NAGI_BVH_WIDTH + slot) - 2,
+// so that leaves are pushed on the traversal stack and processed in distance order as well.
+int WideNodeIntersect(int nodeIdx, Ray r, float tMax, out int hitEntry[NAGI_BVH_WIDTH])
+{
+    float hitT[NAGI_BVH_WIDTH];
+    int hitNum = 0;
+
+    for (int g = 0; g < NAGI_BVH_WIDTH / 4; g++)
+    {
+        // WideBVHNode in bvh.h: boundsMin[3], boundsMax[3], childOffset, childCount, childParam, 9 ivec4 texels
+        int base = (nodeIdx * (NAGI_BVH_WIDTH / 4) + g) * 9;
+        vec4 tEnter;
+        bvec4 hit = AABBIntersect4(
+            intBitsToFloat(texelFetch(wideBVHTex, base + 0)), intBitsToFloat(texelFetch(wideBVHTex, base + 1)),
+            intBitsToFloat(texelFetch(wideBVHTex, base + 2)), intBitsToFloat(texelFetch(wideBVHTex, base + 3)),
+            intBitsToFloat(texelFetch(wideBVHTex, base + 4)), intBitsToFloat(texelFetch(wideBVHTex, base + 5)),
+            r, tMax, tEnter);
+        ivec4 childOffset = texelFetch(wideBVHTex, base + 6);
+        ivec4 childCount  = texelFetch(wideBVHTex, base + 7);
+
+        for (int c = 0; c < 4; c++)
+        {
+            // childCount == -1 is an empty slot
+            if (!hit[c] || childCount[c] < 0)
+                continue;
+
+            int entry = childCount[c] == 0 ? childOffset[c] : -(nodeIdx * NAGI_BVH_WIDTH + g * 4 + c) - 2;
+
+            // insertion sort by distance, farthest first
+            int k = hitNum++;
+            while (k > 0 && hitT[k - 1] < tEnter[c])
+            {
+                hitT[k] = hitT[k - 1];
+                hitEntry[k] = hitEntry[k - 1];
+                k--;
+            }
+            hitT[k] = tEnter[c];
+            hitEntry[k] = entry;
+        }
+    }
+
+    return hitNum;
+}
+
+// Resolves a leaf entry pushed by WideNodeIntersect. blasBVH leaf: offset and count of its primitives,
+// tlasBVH leaf: offset is the blasBVH root, count is meshInstanceIdx+1 and param the materialID
+void WideLeafDecode(int entry, out int nodeIdx, out int offset, out int count, out int param)
+{
+    int slot = -entry - 2;
+    nodeIdx = slot / NAGI_BVH_WIDTH;
+    int lane = slot % NAGI_BVH_WIDTH;
+    int base = (nodeIdx * (NAGI_BVH_WIDTH / 4) + lane / 4) * 9;
+    offset = texelFetch(wideBVHTex, base + 6)[lane & 3];
+    count  = texelFetch(wideBVHTex, base + 7)[lane & 3];
+    param  = texelFetch(wideBVHTex, base + 8)[lane & 3];
+}
+#endif
+#endif
+
+// ----------------------------------------------------------------------
+// Light BVH---lightBVH.h
+// ----------------------------------------------------------------------
+
+// lightBVHTex holds NAGI_LIGHT_NODE_TEXELS texels per LightBVHNode: (boundsMin, phi), (boundsMax, cosThetaO),
+// (w, cosThetaE), (childOrLight, isLeaf, bitTrail, 0), floats as intBitsToFloat. one texel per distant light index follows,
+// then NAGI_EMISSIVE_TRIANGLE_TEXELS per EmissiveTriangle: (primIdx, instanceIdx, matID, pickPdf), (threshold, alias, 0, 0)
+#define NAGI_LIGHT_NODE_TEXELS 4
+#define NAGI_EMISSIVE_TRIANGLE_TEXELS 2
+
+#ifdef NAGI_LIGHTS
+
+// 根据light.h中Light的成员变量顺序获取数据，以vec3f为刻度，Light等同5个vec3f
+Light FetchLight(int i)
+{
+    vec3 position   = texelFetch(lightsTex, ivec2(i * 5 + 0, 0), 0).xyz;
+    vec3 emission   = texelFetch(lightsTex, ivec2(i * 5 + 1, 0), 0).xyz;
+    vec3 u          = texelFetch(lightsTex, ivec2(i * 5 + 2, 0), 0).xyz;     // u vector for rect
+    vec3 v          = texelFetch(lightsTex, ivec2(i * 5 + 3, 0), 0).xyz;     // v vector for rect
+    vec3 params     = texelFetch(lightsTex, ivec2(i * 5 + 4, 0), 0).xyz;
+    return Light(position, emission, u, v, params.x, params.y, params.z);   // radius, area, type
+}
+
+// 与rect或sphere光源求交，返回距离，未击中返回INF。cullBack时rect光源的背面不相交
+float LightIntersect(Light light, Ray r, bool cullBack)
+{
+    if (int(light.type) == QUAD_LIGHT)
+    {
+        vec3 normal = normalize(cross(light.u, light.v));
+        if (cullBack && dot(normal, r.dir) > 0.0)
+            return INF;
+        vec4 plane = vec4(normal, dot(normal, light.position));
+        vec3 u = light.u / dot(light.u, light.u);  // normalization
+        vec3 v = light.v / dot(light.v, light.v);  // normalization
+        return RectangleIntersect(light.position, u, v, plane, r);
+    }
+    return SphereIntersect(light.position, light.radius, r);
+}
+
+// 遍历light BVH求ray在tMax之内与光源的交点并更新tMax。anyHit时在第一个交点返回且不剔除rect光源背面，否则求最近交点。
+// 返回击中光源的叶子节点，未击中返回-1
+int LightBVHIntersect(Ray r, bool anyHit, inout float tMax)
+{
+    if (lightBVHNodesNum == 0)
+        return -1;
+
+    // LightBVHNode::bitTrail limits the depth to 31
+    int nodesToVisit[32];
+    int toVisitOffset = 0;
+    int curNodeIdx = 0;
+    int hitNode = -1;
+    vec3 invDir = 1.0 / r.dir;
+
+    while (true)
+    {
+        int base = curNodeIdx * NAGI_LIGHT_NODE_TEXELS;
+        vec3 t0 = (intBitsToFloat(texelFetch(lightBVHTex, base + 0).xyz) - r.ori) * invDir;
+        vec3 t1 = (intBitsToFloat(texelFetch(lightBVHTex, base + 1).xyz) - r.ori) * invDir;
+        vec3 tNear = min(t0, t1), tFar = max(t0, t1);
+        float tEnter = max(max(tNear.x, tNear.y), max(tNear.z, 0.0));
+        float tExit = min(min(tFar.x, tFar.y), min(tFar.z, tMax));
+
+        if (tEnter <= tExit)
+        {
+            ivec4 node = texelFetch(lightBVHTex, base + 3);
+            // 中间节点，第一个子节点紧随其后，第二个入栈
+            if (node.y == 0)
+            {
+                nodesToVisit[toVisitOffset++] = node.x;
+                curNodeIdx++;
+                continue;
+            }
+
+            float d = LightIntersect(FetchLight(node.x), r, !anyHit);
+            if (d < tMax)
+            {
+                tMax = d;
+                hitNode = curNodeIdx;
+                if (anyHit)
+                    break;
+            }
+        }
+
+        if (toVisitOffset == 0)
+            break;
+        curNodeIdx = nodesToVisit[--toVisitOffset];
+    }
+    return hitNode;
+}
+
+#endif
@@ -4,7 +4,8 @@
 
 
 // 从materialsTex中按 C++：class Material 解析参数到 GLSL：struct Material
-void GetMaterial(inout State state, Ray r)
+// coneWidth is the width of the ray cone at the hit point, it selects the mip level of the textures
+void GetMaterial(inout State state, Ray r, float coneWidth)
 {
     // 每个Material等同8个vec4f, 共有8组参数
     int startOffset = state.matID * 8;
@@ -52,10 +53,13 @@ void GetMaterial(inout State state, Ray r)
     mat.alphaMode           = int(param8.z);
     mat.alphaCutoff         = param8.w;
 
+    // log2 of the cone footprint in texture coordinates, stretched by grazing angles
+    float uvLod = state.texLodBase + log2(max(coneWidth, 1e-20) / max(abs(dot(state.normal, r.dir)), 1e-4));
+
     // BaseColor Map
     if (baseColorTexID >= 0)
     {
-        vec4 color = texture(textureMapsArrayTex, vec3(state.texCoord, baseColorTexID));
+        vec4 color = SampleTexture(baseColorTexID, state.texCoord, uvLod);
         mat.baseColor = pow(color.rgb, vec3(2.2));  // srgb to linear
         mat.opacity *= color.a;
     }
@@ -64,26 +68,30 @@ void GetMaterial(inout State state, Ray r)
     if (roughnessTexID >= 0)
     {
         // TODO: fix roughness?
-        // float rgh = texture(textureMapsArrayTex, vec3(state.texCoord, roughnessTexID)).r;
+        // float rgh = SampleTexture(roughnessTexID, state.texCoord).r;
         // mat.roughness = max(rgh * rgh, 0.001);
-        mat.roughness = max(texture(textureMapsArrayTex, vec3(state.texCoord, roughnessTexID)).r, 0.001);
+        mat.roughness = max(SampleTexture(roughnessTexID, state.texCoord, uvLod).r, 0.001);
     }
 
     // Metallic Map
     if (metallicTexID >= 0)
     {
-        mat.metallic = texture(textureMapsArrayTex, vec3(state.texCoord, metallicTexID)).r;
+        mat.metallic = SampleTexture(metallicTexID, state.texCoord, uvLod).r;
     }
 
     // Normal Map
     if (normalMapTexID >= 0)
     {
-        vec3 texNormal = texture(textureMapsArrayTex, vec3(state.texCoord, normalMapTexID)).rgb;
+        // only RG are stored (BC5 normal maps), z is reconstructed from the unit length
+        vec3 texNormal;
+        texNormal.xy = SampleTexture(normalMapTexID, state.texCoord, uvLod).rg;
 
 #ifdef NAGI_OPENGL_NORMALMAP
         texNormal.y = 1.0 - texNormal.y;
 #endif
-        texNormal = normalize(texNormal * 2.0 - 1.0);   // remap
+        texNormal.xy = texNormal.xy * 2.0 - 1.0;   // remap
+        texNormal.z = sqrt(max(1.0 - dot(texNormal.xy, texNormal.xy), 0.0));
+        texNormal = normalize(texNormal);
 
         vec3 originNormal = state.normal;   // state.normal = geometry normal
         // convert texNormal to world space
@@ -94,7 +102,7 @@ void GetMaterial(inout State state, Ray r)
     // Emission Map
     if (emissionMapTexID >= 0)
     {
-        mat.emission = pow(texture(textureMapsArrayTex, vec3(state.texCoord, emissionMapTexID)).rgb, vec3(2.2));  // srgb to linear
+        mat.emission = pow(SampleTexture(emissionMapTexID, state.texCoord, uvLod).rgb, vec3(2.2));  // srgb to linear
     }
 
 #ifdef NAGI_ROUGHNESS_MOLLIFICATION
@@ -114,7 +122,8 @@ void GetMaterial(inout State state, Ray r)
 
 
 #if defined(NAGI_MEDIUM) && defined(NAGI_VOL_MIS)
-vec3 EvalTransmittance(Ray r)
+// maxDist为到被采样点的距离，其后的表面不再遮挡。发光三角形不是光源，ClosestHit击中时不会设置isEmitter
+vec3 EvalTransmittance(Ray r, float maxDist)
 {
     LightSample lightSample;
     State state;
@@ -124,8 +133,8 @@ vec3 EvalTransmittance(Ray r)
     {
         bool hit = ClosestHit(r, state, lightSample);
 
-        // 没有命中物体，或者命中的是光源, break后返回transmittance
-        if (!hit || state.isEmitter)
+        // 没有命中物体，或者命中的是光源、被采样点, break后返回transmittance
+        if (!hit || state.isEmitter || state.hitT >= maxDist - EPSILON)
             break;
         
         // 获取用于计算的材质参数
@@ -162,6 +171,7 @@ vec3 EvalTransmittance(Ray r)
 
         // Move ray origin to hit point
         r.ori = state.fhp + r.dir * EPSILON;
+        maxDist -= state.hitT + EPSILON;
     }
     return transmittance;
 }
@@ -189,7 +199,7 @@ vec3 DirectLight(Ray r, State state, bool isSurface)
 
     #if defined(NAGI_MEDIUM) && defined(NAGI_VOL_MIS)
         // scene中有参与介质
-        Li *= EvalTransmittance(shadowRay);
+        Li *= EvalTransmittance(shadowRay, INF);
         
         if (isSurface)
             scatterSample.f = DisneyEval(state, -r.dir, state.ffnormal, lightDir, scatterSample.pdf);
@@ -226,24 +236,65 @@ vec3 DirectLight(Ray r, State state, bool isSurface)
 #endif
 
 
+    /* 采样发光三角形 */
+#ifdef NAGI_EMISSIVE_TRIANGLES
+    {
+        LightSample lightSample;
+        SampleEmissiveTriangle(scatterPos, lightSample);
+        Li = lightSample.emission;
+        Ray shadowRay = Ray(scatterPos, lightSample.direction);
+
+    #if defined(NAGI_MEDIUM) && defined(NAGI_VOL_MIS)
+        // scene中有参与介质
+        Li *= EvalTransmittance(shadowRay, lightSample.dist);
+
+        if (isSurface)
+            scatterSample.f = DisneyEval(state, -r.dir, state.ffnormal, lightSample.direction, scatterSample.pdf);
+        else
+        {
+            float p = PhaseHG(dot(-r.dir, lightSample.direction), state.medium.anisotropy);
+            scatterSample.f = vec3(p);
+            scatterSample.pdf = p;
+        }
+
+        if (scatterSample.pdf > 0.0)
+        {
+            float misWeight = PowerHeuristic(lightSample.pdf, scatterSample.pdf);
+            Ld += misWeight * Li * scatterSample.f / lightSample.pdf;
+        }
+    #else
+        // scene中无参与介质，全部为实体
+        bool inShadow = AnyHit(shadowRay, lightSample.dist - EPSILON);
+
+        if (!inShadow)
+        {
+            scatterSample.f = DisneyEval(state, -r.dir, state.ffnormal, lightSample.direction, scatterSample.pdf);
+
+            if (scatterSample.pdf > 0.0)
+            {
+                float misWeight = PowerHeuristic(lightSample.pdf, scatterSample.pdf);
+                Ld += misWeight * Li * scatterSample.f / lightSample.pdf;
+            }
+        }
+    #endif
+    }   /* 采样发光三角形 */
+#endif
+
+
     /* 采样解析光源 */
 #ifdef NAGI_LIGHTS
     {
-        // 选择一个要采样的光源
-        int index = int(rand() * float(lightsNum)) * 5;
-        // 根据light.h中Light的成员变量顺序获取数据，以vec3f为刻度，Light等同5个vec3f
-        vec3 position   = texelFetch(lightsTex, ivec2(index * 5 + 0, 0), 0).xyz;
-        vec3 emission   = texelFetch(lightsTex, ivec2(index * 5 + 1, 0), 0).xyz;
-        vec3 u          = texelFetch(lightsTex, ivec2(index * 5 + 2, 0), 0).xyz;     // u vector for rect
-        vec3 v          = texelFetch(lightsTex, ivec2(index * 5 + 3, 0), 0).xyz;     // v vector for rect
-        vec3 params     = texelFetch(lightsTex, ivec2(index * 5 + 4, 0), 0).xyz;
-        float radius    = params.x;
-        float area      = params.y;
-        float type      = params.z;     // 0->Rect, 1->Sphere, 2->Distant
+        // 由light BVH按对着色点的重要性选择一个要采样的光源
+        float lightPickPdf;
+        int index = SampleLightBVH(state.fhp, isSurface ? state.normal : vec3(0.0), lightPickPdf);
+        if (index < 0)
+            return Ld;
 
         LightSample lightSample;
-        Light light = Light(position, emission, u, v, radius, area, type);
+        Light light = FetchLight(index);
         SampleOneLight(light, scatterPos, lightSample);
+        // 光源的pdf包含其被选中的概率，与ClosestHit击中光源时的pdf一致
+        lightSample.pdf *= lightPickPdf;
         Li = lightSample.emission;
 
         // quad光源具有单边性，所以需要判断是否在背面，只处理正面的
@@ -253,7 +304,7 @@ vec3 DirectLight(Ray r, State state, bool isSurface)
 
     #if defined(NAGI_MEDIUM) && defined(NAGI_VOL_MIS)
             // scene中有参与介质
-            Li *= EvalTransmittance(shadowRay);
+            Li *= EvalTransmittance(shadowRay, INF);
             
             if (isSurface)
                 scatterSample.f = DisneyEval(state, -r.dir, state.ffnormal, lightSample.direction, scatterSample.pdf);
@@ -310,6 +361,10 @@ vec4 PathTrace(Ray r)
     bool inMedium = false;
     bool mediumSampled = false;
     bool surfaceScatter = false;
+
+    // ray cone for texture LOD: width at the current hit and spread angle, a camera ray covers one pixel
+    float coneWidth = 0.0;
+    float coneSpread = atan(2.0 * tan(camera.fov * 0.5) / resolution.y);
     
     for(state.depth = 0;; state.depth++)
     {
@@ -354,10 +409,23 @@ vec4 PathTrace(Ray r)
         }   /* 未命中物体或光源 */
 
         /* 获取scatterPos的材质信息 */
-        GetMaterial(state, r);
+        coneWidth += coneSpread * state.hitT;
+        GetMaterial(state, r, coneWidth);
+
+        /* 累计发光物体的radiance贡献 */
+    #ifdef NAGI_EMISSIVE_TRIANGLES
+        {
+            // 上一个散射点（表面或介质）的DirectLight也可能采样到这个三角形，使用ClosestHit求出的lightSample.pdf计算misWeight
+            float misWeight = 1.0;
+            if (state.depth > 0 && !state.isEmitter)
+                misWeight = PowerHeuristic(scatterSample.pdf, lightSample.pdf);
 
-        /* 累计发光物体的radiance贡献。此处不进行重要性采样 */
+            radiance += misWeight * state.mat.emission * throughput;
+        }
+    #else
+        // 此处不进行重要性采样
         radiance += state.mat.emission * throughput;
+    #endif
 
         /* 累计光源的radiance贡献 */
     #ifdef NAGI_LIGHTS
@@ -412,12 +480,15 @@ vec4 PathTrace(Ray r)
                     state.fhp = r.ori;
 
                     // Transmittance Evaluation
+                    state.lightPickPos = state.fhp;
+                    state.lightPickNormal = vec3(0.0);
                     radiance += DirectLight(r, state, false) * throughput;
 
                     // Pick a new direction based on the phase function
                     vec3 scatterDir = SampleHG(-r.dir, state.medium.anisotropy, rand(), rand());
                     scatterSample.pdf = PhaseHG(dot(-r.dir, scatterDir), state.medium.anisotropy);
                     r.dir = scatterDir;
+                    coneSpread += 1.0;
                 }
             }
         }
@@ -441,6 +512,8 @@ vec4 PathTrace(Ray r)
                 surfaceScatter = true;
 
                 // Next event estimation
+                state.lightPickPos = state.fhp;
+                state.lightPickNormal = state.normal;
                 radiance += DirectLight(r, state, true) * throughput;
 
                 // Sample BSDF for color and outgoing direction
@@ -449,6 +522,9 @@ vec4 PathTrace(Ray r)
                     throughput *= scatterSample.f / scatterSample.pdf;
                 else
                     break;
+
+                // the sampled lobe widens the cone, its width is about the GGX alpha in radians
+                coneSpread += state.mat.roughness * state.mat.roughness;
             }
 
             // Move ray origin to hit point and set direction for next bounce
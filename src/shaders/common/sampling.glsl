@@ -5,6 +5,8 @@
     SmithGGX几何函数
     cosine半球采样、均匀球面/半球采样
     矩形、球形、平行光源采样
+    alias table采样
+    light BVH选择光源
 */
 
 /* References:
@@ -255,7 +257,7 @@ void SampleSphereLight(Light light, vec3 scatterPos, inout LightSample lightSamp
     
     // normalize(lightSurfacePos - light.position) == sampledDir?
     lightSample.normal = normalize(lightSurfacePos - light.position);
-    lightSample.emission = light.emission * float(lightsNum);   // ?
+    lightSample.emission = light.emission;
     
     // 球面只有一半能照射到scatterPos，所以面积A要乘0.5
     // 积分项为dw: pdf = r^2 / (A * 0.5 * cosTheta')
@@ -278,7 +280,7 @@ void SampleRectLight(Light light, vec3 scatterPos, inout LightSample lightSample
     lightSample.direction /= lightSample.dist;
 
     lightSample.normal = normalize(cross(light.u, light.v));
-    lightSample.emission = light.emission * float(lightsNum);
+    lightSample.emission = light.emission;
     
     // 积分项为dw: pdf = r^2 / (A * cosTheta')
     lightSample.pdf = (lightSample.dist * lightSample.dist) / (light.area * abs(dot(lightSample.normal, lightSample.direction)));
@@ -291,7 +293,7 @@ void SampleDistantLight(Light light, vec3 scatterPos, inout LightSample lightSam
     lightSample.direction = normalize(light.position - vec3(0.0));
     lightSample.dist = INF;
     lightSample.normal = normalize(scatterPos - light.position);
-    lightSample.emission = light.emission * float(lightsNum);
+    lightSample.emission = light.emission;
     lightSample.pdf = 1.0;
 }
 
@@ -308,6 +310,228 @@ void SampleOneLight(Light light, vec3 scatterPos, inout LightSample lightSample)
         SampleDistantLight(light, scatterPos, lightSample);
 }
 
+// ----------------------------------------------------------------------
+// Alias Table---Scene::BuildLightsAliasTable、EnvironmentMap::BuildAliasTable
+// ----------------------------------------------------------------------
+
+// 从count列的alias table中按权重采样一列，O(1)：RandInt均匀选列，rnd小于threshold则保留该列，否则取其alias。
+// 列用整数随机数选取，rand()只有24位精度，列数超过2^24时部分列永远选不到
+int SampleAliasTable(usamplerBuffer table, int count, float rnd)
+{
+    int column = RandInt(count);
+    uvec2 entry = texelFetch(table, column).rg;
+    return rnd < uintBitsToFloat(entry.x) ? column : int(entry.y);
+}
+
+// ----------------------------------------------------------------------
+// Light BVH Sampling---[Importance Sampling of Many Lights with Adaptive Tree Splitting] Conty & Kulla 2018、PBRT-V4 12.6.3
+// ----------------------------------------------------------------------
+
+#ifdef NAGI_LIGHTS
+
+// cos(max(0, a - b))、sin(max(0, a - b))
+float CosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1.0 : cosA * cosB + sinA * sinB;
+}
+
+float SinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0.0 : sinA * cosB - cosA * sinB;
+}
+
+// 节点中的光源对点p(表面法线n，介质中为0)贡献的上界估计：功率 / 距离平方，乘以bounds内最接近p的发射方向的cos，
+// 以及最接近n的入射方向的cos。点p在发射锥之外时为0
+float LightNodeImportance(int nodeIdx, vec3 p, vec3 n)
+{
+    int base = nodeIdx * NAGI_LIGHT_NODE_TEXELS;
+    vec4 t0 = intBitsToFloat(texelFetch(lightBVHTex, base + 0));
+    vec4 t1 = intBitsToFloat(texelFetch(lightBVHTex, base + 1));
+    vec4 t2 = intBitsToFloat(texelFetch(lightBVHTex, base + 2));
+    float phi = t0.w;
+    float cosThetaO = t1.w;
+    float cosThetaE = t2.w;
+    if (phi == 0.0)
+        return 0.0;
+
+    vec3 pc = (t0.xyz + t1.xyz) * 0.5;
+    vec3 toP = p - pc;
+    float dist2 = dot(toP, toP);
+    // 点在bounds附近时距离平方不应趋于0
+    float d2 = max(dist2, length(t1.xyz - t0.xyz) * 0.5);
+    vec3 wi = toP / sqrt(max(dist2, 1e-20));
+
+    float cosThetaW = dot(t2.xyz, wi);
+    float sinThetaW = sqrt(max(0.0, 1.0 - cosThetaW * cosThetaW));
+
+    // bounds的外接球在p处所张的半角thetaB，p在球内时为PI
+    float radius2 = dot(t1.xyz - t0.xyz, t1.xyz - t0.xyz) * 0.25;
+    float cosThetaB = dist2 < radius2 ? -1.0 : sqrt(max(0.0, 1.0 - radius2 / dist2));
+    float sinThetaB = sqrt(max(0.0, 1.0 - cosThetaB * cosThetaB));
+
+    // theta' = max(0, thetaW - thetaO - thetaB)
+    float sinThetaO = sqrt(max(0.0, 1.0 - cosThetaO * cosThetaO));
+    float cosThetaX = CosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = SinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = CosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE)
+        return 0.0;
+
+    float importance = phi * cosThetaP / d2;
+    if (n != vec3(0.0))
+    {
+        float cosThetaI = abs(dot(wi, n));
+        float sinThetaI = sqrt(max(0.0, 1.0 - cosThetaI * cosThetaI));
+        importance *= CosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+    return max(importance, 0.0);
+}
+
+// 平行光源没有bounds，与light BVH按数量分配被选中的概率
+float DistantLightsPickPdf()
+{
+    return float(distantLightsNum) / float(distantLightsNum + (lightBVHNodesNum > 0 ? 1 : 0));
+}
+
+// 为点p选择一个光源：按比例选平行光源，否则从根节点起按子节点的重要性随机下行到叶子。
+// 返回光源索引，pmf为其被选中的概率；所有光源的重要性都为0时返回-1
+int SampleLightBVH(vec3 p, vec3 n, out float pmf)
+{
+    float pDistant = DistantLightsPickPdf();
+    float u = rand();
+    if (u < pDistant)
+    {
+        int k = min(int(u / pDistant * float(distantLightsNum)), distantLightsNum - 1);
+        pmf = pDistant / float(distantLightsNum);
+        return texelFetch(lightBVHTex, lightBVHNodesNum * NAGI_LIGHT_NODE_TEXELS + k).x;
+    }
+
+    pmf = 1.0 - pDistant;
+    if (LightNodeImportance(0, p, n) == 0.0)
+        return -1;
+
+    int nodeIdx = 0;
+    ivec4 node = texelFetch(lightBVHTex, 3);
+    while (node.y == 0)
+    {
+        float ci0 = LightNodeImportance(nodeIdx + 1, p, n);
+        float ci1 = LightNodeImportance(node.x, p, n);
+        if (ci0 == 0.0 && ci1 == 0.0)
+            return -1;
+
+        float p0 = ci0 / (ci0 + ci1);
+        if (rand() < p0)
+        {
+            pmf *= p0;
+            nodeIdx = nodeIdx + 1;
+        }
+        else
+        {
+            pmf *= 1.0 - p0;
+            nodeIdx = node.x;
+        }
+        node = texelFetch(lightBVHTex, nodeIdx * NAGI_LIGHT_NODE_TEXELS + 3);
+    }
+    return node.x;
+}
+
+// SampleLightBVH为点p选中叶子leafIdx中光源的概率，沿叶子的bitTrail从根节点走到叶子
+float LightBVHPmf(int leafIdx, vec3 p, vec3 n)
+{
+    int bitTrail = texelFetch(lightBVHTex, leafIdx * NAGI_LIGHT_NODE_TEXELS + 3).z;
+    float pmf = 1.0 - DistantLightsPickPdf();
+    int nodeIdx = 0;
+
+    while (nodeIdx != leafIdx)
+    {
+        int secondChild = texelFetch(lightBVHTex, nodeIdx * NAGI_LIGHT_NODE_TEXELS + 3).x;
+        float ci0 = LightNodeImportance(nodeIdx + 1, p, n);
+        float ci1 = LightNodeImportance(secondChild, p, n);
+        if (ci0 == 0.0 && ci1 == 0.0)
+            return 0.0;
+
+        if ((bitTrail & 1) == 0)
+        {
+            pmf *= ci0 / (ci0 + ci1);
+            nodeIdx = nodeIdx + 1;
+        }
+        else
+        {
+            pmf *= ci1 / (ci0 + ci1);
+            nodeIdx = secondChild;
+        }
+        bitTrail >>= 1;
+    }
+    return pmf;
+}
+
+#endif
+
+// ----------------------------------------------------------------------
+// Emissive Triangle Sampling---Scene::CollectEmissiveTriangles
+// ----------------------------------------------------------------------
+
+#ifdef NAGI_EMISSIVE_TRIANGLES
+
+// 由alias table按功率选择一个发光三角形，再在其上按面积均匀采样一点。三角形两面都发光，与PathTrace中累加emission一致
+// 积分项为dw: pdf = pickPdf / A * r^2 / |cosTheta'|，A为三角形在世界空间的面积
+void SampleEmissiveTriangle(vec3 scatterPos, inout LightSample lightSample)
+{
+    int offset = lightBVHNodesNum * NAGI_LIGHT_NODE_TEXELS + distantLightsNum;
+    int column = RandInt(emissiveTrianglesNum);
+    ivec4 entry = texelFetch(lightBVHTex, offset + column * NAGI_EMISSIVE_TRIANGLE_TEXELS + 1);
+    int idx = rand() < intBitsToFloat(entry.x) ? column : entry.y;
+    ivec4 tri = texelFetch(lightBVHTex, offset + idx * NAGI_EMISSIVE_TRIANGLE_TEXELS);     // primIdx, instanceIdx, matID, pickPdf
+
+    ivec3 vertexIdx = texelFetch(vertexIndicesTex, tri.x).xyz;
+    vec4 v0 = texelFetch(verticesTex, vertexIdx.x);
+    vec4 v1 = texelFetch(verticesTex, vertexIdx.y);
+    vec4 v2 = texelFetch(verticesTex, vertexIdx.z);
+
+    // 三角形上均匀分布的重心坐标
+    float su = sqrt(rand());
+    float r2 = rand();
+    vec3 barycentric = vec3(1.0 - su, su * (1.0 - r2), su * r2);
+
+    // 顶点在instance的局部空间，用instance的变换转到世界空间
+    mat3 linear, normalMat;
+    InstanceLinearMatrices(tri.y, linear, normalMat);
+    vec3 translation = texelFetch(transformsTex, tri.y * NAGI_TRANSFORM_TEXELS + 3).xyz;
+    vec3 lightSurfacePos = linear * (v0.xyz * barycentric.x + v1.xyz * barycentric.y + v2.xyz * barycentric.z) + translation;
+    vec3 faceNormal = cross(linear * (v1.xyz - v0.xyz), linear * (v2.xyz - v0.xyz));
+    float area = 0.5 * length(faceNormal);
+
+    // 初始化lightSample
+    lightSample.direction = lightSurfacePos - scatterPos;
+    lightSample.dist = length(lightSample.direction);
+    lightSample.direction /= lightSample.dist;
+    lightSample.normal = faceNormal / (2.0 * area);
+    lightSample.pdf = intBitsToFloat(tri.w) / area * (lightSample.dist * lightSample.dist) / abs(dot(lightSample.normal, lightSample.direction));
+
+    // 与GetMaterial相同，emission map替代emission颜色。这里没有ray cone，采样最精细的mip
+    int startOffset = tri.z * 8;
+    lightSample.emission = texelFetch(materialsTex, ivec2(startOffset + 1, 0), 0).rgb;
+    int emissionMapTexID = int(texelFetch(materialsTex, ivec2(startOffset + 7, 0), 0).x);
+    if (emissionMapTexID >= 0)
+    {
+        vec2 uv0 = vec2(v0.w, texelFetch(normalsTex, vertexIdx.x).w);
+        vec2 uv1 = vec2(v1.w, texelFetch(normalsTex, vertexIdx.y).w);
+        vec2 uv2 = vec2(v2.w, texelFetch(normalsTex, vertexIdx.z).w);
+        vec2 texCoord = uv0 * barycentric.x + uv1 * barycentric.y + uv2 * barycentric.z;
+        lightSample.emission = pow(SampleTexture(emissionMapTexID, texCoord, TEXTURE_LOD_FULL).rgb, vec3(2.2));  // srgb to linear
+    }
+}
+
+// BSDF采样的光线击中发光三角形时，SampleEmissiveTriangle采样到该点的pdf。pickPdf = emissivePickScale * A，
+// 所以面积被约掉：pdf = emissivePickScale * t^2 / |cosTheta'|，faceNormal为世界空间的面法线，无需归一化
+float EmissiveTrianglePdf(int matID, vec3 faceNormal, vec3 dir, float t)
+{
+    float pickScale = texelFetch(materialsTex, ivec2(matID * 8 + 1, 0), 0).w;
+    return pickScale * t * t * length(faceNormal) / abs(dot(faceNormal, dir));
+}
+
+#endif
+
 
 
 // ----------------------------------------------------------------------
@@ -10,18 +10,27 @@ uniform float envMapTotalSum;
 uniform vec2 resolution;
 uniform vec2 invTilesNum;
 uniform int lightsNum;
+uniform int lightBVHNodesNum;
+uniform int distantLightsNum;
+uniform int emissiveTrianglesNum;
 uniform int tlasBVHStartOffset;
 uniform sampler2D accumTex;
 uniform samplerBuffer BVHTex;
+uniform isamplerBuffer wideBVHTex;
 uniform isamplerBuffer vertexIndicesTex;
 uniform samplerBuffer verticesTex;
 uniform samplerBuffer normalsTex;
 uniform sampler2D materialsTex;
-uniform sampler2D transformsTex;
+uniform samplerBuffer transformsTex;
 uniform sampler2D lightsTex;
-uniform sampler2DArray textureMapsArrayTex;
+// light BVH over the rect and sphere lights, then the indices of the distant lights, then the emissive triangles
+uniform isamplerBuffer lightBVHTex;
+// one array per texture size class, textures [textureClassEnds[c-1], textureClassEnds[c]) are the layers of class c
+uniform sampler2DArray textureMapsArrayTex[4];
+uniform int textureClassEnds[4];
 uniform sampler2D envMapTex;
-uniform sampler2D envMapCDFTex;
+// one alias table entry per envMapTex pixel, row-major
+uniform usamplerBuffer envMapAliasTex;
 
 // 
 uniform float envMapIntensity;
@@ -30,4 +39,27 @@ uniform vec3 uniformLightCol;
 uniform int maxDepth;
 uniform vec2 tileOffset;
 uniform int frameNum;
-uniform float roughnessMollificationAmt;
\ No newline at end of file
+uniform float roughnessMollificationAmt;
+
+// lod of SampleTexture that always picks the largest mip level
+#define TEXTURE_LOD_FULL -64.0
+
+// uvLod is log2 of the footprint in texture coordinates, the mip level adds log2 of the texel count of the class.
+// implicit derivatives mean nothing for scattered rays, so the level is always explicit
+vec4 SampleTextureLayer(sampler2DArray tex, vec2 texCoord, int layer, float uvLod)
+{
+    vec2 size = vec2(textureSize(tex, 0).xy);
+    return textureLod(tex, vec3(texCoord, layer), uvLod + 0.5 * log2(size.x * size.y));
+}
+
+// sampler arrays can only be indexed by constants in GLSL 3.30, so the class of texID is found by comparisons
+vec4 SampleTexture(int texID, vec2 texCoord, float uvLod)
+{
+    if (texID < textureClassEnds[0])
+        return SampleTextureLayer(textureMapsArrayTex[0], texCoord, texID, uvLod);
+    if (texID < textureClassEnds[1])
+        return SampleTextureLayer(textureMapsArrayTex[1], texCoord, texID - textureClassEnds[0], uvLod);
+    if (texID < textureClassEnds[2])
+        return SampleTextureLayer(textureMapsArrayTex[2], texCoord, texID - textureClassEnds[1], uvLod);
+    return SampleTextureLayer(textureMapsArrayTex[3], texCoord, texID - textureClassEnds[2], uvLod);
+}